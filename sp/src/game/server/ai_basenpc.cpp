@@ -165,6 +165,9 @@ ConVar	ai_frametime_limit( "ai_frametime_limit", "50", FCVAR_NONE, "frametime li
 
 ConVar	ai_use_think_optimizations( "ai_use_think_optimizations", "1" );
 
+ConVar	ai_think_scheduler( "ai_think_scheduler", "1", FCVAR_NONE, "Schedule NPC thinks each tick against ai_think_budget using measured think costs, instead of the periodic think rebalance." );
+ConVar	ai_think_budget( "ai_think_budget", "4", FCVAR_NONE, "Per-tick time budget for NPC thinks moved by ai_think_scheduler (in ms)." );
+
 ConVar	ai_test_moveprobe_ignoresmall( "ai_test_moveprobe_ignoresmall", "0" );
 
 #ifdef HL2_EPISODIC
@@ -184,11 +187,13 @@ ConVar	ai_debug_fake_sequence_gestures_always_play( "ai_debug_fake_sequence_gest
 #define ShouldUseFrameThinkLimits()		( ai_use_think_optimizations.GetBool() && ai_use_frame_think_limits.GetBool() )
 #define ShouldRebalanceThinks()			( ai_use_think_optimizations.GetBool() && ai_rebalance_thinks.GetBool() )
 #define ShouldDefaultEfficient()		( ai_use_think_optimizations.GetBool() && ai_default_efficient.GetBool() )
+#define ShouldScheduleThinks()			( ShouldRebalanceThinks() && ai_think_scheduler.GetBool() )
 #else
 #define ShouldUseEfficiency()			( true )
 #define ShouldUseFrameThinkLimits()		( true )
 #define ShouldRebalanceThinks()			( true )
 #define ShouldDefaultEfficient()		( true )
+#define ShouldScheduleThinks()			( ai_think_scheduler.GetBool() )
 #endif
 
 #ifndef _RETAIL
@@ -317,6 +322,7 @@ CAI_LocalIdSpace			CAI_BaseNPC::gm_SquadSlotIdSpace( true );
 string_t CAI_BaseNPC::gm_iszPlayerSquad;
 
 int		CAI_BaseNPC::gm_iNextThinkRebalanceTick;
+int		CAI_BaseNPC::gm_iLastThinkScheduleTick = -1;
 float	CAI_BaseNPC::gm_flTimeLastSpawn;
 int		CAI_BaseNPC::gm_nSpawnedThisFrame;
 
@@ -4207,6 +4213,16 @@ void CAI_BaseNPC::RebalanceThinks()
 			nRebalanceableThinksInTick++;
 	}
 
+	if ( ShouldScheduleThinks() )
+	{
+		if ( gpGlobals->tickcount != gm_iLastThinkScheduleTick )
+		{
+			gm_iLastThinkScheduleTick = gpGlobals->tickcount;
+			ScheduleThinks();
+		}
+		return;
+	}
+
 	if ( ShouldRebalanceThinks() && gpGlobals->tickcount >= gm_iNextThinkRebalanceTick )
 	{
 		AI_PROFILE_SCOPE(AI_Think_Rebalance );
@@ -4333,6 +4349,307 @@ void CAI_BaseNPC::RebalanceThinks()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Think scheduling
+//
+// Each tick, NPCs due to think within the next 10Hz window are placed on
+// ticks so the measured cost of their thinks stays within ai_think_budget.
+// The most relevant NPCs, judged against every connected player, are placed
+// first and keep their tick; less relevant ones move to the tick with the
+// most room left, at most one think interval away. Relevance is worked out
+// by each NPC as it thinks, so the per-tick pass does no PVS tests.
+//-----------------------------------------------------------------------------
+
+struct AIThinkViewer_t
+{
+	Vector vecEyePosition;
+	Vector vecForward;
+};
+
+struct AIThinkScheduleInfo_t
+{
+	CAI_BaseNPC *	pNPC;
+	int				iNextThinkTick;
+	int				iLatestTick;
+	float			flRelevance;
+	float			flCost;
+	bool			bCritical;
+};
+
+// Think cost assumed for NPCs that haven't been measured yet, in ms
+const float AI_THINK_MIN_COST = 0.05f;
+
+// Weight of the latest measurement in an NPC's running think cost
+const float AI_THINK_COST_WEIGHT = 0.25f;
+
+// Distance past which a player adds nothing to an NPC's relevance
+const float AI_THINK_RELEVANCE_DIST = 4096.0f;
+
+// Longest an NPC can go between real thinks before the scheduler stops moving
+// it: the slowest standard think interval, plus one 10Hz window of slack
+const float AI_THINK_MAX_DEFERRAL = 0.3f;
+
+static int __cdecl ThinkScheduleCompare( const AIThinkScheduleInfo_t *pLeft, const AIThinkScheduleInfo_t *pRight )
+{
+	if ( pLeft->bCritical != pRight->bCritical )
+		return ( pLeft->bCritical ) ? -1 : 1;
+
+	if ( pLeft->flRelevance > pRight->flRelevance )
+		return -1;
+
+	if ( pLeft->flRelevance < pRight->flRelevance )
+		return 1;
+
+	return pLeft->iNextThinkTick - pRight->iNextThinkTick;
+}
+
+//-------------------------------------
+
+static int AI_GetThinkViewers( CUtlVector<AIThinkViewer_t> *pViewers )
+{
+	static int iPrevTick = -1;
+	if ( gpGlobals->tickcount == iPrevTick )
+		return pViewers->Count();
+
+	iPrevTick = gpGlobals->tickcount;
+	pViewers->RemoveAll();
+
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if ( pPlayer && pPlayer->IsConnected() )
+		{
+			int iViewer = pViewers->AddToTail();
+			pPlayer->EyePositionAndVectors( &(*pViewers)[iViewer].vecEyePosition, &(*pViewers)[iViewer].vecForward, NULL, NULL );
+		}
+	}
+
+	return pViewers->Count();
+}
+
+//-------------------------------------
+// Purpose: How much it matters that this NPC thinks on time. Critical NPCs are
+//			never moved off their tick, even if that exceeds the budget.
+//			Called from NPCThink() with the PVS result it already has.
+//-------------------------------------
+
+void CAI_BaseNPC::UpdateThinkRelevance( bool bInPVS )
+{
+	m_flThinkRelevance = 0;
+	m_bThinkCritical = false;
+
+	if ( IsFlaggedEfficient() )
+		return;
+
+	if ( m_bForceConditionsGather || 
+		 gpGlobals->curtime - GetLastAttackTime() < .2 ||
+		 gpGlobals->curtime - m_flLastDamageTime < .2 )
+	{
+		m_bThinkCritical = true;
+	}
+
+	static CUtlVector<AIThinkViewer_t> viewers( 4, 0 );
+	int nViewers = AI_GetThinkViewers( &viewers );
+	const AIThinkViewer_t *pViewers = viewers.Base();
+
+	if ( nViewers == 0 )
+	{
+		m_flThinkRelevance = 1;
+		return;
+	}
+
+	float flBest = 0;
+
+	for ( int i = 0; i < nViewers; i++ )
+	{
+		Vector vToNPC = EyePosition() - pViewers[i].vecEyePosition;
+		float flDist = VectorNormalize( vToNPC );
+		float flDot = pViewers[i].vecForward.Dot( vToNPC );
+
+		float flRelevance = 1.0f - MIN( flDist / AI_THINK_RELEVANCE_DIST, 1.0f );
+		if ( bInPVS && flDot > 0 )
+		{
+			flRelevance += flDot;
+		}
+		flBest = MAX( flBest, flRelevance );
+
+		if ( bInPVS && ( flDot > 0.5f || flDist < 25*12 ) )
+		{
+			m_bThinkCritical = true;
+		}
+	}
+
+	if ( bInPVS )
+		flBest += 2;
+
+	if ( GetEnemy() )
+		flBest += 1;
+
+	m_flThinkRelevance = flBest;
+}
+
+//-------------------------------------
+
+void CAI_BaseNPC::ScheduleThinks()
+{
+	AI_PROFILE_SCOPE( AI_Think_Schedule );
+
+	bool bDebugThinkTicks = ai_debug_think_ticks.GetBool();
+
+	static CUtlVector<AIThinkScheduleInfo_t> candidates( 16, 64 );
+
+	int nTicksPer10Hz = MAX( TIME_TO_TICKS( .1 ), 1 );
+	int iFirstTick = gpGlobals->tickcount;
+	int iLastTick = iFirstTick + nTicksPer10Hz - 1;
+
+	candidates.RemoveAll();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pCandidate = g_AI_Manager.AccessAIs()[i];
+		if ( pCandidate->CanThinkRebalance() &&
+			 pCandidate->GetNextThinkTick() >= iFirstTick - 1 && // -1 needed for alternate ticks
+			 pCandidate->GetNextThinkTick() <= iLastTick )
+		{
+			int iInfo = candidates.AddToTail();
+			candidates[iInfo].pNPC = pCandidate;
+			candidates[iInfo].iNextThinkTick = pCandidate->GetNextThinkTick();
+			candidates[iInfo].flCost = MAX( pCandidate->m_flThinkCost, AI_THINK_MIN_COST );
+			candidates[iInfo].flRelevance = pCandidate->m_flThinkRelevance;
+			candidates[iInfo].bCritical = pCandidate->m_bThinkCritical;
+
+			// Don't let an NPC be pushed back tick after tick; once it would go too
+			// long without a real think, it can only be moved earlier
+			int iLatestTick = TIME_TO_TICKS( pCandidate->m_flLastRealThinkTime + AI_THINK_MAX_DEFERRAL );
+			candidates[iInfo].iLatestTick = MAX( iLatestTick, candidates[iInfo].iNextThinkTick );
+		}
+	}
+
+	if ( !candidates.Count() )
+		return;
+
+	candidates.Sort( ThinkScheduleCompare );
+
+	CUtlVectorFixedGrowable<float, 16> load;
+	load.SetCount( nTicksPer10Hz );
+	for ( int i = 0; i < load.Count(); i++ )
+	{
+		load[i] = 0;
+	}
+
+	// "this" is thinking now
+	load[0] = MAX( m_flThinkCost, AI_THINK_MIN_COST );
+
+	float flBudget = ai_think_budget.GetFloat();
+
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		AIThinkScheduleInfo_t &info = candidates[i];
+		int iPreferred = clamp( info.iNextThinkTick - iFirstTick, 0, nTicksPer10Hz - 1 );
+		int iSlot = iPreferred;
+
+		if ( !info.bCritical && load[iPreferred] + info.flCost > flBudget )
+		{
+			// Nearest tick with room, else the least loaded one. Don't move anything
+			// onto the current tick, since it may already have been passed over.
+			int iLeastLoaded = iPreferred;
+			int iFits = -1;
+			for ( int iOffset = 1; iOffset < nTicksPer10Hz && iFits == -1; iOffset++ )
+			{
+				for ( int iSign = -1; iSign <= 1; iSign += 2 )
+				{
+					int iTest = iPreferred + iOffset * iSign;
+					if ( iTest < 1 || iTest >= nTicksPer10Hz || iFirstTick + iTest > info.iLatestTick )
+						continue;
+
+					if ( load[iTest] + info.flCost <= flBudget )
+					{
+						iFits = iTest;
+						break;
+					}
+
+					if ( load[iTest] < load[iLeastLoaded] )
+					{
+						iLeastLoaded = iTest;
+					}
+				}
+			}
+
+			iSlot = ( iFits != -1 ) ? iFits : iLeastLoaded;
+		}
+
+		load[iSlot] += info.flCost;
+
+		if ( iFirstTick + iSlot != info.iNextThinkTick )
+		{
+			if ( bDebugThinkTicks )
+				DevMsg( "   Scheduling %d from %d to %d (%.2f ms, relevance %.2f)\n", info.pNPC->entindex(), info.iNextThinkTick, iFirstTick + iSlot, info.flCost, info.flRelevance );
+
+			info.pNPC->SetNextThink( TICKS_TO_TIME( iFirstTick + iSlot ) );
+		}
+	}
+
+	Assert( GetNextThinkTick() == TICK_NEVER_THINK ); // never change this objects tick
+}
+
+//-------------------------------------
+
+void CAI_BaseNPC::ReportThinkSchedule()
+{
+	int nTicksPer10Hz = MAX( TIME_TO_TICKS( .1 ), 1 );
+	int nTicks = nTicksPer10Hz * 2;
+
+	CUtlVectorFixedGrowable<float, 32> load;
+	CUtlVectorFixedGrowable<int, 32> count;
+	load.SetCount( nTicks );
+	count.SetCount( nTicks );
+	for ( int i = 0; i < nTicks; i++ )
+	{
+		load[i] = 0;
+		count[i] = 0;
+	}
+
+	float flTotal = 0;
+	int nUnscheduled = 0;
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pNPC = g_AI_Manager.AccessAIs()[i];
+		flTotal += pNPC->m_flThinkCost;
+
+		int iSlot = pNPC->GetNextThinkTick() - gpGlobals->tickcount;
+		if ( iSlot >= 0 && iSlot < nTicks )
+		{
+			load[iSlot] += MAX( pNPC->m_flThinkCost, AI_THINK_MIN_COST );
+			count[iSlot]++;
+		}
+		else
+		{
+			nUnscheduled++;
+		}
+	}
+
+	float flBudget = ai_think_budget.GetFloat();
+
+	Msg( "NPC think schedule at tick %d (%s, budget %.2f ms):\n", gpGlobals->tickcount, ShouldScheduleThinks() ? "scheduler" : "rebalance", flBudget );
+	for ( int i = 0; i < nTicks; i++ )
+	{
+		char szBar[41];
+		int nBar = ( flBudget > 0 ) ? MIN( (int)( 20 * load[i] / flBudget ), 40 ) : 0;
+		memset( szBar, '#', nBar );
+		szBar[nBar] = 0;
+
+		Msg( "   +%-3d %3d NPCs %7.2f ms %c%s\n", i, count[i], load[i], ( load[i] > flBudget ) ? '!' : ' ', szBar );
+	}
+	Msg( "%d NPCs, %.2f ms of thinks per 10Hz cycle, %d not due within %d ticks\n", g_AI_Manager.NumAIs(), flTotal, nUnscheduled, nTicks );
+}
+
+CON_COMMAND( ai_think_schedule, "Show the estimated NPC think load for each upcoming tick" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CAI_BaseNPC::ReportThinkSchedule();
+}
+
 static float g_NpcTimeThisFrame;
 static float g_StartTimeCurThink;
 
@@ -4432,8 +4749,14 @@ void CAI_BaseNPC::CallNPCThink( void )
 	// reduce cache queries by locking model in memory
 	MDLCACHE_CRITICAL_SECTION();
 
+	CFastTimer thinkTimer;
+	thinkTimer.Start();
+
 	this->NPCThink(); 
 
+	thinkTimer.End();
+	m_flThinkCost = Lerp( AI_THINK_COST_WEIGHT, m_flThinkCost, (float)thinkTimer.GetDuration().GetMillisecondsF() );
+
 	m_flLastRealThinkTime = gpGlobals->curtime;
 
 	PostNPCThink();
@@ -4669,6 +4992,11 @@ void CAI_BaseNPC::NPCThink( void )
 
 	UpdateEfficiency( bInPVS );
 
+	if ( ShouldScheduleThinks() )
+	{
+		UpdateThinkRelevance( bInPVS );
+	}
+
 	if ( m_bUsingStandardThinkTime )
 	{
 		static const char *ppszEfficiencies[] =
@@ -12419,6 +12747,7 @@ BEGIN_DATADESC( CAI_BaseNPC )
 	DEFINE_KEYFIELD( m_iszEnemyFilterName,		FIELD_STRING, "enemyfilter" ),
 	DEFINE_FIELD( m_bImportanRagdoll,			FIELD_BOOLEAN ),
 	DEFINE_FIELD( m_bPlayerAvoidState,			FIELD_BOOLEAN ),
+	DEFINE_KEYFIELD( m_bLagCompensate,			FIELD_BOOLEAN, "LagCompensate" ),
 #ifdef EZ
 		DEFINE_KEYFIELD( m_tEzVariant,			FIELD_INTEGER, "ezvariant" ),
 		DEFINE_KEYFIELD( m_bNoGlow,				FIELD_BOOLEAN, "noglow" ),
@@ -13322,9 +13651,14 @@ CAI_BaseNPC::CAI_BaseNPC(void)
 
 	m_iFrameBlocked = -1;
 	m_bInChoreo = true; // assume so until call to UpdateEfficiency()
+	m_flThinkCost = 0;
+	m_flThinkRelevance = 0;
+	m_bThinkCritical = false;
 	
 	SetCollisionGroup( COLLISION_GROUP_NPC );
 
+	m_bLagCompensate = false;
+
 #ifdef MAPBASE
 	m_iDynamicInteractionsAllowed = TRS_NONE;
 	m_flSpeedModifier = 1.0f;
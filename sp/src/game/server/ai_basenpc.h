@@ -749,9 +749,14 @@ protected:
 
 	bool				CheckPVSCondition();
 
+public:
+	static void			ReportThinkSchedule();
+
 private:
 	bool				CanThinkRebalance();
 	void				RebalanceThinks();
+	void				ScheduleThinks();
+	void				UpdateThinkRelevance( bool bInPVS );
 
 	bool				PreNPCThink();
 	void				PostNPCThink();
@@ -882,8 +887,12 @@ private:
 	float				m_flLastRealThinkTime;
 	int					m_iFrameBlocked;
 	bool				m_bInChoreo;
+	float				m_flThinkCost;				// recent cost of NPCThink(), in ms
+	float				m_flThinkRelevance;			// as of the last think, for ScheduleThinks()
+	bool				m_bThinkCritical;
 
 	static int			gm_iNextThinkRebalanceTick;
+	static int			gm_iLastThinkScheduleTick;
 	static float		gm_flTimeLastSpawn;
 	static int			gm_nSpawnedThisFrame;
 
@@ -2531,6 +2540,13 @@ public:
 	float				m_flSpeedModifier;
 #endif
 
+	// Keep a movement history so player shots can be lag compensated against this NPC
+	bool				ShouldLagCompensate() const { return m_bLagCompensate; }
+	void				SetLagCompensate( bool bLagCompensate ) { m_bLagCompensate = bLagCompensate; }
+private:
+	bool				m_bLagCompensate;	// "LagCompensate" keyvalue
+public:
+
 	virtual bool		ShouldProbeCollideAgainstEntity( CBaseEntity *pEntity );
 
 	bool				m_bPlayerAvoidState;
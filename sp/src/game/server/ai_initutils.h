@@ -96,6 +96,9 @@ public:
 	static CAI_TestHull*	GetTestHull(void);						// Get the test hull
 	static void				ReturnTestHull(void);					// Return the test hull
 
+	static CAI_TestHull*	CreateWorkerHull(void);					// Extra hull for a graph build worker thread
+	static void				DestroyWorkerHull(CAI_TestHull *pHull);
+
 	bool					bInUse;
 	virtual void			Precache();
 	void					Spawn(void);
@@ -16,6 +16,10 @@
 #include "ai_navigator.h"
 #include "world.h"
 #include "ai_moveprobe.h"
+#ifdef AI_PERF_MON
+#include "ai_networkmanager.h"
+#include "tier0/fasttimer.h"
+#endif
 #ifdef MAPBASE_VSCRIPT
 #include "ai_hint.h"
 #endif
@@ -184,13 +188,7 @@ CAI_Network::CAI_Network()
 	m_iNumNodes				= 0;		// Number of nodes in this network
 	m_pAInode				= NULL;		// Array of all nodes in this network
 
-	m_iNearestCacheNext	= NEARNODE_CACHE_SIZE - 1;
-	// Force empty node caches to be rebuild
-	for (int node=0;node<NEARNODE_CACHE_SIZE;node++)
-	{
-		m_NearestCache[node].hull = HULL_NONE;
-		m_NearestCache[node].expiration	= FLT_MIN;
-	}
+	ClearNearestNodeCache();
 
 #ifdef AI_NODE_TREE
 	m_pNodeTree = NULL;
@@ -201,6 +199,8 @@ CAI_Network::CAI_Network()
 
 CAI_Network::~CAI_Network()
 {
+	m_NodeGrid.Purge();
+
 #ifdef AI_NODE_TREE
 	if ( m_pNodeTree )
 	{
@@ -284,9 +284,17 @@ int CAI_Network::ListNodesInBox( CNodeList &list, int maxListCount, const Vector
 	float flClosest = 1000000.0 * 1000000;
 	int closest = 0;
 
-// UNDONE: Store the nodes in a tree and query the tree instead of the entire list!!!
-	for ( int node = 0; node < m_iNumNodes; node++ )
+	if ( !m_NodeGrid.IsValid() )
+		BuildNodeGrid();
+
+	// Candidates come back in ascending ID order, so ties resolve exactly as
+	// they did when every node was walked
+	CUtlVectorFixedGrowable<int, 256> candidates;
+	m_NodeGrid.GatherNodesInBox( mins, maxs, candidates );
+
+	for ( int iCandidate = 0; iCandidate < candidates.Count(); iCandidate++ )
 	{
+		int node = candidates[iCandidate];
 		CAI_Node *pNode = m_pAInode[node];
 		const Vector &origin = pNode->GetOrigin();
 		// in box?
@@ -343,6 +351,10 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 	if (m_iNumNodes == 0)
 		return NO_NODE;
 
+#ifdef AI_PERF_MON
+	CTimeAdder perfTimeAdder( &CAI_NetworkEditTools::m_PerfStatNNTime );
+#endif
+
 	// ----------------------------------------------------------------
 	//  First check cached nearest node positions
 	// ----------------------------------------------------------------
@@ -367,7 +379,10 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 
 		if ( cachedNode != NO_NODE && ( !pFilter || pFilter->IsValid( m_pAInode[cachedNode] ) ) )
 		{
-			m_NearestCache[cachePos].expiration	= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+			m_NearestCache[pNPC->GetHullType()][cachePos].expiration = gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+#ifdef AI_PERF_MON
+			CAI_NetworkEditTools::m_nPerfStatNNCacheHits++;
+#endif
 			return cachedNode;
 		}
 	}
@@ -384,7 +399,7 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 #endif
 
 #ifdef AI_PERF_MON
-		m_nPerfStatNN++;
+		CAI_NetworkEditTools::m_nPerfStatNN++;
 #endif
 
 	AI_NearNode_t *pBuffer = (AI_NearNode_t *)stackalloc( sizeof(AI_NearNode_t) * MAX_NEAR_NODES );
@@ -477,17 +492,18 @@ int	CAI_Network::GetCachedNode(const Vector &checkPos, Hull_t nHull, int *pCache
 		return NOT_CACHED;
 
 	// Walk from newest to oldest.
-	int iNewest = m_iNearestCacheNext + 1;
+	NearNodeCache_T *pCache = m_NearestCache[nHull];
+	int iNewest = m_iNearestCacheNext[nHull] + 1;
 	for ( int i = 0; i < NEARNODE_CACHE_SIZE; i++ )
 	{
 		int iCurrent = ( iNewest + i ) % NEARNODE_CACHE_SIZE;
-		if ( m_NearestCache[iCurrent].hull == nHull && m_NearestCache[iCurrent].expiration > gpGlobals->curtime )
+		if ( pCache[iCurrent].expiration > gpGlobals->curtime )
 		{
-			if ( (m_NearestCache[iCurrent].vTestPosition - checkPos).LengthSqr() < Square(24.0) )
+			if ( (pCache[iCurrent].vTestPosition - checkPos).LengthSqr() < Square(24.0) )
 			{
 				if ( pCachePos )
 					*pCachePos = iCurrent;
-				return m_NearestCache[iCurrent].node;
+				return pCache[iCurrent].node;
 			}
 		}
 	}
@@ -526,18 +542,45 @@ void CAI_Network::SetCachedNearestNode(const Vector &checkPos, int nodeID, Hull_
 	if ( ai_no_node_cache.GetBool() )
 		return;
 
-	m_NearestCache[m_iNearestCacheNext].vTestPosition	= checkPos;
-	m_NearestCache[m_iNearestCacheNext].node			= nodeID;
-	m_NearestCache[m_iNearestCacheNext].hull			= nHull;
-	m_NearestCache[m_iNearestCacheNext].expiration		= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+	int &iNext = m_iNearestCacheNext[nHull];
+
+	m_NearestCache[nHull][iNext].vTestPosition	= checkPos;
+	m_NearestCache[nHull][iNext].node			= nodeID;
+	m_NearestCache[nHull][iNext].expiration		= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+
+	iNext--;
+	if ( iNext < 0 )
+	{
+		iNext = NEARNODE_CACHE_SIZE - 1;
+	}
+}
+
+//-----------------------------------------------------------------------------
 
-	m_iNearestCacheNext--;
-	if ( m_iNearestCacheNext < 0 )
+void CAI_Network::ClearNearestNodeCache()
+{
+	// Force empty node caches to be rebuild
+	for ( int hull = 0; hull <= NUM_HULLS; hull++ )
 	{
-		m_iNearestCacheNext = NEARNODE_CACHE_SIZE - 1;
+		m_iNearestCacheNext[hull] = NEARNODE_CACHE_SIZE - 1;
+		for ( int node = 0; node < NEARNODE_CACHE_SIZE; node++ )
+		{
+			m_NearestCache[hull][node].expiration = FLT_MIN;
+		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the spatial index over node origins. Cached nearest node
+//			results may refer to old positions, so they are dropped too.
+//-----------------------------------------------------------------------------
+
+void CAI_Network::BuildNodeGrid()
+{
+	m_NodeGrid.Build( m_pAInode, m_iNumNodes );
+	ClearNearestNodeCache();
+}
+
 //-----------------------------------------------------------------------------
 
 Vector CAI_Network::GetNodePosition( Hull_t hull, int nodeID )
@@ -613,6 +656,7 @@ CAI_Node *CAI_Network::AddNode( const Vector &origin, float yaw )
 	}
 
 	m_pAInode[m_iNumNodes] = new CAI_Node( m_iNumNodes, origin, yaw );
+	m_NodeGrid.Invalidate();
 
 #ifdef AI_NODE_TREE
 	if ( !m_pNodeTree )
@@ -727,3 +771,84 @@ IterationRetval_t CAI_Network::EnumElement( IHandleEntity *pHandleEntity )
 }
 
 //=============================================================================
+
+//=============================================================================
+// CAI_NodeGrid
+//=============================================================================
+
+CAI_NodeGrid::CAI_NodeGrid()
+ :	m_flMinX( 0 ),
+	m_flMinY( 0 ),
+	m_flInvCellSize( 1.0f / MIN_CELL_SIZE ),
+	m_nCellsX( 0 ),
+	m_nCellsY( 0 ),
+	m_bValid( false )
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NodeGrid::Purge()
+{
+	m_CellStart.Purge();
+	m_CellNodes.Purge();
+	m_nCellsX = m_nCellsY = 0;
+	m_bValid = false;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_NodeGrid::Build( CAI_Node **ppNodes, int nNodes )
+{
+	m_CellStart.RemoveAll();
+	m_CellNodes.RemoveAll();
+	m_bValid = true;
+
+	if ( !nNodes )
+	{
+		m_nCellsX = m_nCellsY = 0;
+		return;
+	}
+
+	float flMaxX = -FLT_MAX, flMaxY = -FLT_MAX;
+	m_flMinX = m_flMinY = FLT_MAX;
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const Vector &origin = ppNodes[i]->GetOrigin();
+		m_flMinX = MIN( m_flMinX, origin.x );
+		m_flMinY = MIN( m_flMinY, origin.y );
+		flMaxX = MAX( flMaxX, origin.x );
+		flMaxY = MAX( flMaxY, origin.y );
+	}
+
+	float flCellSize = MAX( (float)MIN_CELL_SIZE, MAX( flMaxX - m_flMinX, flMaxY - m_flMinY ) / MAX_CELLS_AXIS );
+	m_flInvCellSize = 1.0f / flCellSize;
+	m_nCellsX = (int)( ( flMaxX - m_flMinX ) * m_flInvCellSize ) + 1;
+	m_nCellsY = (int)( ( flMaxY - m_flMinY ) * m_flInvCellSize ) + 1;
+
+	// Counting sort of node IDs by cell. Walking nodes in ID order keeps each
+	// cell's list ascending.
+	int nCells = m_nCellsX * m_nCellsY;
+	m_CellStart.SetCount( nCells + 1 );
+	memset( m_CellStart.Base(), 0, m_CellStart.Count() * sizeof(int) );
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const Vector &origin = ppNodes[i]->GetOrigin();
+		m_CellStart[ CellY( origin.y ) * m_nCellsX + CellX( origin.x ) + 1 ]++;
+	}
+
+	for ( int i = 0; i < nCells; i++ )
+	{
+		m_CellStart[i + 1] += m_CellStart[i];
+	}
+
+	CUtlVector<int> fill;
+	fill.CopyArray( m_CellStart.Base(), nCells );
+	m_CellNodes.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const Vector &origin = ppNodes[i]->GetOrigin();
+		m_CellNodes[ fill[ CellY( origin.y ) * m_nCellsX + CellX( origin.x ) ]++ ] = i;
+	}
+}
@@ -14,6 +14,7 @@
 
 #include "ispatialpartition.h"
 #include "utlpriorityqueue.h"
+#include "ai_hull.h"
 
 // ------------------------------------
 
@@ -78,6 +79,88 @@ public:
 	CNodeList( AI_NearNode_t *pMemory, int count ) : CUtlPriorityQueue<AI_NearNode_t>( pMemory, count, IsLowerPriority ) {}
 };
 
+//-----------------------------------------------------------------------------
+// CAI_NodeGrid
+//
+// Purpose: Uniform 2D grid over node origins, used to answer box queries
+//			without walking every node in the network
+//-----------------------------------------------------------------------------
+
+class CAI_NodeGrid
+{
+public:
+	CAI_NodeGrid();
+
+	void			Build( CAI_Node **ppNodes, int nNodes );
+	void			Purge();
+
+	bool			IsValid() const	{ return m_bValid; }
+	void			Invalidate()	{ m_bValid = false; }
+
+	// Appends the IDs of nodes in cells overlapping the box (in x/y only), in ascending order
+	template <class NODE_ID_VECTOR>
+	void			GatherNodesInBox( const Vector &mins, const Vector &maxs, NODE_ID_VECTOR &result ) const;
+
+private:
+	enum
+	{
+		MIN_CELL_SIZE	= 256,
+		MAX_CELLS_AXIS	= 256,
+	};
+
+	int				CellX( float x ) const	{ return clamp( (int)( ( x - m_flMinX ) * m_flInvCellSize ), 0, m_nCellsX - 1 ); }
+	int				CellY( float y ) const	{ return clamp( (int)( ( y - m_flMinY ) * m_flInvCellSize ), 0, m_nCellsY - 1 ); }
+
+	float			m_flMinX;
+	float			m_flMinY;
+	float			m_flInvCellSize;
+	int				m_nCellsX;
+	int				m_nCellsY;
+	CUtlVector<int>	m_CellStart;		// m_nCellsX * m_nCellsY + 1 offsets into m_CellNodes
+	CUtlVector<int>	m_CellNodes;		// Node IDs, ascending within each cell
+	bool			m_bValid;
+};
+
+//-------------------------------------
+
+inline int __cdecl AI_NodeIDCompare( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+template <class NODE_ID_VECTOR>
+inline void CAI_NodeGrid::GatherNodesInBox( const Vector &mins, const Vector &maxs, NODE_ID_VECTOR &result ) const
+{
+	if ( !m_nCellsX || !m_nCellsY )
+		return;
+
+	if ( maxs.x < m_flMinX || maxs.y < m_flMinY )
+		return;
+
+	int x0 = CellX( mins.x ), x1 = CellX( maxs.x );
+	int y0 = CellY( mins.y ), y1 = CellY( maxs.y );
+
+	int nFirst = result.Count();
+	for ( int y = y0; y <= y1; y++ )
+	{
+		for ( int x = x0; x <= x1; x++ )
+		{
+			int iCell = y * m_nCellsX + x;
+			int nNodes = m_CellStart[iCell + 1] - m_CellStart[iCell];
+			if ( nNodes )
+			{
+				result.AddMultipleToTail( nNodes, &m_CellNodes[ m_CellStart[iCell] ] );
+			}
+		}
+	}
+
+	// Each cell is already ascending, but several cells need merging
+	if ( x0 != x1 || y0 != y1 )
+	{
+		qsort( result.Base() + nFirst, result.Count() - nFirst, sizeof(int), (int (__cdecl *)(const void *, const void *))AI_NodeIDCompare );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // CAI_Network
 //
@@ -128,6 +211,9 @@ public:
 	
 	CAI_Node**		AccessNodes() const	{ return m_pAInode; }
 
+	// Call once node origins are final (after loading or building the graph)
+	void			BuildNodeGrid();
+
 #ifdef MAPBASE_VSCRIPT
 	Vector		ScriptGetNodePosition( int nodeID ) { return GetNodePosition( HULL_HUMAN, nodeID ); }
 	Vector		ScriptGetNodePositionWithHull( int nodeID, int hull ) { return GetNodePosition( (Hull_t)hull, nodeID ); }
@@ -152,9 +238,11 @@ private:
 
 	//---------------------------------
 
+	void			ClearNearestNodeCache();
+
 	enum
 	{
-		NEARNODE_CACHE_SIZE = 32,
+		NEARNODE_CACHE_SIZE = 64,		// Per hull
 		NEARNODE_CACHE_LIFE = 10,
 	};
 
@@ -163,8 +251,6 @@ private:
 		Vector	vTestPosition;		
 		float	expiration;				// Time tested
 		int		node;					// Nearest Node to position
-		int		hull;					// Hull	type tested (or HULL_NONE is only visibility tested)
-
 	};
 
 	int					m_iNumNodes;				// Number of nodes in this network
@@ -175,8 +261,11 @@ private:
 		PARTITION_NODE	= ( 1 << 0 )
 	};
 
-	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
-	int					m_iNearestCacheNext;					// Oldest record in the cache
+	// Cache of nearest nodes, one ring per hull type (HULL_NONE if only visibility tested)
+	NearNodeCache_T		m_NearestCache[NUM_HULLS + 1][NEARNODE_CACHE_SIZE];
+	int					m_iNearestCacheNext[NUM_HULLS + 1];		// Oldest record in each ring
+
+	CAI_NodeGrid		m_NodeGrid;
 
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
@@ -25,6 +25,7 @@
 #include "ndebugoverlay.h"
 #include "ai_hint.h"
 #include "tier0/icommandline.h"
+#include "vstdlib/jobthread.h"
 #ifdef MAPBASE
 #include "gameinterface.h"
 #endif
@@ -72,6 +73,7 @@ CON_COMMAND( ai_debug_node_connect, "Debug the attempted connection between two
 // line to properly override the node graph building.
 
 ConVar g_ai_norebuildgraph( "ai_norebuildgraph", "0" );
+ConVar ai_threaded_graph_build( "ai_threaded_graph_build", "1", FCVAR_NONE, "Run the traces for a full node graph build as parallel jobs. The resulting graph is identical to a serial build." );
 #ifdef MAPBASE
 ConVar g_ai_norebuildgraphmessage( "ai_norebuildgraphmessage", "0", FCVAR_ARCHIVE, "Stops the \"Node graph out of date\" message from appearing when rebuilding node graph" );
 
@@ -721,6 +723,8 @@ void CAI_NetworkManager::LoadNetworkGraph( void )
 		DevMsg( "\n** Should run \"Check For Problems\" on the VMF then verify dynamic links\n" );
 #endif
 
+	m_pNetwork->BuildNodeGrid();
+
 	gm_fNetworksLoaded = true;
 	CAI_DynamicLink::gm_bInitialized = false;
 }
@@ -1205,6 +1209,8 @@ float			CAI_NetworkEditTools::m_flAirEditDistance	= 300;
 #ifdef AI_PERF_MON
 	// Performance stats (only for development)
 	int				CAI_NetworkEditTools::m_nPerfStatNN			= 0;
+	int				CAI_NetworkEditTools::m_nPerfStatNNCacheHits	= 0;
+	CCycleCount		CAI_NetworkEditTools::m_PerfStatNNTime;
 	int				CAI_NetworkEditTools::m_nPerfStatPB			= 0;
 	float			CAI_NetworkEditTools::m_fNextPerfStatTime	= -1;
 #endif
@@ -2007,12 +2013,17 @@ void CAI_NetworkEditTools::DrawAINetworkOverlay(void)
 #ifdef AI_PERF_MON
 		if (m_fNextPerfStatTime < gpGlobals->curtime)
 		{
+			int nNearestQueries = m_nPerfStatNN + m_nPerfStatNNCacheHits;
+			float flCacheHitRate = ( nNearestQueries ) ? ( 100.0f * m_nPerfStatNNCacheHits / nNearestQueries ) : 0.0f;
+
 			char temp[512];
-			Q_snprintf(temp,sizeof(temp),"%3.2f NN/m\n%3.2f P/m\n",(m_nPerfStatNN/1.0),(m_nPerfStatPB/1.0));
+			Q_snprintf(temp,sizeof(temp),"%3.2f NN/m\n%3.2f%% NN cache hits\n%3.2f ms NN\n%3.2f P/m\n",(m_nPerfStatNN/1.0),flCacheHitRate,m_PerfStatNNTime.GetMillisecondsF(),(m_nPerfStatPB/1.0));
 			UTIL_CenterPrintAll(temp);
 
 			m_fNextPerfStatTime = gpGlobals->curtime + 1;
 			m_nPerfStatNN		= 0;
+			m_nPerfStatNNCacheHits = 0;
+			m_PerfStatNNTime.Init();
 			m_nPerfStatPB		= 0;
 		}
 #endif		
@@ -2202,6 +2213,7 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 		}
 	}
 	nNodes = pNetwork->NumNodes(); // InitNodePosition can create nodes
+	pNetwork->BuildNodeGrid();
 
 	// ---------------------------
 	// Initialize node neighbors
@@ -2261,6 +2273,7 @@ void CAI_NetworkBuilder::BeginBuild()
 
 void CAI_NetworkBuilder::EndBuild()
 {
+	ClearPrecomputed();
 	m_NeighborsTable.SetSize(0);
 	m_DidSetNeighborsTable.Resize(0);
 	CAI_TestHull::ReturnTestHull();
@@ -2305,12 +2318,23 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 			pHelper->PostInitNodePosition( pNetwork, ppNodes[i] );
 	}
 	nNodes = pNetwork->NumNodes(); // InitNodePosition can create nodes
+	pNetwork->BuildNodeGrid();
 	timer.End();
 	DevMsg( "...done initializing node positions. %f seconds\n", timer.GetDuration().GetSeconds() );
 
 	// ---------------------------
 	// Initialize node neighbors
 	// ---------------------------
+	bool bThreaded = ( ai_threaded_graph_build.GetBool() && g_pThreadPool && g_pThreadPool->NumThreads() > 0 );
+	if ( bThreaded )
+	{
+		DevMsg( "Computing node visibility (%d threads)...\n", g_pThreadPool->NumThreads() + 1 );
+		timer.Start();
+		PrecomputeVisibility( pNetwork );
+		timer.End();
+		DevMsg( "...done computing node visibility. %f seconds\n", timer.GetDuration().GetSeconds() );
+	}
+
 	DevMsg( "Initializing node neighbors...\n" );
 	timer.Start();
 	m_DidSetNeighborsTable.Resize( nNodes );
@@ -2347,10 +2371,19 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 		// Make sure all the links are clear
 		ppNodes[i]->ClearLinks();
 	}
+	if ( bThreaded )
+	{
+		CFastTimer precomputeTimer;
+		precomputeTimer.Start();
+		PrecomputeConnections( pNetwork );
+		precomputeTimer.End();
+		DevMsg( "...computed %d connections (%d threads). %f seconds\n", m_PrecomputedConnections.Count(), g_pThreadPool->NumThreads() + 1, precomputeTimer.GetDuration().GetSeconds() );
+	}
 	for (i = 0; i < nNodes; i++)
 	{	
 		InitLinks( pNetwork, ppNodes[i] );
 	}
+	ClearPrecomputed();
 	timer.End();
 	DevMsg( "...done determining links. %f seconds\n", timer.GetDuration().GetSeconds() );
 
@@ -2651,6 +2684,46 @@ void CAI_NetworkBuilder::InitNodePosition(CAI_Network *pNetwork, CAI_Node *pNode
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Line of sight test between two node positions. Only traces against
+//			world geometry, so it is safe to call from a worker thread.
+//-----------------------------------------------------------------------------
+
+static bool TestNodeVisibility( const Vector &srcPos, const Vector &destPos )
+{
+	trace_t	tr;
+
+	// ------------------
+	//  Bottom to bottom
+	// ------------------
+	AI_TraceLine ( srcPos, destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+		return true;
+
+	// ------------------
+	//  Top to top
+	// ------------------
+	AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+		return true;
+
+	// ------------------
+	//  Top to Bottom
+	// ------------------
+	AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+		return true;
+
+	// ------------------
+	//  Bottom to Top
+	// ------------------
+	AI_TraceLine ( srcPos,destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+		return true;
+
+	return false;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Set the visibility for this node.  (What nodes it can see with a
 //			line trace)
@@ -2728,56 +2801,15 @@ void CAI_NetworkBuilder::InitVisibility(CAI_Network *pNetwork, CAI_Node *pNode)
 		// position using the smallest hull to make sure were not in geometry
 		Vector destPos = pNetwork->GetNode( testnode )->GetPosition(HULL_SMALL_CENTERED);
 
-		trace_t	tr;
-		tr.m_pEnt = NULL;
-
-		// Try several line of sight checks
-
-		bool isVisible = false;
-
-		// ------------------
-		//  Bottom to bottom
-		// ------------------
-		AI_TraceLine ( srcPos, destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-		if (!tr.startsolid && tr.fraction == 1.0)
-		{
-			isVisible = true;
-		}
-
-		// ------------------
-		//  Top to top
-		// ------------------
-		if (!isVisible)
-		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
-		}
-
-		// ------------------
-		//  Top to Bottom
-		// ------------------
-		if (!isVisible)
+		// Try several line of sight checks, unless a threaded build already has
+		bool isVisible;
+		if ( m_bHaveVisibilityTable && testnode > pNode->m_iID )
 		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = m_VisibilityTable[pNode->m_iID].IsBitSet( testnode );
 		}
-
-		// ------------------
-		//  Bottom to Top
-		// ------------------
-		if (!isVisible)
+		else
 		{
-			AI_TraceLine ( srcPos,destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = TestNodeVisibility( srcPos, destPos );
 		}
 
 		// ------------------
@@ -3005,37 +3037,59 @@ static bool IsInLineForClimb( const Vector &srcPos, const Vector &srcFacing, con
 
 int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull )
 {
-	int srcId = pSrcNode->m_iID;
-	int destId = pDestNode->m_iID;
-	int result = 0;
-	trace_t tr;
-	
+	PrepareTestHull( m_pTestHull, hull );
+	return ComputeConnection( m_pTestHull, pSrcNode, pDestNode, hull );
+}
+
+//-------------------------------------
+// Sets the test hull up for the given hull type. This changes entity state, so
+// it is always done on the main thread.
+//-------------------------------------
+
+void CAI_NetworkBuilder::PrepareTestHull( CAI_TestHull *pTestHull, Hull_t hull )
+{
 	// Set the size of the test hull
-	if ( m_pTestHull->GetHullType() != hull ) 
+	if ( pTestHull->GetHullType() != hull ) 
 	{
-		m_pTestHull->SetHullType( hull );
-		m_pTestHull->SetHullSizeNormal( true );
+		pTestHull->SetHullType( hull );
+		pTestHull->SetHullSizeNormal( true );
 	}
 
-	if ( !( m_pTestHull->GetFlags() & FL_ONGROUND ) )
+	if ( !( pTestHull->GetFlags() & FL_ONGROUND ) )
 	{
 		DevWarning( 2, "OFFGROUND!\n" );
+		pTestHull->AddFlag( FL_ONGROUND );
 	}
-	m_pTestHull->AddFlag( FL_ONGROUND );
+}
+
+//-------------------------------------
+// Tests the connection using a test hull already set up by PrepareTestHull().
+// Only traces, so it may run on a worker thread as long as each thread has
+// its own test hull.
+//-------------------------------------
+
+int CAI_NetworkBuilder::ComputeConnection( CAI_TestHull *pTestHull, CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull )
+{
+	int srcId = pSrcNode->m_iID;
+	int destId = pDestNode->m_iID;
+	int result = 0;
+	trace_t tr;
+
+	Assert( pTestHull->GetHullType() == hull && ( pTestHull->GetFlags() & FL_ONGROUND ) );
 
 	// ==============================================================
 	// FIRST CHECK IF HULL CAN EVEN FIT AT THESE NODES
 	// ==============================================================
 	// @Note (toml 02-10-03): this should be optimized, caching the results of CanFitAtNode() 
 	if ( !( pSrcNode->m_eNodeInfo & ( HullToBit( hull ) << NODE_ENT_FLAGS_SHIFT ) ) &&
-		 !m_pTestHull->GetNavigator()->CanFitAtNode(srcId,MASK_NPCWORLDSTATIC) )
+		 !pTestHull->GetNavigator()->CanFitAtNode(srcId,MASK_NPCWORLDSTATIC) )
 	{
 		DebugConnectMsg( srcId, destId, "      Cannot fit at node %d\n", srcId );
 		return 0;
 	}
 	
 	if (  !( pDestNode->m_eNodeInfo & ( HullToBit( hull ) << NODE_ENT_FLAGS_SHIFT ) ) &&
-		 !m_pTestHull->GetNavigator()->CanFitAtNode(destId,MASK_NPCWORLDSTATIC) )
+		 !pTestHull->GetNavigator()->CanFitAtNode(destId,MASK_NPCWORLDSTATIC) )
 	{
 		DebugConnectMsg( srcId, destId, "      Cannot fit at node %d\n", destId );
 		return 0;
@@ -3051,7 +3105,7 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 		// Air nodes only connect to other air nodes and nothing else
 		if (pSrcNode->m_eNodeType == NODE_AIR && pDestNode->GetType() == NODE_AIR)
 		{
-			AI_TraceHull( pSrcNode->GetOrigin(), pDestNode->GetOrigin(), NAI_Hull::Mins(hull),NAI_Hull::Maxs(hull), MASK_NPCWORLDSTATIC, m_pTestHull, COLLISION_GROUP_NONE, &tr );
+			AI_TraceHull( pSrcNode->GetOrigin(), pDestNode->GetOrigin(), NAI_Hull::Mins(hull),NAI_Hull::Maxs(hull), MASK_NPCWORLDSTATIC, pTestHull, COLLISION_GROUP_NONE, &tr );
 			if (!tr.startsolid && tr.fraction == 1.0)
 			{
 				result |= bits_CAP_MOVE_FLY;
@@ -3076,7 +3130,7 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 		{
 			AI_TraceHull( srcPos, destPos, 
 							NAI_Hull::Mins(hull),NAI_Hull::Maxs(hull), 
-							MASK_NPCWORLDSTATIC, m_pTestHull, COLLISION_GROUP_NONE, &tr );
+							MASK_NPCWORLDSTATIC, pTestHull, COLLISION_GROUP_NONE, &tr );
 			if (!tr.startsolid && tr.fraction == 1.0)
 			{
 				result |= bits_CAP_MOVE_CLIMB;
@@ -3102,7 +3156,7 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 				return 0;
 			}
 
-			AI_TraceHull( srcPos, destPos, NAI_Hull::Mins(hull),NAI_Hull::Maxs(hull), MASK_NPCWORLDSTATIC, m_pTestHull, COLLISION_GROUP_NONE, &tr );
+			AI_TraceHull( srcPos, destPos, NAI_Hull::Mins(hull),NAI_Hull::Maxs(hull), MASK_NPCWORLDSTATIC, pTestHull, COLLISION_GROUP_NONE, &tr );
 			if (!tr.startsolid && tr.fraction == 1.0)
 			{
 				result |= bits_CAP_MOVE_CLIMB;
@@ -3130,13 +3184,13 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 		Vector srcPos	 = pSrcNode->GetPosition(hull);
 		Vector destPos	 = pDestNode->GetPosition(hull);
 
-		if (!m_pTestHull->GetMoveProbe()->CheckStandPosition( srcPos, MASK_NPCWORLDSTATIC))
+		if (!pTestHull->GetMoveProbe()->CheckStandPosition( srcPos, MASK_NPCWORLDSTATIC))
 		{
 			DebugConnectMsg( srcId, destId, "      Failed to stand at %d\n", srcId );
 			fStandFailed = true;
 		}
 
-		if (!m_pTestHull->GetMoveProbe()->CheckStandPosition( destPos, MASK_NPCWORLDSTATIC))
+		if (!pTestHull->GetMoveProbe()->CheckStandPosition( destPos, MASK_NPCWORLDSTATIC))
 		{
 			DebugConnectMsg( srcId, destId, "      Failed to stand at %d\n", destId );
 			fStandFailed = true;
@@ -3147,7 +3201,7 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 
 		if ( !fStandFailed )
 		{
-			fWalkFailed = !m_pTestHull->GetMoveProbe()->TestGroundMove( srcPos, destPos, MASK_NPCWORLDSTATIC, AITGM_IGNORE_INITIAL_STAND_POS, NULL );
+			fWalkFailed = !pTestHull->GetMoveProbe()->TestGroundMove( srcPos, destPos, MASK_NPCWORLDSTATIC, AITGM_IGNORE_INITIAL_STAND_POS, NULL );
 			if ( fWalkFailed )
 				DebugConnectMsg( srcId, destId, "      Failed to walk between nodes\n" );
 		}
@@ -3173,15 +3227,16 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 
 			// Jumps aren't bi-directional.  We can jump down further than we can jump up so
 			// we have to test for either one
-			bool canDestJump = m_pTestHull->IsJumpLegal(srcPos, destPos, destPos);
-			bool canSrcJump  = m_pTestHull->IsJumpLegal(destPos, srcPos, srcPos);
+			bool canDestJump = pTestHull->IsJumpLegal(srcPos, destPos, destPos);
+			bool canSrcJump  = pTestHull->IsJumpLegal(destPos, srcPos, srcPos);
 
 			if (canDestJump || canSrcJump) 
 			{
-				CAI_MoveProbe *pMoveProbe = m_pTestHull->GetMoveProbe();
+				CAI_MoveProbe *pMoveProbe = pTestHull->GetMoveProbe();
 
 				bool fJumpLegal = false;
-				m_pTestHull->SetGravity(1.0);
+				if ( pTestHull->GetGravity() != 1.0 )
+					pTestHull->SetGravity(1.0);
 
 				AIMoveTrace_t moveTrace;
 				pMoveProbe->MoveLimit( NAV_JUMP, srcPos,destPos, MASK_NPCWORLDSTATIC, NULL, &moveTrace);
@@ -3264,11 +3319,16 @@ void CAI_NetworkBuilder::InitLinks(CAI_Network *pNetwork, CAI_Node *pNode)
 
 			if ( !(pNode->m_eNodeInfo & bits_NODE_FALLEN) && !(pDestNode->m_eNodeInfo & bits_NODE_FALLEN) )
 			{
+				const PrecomputedConnection_t *pPrecomputed = FindPrecomputedConnection( pNode->m_iID, i );
+
 				for (int hull = 0 ; hull < NUM_HULLS; hull++ )
 				{
 					DebugConnectMsg( pNode->m_iID, i, "   Testing for hull %s\n", NAI_Hull::Name( (Hull_t)hull  ) );
 					
-					acceptedMotions[hull] = ComputeConnection( pNode, pDestNode, (Hull_t)hull );
+					if ( pPrecomputed )
+						acceptedMotions[hull] = pPrecomputed->acceptedMotions[hull];
+					else
+						acceptedMotions[hull] = ComputeConnection( pNode, pDestNode, (Hull_t)hull );
 					if ( acceptedMotions[hull] != 0 )
 						bAllFailed = false;
 				}
@@ -3300,4 +3360,234 @@ void CAI_NetworkBuilder::InitLinks(CAI_Network *pNetwork, CAI_Node *pNode)
 	}
 }
 
+
+//-----------------------------------------------------------------------------
+// Purpose: Threaded build, first half. Runs the line of sight traces that
+//			InitVisibility() would make for every node pair (i, j) with j > i.
+//			Pairs with j < i are copied from node j's finished neighbor list,
+//			so they never need traces.
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkBuilder::PrecomputeVisibility( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+
+	m_pPrecomputeNetwork = pNetwork;
+	m_VisibilityTable.SetSize( nNodes );
+
+	CUtlVector<int> nodeIDs;
+	nodeIDs.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		m_VisibilityTable[i].Resize( nNodes );
+		m_VisibilityTable[i].ClearAll();
+		nodeIDs[i] = i;
+	}
+
+	ParallelProcess( "CAI_NetworkBuilder::PrecomputeVisibility", nodeIDs.Base(), nodeIDs.Count(), this, &CAI_NetworkBuilder::PrecomputeVisibilityForNode );
+
+	m_bHaveVisibilityTable = true;
+}
+
+//-------------------------------------
+
+void CAI_NetworkBuilder::PrecomputeVisibilityForNode( int &iNode )
+{
+	CAI_Network *pNetwork = m_pPrecomputeNetwork;
+	CAI_Node *pNode = pNetwork->GetNode( iNode );
+
+	if ( pNode->GetType() == NODE_DELETED )
+		return;
+
+	Vector srcPos = pNode->GetPosition(HULL_SMALL_CENTERED);
+
+	// Same filtering as InitVisibility(). Nodes it would discard as duplicates
+	// get traced anyway, the result is just never read.
+	for ( int testnode = iNode + 1; testnode < pNetwork->NumNodes(); testnode++ )
+	{
+		CAI_Node *pTestNode = pNetwork->GetNode( testnode );
+		if ( pTestNode->GetType() == NODE_DELETED )
+			continue;
+
+		float flDistToCheckNode = ( pTestNode->GetOrigin() - pNode->GetOrigin() ).LengthSqr(); 
+		if ( flDistToCheckNode > ( ( pTestNode->GetType() == NODE_AIR ) ? MAX_AIR_NODE_LINK_DIST_SQ : MAX_NODE_LINK_DIST_SQ ) )
+			continue;
+
+		if ( TestNodeVisibility( srcPos, pTestNode->GetPosition(HULL_SMALL_CENTERED) ) )
+		{
+			m_VisibilityTable[iNode].Set( testnode );
+		}
+	}
+}
+
+static int __cdecl PrecomputedConnectionCompare( const CAI_NetworkBuilder::PrecomputedConnection_t *pLeft, const CAI_NetworkBuilder::PrecomputedConnection_t *pRight )
+{
+	if ( pLeft->srcID != pRight->srcID )
+		return pLeft->srcID - pRight->srcID;
+	return pLeft->destID - pRight->destID;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Threaded build, second half. Works out which node pairs InitLinks()
+//			is going to test and runs ComputeConnection() on them in parallel,
+//			one test hull per job so no entity is shared between threads.
+//			Anything InitLinks() asks for that isn't here is computed serially.
+//-----------------------------------------------------------------------------
+
+void CAI_NetworkBuilder::PrecomputeConnections( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+	CAI_Node **ppNodes = pNetwork->AccessNodes();
+
+	m_pPrecomputeNetwork = pNetwork;
+	m_PrecomputedConnections.RemoveAll();
+
+	// One test hull per job
+	CUtlVector<CAI_TestHull *> testHulls;
+	testHulls.AddToTail( m_pTestHull );
+	for ( int i = 0; i < g_pThreadPool->NumThreads(); i++ )
+	{
+		testHulls.AddToTail( CAI_TestHull::CreateWorkerHull() );
+	}
+	for ( int i = 0; i < testHulls.Count(); i++ )
+	{
+		testHulls[i]->GetNavigator()->SetNetwork( pNetwork );
+	}
+
+	// A node tests every neighbor it isn't linked to yet. The first node of a
+	// pair always tests it; the second only if it wasn't linked by the first.
+	for ( int src = 0; src < nNodes; src++ )
+	{
+		if ( ppNodes[src]->m_eNodeInfo & bits_NODE_FALLEN )
+			continue;
+
+		for ( int dest = 0; dest < nNodes; dest++ )
+		{
+			if ( dest == src || !m_NeighborsTable[src].IsBitSet( dest ) )
+				continue;
+
+			if ( ppNodes[dest]->m_eNodeInfo & bits_NODE_FALLEN )
+				continue;
+
+			if ( dest < src && m_NeighborsTable[dest].IsBitSet( src ) )
+				continue;
+
+			int iConnection = m_PrecomputedConnections.AddToTail();
+			m_PrecomputedConnections[iConnection].srcID = src;
+			m_PrecomputedConnections[iConnection].destID = dest;
+		}
+	}
+
+	int nFirstRound = m_PrecomputedConnections.Count();
+	RunConnectionJobs( testHulls, 0, nFirstRound );
+
+	// The second node of a mutual pair also tests it when the first found no
+	// connection for any hull
+	for ( int iConnection = 0; iConnection < nFirstRound; iConnection++ )
+	{
+		const PrecomputedConnection_t &connection = m_PrecomputedConnections[iConnection];
+		if ( connection.srcID > connection.destID || !m_NeighborsTable[connection.destID].IsBitSet( connection.srcID ) )
+			continue;
+
+		bool bAllFailed = true;
+		for ( int hull = 0; hull < NUM_HULLS; hull++ )
+		{
+			if ( connection.acceptedMotions[hull] != 0 )
+			{
+				bAllFailed = false;
+				break;
+			}
+		}
+
+		if ( bAllFailed )
+		{
+			int iReverse = m_PrecomputedConnections.AddToTail();
+			m_PrecomputedConnections[iReverse].srcID = connection.destID;
+			m_PrecomputedConnections[iReverse].destID = connection.srcID;
+		}
+	}
+
+	RunConnectionJobs( testHulls, nFirstRound, m_PrecomputedConnections.Count() );
+
+	m_PrecomputedConnections.Sort( PrecomputedConnectionCompare );
+
+	for ( int i = 1; i < testHulls.Count(); i++ )
+	{
+		CAI_TestHull::DestroyWorkerHull( testHulls[i] );
+	}
+}
+
+//-------------------------------------
+
+void CAI_NetworkBuilder::RunConnectionJobs( CUtlVector<CAI_TestHull *> &testHulls, int iFirst, int iLimit )
+{
+	if ( iFirst >= iLimit )
+		return;
+
+	CUtlVector<ConnectionBatch_t> batches;
+	batches.SetCount( testHulls.Count() );
+
+	// Hull size changes touch the spatial partition, so hulls are resized here
+	// and each pass only tests the one hull type
+	for ( int hull = 0; hull < NUM_HULLS; hull++ )
+	{
+		for ( int i = 0; i < testHulls.Count(); i++ )
+		{
+			PrepareTestHull( testHulls[i], (Hull_t)hull );
+
+			batches[i].pTestHull = testHulls[i];
+			batches[i].hull = (Hull_t)hull;
+			batches[i].iFirst = iFirst + i;
+			batches[i].iLimit = iLimit;
+			batches[i].nStride = testHulls.Count();
+		}
+
+		ParallelProcess( "CAI_NetworkBuilder::ComputeConnections", batches.Base(), batches.Count(), this, &CAI_NetworkBuilder::ComputeConnectionBatch );
+	}
+}
+
+//-------------------------------------
+
+void CAI_NetworkBuilder::ComputeConnectionBatch( ConnectionBatch_t &batch )
+{
+	CAI_Node **ppNodes = m_pPrecomputeNetwork->AccessNodes();
+
+	for ( int i = batch.iFirst; i < batch.iLimit; i += batch.nStride )
+	{
+		PrecomputedConnection_t &connection = m_PrecomputedConnections[i];
+		connection.acceptedMotions[batch.hull] = ComputeConnection( batch.pTestHull, ppNodes[connection.srcID], ppNodes[connection.destID], batch.hull );
+	}
+}
+
+//-------------------------------------
+
+const CAI_NetworkBuilder::PrecomputedConnection_t *CAI_NetworkBuilder::FindPrecomputedConnection( int srcID, int destID ) const
+{
+	int iLow = 0;
+	int iHigh = m_PrecomputedConnections.Count() - 1;
+	while ( iLow <= iHigh )
+	{
+		int iMid = ( iLow + iHigh ) / 2;
+		const PrecomputedConnection_t &connection = m_PrecomputedConnections[iMid];
+		if ( connection.srcID == srcID && connection.destID == destID )
+			return &connection;
+
+		if ( connection.srcID < srcID || ( connection.srcID == srcID && connection.destID < destID ) )
+			iLow = iMid + 1;
+		else
+			iHigh = iMid - 1;
+	}
+	return NULL;
+}
+
+//-------------------------------------
+
+void CAI_NetworkBuilder::ClearPrecomputed()
+{
+	m_VisibilityTable.Purge();
+	m_bHaveVisibilityTable = false;
+	m_PrecomputedConnections.Purge();
+	m_pPrecomputeNetwork = NULL;
+}
+
 //-----------------------------------------------------------------------------
@@ -9,6 +9,10 @@
 
 #include "utlvector.h"
 #include "bitstring.h"
+#include "ai_hull.h"
+#ifdef AI_PERF_MON
+#include "tier0/fasttimer.h"
+#endif
 
 #if defined( _WIN32 )
 #pragma once
@@ -113,13 +117,52 @@ private:
 	void			FloodFillZone( CAI_Node **ppNodes, CAI_Node *pNode, int zone );
 
 	int				ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull );
+	int				ComputeConnection( CAI_TestHull *pTestHull, CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull );
+	void			PrepareTestHull( CAI_TestHull *pTestHull, Hull_t hull );
 	
 	void 			BeginBuild();
 	void			EndBuild();
 
+	//---------------------------------
+	// Threaded build. The traces for visibility and links are run as parallel
+	// jobs up front, then the serial passes consume the results in the usual
+	// order, so the graph comes out exactly as a serial build would make it.
+	//---------------------------------
+
+public:
+	struct PrecomputedConnection_t
+	{
+		int		srcID;
+		int		destID;
+		int		acceptedMotions[NUM_HULLS];
+	};
+
+	struct ConnectionBatch_t
+	{
+		CAI_TestHull *	pTestHull;
+		Hull_t			hull;
+		int				iFirst;
+		int				iLimit;
+		int				nStride;
+	};
+
+private:
+	void			PrecomputeVisibility( CAI_Network *pNetwork );
+	void			PrecomputeVisibilityForNode( int &iNode );
+	void			PrecomputeConnections( CAI_Network *pNetwork );
+	void			RunConnectionJobs( CUtlVector<CAI_TestHull *> &testHulls, int iFirst, int iLimit );
+	void			ComputeConnectionBatch( ConnectionBatch_t &batch );
+	const PrecomputedConnection_t *FindPrecomputedConnection( int srcID, int destID ) const;
+	void			ClearPrecomputed();
+
 	CUtlVector<CVarBitVec>	m_NeighborsTable;
 	CVarBitVec				m_DidSetNeighborsTable;
 	CAI_TestHull *			m_pTestHull;
+
+	CAI_Network *			m_pPrecomputeNetwork;
+	CUtlVector<CVarBitVec>	m_VisibilityTable;		// Line of sight from node i to node j, for j > i
+	bool					m_bHaveVisibilityTable;
+	CUtlVector<PrecomputedConnection_t> m_PrecomputedConnections;	// Sorted by source, then dest
 };
 
 extern CAI_NetworkBuilder g_AINetworkBuilder;
@@ -184,6 +227,8 @@ public:
 	// Performance stats
 	//----------------------
 	static	int			m_nPerfStatNN;
+	static	int			m_nPerfStatNNCacheHits;
+	static	CCycleCount	m_PerfStatNNTime;
 	static	int			m_nPerfStatPB;
 	static	float		m_fNextPerfStatTime;
 #endif
@@ -21,6 +21,11 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "filesystem.h"
+#include "tier0/fasttimer.h"
+#ifdef AI_PERF_MON
+#include "ai_networkmanager.h"
+#endif
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -272,6 +277,212 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Scratch state used by FindBestPath. Each thread that pathfinds owns
+//			one, and entries are only valid when their generation matches the
+//			current search, so a search never has to clear the whole graph.
+//			The open list is an indexed binary heap ordered by (F, node ID),
+//			which pops nodes in exactly the order the old bit string scan did.
+//-----------------------------------------------------------------------------
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iGeneration( 0 ),
+		m_bInUse( false )
+	{
+	}
+
+	void Begin( int nNodes )
+	{
+		if ( m_Generation.Count() < nNodes )
+		{
+			int nOld = m_Generation.Count();
+			m_G.SetCount( nNodes );
+			m_H.SetCount( nNodes );
+			m_F.SetCount( nNodes );
+			m_Parent.SetCount( nNodes );
+			m_HeapIndex.SetCount( nNodes );
+			m_Generation.SetCount( nNodes );
+			for ( int i = nOld; i < nNodes; i++ )
+				m_Generation[i] = 0;
+		}
+
+		if ( ++m_iGeneration == 0 )
+		{
+			// Wrapped, every stamp is suspect now
+			for ( int i = 0; i < m_Generation.Count(); i++ )
+				m_Generation[i] = 0;
+			m_iGeneration = 1;
+		}
+
+		m_Heap.RemoveAll();
+	}
+
+	bool IsTouched( int iNode ) const	{ return ( m_Generation[iNode] == m_iGeneration ); }
+
+	void Touch( int iNode )
+	{
+		m_Generation[iNode] = m_iGeneration;
+		m_HeapIndex[iNode] = -1;
+		m_Parent[iNode] = NO_NODE;
+	}
+
+	bool IsOpenEmpty() const			{ return ( m_Heap.Count() == 0 ); }
+
+	// Adds a touched node to the open list, or repositions it if already there
+	void Open( int iNode )
+	{
+		Assert( IsTouched( iNode ) );
+		int i = m_HeapIndex[iNode];
+		if ( i < 0 )
+		{
+			i = m_Heap.AddToTail( iNode );
+			m_HeapIndex[iNode] = i;
+		}
+		i = SiftUp( i );
+		SiftDown( i );
+	}
+
+	int PopOpen()
+	{
+		int iNode = m_Heap[0];
+		int iLast = m_Heap.Count() - 1;
+		m_HeapIndex[iNode] = -1;
+		if ( iLast > 0 )
+		{
+			m_Heap[0] = m_Heap[iLast];
+			m_HeapIndex[m_Heap[0]] = 0;
+			m_Heap.RemoveMultipleFromTail( 1 );
+			SiftDown( 0 );
+		}
+		else
+		{
+			m_Heap.RemoveAll();
+		}
+		return iNode;
+	}
+
+	CUtlVector<float>	m_G;
+	CUtlVector<float>	m_H;
+	CUtlVector<float>	m_F;
+	CUtlVector<int>		m_Parent;
+
+	bool				m_bInUse;
+
+private:
+	bool IsLower( int iNodeA, int iNodeB ) const
+	{
+		if ( m_F[iNodeA] != m_F[iNodeB] )
+			return ( m_F[iNodeA] < m_F[iNodeB] );
+		return ( iNodeA < iNodeB );
+	}
+
+	void Swap( int i, int j )
+	{
+		int iTemp = m_Heap[i];
+		m_Heap[i] = m_Heap[j];
+		m_Heap[j] = iTemp;
+		m_HeapIndex[m_Heap[i]] = i;
+		m_HeapIndex[m_Heap[j]] = j;
+	}
+
+	int SiftUp( int i )
+	{
+		while ( i > 0 )
+		{
+			int iParent = ( i - 1 ) / 2;
+			if ( !IsLower( m_Heap[i], m_Heap[iParent] ) )
+				break;
+			Swap( i, iParent );
+			i = iParent;
+		}
+		return i;
+	}
+
+	void SiftDown( int i )
+	{
+		int nCount = m_Heap.Count();
+		for (;;)
+		{
+			int iBest = i;
+			int iLeft = 2 * i + 1;
+			int iRight = iLeft + 1;
+			if ( iLeft < nCount && IsLower( m_Heap[iLeft], m_Heap[iBest] ) )
+				iBest = iLeft;
+			if ( iRight < nCount && IsLower( m_Heap[iRight], m_Heap[iBest] ) )
+				iBest = iRight;
+			if ( iBest == i )
+				break;
+			Swap( i, iBest );
+			i = iBest;
+		}
+	}
+
+	CUtlVector<int>			m_HeapIndex;
+	CUtlVector<unsigned>	m_Generation;
+	CUtlVector<int>			m_Heap;
+	unsigned				m_iGeneration;
+};
+
+static CThreadLocalPtr<CAI_PathfindScratch> g_pPathfindScratch;
+
+//-----------------------------------------------------------------------------
+// Claims this thread's scratch state for one search. If a search is already
+// running on this thread (an NPC callback pathfinding from inside a pathfind),
+// a temporary one is used instead.
+//-----------------------------------------------------------------------------
+class CAI_PathfindScratchLock
+{
+public:
+	CAI_PathfindScratchLock()
+	 :	m_pTemp( NULL )
+	{
+		CAI_PathfindScratch *pScratch = g_pPathfindScratch;
+		if ( !pScratch )
+		{
+			pScratch = new CAI_PathfindScratch;
+			g_pPathfindScratch = pScratch;
+		}
+
+		if ( pScratch->m_bInUse )
+		{
+			m_pTemp = new CAI_PathfindScratch;
+			pScratch = m_pTemp;
+		}
+
+		pScratch->m_bInUse = true;
+		m_pScratch = pScratch;
+	}
+
+	~CAI_PathfindScratchLock()
+	{
+		m_pScratch->m_bInUse = false;
+		delete m_pTemp;
+	}
+
+	CAI_PathfindScratch *operator->()	{ return m_pScratch; }
+
+private:
+	CAI_PathfindScratch *m_pScratch;
+	CAI_PathfindScratch *m_pTemp;
+};
+
+//-----------------------------------------------------------------------------
+// Records FindBestPath start/end pairs so ai_pathfind_bench can replay them
+//-----------------------------------------------------------------------------
+struct AI_PathfindRecord_t
+{
+	int		hull;
+	int		startID;
+	int		endID;
+};
+
+static CUtlVector<AI_PathfindRecord_t> g_AI_PathfindRecords;
+ConVar ai_pathfind_record( "ai_pathfind_record", "0", FCVAR_CHEAT, "Record node pathfind start/end pairs for ai_pathfind_bench" );
+
+#define AI_PATHFIND_RECORD_MAX 8192
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -284,9 +495,110 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 		return NULL;
 
 #ifdef AI_PERF_MON
-	m_nPerfStatPB++;
+	CAI_NetworkEditTools::m_nPerfStatPB++;
+#endif
+
+	if ( ai_pathfind_record.GetBool() && g_AI_PathfindRecords.Count() < AI_PATHFIND_RECORD_MAX && ThreadInMainThread() )
+	{
+		AI_PathfindRecord_t record = { GetHullType(), startID, endID };
+		g_AI_PathfindRecords.AddToTail( record );
+	}
+
+	int nNodes = GetNetwork()->NumNodes();
+	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+
+	// ------------- INITIALIZE ------------------------
+	CAI_PathfindScratchLock scratch;
+	scratch->Begin( nNodes );
+
+	float *nodeG = scratch->m_G.Base();
+	float *nodeH = scratch->m_H.Base();
+	float *nodeF = scratch->m_F.Base();
+	int   *nodeP = scratch->m_Parent.Base();		// Node parent 
+
+	const Vector &vecEnd = pAInode[endID]->GetPosition(GetHullType());
+
+	scratch->Touch( startID );
+	nodeG[startID] = 0;
+	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-vecEnd).Length(); // Don't want to over estimate
+	nodeF[startID] = nodeG[startID] + nodeH[startID];
+
+	scratch->Open( startID );
+
+	// --------------- FIND BEST PATH ------------------
+	while ( !scratch->IsOpenEmpty() ) 
+	{
+		int smallestID = scratch->PopOpen();
+
+		CAI_Node *pSmallestNode = pAInode[smallestID];
+		
+		if (GetOuter()->IsUnusableNode(smallestID, pSmallestNode->GetHint()))
+			continue;
+
+		if (smallestID == endID) 
+		{
+			AI_Waypoint_t* route = MakeRouteFromParents(nodeP, endID);
+			return route;
+		}
+
+		// Check this if the node is immediately in the path after the startNode 
+		// that it isn't blocked
+		for (int link=0; link < pSmallestNode->NumLinks();link++) 
+		{
+			CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex(link);
+			
+			if (!IsLinkUsable(nodeLink,smallestID))
+				continue;
+
+			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
+			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
+			int testID	 = nodeLink->DestNodeID(smallestID);
+
+			Vector r1 = pSmallestNode->GetPosition(GetHullType());
+			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
+			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
+
+#ifdef EZ2
+			if ( pAInode[testID]->GetHint() != NULL )
+			{
+				dist = GetOuter()->GetNavigator()->HintCost( pAInode[testID]->GetHint()->HintType(), dist, r2 );
+			}
 #endif
 
+			if ( dist == FLT_MAX )
+				continue;
+
+			float new_g  = nodeG[smallestID] + dist;
+
+			bool bTouched = scratch->IsTouched( testID );
+			if ( !bTouched || (new_g < nodeG[testID]) ) 
+			{
+				if ( !bTouched )
+					scratch->Touch( testID );
+
+				nodeP[testID] = smallestID;
+				nodeG[testID] = new_g;
+				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-vecEnd).Length();
+				nodeF[testID] = nodeG[testID] + nodeH[testID];
+
+				scratch->Open( testID );
+			}
+		}
+	}
+
+	return NULL;   
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The original bit string scan version of FindBestPath. Kept as the
+//			reference that ai_pathfind_bench checks routes against.
+//-----------------------------------------------------------------------------
+
+AI_Waypoint_t *CAI_Pathfinder::FindBestPathReference(int startID, int endID) 
+{
+	if ( !GetNetwork()->NumNodes() )
+		return NULL;
+
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
@@ -331,8 +643,6 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			return route;
 		}
 
-		// Check this if the node is immediately in the path after the startNode 
-		// that it isn't blocked
 		for (int link=0; link < pSmallestNode->NumLinks();link++) 
 		{
 			CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex(link);
@@ -340,7 +650,6 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			if (!IsLinkUsable(nodeLink,smallestID))
 				continue;
 
-			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
 			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
 			int testID	 = nodeLink->DestNodeID(smallestID);
 
@@ -376,6 +685,168 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	return NULL;   
 }
 
+//-----------------------------------------------------------------------------
+// Benchmark: replays recorded start/end pairs through both FindBestPath and
+// the reference search, checking the routes match and timing each.
+//-----------------------------------------------------------------------------
+
+// Saved and loaded through the same search path so the bench finds what was saved
+#define AI_PATHFIND_RECORD_PATH_ID "MOD"
+
+static void AI_GetPathfindRecordFilename( char *pszFilename, int nSize )
+{
+	Q_snprintf( pszFilename, nSize, "maps/graphs/%s.aipb", STRING( gpGlobals->mapname ) );
+}
+
+CON_COMMAND( ai_pathfind_record_save, "Save the pairs recorded by ai_pathfind_record to maps/graphs/<map>.aipb" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	char szFilename[MAX_PATH];
+	AI_GetPathfindRecordFilename( szFilename, sizeof(szFilename) );
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	for ( int i = 0; i < g_AI_PathfindRecords.Count(); i++ )
+	{
+		const AI_PathfindRecord_t &record = g_AI_PathfindRecords[i];
+		buf.Printf( "%d %d %d\n", record.hull, record.startID, record.endID );
+	}
+
+	filesystem->CreateDirHierarchy( "maps/graphs", AI_PATHFIND_RECORD_PATH_ID );
+	if ( !filesystem->WriteFile( szFilename, AI_PATHFIND_RECORD_PATH_ID, buf ) )
+	{
+		Warning( "ai_pathfind_record_save: couldn't write %s\n", szFilename );
+		return;
+	}
+
+	Msg( "ai_pathfind_record_save: wrote %d pairs to %s\n", g_AI_PathfindRecords.Count(), szFilename );
+}
+
+CON_COMMAND( ai_pathfind_record_clear, "Clear the pairs recorded by ai_pathfind_record" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	g_AI_PathfindRecords.Purge();
+}
+
+static bool AI_RoutesMatch( const AI_Waypoint_t *pRouteA, const AI_Waypoint_t *pRouteB )
+{
+	while ( pRouteA && pRouteB )
+	{
+		if ( pRouteA->iNodeID != pRouteB->iNodeID || pRouteA->NavType() != pRouteB->NavType() )
+			return false;
+		pRouteA = pRouteA->GetNext();
+		pRouteB = pRouteB->GetNext();
+	}
+	return ( pRouteA == pRouteB );
+}
+
+CON_COMMAND( ai_pathfind_bench, "Replay recorded node pathfinds (in memory, or maps/graphs/<map>.aipb) and compare against the reference search. Usage: ai_pathfind_bench [iterations]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	CAI_Network *pNetwork = g_pBigAINet;
+	if ( !pNetwork || !pNetwork->NumNodes() )
+	{
+		Msg( "ai_pathfind_bench: no node graph loaded\n" );
+		return;
+	}
+
+	CUtlVector<AI_PathfindRecord_t> records;
+	records.AddVectorToTail( g_AI_PathfindRecords );
+
+	if ( !records.Count() )
+	{
+		char szFilename[MAX_PATH];
+		AI_GetPathfindRecordFilename( szFilename, sizeof(szFilename) );
+
+		CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+		if ( filesystem->ReadFile( szFilename, AI_PATHFIND_RECORD_PATH_ID, buf ) )
+		{
+			for (;;)
+			{
+				AI_PathfindRecord_t record;
+				if ( buf.Scanf( "%d %d %d", &record.hull, &record.startID, &record.endID ) != 3 )
+					break;
+				records.AddToTail( record );
+			}
+		}
+	}
+
+	if ( !records.Count() )
+	{
+		Msg( "ai_pathfind_bench: nothing recorded, set ai_pathfind_record 1 and play for a while\n" );
+		return;
+	}
+
+	int nIterations = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1;
+
+	// Pathfinds are evaluated for a live NPC of the recorded hull
+	CAI_BaseNPC *pHullNPC[NUM_HULLS] = {};
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pNPC = ppAIs[i];
+		if ( pNPC->GetPathfinder() && !pHullNPC[pNPC->GetHullType()] )
+			pHullNPC[pNPC->GetHullType()] = pNPC;
+	}
+
+	bool bWasRecording = ai_pathfind_record.GetBool();
+	ai_pathfind_record.SetValue( 0 );
+
+	CFastTimer timer;
+	CCycleCount newTime, referenceTime;
+	int nRun = 0, nSkipped = 0, nMismatches = 0;
+
+	for ( int i = 0; i < records.Count(); i++ )
+	{
+		const AI_PathfindRecord_t &record = records[i];
+		if ( record.hull < 0 || record.hull >= NUM_HULLS || !pHullNPC[record.hull] ||
+			 record.startID < 0 || record.startID >= pNetwork->NumNodes() ||
+			 record.endID < 0 || record.endID >= pNetwork->NumNodes() )
+		{
+			nSkipped++;
+			continue;
+		}
+
+		CAI_Pathfinder *pPathfinder = pHullNPC[record.hull]->GetPathfinder();
+
+		for ( int j = 0; j < nIterations; j++ )
+		{
+			timer.Start();
+			AI_Waypoint_t *pRoute = pPathfinder->FindBestPath( record.startID, record.endID );
+			timer.End();
+			newTime += timer.GetDuration();
+
+			timer.Start();
+			AI_Waypoint_t *pReference = pPathfinder->FindBestPathReference( record.startID, record.endID );
+			timer.End();
+			referenceTime += timer.GetDuration();
+
+			if ( j == 0 && !AI_RoutesMatch( pRoute, pReference ) )
+			{
+				nMismatches++;
+				Warning( "ai_pathfind_bench: route mismatch for hull %d, %d -> %d\n", record.hull, record.startID, record.endID );
+			}
+
+			DeleteAll( pRoute );
+			DeleteAll( pReference );
+		}
+
+		nRun++;
+	}
+
+	ai_pathfind_record.SetValue( bWasRecording );
+
+	Msg( "ai_pathfind_bench: %d pairs x %d (%d skipped, no NPC of that hull), %d nodes\n", nRun, nIterations, nSkipped, pNetwork->NumNodes() );
+	Msg( "  heap:      %.3f ms\n", newTime.GetMillisecondsF() );
+	Msg( "  reference: %.3f ms\n", referenceTime.GetMillisecondsF() );
+	Msg( "  %d mismatched routes\n", nMismatches );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Find a short random path of at least pathLength distance.  If
 //			vDirection is given random path will expand in the given direction,
@@ -63,6 +63,7 @@ public:
 	int				NearestNodeToPoint( const Vector &vecOrigin );
 
 	AI_Waypoint_t*	FindBestPath		(int startID, int endID);
+	AI_Waypoint_t*	FindBestPathReference(int startID, int endID);
 	AI_Waypoint_t*	FindShortRandomPath	(int startID, float minPathLength, const Vector &vDirection = vec3_origin);
 
 	// --------------------------------
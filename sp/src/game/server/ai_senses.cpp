@@ -53,6 +53,359 @@ struct AISightIterVal_t
 
 #pragma pack(pop)
 
+//=============================================================================
+//
+// CAI_SensesGrid
+//
+// A spatial hash of NPCs and sensed objects, built at most once per tick and
+// shared by every CAI_Senses, so that LookForNPCs() and LookForObjects() only
+// distance check entities in nearby cells rather than everything in the level.
+// Line of sight is left to CBaseCombatCharacter::FVisible(), whose visibility
+// cache already shares results between both entities of a pair; the grid only
+// counts how many of the senses' sight traces that cache saves.
+//
+//=============================================================================
+
+ConVar ai_senses_grid( "ai_senses_grid", "1", FCVAR_NONE, "Use a shared per-tick spatial grid for NPC sight look-ups" );
+ConVar ai_senses_stats( "ai_senses_stats", "0", FCVAR_NONE, "Show distance checks saved by the shared sensing grid and sight traces saved by the visibility cache each tick" );
+ConVar ai_sound_index( "ai_sound_index", "1", FCVAR_NONE, "Use CSoundEnt's spatial and per-type sound index when NPCs listen" );
+ConVar ai_sound_index_verify( "ai_sound_index_verify", "0", FCVAR_NONE, "Compare each NPC's audible sounds from the sound index against a walk of the whole active list" );
+
+// Entities are bucketed on XY only; sight distances are mostly horizontal.
+const float AI_SENSES_GRID_CELL_SIZE = 512.0f;
+
+// Grid positions are sampled when the grid is built, and entities keep moving
+// as they think later in the tick. Queries are widened by this much to cover it.
+const float AI_SENSES_GRID_SLACK = 128.0f;
+
+typedef CUtlVectorFixedGrowable<int, 128> AISensesCandidates_t;
+
+//-------------------------------------
+
+class CAI_SensesCellGrid
+{
+public:
+	void RemoveAll()
+	{
+		m_Entries.RemoveAll();
+	}
+
+	void AddEntity( int index, const Vector &origin )
+	{
+		int i = m_Entries.AddToTail();
+		m_Entries[i].x = CellCoord( origin.x );
+		m_Entries[i].y = CellCoord( origin.y );
+		m_Entries[i].index = index;
+	}
+
+	// Bucket the entries with a counting sort so each bucket is contiguous
+	void Build()
+	{
+		memset( m_BucketStart, 0, sizeof( m_BucketStart ) );
+		for ( int i = 0; i < m_Entries.Count(); i++ )
+		{
+			m_BucketStart[Bucket( m_Entries[i].x, m_Entries[i].y ) + 1]++;
+		}
+		for ( int i = 0; i < NUM_BUCKETS; i++ )
+		{
+			m_BucketStart[i + 1] += m_BucketStart[i];
+		}
+
+		int cursor[NUM_BUCKETS];
+		memcpy( cursor, m_BucketStart, sizeof( cursor ) );
+		m_Sorted.SetCount( m_Entries.Count() );
+		for ( int i = 0; i < m_Entries.Count(); i++ )
+		{
+			m_Sorted[cursor[Bucket( m_Entries[i].x, m_Entries[i].y )]++] = m_Entries[i];
+		}
+	}
+
+	int Count() const { return m_Entries.Count(); }
+
+	// Appends the index of every entity in a cell overlapping the box around origin
+	void Gather( const Vector &origin, float flRadius, AISensesCandidates_t *pResult ) const
+	{
+		int x0 = CellCoord( origin.x - flRadius ), x1 = CellCoord( origin.x + flRadius );
+		int y0 = CellCoord( origin.y - flRadius ), y1 = CellCoord( origin.y + flRadius );
+
+		// Walking more cells than there are entities is slower than taking them all
+		if ( (int64)( x1 - x0 + 1 ) * ( y1 - y0 + 1 ) >= m_Entries.Count() )
+		{
+			for ( int i = 0; i < m_Entries.Count(); i++ )
+			{
+				pResult->AddToTail( m_Entries[i].index );
+			}
+			return;
+		}
+
+		for ( int x = x0; x <= x1; x++ )
+		{
+			for ( int y = y0; y <= y1; y++ )
+			{
+				int iBucket = Bucket( x, y );
+				for ( int i = m_BucketStart[iBucket]; i < m_BucketStart[iBucket + 1]; i++ )
+				{
+					// Different cells can share a bucket; only take this cell's
+					// entries so nothing is returned twice
+					if ( m_Sorted[i].x == x && m_Sorted[i].y == y )
+					{
+						pResult->AddToTail( m_Sorted[i].index );
+					}
+				}
+			}
+		}
+	}
+
+private:
+	enum
+	{
+		NUM_BUCKETS = 1024,
+	};
+
+	struct Entry_t
+	{
+		int x, y;
+		int index;
+	};
+
+	static int CellCoord( float flCoord )
+	{
+		return (int)floorf( flCoord * ( 1.0f / AI_SENSES_GRID_CELL_SIZE ) );
+	}
+
+	static int Bucket( int x, int y )
+	{
+		return ( ( (unsigned)x * 73856093u ) ^ ( (unsigned)y * 19349663u ) ) & ( NUM_BUCKETS - 1 );
+	}
+
+	CUtlVector<Entry_t> m_Entries;
+	CUtlVector<Entry_t> m_Sorted;
+	int					m_BucketStart[NUM_BUCKETS + 1];
+};
+
+//-------------------------------------
+
+class CAI_SensesGrid
+{
+public:
+	CAI_SensesGrid()
+	 :	m_iNPCTick( -1 ),
+		m_iObjectTick( -1 ),
+		m_iStatsTick( -1 )
+	{
+		memset( &m_Stats, 0, sizeof( m_Stats ) );
+	}
+
+	void Invalidate()
+	{
+		m_iNPCTick = m_iObjectTick = -1;
+		m_NPCs.RemoveAll();
+		m_Objects.RemoveAll();
+	}
+
+	void GatherNPCs( const Vector &origin, float flDistance, AISensesCandidates_t *pResult );
+	void GatherObjects( const Vector &origin, float flDistance, AISensesCandidates_t *pResult );
+	void CountSightTrace( bool bCached );
+
+private:
+	struct Stats_t
+	{
+		int nDistChecks;
+		int nDistChecksSaved;
+		int nTraces;
+		int nTracesSaved;
+	};
+
+	void BuildNPCs();
+	void BuildObjects();
+	bool ValidateNPCs( const AISensesCandidates_t &candidates );
+	bool ValidateObjects( const AISensesCandidates_t &candidates );
+	void UpdateStats();
+
+	CAI_SensesCellGrid			m_NPCGrid;
+	CUtlVector<CAI_BaseNPC *>	m_NPCs;				// g_AI_Manager's list when the grid was built
+	CUtlVector<int>				m_NeverCulledNPCs;
+	int							m_iNPCTick;
+
+	CAI_SensesCellGrid			m_ObjectGrid;
+	CUtlVector<CBaseEntity *>	m_Objects;			// g_AI_SensedObjectsManager's list when the grid was built
+	int							m_iObjectTick;
+
+	Stats_t						m_Stats;
+	int							m_iStatsTick;
+};
+
+static CAI_SensesGrid g_AI_SensesGrid;
+
+//-------------------------------------
+
+static int __cdecl CompareCandidates( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+//-------------------------------------
+
+void CAI_SensesGrid::BuildNPCs()
+{
+	AI_PROFILE_SENSES(CAI_SensesGrid_BuildNPCs);
+
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	int nAIs = g_AI_Manager.NumAIs();
+
+	m_NPCGrid.RemoveAll();
+	m_NeverCulledNPCs.RemoveAll();
+	m_NPCs.CopyArray( ppAIs, nAIs );
+
+	for ( int i = 0; i < nAIs; i++ )
+	{
+		if ( ppAIs[i]->ShouldNotDistanceCull() )
+			m_NeverCulledNPCs.AddToTail( i );
+		else
+			m_NPCGrid.AddEntity( i, ppAIs[i]->GetAbsOrigin() );
+	}
+
+	m_NPCGrid.Build();
+	m_iNPCTick = gpGlobals->tickcount;
+}
+
+//-------------------------------------
+
+void CAI_SensesGrid::BuildObjects()
+{
+	AI_PROFILE_SENSES(CAI_SensesGrid_BuildObjects);
+
+	m_ObjectGrid.RemoveAll();
+	m_Objects.SetCount( g_AI_SensedObjectsManager.Count() );
+
+	for ( int i = 0; i < m_Objects.Count(); i++ )
+	{
+		CBaseEntity *pEnt = g_AI_SensedObjectsManager.Get( i );
+		m_Objects[i] = pEnt;
+		if ( pEnt )
+			m_ObjectGrid.AddEntity( i, pEnt->GetAbsOrigin() );
+	}
+
+	m_ObjectGrid.Build();
+	m_iObjectTick = gpGlobals->tickcount;
+}
+
+//-------------------------------------
+// NPCs can spawn or be removed part way through a tick; make sure the
+// candidate indices still refer to the same NPCs as when the grid was built
+//-------------------------------------
+
+bool CAI_SensesGrid::ValidateNPCs( const AISensesCandidates_t &candidates )
+{
+	if ( g_AI_Manager.NumAIs() != m_NPCs.Count() )
+		return false;
+
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		if ( ppAIs[candidates[i]] != m_NPCs[candidates[i]] )
+			return false;
+	}
+	return true;
+}
+
+//-------------------------------------
+
+bool CAI_SensesGrid::ValidateObjects( const AISensesCandidates_t &candidates )
+{
+	if ( g_AI_SensedObjectsManager.Count() != m_Objects.Count() )
+		return false;
+
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		if ( g_AI_SensedObjectsManager.Get( candidates[i] ) != m_Objects[candidates[i]] )
+			return false;
+	}
+	return true;
+}
+
+//-------------------------------------
+// Returns indices into g_AI_Manager.AccessAIs() of NPCs that may be within
+// flDistance of origin, in list order. The caller still does the exact test.
+//-------------------------------------
+
+void CAI_SensesGrid::GatherNPCs( const Vector &origin, float flDistance, AISensesCandidates_t *pResult )
+{
+	UpdateStats();
+
+	for ( int iAttempt = 0; iAttempt < 2; iAttempt++ )
+	{
+		if ( m_iNPCTick != gpGlobals->tickcount || iAttempt > 0 )
+			BuildNPCs();
+
+		pResult->RemoveAll();
+		m_NPCGrid.Gather( origin, flDistance + AI_SENSES_GRID_SLACK, pResult );
+		pResult->AddMultipleToTail( m_NeverCulledNPCs.Count(), m_NeverCulledNPCs.Base() );
+
+		if ( ValidateNPCs( *pResult ) )
+			break;
+	}
+
+	// Keep the original list order, which the seen list order relies on
+	pResult->Sort( CompareCandidates );
+
+	m_Stats.nDistChecks += pResult->Count();
+	m_Stats.nDistChecksSaved += g_AI_Manager.NumAIs() - pResult->Count();
+}
+
+//-------------------------------------
+
+void CAI_SensesGrid::GatherObjects( const Vector &origin, float flDistance, AISensesCandidates_t *pResult )
+{
+	UpdateStats();
+
+	for ( int iAttempt = 0; iAttempt < 2; iAttempt++ )
+	{
+		if ( m_iObjectTick != gpGlobals->tickcount || iAttempt > 0 )
+			BuildObjects();
+
+		pResult->RemoveAll();
+		m_ObjectGrid.Gather( origin, flDistance + AI_SENSES_GRID_SLACK, pResult );
+
+		if ( ValidateObjects( *pResult ) )
+			break;
+	}
+
+	pResult->Sort( CompareCandidates );
+
+	m_Stats.nDistChecks += pResult->Count();
+	m_Stats.nDistChecksSaved += g_AI_SensedObjectsManager.Count() - pResult->Count();
+}
+
+//-------------------------------------
+
+void CAI_SensesGrid::CountSightTrace( bool bCached )
+{
+	UpdateStats();
+
+	if ( bCached )
+		m_Stats.nTracesSaved++;
+	else
+		m_Stats.nTraces++;
+}
+
+//-------------------------------------
+
+void CAI_SensesGrid::UpdateStats()
+{
+	if ( m_iStatsTick == gpGlobals->tickcount )
+		return;
+
+	if ( ai_senses_stats.GetBool() && m_iStatsTick != -1 )
+	{
+		engine->Con_NPrintf( 10, "Senses grid: %d distance checks, %d saved", m_Stats.nDistChecks, m_Stats.nDistChecksSaved );
+		engine->Con_NPrintf( 11, "Senses sight: %d traces, %d saved by the visibility cache", m_Stats.nTraces, m_Stats.nTracesSaved );
+	}
+
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+	m_iStatsTick = gpGlobals->tickcount;
+}
+
 
 //=============================================================================
 //
@@ -120,26 +473,92 @@ void CAI_Senses::Listen( void )
 	
 	if ( iSoundMask != SOUND_NONE && !(GetOuter()->HasSpawnFlags(SF_NPC_WAIT_TILL_SEEN)) )
 	{
-		int	iSound = CSoundEnt::ActiveList();
-		
-		while ( iSound != SOUNDLIST_EMPTY )
+		CSoundListBits candidates;
+
+		if ( ai_sound_index.GetBool() && CSoundEnt::GetSoundCandidates( GetOuter()->EarPosition(), GetOuter()->HearingSensitivity(), iSoundMask, &candidates ) )
 		{
-			CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
+			// Candidates are in active list order, so this builds the same list as the walk below
+			for ( int iRank = candidates.FindNextSetBit( 0 ); iRank != -1; iRank = candidates.FindNextSetBit( iRank + 1 ) )
+			{
+				int iSound = CSoundEnt::SoundIndexForRank( iRank );
+				CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
 
-			if ( pCurrentSound	&& (iSoundMask & pCurrentSound->SoundType()) && CanHearSound( pCurrentSound ) )
+				if ( pCurrentSound	&& (iSoundMask & pCurrentSound->SoundType()) && CanHearSound( pCurrentSound ) )
+				{
+					pCurrentSound->m_iNextAudible = m_iAudibleList;
+					m_iAudibleList = iSound;
+				}
+			}
+
+			if ( ai_sound_index_verify.GetBool() )
 			{
-	 			// the npc cares about this sound, and it's close enough to hear.
-				pCurrentSound->m_iNextAudible = m_iAudibleList;
-				m_iAudibleList = iSound;
+				VerifyAudibleList( iSoundMask );
 			}
+		}
+		else
+		{
+			int	iSound = CSoundEnt::ActiveList();
+			
+			while ( iSound != SOUNDLIST_EMPTY )
+			{
+				CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
+
+				if ( pCurrentSound	&& (iSoundMask & pCurrentSound->SoundType()) && CanHearSound( pCurrentSound ) )
+				{
+	 				// the npc cares about this sound, and it's close enough to hear.
+					pCurrentSound->m_iNextAudible = m_iAudibleList;
+					m_iAudibleList = iSound;
+				}
 
-			iSound = pCurrentSound->NextSound();
+				iSound = pCurrentSound->NextSound();
+			}
 		}
 	}
 	
 	GetOuter()->OnListened();
 }
 
+//-----------------------------------------------------------------------------
+// Check the audible list built from the sound index against a walk of the
+// whole active list
+//-----------------------------------------------------------------------------
+
+void CAI_Senses::VerifyAudibleList( int iSoundMask )
+{
+	CUtlVectorFixed<int, MAX_WORLD_SOUNDS_MP> expected;
+
+	for ( int iSound = CSoundEnt::ActiveList(); iSound != SOUNDLIST_EMPTY && expected.Count() < MAX_WORLD_SOUNDS_MP; )
+	{
+		CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
+		if ( !pCurrentSound )
+			break;
+
+		if ( (iSoundMask & pCurrentSound->SoundType()) && CanHearSound( pCurrentSound ) )
+		{
+			expected.AddToHead( iSound );
+		}
+
+		iSound = pCurrentSound->NextSound();
+	}
+
+	int i = 0;
+	bool bMatch = true;
+	for ( int iSound = m_iAudibleList; iSound != SOUNDLIST_EMPTY; iSound = CSoundEnt::SoundPointerForIndex( iSound )->m_iNextAudible, i++ )
+	{
+		if ( i >= expected.Count() || expected[i] != iSound )
+		{
+			bMatch = false;
+			break;
+		}
+	}
+
+	if ( !bMatch || i != expected.Count() )
+	{
+		Warning( "%s (%d): audible sounds from the sound index don't match the active list (%d expected)\n", GetOuter()->GetClassname(), GetOuter()->entindex(), expected.Count() );
+		Assert( 0 );
+	}
+}
+
 //-----------------------------------------------------------------------------
 
 bool CAI_Senses::ShouldSeeEntity( CBaseEntity *pSightEnt )
@@ -171,7 +590,13 @@ bool CAI_Senses::ShouldSeeEntity( CBaseEntity *pSightEnt )
 
 bool CAI_Senses::CanSeeEntity( CBaseEntity *pSightEnt )
 {
-	return ( GetOuter()->FInViewCone( pSightEnt ) && GetOuter()->FVisible( pSightEnt ) );
+	if ( !GetOuter()->FInViewCone( pSightEnt ) )
+		return false;
+
+	int nCacheHits = CBaseCombatCharacter::GetVisibilityCacheHits();
+	bool bVisible = GetOuter()->FVisible( pSightEnt );
+	g_AI_SensesGrid.CountSightTrace( CBaseCombatCharacter::GetVisibilityCacheHits() != nCacheHits );
+	return bVisible;
 }
 
 #ifdef PORTAL
@@ -464,13 +889,33 @@ int CAI_Senses::LookForNPCs( int iDistance )
 
 			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
 			
-			for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+			if ( ai_senses_grid.GetBool() )
 			{
-				if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+				AISensesCandidates_t candidates;
+				g_AI_SensesGrid.GatherNPCs( origin, iDistance, &candidates );
+
+				for ( int j = 0; j < candidates.Count(); j++ )
 				{
-					if ( Look( ppAIs[i] ) )
+					i = candidates[j];
+					if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
 					{
-						nSeen++;
+						if ( Look( ppAIs[i] ) )
+						{
+							nSeen++;
+						}
+					}
+				}
+			}
+			else
+			{
+				for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+				{
+					if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+					{
+						if ( Look( ppAIs[i] ) )
+						{
+							nSeen++;
+						}
 					}
 				}
 			}
@@ -520,18 +965,38 @@ int CAI_Senses::LookForObjects( int iDistance )
 
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
-		int iter;
-		CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
-		while ( pEnt )
+		if ( ai_senses_grid.GetBool() )
 		{
-			if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+			AISensesCandidates_t candidates;
+			g_AI_SensesGrid.GatherObjects( origin, iDistance, &candidates );
+
+			for ( int i = 0; i < candidates.Count(); i++ )
 			{
-				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+				CBaseEntity *pEnt = g_AI_SensedObjectsManager.Get( candidates[i] );
+				if ( pEnt && ( pEnt->GetFlags() & BOX_QUERY_MASK ) )
 				{
-					nSeen++;
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
 				}
 			}
-			pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+		}
+		else
+		{
+			int iter;
+			CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+			while ( pEnt )
+			{
+				if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+				{
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
+				}
+				pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+			}
 		}
 		
 		EndGather( nSeen, &m_SeenMisc );
@@ -679,6 +1144,8 @@ void CAI_SensedObjectsManager::Init()
 	}
 
 	gEntList.AddListenerEntity( this );
+
+	g_AI_SensesGrid.Invalidate();
 }
 
 //-----------------------------------------------------------------------------
@@ -687,6 +1154,8 @@ void CAI_SensedObjectsManager::Term()
 {
 	gEntList.RemoveListenerEntity( this );
 	m_SensedObjects.RemoveAll();
+
+	g_AI_SensesGrid.Invalidate();
 }
 
 //-----------------------------------------------------------------------------
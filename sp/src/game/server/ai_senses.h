@@ -115,6 +115,8 @@ private:
 	bool 			LookThroughPortal( const CProp_Portal *pPortal, CBaseEntity *pSightEnt );
 #endif
 
+	void			VerifyAudibleList( int iSoundMask );
+
 	int 			LookForHighPriorityEntities( int iDistance );
 	int 			LookForNPCs( int iDistance );
 	int 			LookForObjects( int iDistance );
@@ -151,6 +153,9 @@ public:
 	CBaseEntity *	GetFirst( int *pIter );
 	CBaseEntity *	GetNext( int *pIter );
 
+	int				Count() const			{ return m_SensedObjects.Count(); }
+	CBaseEntity *	Get( int i ) const		{ return m_SensedObjects[i]; }
+
 	virtual void 	AddEntity( CBaseEntity *pEntity );
 
 private:
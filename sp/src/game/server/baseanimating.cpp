@@ -25,6 +25,7 @@
 #include "ai_basenpc.h"
 #include "physics_prop_ragdoll.h"
 #include "datacache/idatacache.h"
+#include "vstdlib/jobthread.h"
 #include "smoke_trail.h"
 #include "props.h"
 #ifdef MAPBASE
@@ -388,6 +389,7 @@ CBaseAnimating::CBaseAnimating()
 	m_fadeMaxDist = 0;
 	m_flFadeScale = 0.0f;
 	m_fBoneCacheFlags = 0;
+	m_iBoneCacheQueryTick = -1;
 }
 
 CBaseAnimating::~CBaseAnimating()
@@ -2890,26 +2892,71 @@ void CBaseAnimating::UnlockStudioHdr()
 // Purpose: return the index to the shared bone cache
 // Output :
 //-----------------------------------------------------------------------------
-CBoneCache *CBaseAnimating::GetBoneCache( void )
+static int GetBoneCacheMask( void )
 {
-	CStudioHdr *pStudioHdr = GetModelPtr( );
-	Assert(pStudioHdr);
-
-	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
 	int boneMask = BONE_USED_BY_HITBOX | BONE_USED_BY_ATTACHMENT;
 
 	// TF queries these bones to position weapons when players are killed
 #if defined( TF_DLL )
 	boneMask |= BONE_USED_BY_BONE_MERGE;
 #endif
-	if ( pcache )
+	return boneMask;
+}
+
+CBoneCache *CBaseAnimating::GetBoneCache( void )
+{
+	int boneMask = GetBoneCacheMask();
+
+	m_iBoneCacheQueryTick = gpGlobals->tickcount;
+
+	if ( IsBoneCacheValid( boneMask ) )
 	{
-		if ( pcache->IsValid( gpGlobals->curtime ) && (pcache->m_boneMask & boneMask) == boneMask && pcache->m_timeValid <= gpGlobals->curtime)
+		// in memory and still valid, use it!
+		if ( m_fBoneCacheFlags & BCF_BATCHED )
 		{
-			// Msg("%s:%s:%s (%x:%x:%8.4f) cache\n", GetClassname(), GetDebugName(), STRING(GetModelName()), boneMask, pcache->m_boneMask, pcache->m_timeValid );
-			// in memory and still valid, use it!
-			return pcache;
+			VPROF_INCREMENT_COUNTER( "SetupBones batched (used)", 1 );
+			ClearBoneCacheFlags( BCF_BATCHED );
 		}
+		return Studio_GetBoneCache( m_boneCacheHandle );
+	}
+
+	VPROF_INCREMENT_COUNTER( "SetupBones lazy", 1 );
+	ClearBoneCacheFlags( BCF_BATCHED );
+	return UpdateBoneCache( boneMask );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: is the shared bone cache in memory, current, and has all of boneMask?
+//-----------------------------------------------------------------------------
+bool CBaseAnimating::IsBoneCacheValid( int boneMask )
+{
+	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
+	// Msg("%s:%s:%s (%x:%x:%8.4f) cache\n", GetClassname(), GetDebugName(), STRING(GetModelName()), boneMask, pcache->m_boneMask, pcache->m_timeValid );
+	return ( pcache && pcache->IsValid( gpGlobals->curtime ) && (pcache->m_boneMask & boneMask) == boneMask && pcache->m_timeValid <= gpGlobals->curtime );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: set up the bones and store them in the shared bone cache
+//-----------------------------------------------------------------------------
+CBoneCache *CBaseAnimating::UpdateBoneCache( int boneMask )
+{
+	matrix3x4_t bonetoworld[MAXSTUDIOBONES];
+	SetupBones( bonetoworld, boneMask );
+
+	return StoreBoneCache( bonetoworld, boneMask );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: store bones that have been set up in the shared bone cache
+//-----------------------------------------------------------------------------
+CBoneCache *CBaseAnimating::StoreBoneCache( const matrix3x4_t *pBoneToWorld, int boneMask )
+{
+	CStudioHdr *pStudioHdr = GetModelPtr( );
+	Assert(pStudioHdr);
+
+	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
+	if ( pcache )
+	{
 		// in memory, but missing some of the bone masks
 		if ( (pcache->m_boneMask & boneMask) != boneMask )
 		{
@@ -2919,19 +2966,16 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 		}
 	}
 
-	matrix3x4_t bonetoworld[MAXSTUDIOBONES];
-	SetupBones( bonetoworld, boneMask );
-
 	if ( pcache )
 	{
 		// still in memory but out of date, refresh the bones.
-		pcache->UpdateBones( bonetoworld, pStudioHdr->numbones(), gpGlobals->curtime );
+		pcache->UpdateBones( pBoneToWorld, pStudioHdr->numbones(), gpGlobals->curtime );
 	}
 	else
 	{
 		bonecacheparams_t params;
 		params.pStudioHdr = pStudioHdr;
-		params.pBoneToWorld = bonetoworld;
+		params.pBoneToWorld = const_cast<matrix3x4_t *>( pBoneToWorld );
 		params.curtime = gpGlobals->curtime;
 		params.boneMask = boneMask;
 
@@ -2948,6 +2992,114 @@ void CBaseAnimating::InvalidateBoneCache( void )
 	Studio_InvalidateBoneCache( m_boneCacheHandle );
 }
 
+//-----------------------------------------------------------------------------
+// Batched bone setup
+//
+// Bones are normally set up lazily, the first time a hitbox or attachment is
+// queried after the entity animates. At the end of each frame, entities that
+// were queried recently and whose cache has gone stale get their bones set up
+// in parallel instead, so queries early in the next frame (player shots, NPCs
+// thinking before their target) find a valid cache. StudioFrameAdvance() still
+// invalidates it as usual once the entity animates again.
+//
+// Only the bone setup runs on the workers. The shared bone cache can evict
+// entries whenever one is created, so results are stored on the main thread.
+//-----------------------------------------------------------------------------
+ConVar sv_batch_setupbones( "sv_batch_setupbones", "1", 0, "Set up bones for recently queried NPCs in parallel at the end of each frame" );
+
+// Entities queried within this many ticks are assumed to be queried again
+#define BATCH_SETUPBONES_QUERY_TICKS	8
+
+//-----------------------------------------------------------------------------
+// Purpose: can this entity's bones be set up away from the main thread?
+//			Must be called on the main thread; resolves the state that
+//			SetupBones() would otherwise compute lazily.
+//-----------------------------------------------------------------------------
+bool CBaseAnimating::CanBatchSetupBones( void )
+{
+	if ( m_iBoneCacheQueryTick < 0 || gpGlobals->tickcount - m_iBoneCacheQueryTick > BATCH_SETUPBONES_QUERY_TICKS )
+		return false;
+
+	if ( IsMarkedForDeletion() || IsEFlagSet( EFL_SETTING_UP_BONES ) )
+		return false;
+
+	// IK traces against the world, and bone merging sets up the parent's bones too
+	if ( m_pIk || dynamic_cast< CBaseAnimating* >( GetMoveParent() ) )
+		return false;
+
+	if ( !GetModelPtr() || IsBoneCacheValid( GetBoneCacheMask() ) )
+		return false;
+
+	// Resolve dirty transforms here rather than on a worker thread
+	GetAbsOrigin();
+	GetAbsAngles();
+	return true;
+}
+
+void CBaseAnimating::BatchSetupBonesJob( BatchSetupBones_t &item )
+{
+	item.pAnimating->SetupBones( item.pBoneToWorld, GetBoneCacheMask() );
+}
+
+static void PreBatchSetupBones()
+{
+	mdlcache->BeginLock();
+}
+
+static void PostBatchSetupBones()
+{
+	mdlcache->EndLock();
+}
+
+void CBaseAnimating::BatchSetupBones( void )
+{
+	if ( !sv_batch_setupbones.GetBool() || ai_setupbones_debug.GetBool() )
+		return;
+
+	VPROF_BUDGET( "CBaseAnimating::BatchSetupBones", VPROF_BUDGETGROUP_SERVER_ANIM );
+
+	// NPCs are the bulk of hitbox and attachment queries. Subclasses that
+	// override SetupBones() (ragdolls read their physics objects) aren't NPCs.
+	static CUtlVector<BatchSetupBones_t> batch;
+	static CUtlVector<matrix3x4_t> boneToWorld;
+	batch.RemoveAll();
+
+	int nBones = 0;
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		if ( ppAIs[i]->CanBatchSetupBones() )
+		{
+			int iItem = batch.AddToTail();
+			batch[iItem].pAnimating = ppAIs[i];
+			batch[iItem].pBoneToWorld = NULL;
+			nBones += ppAIs[i]->GetModelPtr()->numbones();
+		}
+	}
+
+	if ( batch.Count() == 0 )
+		return;
+
+	boneToWorld.SetCount( nBones );
+	nBones = 0;
+	for ( int i = 0; i < batch.Count(); i++ )
+	{
+		batch[i].pBoneToWorld = boneToWorld.Base() + nBones;
+		nBones += batch[i].pAnimating->GetModelPtr()->numbones();
+	}
+
+	ParallelProcess( "CBaseAnimating::BatchSetupBones", batch.Base(), batch.Count(), &BatchSetupBonesJob, &PreBatchSetupBones, &PostBatchSetupBones );
+
+	int boneMask = GetBoneCacheMask();
+	for ( int i = 0; i < batch.Count(); i++ )
+	{
+		batch[i].pAnimating->StoreBoneCache( batch[i].pBoneToWorld, boneMask );
+		batch[i].pAnimating->SetBoneCacheFlags( BCF_BATCHED );
+	}
+
+	VPROF_INCREMENT_COUNTER( "SetupBones batched", batch.Count() );
+}
+
 bool CBaseAnimating::TestCollision( const Ray_t &ray, unsigned int fContentsMask, trace_t& tr )
 {
 	// Return a special case for scaled physics objects
@@ -25,6 +25,7 @@ FORWARD_DECLARE_HANDLE( memhandle_t );
 
 #define	BCF_NO_ANIMATION_SKIP	( 1 << 0 )	// Do not allow PVS animation skipping (mostly for attachments being critical to an entity)
 #define	BCF_IS_IN_SPAWN			( 1 << 1 )	// Is currently inside of spawn, always evaluate animations
+#define	BCF_BATCHED				( 1 << 2 )	// Bone cache was filled by BatchSetupBones() and hasn't been used yet
 
 class CBaseAnimating : public CBaseEntity
 {
@@ -289,6 +290,10 @@ public:
 	class CBoneCache *GetBoneCache( void );
 	void InvalidateBoneCache();
 	void InvalidateBoneCacheIfOlderThan( float deltaTime );
+
+	// Set up bone caches in parallel for entities whose bones were recently queried,
+	// ahead of the lazy path in GetBoneCache()
+	static void BatchSetupBones( void );
 	virtual int DrawDebugTextOverlays( void );
 	
 	// See note in code re: bandwidth usage!!!
@@ -470,8 +475,21 @@ private:
 	string_t m_iszLightingOriginRelative;	// for reading from the file only
 	string_t m_iszLightingOrigin;			// for reading from the file only
 
+	struct BatchSetupBones_t
+	{
+		CBaseAnimating	*pAnimating;
+		matrix3x4_t		*pBoneToWorld;
+	};
+
+	bool IsBoneCacheValid( int boneMask );
+	class CBoneCache *UpdateBoneCache( int boneMask );
+	class CBoneCache *StoreBoneCache( const matrix3x4_t *pBoneToWorld, int boneMask );
+	bool CanBatchSetupBones( void );
+	static void BatchSetupBonesJob( BatchSetupBones_t &item );
+
 	memhandle_t		m_boneCacheHandle;
 	unsigned short	m_fBoneCacheFlags;		// Used for bone cache state on model
+	int				m_iBoneCacheQueryTick;	// Last tick GetBoneCache() was called, for BatchSetupBones()
 
 protected:
 	CNetworkVar( float, m_fadeMinDist );	// Point at which fading is absolute
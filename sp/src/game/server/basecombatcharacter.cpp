@@ -467,6 +467,12 @@ public:
 
 static CUtlRBTree<VisibilityCacheEntry_t, unsigned short, CVisibilityCacheEntryLess> g_VisibilityCache;
 const float VIS_CACHE_ENTRY_LIFE = ( !IsXbox() ) ? .090 : .500;
+static int g_nVisibilityCacheHits;
+
+int CBaseCombatCharacter::GetVisibilityCacheHits()
+{
+	return g_nVisibilityCacheHits;
+}
 
 bool CBaseCombatCharacter::FVisible( CBaseEntity *pEntity, int traceMask, CBaseEntity **ppBlocker )
 {
@@ -505,6 +511,8 @@ bool CBaseCombatCharacter::FVisible( CBaseEntity *pEntity, int traceMask, CBaseE
 	{
 		if ( gpGlobals->curtime - g_VisibilityCache[iCache].time < VIS_CACHE_ENTRY_LIFE )
 		{
+			g_nVisibilityCacheHits++;
+
 			bool bCachedResult = !g_VisibilityCache[iCache].pBlocker.IsValid();
 			if ( bCachedResult )
 			{
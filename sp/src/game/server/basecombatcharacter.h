@@ -138,6 +138,7 @@ public:
 	virtual	bool		FVisible ( CBaseEntity *pEntity, int traceMask = MASK_BLOCKLOS, CBaseEntity **ppBlocker = NULL ); // true iff the parameter can be seen by me.
 	virtual bool		FVisible( const Vector &vecTarget, int traceMask = MASK_BLOCKLOS, CBaseEntity **ppBlocker = NULL )	{ return BaseClass::FVisible( vecTarget, traceMask, ppBlocker ); }
 	static void			ResetVisibilityCache( CBaseCombatCharacter *pBCC = NULL );
+	static int			GetVisibilityCacheHits();	// running count of FVisible() calls answered from the cache
 
 #ifdef MAPBASE
 	virtual bool		ShouldUseVisibilityCache( CBaseEntity *pEntity );
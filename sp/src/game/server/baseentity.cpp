@@ -645,8 +645,22 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.UpdateEntityIndex( this );
 }
 
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.UpdateEntityIndex( this );
+}
+
+#ifdef MAPBASE_VSCRIPT
+void CBaseEntity::SetNameAsCStr( const char *newName )
+{
+	SetName( AllocPooledString(newName) );
+}
+#endif
+
 void CBaseEntity::SetModelIndex( int index )
 {
 	if ( IsDynamicModelIndex( index ) && !(GetBaseAnimating() && m_bDynamicModelAllowed) )
@@ -3910,6 +3924,9 @@ int CBaseEntity::Restore( IRestore &restore )
 		m_hGroundEntity->AddEntityToGroundList( this );
 	}
 
+	// Our name and classname were read straight into the fields
+	gEntList.UpdateEntityIndex( this );
+
 	return status;
 }
 
@@ -318,10 +318,160 @@ CBaseEntityClassList::~CBaseEntityClassList()
 static CUtlVector<CustomProcedural_t> g_CustomProcedurals;
 #endif
 
+ConVar ent_find_index( "ent_find_index", "1", 0, "Use the targetname/classname index for entity searches without wildcards." );
+
+// Set while ent_find_index_verify collects the reference results
+static bool g_bForceLinearEntitySearch = false;
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns true if a name search can be answered by the string index,
+//			ie. it is a plain caseless compare with no wildcards, regex or procedurals.
+//-----------------------------------------------------------------------------
+static bool ShouldUseEntityIndex( const char *pszQuery )
+{
+	if ( g_bForceLinearEntitySearch || !ent_find_index.GetBool() )
+		return false;
+
+	if ( !pszQuery || pszQuery[0] == 0 || pszQuery[0] == '!' || pszQuery[0] == '@' )
+		return false;
+
+	for ( ; *pszQuery; ++pszQuery )
+	{
+		if ( *pszQuery == '*' || *pszQuery == '?' )
+			return false;
+	}
+
+	return true;
+}
+
+CEntityStringIndex::CEntityStringIndex() : m_Keys( 256 )
+{
+	Purge();
+}
+
+void CEntityStringIndex::Purge()
+{
+	m_Keys.Purge();
+
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Links[i].m_pszKey = NULL;
+		m_Links[i].m_iPrev = m_Links[i].m_iNext = -1;
+	}
+}
+
+void CEntityStringIndex::Update( int iSlot, string_t iszKey, const unsigned int *pListOrder )
+{
+	Link_t &link = m_Links[iSlot];
+
+	const char *pszKey = STRING( iszKey );
+	if ( iszKey == NULL_STRING || pszKey[0] == 0 )
+	{
+		Remove( iSlot );
+		return;
+	}
+
+	// Only the case changed (or nothing at all), we're still in the right bucket
+	if ( link.m_pszKey && !Q_stricmp( link.m_pszKey, pszKey ) )
+		return;
+
+	Remove( iSlot );
+
+	UtlHashHandle_t hKey = m_Keys.Find( pszKey );
+	if ( hKey == m_Keys.InvalidHandle() )
+	{
+		// Key off a pooled copy, the entity's own string may not outlive it
+		Bucket_t empty = { -1, -1 };
+		hKey = m_Keys.Insert( STRING( AllocPooledString( pszKey ) ), empty );
+	}
+
+	Bucket_t &bucket = m_Keys[hKey];
+	link.m_pszKey = m_Keys.Key( hKey );
+
+	// Entities are almost always named right after they're added, so search from the tail
+	int iAfter = bucket.m_iTail;
+	while ( iAfter != -1 && pListOrder[iAfter] > pListOrder[iSlot] )
+	{
+		iAfter = m_Links[iAfter].m_iPrev;
+	}
+
+	link.m_iPrev = iAfter;
+	if ( iAfter != -1 )
+	{
+		link.m_iNext = m_Links[iAfter].m_iNext;
+		m_Links[iAfter].m_iNext = iSlot;
+	}
+	else
+	{
+		link.m_iNext = bucket.m_iHead;
+		bucket.m_iHead = iSlot;
+	}
+
+	if ( link.m_iNext != -1 )
+		m_Links[link.m_iNext].m_iPrev = iSlot;
+	else
+		bucket.m_iTail = iSlot;
+}
+
+void CEntityStringIndex::Remove( int iSlot )
+{
+	Link_t &link = m_Links[iSlot];
+	if ( !link.m_pszKey )
+		return;
+
+	UtlHashHandle_t hKey = m_Keys.Find( link.m_pszKey );
+	Assert( hKey != m_Keys.InvalidHandle() );
+
+	Bucket_t &bucket = m_Keys[hKey];
+	if ( link.m_iPrev != -1 )
+		m_Links[link.m_iPrev].m_iNext = link.m_iNext;
+	else
+		bucket.m_iHead = link.m_iNext;
+
+	if ( link.m_iNext != -1 )
+		m_Links[link.m_iNext].m_iPrev = link.m_iPrev;
+	else
+		bucket.m_iTail = link.m_iPrev;
+
+	if ( bucket.m_iHead == -1 )
+	{
+		m_Keys.Remove( link.m_pszKey );
+	}
+
+	link.m_pszKey = NULL;
+	link.m_iPrev = link.m_iNext = -1;
+}
+
+int CEntityStringIndex::FindNext( int iStartSlot, const char *pszKey, const unsigned int *pListOrder ) const
+{
+	UtlHashHandle_t hKey = m_Keys.Find( pszKey );
+	if ( hKey == m_Keys.InvalidHandle() )
+		return -1;
+
+	const Bucket_t &bucket = m_Keys[hKey];
+	if ( iStartSlot < 0 )
+		return bucket.m_iHead;
+
+	// Continuing a search, the start entity is already in this bucket
+	if ( m_Links[iStartSlot].m_pszKey == m_Keys.Key( hKey ) )
+		return m_Links[iStartSlot].m_iNext;
+
+	unsigned int nStartOrder = pListOrder[iStartSlot];
+	for ( int i = bucket.m_iHead; i != -1; i = m_Links[i].m_iNext )
+	{
+		if ( pListOrder[i] > nStartOrder )
+			return i;
+	}
+
+	return -1;
+}
+
 CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	m_nNextListOrder = 0;
+	memset( m_ListOrder, 0, sizeof( m_ListOrder ) );
 }
 
 
@@ -405,6 +555,9 @@ void CGlobalEntityList::Clear( void )
 	// free the memory
 	g_DeleteList.Purge();
 
+	m_NameIndex.Purge();
+	m_ClassnameIndex.Purge();
+
 #ifdef MAPBASE_VSCRIPT
 	g_CustomProcedurals.Purge();
 #endif
@@ -517,6 +670,21 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 #endif
 {
+	if ( ShouldUseEntityIndex( szName ) )
+	{
+		CBaseEntity *pEntity = pStartEntity;
+		while ( ( pEntity = FindEntityInIndex( m_ClassnameIndex, pEntity, szName ) ) != NULL )
+		{
+#ifdef MAPBASE
+			if ( pFilter && !pFilter->ShouldFindEntity(pEntity) )
+				continue;
+#endif
+			return pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -548,19 +716,18 @@ CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity
 // From Alien Swarm SDK
 CBaseEntity *CGlobalEntityList::FindEntityByClassnameFast( CBaseEntity *pStartEntity, string_t iszClassname )
 {
-	/*
-	if ( pStartEntity )
+	if ( iszClassname != NULL_STRING && STRING(iszClassname)[0] != 0 && !g_bForceLinearEntitySearch && ent_find_index.GetBool() )
 	{
-		return pStartEntity->m_pNextByClass;
-	}
+		// The index is caseless, this one has to be the exact string
+		CBaseEntity *pEntity = pStartEntity;
+		while ( ( pEntity = FindEntityInIndex( m_ClassnameIndex, pEntity, STRING(iszClassname) ) ) != NULL )
+		{
+			if ( pEntity->m_iClassname == iszClassname )
+				return pEntity;
+		}
 
-	EntsByStringList_t key = { iszClassname };
-	UtlHashHandle_t hEntry = g_EntsByClassname.Find( key );
-	if ( hEntry != g_EntsByClassname.InvalidHandle() )
-	{
-		return g_EntsByClassname[hEntry].pHead;
+		return NULL;
 	}
-	*/
 
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -858,6 +1025,20 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	if ( ShouldUseEntityIndex( szName ) )
+	{
+		CBaseEntity *ent = pStartEntity;
+		while ( ( ent = FindEntityInIndex( m_NameIndex, ent, szName ) ) != NULL )
+		{
+			if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+				continue;
+
+			return ent;
+		}
+
+		return NULL;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -891,6 +1072,18 @@ CBaseEntity *CGlobalEntityList::FindEntityByNameFast( CBaseEntity *pStartEntity,
 	if ( iszName == NULL_STRING || STRING(iszName)[0] == 0 )
 		return NULL;
 
+	if ( !g_bForceLinearEntitySearch && ent_find_index.GetBool() )
+	{
+		CBaseEntity *ent = pStartEntity;
+		while ( ( ent = FindEntityInIndex( m_NameIndex, ent, STRING(iszName) ) ) != NULL )
+		{
+			if ( ent->m_iName.Get() == iszName )
+				return ent;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -1465,6 +1658,136 @@ CBaseEntity *CGlobalEntityList::FindEntityNearestFacing( const Vector &origin, c
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the entity list slot of an entity, -1 if it isn't in the list yet
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::GetIndexSlot( CBaseEntity *pEntity ) const
+{
+	const CBaseHandle &hEnt = pEntity->GetRefEHandle();
+	if ( !hEnt.IsValid() || LookupEntity( hEnt ) != pEntity )
+		return -1;
+
+	return hEnt.GetEntryIndex();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the next entity after pStartEntity (in entity list order)
+//			that is indexed under pszKey.
+//-----------------------------------------------------------------------------
+CBaseEntity *CGlobalEntityList::FindEntityInIndex( const CEntityStringIndex &index, CBaseEntity *pStartEntity, const char *pszKey ) const
+{
+	int iStartSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+	int iSlot = index.FindNext( iStartSlot, pszKey, m_ListOrder );
+	if ( iSlot < 0 )
+		return NULL;
+
+	return (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Re-files an entity in the name and classname indices. Anything that
+//			writes m_iName or m_iClassname after the entity is created must call this.
+//-----------------------------------------------------------------------------
+void CGlobalEntityList::UpdateEntityIndex( CBaseEntity *pEntity )
+{
+	int iSlot = GetIndexSlot( pEntity );
+	if ( iSlot < 0 )
+		return;
+
+	m_NameIndex.Update( iSlot, pEntity->m_iName.Get(), m_ListOrder );
+	m_ClassnameIndex.Update( iSlot, pEntity->m_iClassname, m_ListOrder );
+}
+
+typedef CBaseEntity *(*EntitySearchFn_t)( CBaseEntity *pStartEntity, const char *pszKey );
+
+static CBaseEntity *VerifySearchByName( CBaseEntity *pStartEntity, const char *pszKey ) { return gEntList.FindEntityByName( pStartEntity, pszKey ); }
+static CBaseEntity *VerifySearchByClassname( CBaseEntity *pStartEntity, const char *pszKey ) { return gEntList.FindEntityByClassname( pStartEntity, pszKey ); }
+static CBaseEntity *VerifySearchByNameFast( CBaseEntity *pStartEntity, const char *pszKey ) { return gEntList.FindEntityByNameFast( pStartEntity, MAKE_STRING( pszKey ) ); }
+static CBaseEntity *VerifySearchByClassnameFast( CBaseEntity *pStartEntity, const char *pszKey ) { return gEntList.FindEntityByClassnameFast( pStartEntity, MAKE_STRING( pszKey ) ); }
+
+static void CollectEntitySearch( EntitySearchFn_t pfnSearch, const char *pszKey, bool bLinear, CUtlVector<CBaseEntity *> &results )
+{
+	g_bForceLinearEntitySearch = bLinear;
+
+	CBaseEntity *pEntity = NULL;
+	while ( ( pEntity = pfnSearch( pEntity, pszKey ) ) != NULL && results.Count() <= NUM_ENT_ENTRIES )
+	{
+		results.AddToTail( pEntity );
+	}
+
+	g_bForceLinearEntitySearch = false;
+}
+
+static int VerifyEntitySearch( const char *pszSearch, EntitySearchFn_t pfnSearch, const char *pszKey, bool bVerbose )
+{
+	CUtlVector<CBaseEntity *> indexed, linear;
+	CollectEntitySearch( pfnSearch, pszKey, false, indexed );
+	CollectEntitySearch( pfnSearch, pszKey, true, linear );
+
+	if ( indexed.Count() == linear.Count() && !V_memcmp( indexed.Base(), linear.Base(), indexed.Count() * sizeof( CBaseEntity * ) ) )
+		return 0;
+
+	if ( bVerbose )
+	{
+		Warning( "%s( \"%s\" ): index found %d entities, list search found %d\n", pszSearch, pszKey, indexed.Count(), linear.Count() );
+	}
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs every name and classname in use through both the indexed and
+//			the full list searches and counts the ones that disagree.
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::VerifyEntityIndex( bool bVerbose )
+{
+	CUtlHashtable< const char *, empty_t, CaselessStringHashFunctor, CaselessStringEqualFunctor > testedNames, testedClassnames;
+	int nMismatches = 0;
+	int nNames = 0;
+	int nClassnames = 0;
+
+	for ( CBaseEntity *pEntity = FirstEnt(); pEntity; pEntity = NextEnt( pEntity ) )
+	{
+		int iSlot = GetIndexSlot( pEntity );
+		const char *pszName = STRING( pEntity->m_iName.Get() );
+		const char *pszClassname = STRING( pEntity->m_iClassname );
+
+		// The entity has to be filed under its current strings
+		const char *pszIndexedName = m_NameIndex.GetKey( iSlot );
+		const char *pszIndexedClassname = m_ClassnameIndex.GetKey( iSlot );
+		if ( Q_stricmp( pszIndexedName ? pszIndexedName : "", pszName ) || Q_stricmp( pszIndexedClassname ? pszIndexedClassname : "", pszClassname ) )
+		{
+			if ( bVerbose )
+			{
+				Warning( "Entity %d (%s) is indexed as \"%s\" (%s)\n", pEntity->entindex(), pEntity->GetDebugName(), pszIndexedName ? pszIndexedName : "", pszIndexedClassname ? pszIndexedClassname : "" );
+			}
+			nMismatches++;
+		}
+
+		if ( pszName[0] && !testedNames.HasElement( pszName ) )
+		{
+			testedNames.Insert( pszName );
+			nNames++;
+
+			if ( ShouldUseEntityIndex( pszName ) )
+				nMismatches += VerifyEntitySearch( "FindEntityByName", VerifySearchByName, pszName, bVerbose );
+			nMismatches += VerifyEntitySearch( "FindEntityByNameFast", VerifySearchByNameFast, pszName, bVerbose );
+		}
+
+		if ( pszClassname[0] && !testedClassnames.HasElement( pszClassname ) )
+		{
+			testedClassnames.Insert( pszClassname );
+			nClassnames++;
+
+			if ( ShouldUseEntityIndex( pszClassname ) )
+				nMismatches += VerifyEntitySearch( "FindEntityByClassname", VerifySearchByClassname, pszClassname, bVerbose );
+			nMismatches += VerifyEntitySearch( "FindEntityByClassnameFast", VerifySearchByClassnameFast, pszClassname, bVerbose );
+		}
+	}
+
+	Msg( "Entity index: %d names (%d keys), %d classnames (%d keys), %d mismatches\n", nNames, m_NameIndex.NumKeys(), nClassnames, m_ClassnameIndex.NumKeys(), nMismatches );
+	return nMismatches;
+}
+
 void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 {
 	int i = handle.GetEntryIndex();
@@ -1474,10 +1797,16 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	if ( i > m_iHighestEnt )
 		m_iHighestEnt = i;
 
+	// New entities always go on the tail of the active list
+	m_ListOrder[i] = ++m_nNextListOrder;
+
 	// If it's a CBaseEntity, notify the listeners.
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts++;
+
+	m_NameIndex.Update( i, pBaseEnt->m_iName.Get(), m_ListOrder );
+	m_ClassnameIndex.Update( i, pBaseEnt->m_iClassname, m_ListOrder );
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
@@ -1511,6 +1840,9 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	m_NameIndex.Remove( handle.GetEntryIndex() );
+	m_ClassnameIndex.Remove( handle.GetEntryIndex() );
+
 	m_iNumEnts--;
 }
 
@@ -1969,6 +2301,15 @@ CON_COMMAND(report_entities, "Lists all entities")
 }
 
 
+CON_COMMAND(ent_find_index_verify, "Checks the entity targetname/classname index against a full entity list search. Pass 1 to list mismatches.")
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	gEntList.VerifyEntityIndex( args.ArgC() > 1 && atoi( args.Arg(1) ) != 0 );
+}
+
+
 CON_COMMAND(report_touchlinks, "Lists all touchlinks")
 {
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
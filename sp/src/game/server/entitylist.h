@@ -14,6 +14,7 @@
 #endif
 
 #include "baseentity.h"
+#include "tier1/utlhashtable.h"
 
 class IEntityListener;
 
@@ -96,6 +97,51 @@ struct CustomProcedural_t
 };
 #endif
 
+//-----------------------------------------------------------------------------
+// Purpose: Maps an entity string (targetname or classname) to the entity list
+//			slots using it. Keys are caseless, matching NamesMatch(), and each
+//			key's slots are kept in entity list order so that lookups return
+//			entities in the same order as a walk of the whole list.
+//-----------------------------------------------------------------------------
+class CEntityStringIndex
+{
+public:
+	CEntityStringIndex();
+
+	void Purge();
+
+	// Sets the key for a slot, pListOrder gives the list position of every slot
+	void Update( int iSlot, string_t iszKey, const unsigned int *pListOrder );
+	void Remove( int iSlot );
+
+	// Returns the first slot after iStartSlot (-1 to start) whose key matches pszKey, or -1
+	int FindNext( int iStartSlot, const char *pszKey, const unsigned int *pListOrder ) const;
+
+	// The key a slot is currently indexed under, NULL if none
+	const char *GetKey( int iSlot ) const { return m_Links[iSlot].m_pszKey; }
+
+	int NumKeys() const { return m_Keys.Count(); }
+
+private:
+	struct Link_t
+	{
+		const char *m_pszKey;
+		short m_iPrev;
+		short m_iNext;
+	};
+
+	struct Bucket_t
+	{
+		short m_iHead;
+		short m_iTail;
+	};
+
+	typedef CUtlHashtable< const char *, Bucket_t, CaselessStringHashFunctor, CaselessStringEqualFunctor > KeyTable_t;
+
+	Link_t		m_Links[NUM_ENT_ENTRIES];
+	KeyTable_t	m_Keys;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: a global list of all the entities in the game.  All iteration through
 //			entities is done through this object.
@@ -111,6 +157,12 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	// Targetname and classname lookup tables, see UpdateEntityIndex()
+	unsigned int		m_nNextListOrder;
+	unsigned int		m_ListOrder[NUM_ENT_ENTRIES];
+	CEntityStringIndex	m_NameIndex;
+	CEntityStringIndex	m_ClassnameIndex;
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -210,6 +262,12 @@ public:
 	CBaseEntity *FindEntityByClassnameNearestFast( string_t iszClassname, const Vector &vecSrc, float flRadius );
 	CBaseEntity *FindEntityByNameFast( CBaseEntity *pStartEntity, string_t iszName );
 
+	// Must be called whenever an entity's m_iName or m_iClassname changes
+	void UpdateEntityIndex( CBaseEntity *pEntity );
+
+	// Compares the indexed lookups against a walk of the whole list, returns the number of mismatches
+	int VerifyEntityIndex( bool bVerbose );
+
 	CGlobalEntityList();
 
 // CBaseEntityList overrides.
@@ -218,6 +276,10 @@ protected:
 	virtual void OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle );
 	virtual void OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle );
 
+private:
+	int GetIndexSlot( CBaseEntity *pEntity ) const;
+	CBaseEntity *FindEntityInIndex( const CEntityStringIndex &index, CBaseEntity *pStartEntity, const char *pszKey ) const;
+
 };
 
 extern CGlobalEntityList gEntList;
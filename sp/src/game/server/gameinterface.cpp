@@ -1286,6 +1286,9 @@ void CServerGameDLL::GameFrame( bool simulating )
 	// free all ents marked in think functions
 	gEntList.CleanupDeleteList();
 
+	// set up bones for NPCs likely to be hit or attached to next frame
+	CBaseAnimating::BatchSetupBones();
+
 	// FIXME:  Should this only occur on the final tick?
 	UpdateAllClientData();
 
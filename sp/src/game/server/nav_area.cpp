@@ -3554,6 +3554,323 @@ void CNavArea::ClearSearchLists( void )
 	m_openListTail = NULL;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CNavPathSearch( bool writeToAreas )
+{
+	m_marker = 0;
+	m_order = 0;
+	m_writeToAreas = writeToAreas;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the search used by the single threaded NavAreaBuildPath(), which leaves its results in the areas
+ */
+CNavPathSearch &CNavPathSearch::GetAreaSearch( void )
+{
+	static CNavPathSearch s_areaSearch( true );
+	return s_areaSearch;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Clears the open and closed lists for a new search
+ */
+void CNavPathSearch::Reset( void )
+{
+	// effectively clears every area's entry
+	++m_marker;
+	if ( m_marker == 0 )
+	{
+		// wrapped around, so old entries could look current
+		FOR_EACH_VEC( m_area, it )
+		{
+			m_area[ it ].marker = 0;
+		}
+		m_marker = 1;
+	}
+
+	m_heap.RemoveAll();
+	m_order = 0;
+
+	if ( m_writeToAreas )
+	{
+		CNavArea::ClearSearchLists();
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::SearchArea &CNavPathSearch::Touch( const CNavArea *area )
+{
+	int id = area->GetID();
+	if ( id >= m_area.Count() )
+	{
+		int first = m_area.AddMultipleToTail( id + 1 - m_area.Count() );
+		for ( int i = first; i < m_area.Count(); ++i )
+		{
+			m_area[i].marker = 0;
+		}
+	}
+
+	SearchArea &entry = m_area[ id ];
+	if ( entry.marker != m_marker )
+	{
+		entry.parent = NULL;
+		entry.parentHow = NUM_TRAVERSE_TYPES;
+		entry.totalCost = 0.0f;
+		entry.costSoFar = 0.0f;
+		entry.pathLengthSoFar = 0.0f;
+		entry.order = 0;
+		entry.heapIndex = -1;
+		entry.marker = m_marker;
+		entry.isClosed = false;
+	}
+
+	return entry;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+const CNavPathSearch::SearchArea *CNavPathSearch::Find( const CNavArea *area ) const
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_area.Count() || m_area[ id ].marker != m_marker )
+		return NULL;
+
+	return &m_area[ id ];
+}
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavPathSearch::IsOpen( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry && entry->heapIndex >= 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavPathSearch::IsClosed( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry && entry->isClosed;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if the area at heapA should be searched before the one at heapB
+ */
+bool CNavPathSearch::IsBefore( int heapA, int heapB ) const
+{
+	const SearchArea &a = m_area[ m_heap[ heapA ]->GetID() ];
+	const SearchArea &b = m_area[ m_heap[ heapB ]->GetID() ];
+
+	if ( a.totalCost != b.totalCost )
+		return a.totalCost < b.totalCost;
+
+	return a.order < b.order;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::HeapSet( int heapIndex, CNavArea *area )
+{
+	m_heap[ heapIndex ] = area;
+	m_area[ area->GetID() ].heapIndex = heapIndex;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SiftUp( int heapIndex )
+{
+	CNavArea *area = m_heap[ heapIndex ];
+	while ( heapIndex > 0 )
+	{
+		int parent = ( heapIndex - 1 ) / HEAP_ARITY;
+		if ( !IsBefore( heapIndex, parent ) )
+			break;
+
+		HeapSet( heapIndex, m_heap[ parent ] );
+		HeapSet( parent, area );
+		heapIndex = parent;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SiftDown( int heapIndex )
+{
+	CNavArea *area = m_heap[ heapIndex ];
+	while ( true )
+	{
+		int first = heapIndex * HEAP_ARITY + 1;
+		if ( first >= m_heap.Count() )
+			break;
+
+		// find the cheapest child
+		int best = first;
+		int last = MIN( first + HEAP_ARITY, m_heap.Count() );
+		for ( int child = first + 1; child < last; ++child )
+		{
+			if ( IsBefore( child, best ) )
+			{
+				best = child;
+			}
+		}
+
+		if ( !IsBefore( best, heapIndex ) )
+			break;
+
+		HeapSet( heapIndex, m_heap[ best ] );
+		HeapSet( best, area );
+		heapIndex = best;
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Add to the open list. The area's total cost must already be set.
+ */
+void CNavPathSearch::AddToOpenList( CNavArea *area )
+{
+	SearchArea &entry = Touch( area );
+	if ( entry.heapIndex >= 0 )
+	{
+		// already on list
+		return;
+	}
+
+	entry.order = m_order++;
+	HeapSet( m_heap.AddToTail(), area );
+	SiftUp( m_heap.Count() - 1 );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A smaller total cost has been found, update this area on the open list
+ */
+void CNavPathSearch::UpdateOnOpenList( CNavArea *area )
+{
+	SearchArea &entry = Touch( area );
+	if ( entry.heapIndex < 0 )
+		return;
+
+	// sort after any open areas of equal cost
+	entry.order = m_order++;
+	SiftUp( entry.heapIndex );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavPathSearch::PopOpenList( void )
+{
+	if ( m_heap.Count() == 0 )
+		return NULL;
+
+	CNavArea *area = m_heap[0];
+	m_area[ area->GetID() ].heapIndex = -1;
+
+	CNavArea *last = m_heap.Tail();
+	m_heap.RemoveMultipleFromTail( 1 );
+	if ( m_heap.Count() )
+	{
+		HeapSet( 0, last );
+		SiftDown( 0 );
+	}
+
+	return area;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::AddToClosedList( CNavArea *area )
+{
+	Touch( area ).isClosed = true;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::RemoveFromClosedList( CNavArea *area )
+{
+	Touch( area ).isClosed = false;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SetParent( CNavArea *area, CNavArea *parent, NavTraverseType how )
+{
+	SearchArea &entry = Touch( area );
+	entry.parent = parent;
+	entry.parentHow = how;
+
+	if ( m_writeToAreas )
+	{
+		area->SetParent( parent, how );
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+CNavArea *CNavPathSearch::GetParent( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry ? entry->parent : NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+NavTraverseType CNavPathSearch::GetParentHow( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry ? entry->parentHow : NUM_TRAVERSE_TYPES;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SetTotalCost( CNavArea *area, float value )
+{
+	Assert( value >= 0.0 && !IS_NAN(value) );
+	Assert( !IsOpen( area ) || value <= GetTotalCost( area ) );		// costs can only decrease while open
+	Touch( area ).totalCost = value;
+
+	if ( m_writeToAreas )
+	{
+		area->SetTotalCost( value );
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavPathSearch::GetTotalCost( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry ? entry->totalCost : 0.0f;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SetCostSoFar( CNavArea *area, float value )
+{
+	Assert( value >= 0.0 && !IS_NAN(value) );
+	Touch( area ).costSoFar = value;
+
+	if ( m_writeToAreas )
+	{
+		area->SetCostSoFar( value );
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavPathSearch::GetCostSoFar( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry ? entry->costSoFar : 0.0f;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::SetPathLengthSoFar( CNavArea *area, float value )
+{
+	Assert( value >= 0.0 && !IS_NAN(value) );
+	Touch( area ).pathLengthSoFar = value;
+
+	if ( m_writeToAreas )
+	{
+		area->SetPathLengthSoFar( value );
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavPathSearch::GetPathLengthSoFar( const CNavArea *area ) const
+{
+	const SearchArea *entry = Find( area );
+	return entry ? entry->pathLengthSoFar : 0.0f;
+}
+
 //--------------------------------------------------------------------------------------------------------------
 void CNavArea::SetCorner( NavCornerType corner, const Vector& newPosition )
 {
@@ -5252,7 +5569,18 @@ CUtlHash< NavVisPair_t, CVisPairHashFuncs, CVisPairHashFuncs > *g_pNavVisPairHas
 void CNavArea::SetupPVS( void ) const
 {
 	m_nPVSSize = sizeof( m_PVS );
-	engine->ResetPVS( m_PVS, m_nPVSSize );
+	SetupPVS( m_PVS, m_nPVSSize );
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Build the Potentially Visible Set as seen from anywhere within this nav area into the given buffer.
+ * The engine builds the PVS in shared state, so this must be called from the main thread.
+ */
+void CNavArea::SetupPVS( byte *pvs, int pvsSize ) const
+{
+	engine->ResetPVS( pvs, pvsSize );
 
 	const float margin = GenerationStepSize/2.0f;
 	Vector eye( 0, 0, 0.75f * HumanHeight );
@@ -5302,6 +5630,22 @@ bool CNavArea::IsInPVS( void ) const
  * Do actual line-of-sight traces to determine if any part of given area is visible from this area
  */
 CNavArea::VisibilityType CNavArea::ComputeVisibility( const CNavArea *area, bool isPVSValid, bool bCheckPVS, bool *pOutsidePVS ) const
+{
+	if ( !isPVSValid )
+	{
+		SetupPVS();
+	}
+
+	return ComputeVisibility( area, bCheckPVS ? m_PVS : NULL, m_nPVSSize, pOutsidePVS );
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Do actual line-of-sight traces to determine if any part of given area is visible from this area,
+ * after culling against the given PVS of this area (if non-NULL)
+ */
+CNavArea::VisibilityType CNavArea::ComputeVisibility( const CNavArea *area, const byte *pvs, int pvsSize, bool *pOutsidePVS ) const
 {
 	float distanceSq = area->GetCenter().DistToSqr( GetCenter() );
 
@@ -5315,14 +5659,9 @@ CNavArea::VisibilityType CNavArea::ComputeVisibility( const CNavArea *area, bool
 		}
 	}
 
-	if ( !isPVSValid )
-	{
-		SetupPVS();
-	}
-
 	Vector eye( 0, 0, 0.75f * HumanHeight );
 
-	if ( bCheckPVS )
+	if ( pvs )
 	{
 		Extent areaExtent;
 		areaExtent.lo = areaExtent.hi = area->GetCenter() + eye;
@@ -5330,7 +5669,7 @@ CNavArea::VisibilityType CNavArea::ComputeVisibility( const CNavArea *area, bool
 		areaExtent.Encompass( area->GetCorner( NORTH_EAST ) + eye );
 		areaExtent.Encompass( area->GetCorner( SOUTH_WEST ) + eye );
 		areaExtent.Encompass( area->GetCorner( SOUTH_EAST ) + eye );
-		if ( !engine->CheckBoxInPVS( areaExtent.lo, areaExtent.hi, m_PVS, m_nPVSSize ) )
+		if ( !engine->CheckBoxInPVS( areaExtent.lo, areaExtent.hi, pvs, pvsSize ) )
 		{
 			if ( pOutsidePVS )
 				*pOutsidePVS = true;
@@ -5438,7 +5777,9 @@ CNavArea::VisibilityType CNavArea::ComputeVisibility( const CNavArea *area, bool
 
 //--------------------------------------------------------------------------------------------------------
 /**
- * Return a list of the delta between our visibility list and the given adjacent area
+ * Return a list of the delta between our visibility list and the given adjacent area.
+ * Both lists must be sorted by area ID (see SortPotentiallyVisibleAreas()), so they can be walked together
+ * in a single pass. The delta is sorted by area ID as well.
  */
 const CNavArea::CAreaBindInfoArray &CNavArea::ComputeVisibilityDelta( const CNavArea *other ) const
 {
@@ -5455,54 +5796,49 @@ const CNavArea::CAreaBindInfoArray &CNavArea::ComputeVisibilityDelta( const CNav
 		return delta;
 	}
 
-	// add any visible areas in my list that are not in 'others' list into the delta
-	int i, j;
-	for( i=0; i<m_potentiallyVisibleAreas.Count(); ++i )
+	const CAreaBindInfoArray &mine = m_potentiallyVisibleAreas;
+	const CAreaBindInfoArray &theirs = other->m_potentiallyVisibleAreas;
+
+	int i = 0, j = 0;
+	while( i < mine.Count() || j < theirs.Count() )
 	{
-		if ( m_potentiallyVisibleAreas[i].area )
+		if ( i < mine.Count() && mine[i].area == NULL )
 		{
-			// is my visible area also in adjacent area's vis list
-			for( j=0; j<other->m_potentiallyVisibleAreas.Count(); ++j )
-			{
-				if ( m_potentiallyVisibleAreas[i].area == other->m_potentiallyVisibleAreas[j].area &&
-					 m_potentiallyVisibleAreas[i].attributes == other->m_potentiallyVisibleAreas[j].attributes )
-				{
-					// mutually identically visible
-					break;
-				}
-			}
+			++i;
+			continue;
+		}
 
-			if ( j == other->m_potentiallyVisibleAreas.Count() )
-			{
-				// my vis area not in adjacent area's vis list or has different visibility attributes - add to delta
-				delta.AddToTail( m_potentiallyVisibleAreas[i] );
-			}
+		if ( j < theirs.Count() && theirs[j].area == NULL )
+		{
+			++j;
+			continue;
 		}
-	}
 
-	// add explicit NOT_VISIBLE references to areas in 'others' list that are NOT in mine
-	for( j=0; j<other->m_potentiallyVisibleAreas.Count(); ++j )
-	{
-		if ( other->m_potentiallyVisibleAreas[j].area )
+		if ( j == theirs.Count() || ( i < mine.Count() && mine[i].area->GetID() < theirs[j].area->GetID() ) )
 		{
-			for( i=0; i<m_potentiallyVisibleAreas.Count(); ++i )
-			{
-				if ( m_potentiallyVisibleAreas[i].area == other->m_potentiallyVisibleAreas[j].area )
-				{
-					// area in both lists - already handled in delta above
-					break;
-				}
-			}
+			// my vis area not in adjacent area's vis list - add to delta
+			delta.AddToTail( mine[i] );
+			++i;
+		}
+		else if ( i == mine.Count() || theirs[j].area->GetID() < mine[i].area->GetID() )
+		{
+			// 'other' has area in their list that we don't - mark it explicitly NOT_VISIBLE
+			AreaBindInfo info;
+			info.area = theirs[j].area;
+			info.attributes = NOT_VISIBLE;
 
-			if ( i == m_potentiallyVisibleAreas.Count() )
+			delta.AddToTail( info );
+			++j;
+		}
+		else
+		{
+			// area in both lists - only a difference in visibility attributes goes into the delta
+			if ( mine[i].attributes != theirs[j].attributes )
 			{
-				// 'other' has area in their list that we don't - mark it explicitly NOT_VISIBLE
-				AreaBindInfo info;
-				info.area = other->m_potentiallyVisibleAreas[j].area;
-				info.attributes = NOT_VISIBLE;
-
-				delta.AddToTail( info );
+				delta.AddToTail( mine[i] );
 			}
+			++i;
+			++j;
 		}
 	}
 
@@ -5517,6 +5853,26 @@ void CNavArea::ResetPotentiallyVisibleAreas()
 }
 
 
+//--------------------------------------------------------------------------------------------------------
+static int __cdecl CompareAreaBindInfoID( const CNavArea::AreaBindInfo *lhs, const CNavArea::AreaBindInfo *rhs )
+{
+	unsigned int lhsID = lhs->area ? lhs->area->GetID() : 0;
+	unsigned int rhsID = rhs->area ? rhs->area->GetID() : 0;
+
+	if ( lhsID < rhsID )
+		return -1;
+
+	return ( lhsID > rhsID ) ? 1 : 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+void CNavArea::SortPotentiallyVisibleAreas()
+{
+	m_potentiallyVisibleAreas.Sort( CompareAreaBindInfoID );
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 /**
  * Determine visibility between areas.
@@ -5524,51 +5880,48 @@ void CNavArea::ResetPotentiallyVisibleAreas()
  * in the PostCustomAnalysis() step.
  */
 
-CNavArea *g_pCurVisArea;
-CTSListWithFreeList< CNavArea::AreaBindInfo > g_ComputedVis;
+struct NavVisPairJob
+{
+	CNavArea *area;							// the area whose visibility is being computed
+	CNavArea *other;						// an area near it
+	const byte *pvs;						// PVS of 'area'
+	int pvsSize;
+
+	// results, written only by the job that traces this pair
+	CNavArea::VisibilityType visThisToOther;
+	CNavArea::VisibilityType visOtherToThis;
+};
 
-void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
+static void ComputeVisPair( NavVisPairJob &job )
 {
-	CNavArea *area = assert_cast< CNavArea * >( pOtherArea );
-	VisibilityType visThisToOther = ( area == g_pCurVisArea ) ? COMPLETELY_VISIBLE : NOT_VISIBLE;
-	VisibilityType visOtherToThis = NOT_VISIBLE;
+	CNavArea *area = job.other;
+	CNavArea::VisibilityType visThisToOther = ( area == job.area ) ? CNavArea::COMPLETELY_VISIBLE : CNavArea::NOT_VISIBLE;
+	CNavArea::VisibilityType visOtherToThis = CNavArea::NOT_VISIBLE;
 
-	if ( area != g_pCurVisArea )
+	if ( area != job.area )
 	{
 		bool bOutsidePVS;
 
-		visOtherToThis = g_pCurVisArea->ComputeVisibility( area, true, true, &bOutsidePVS ); // TODO: Hacky right now. Compute visibility for the "complete" case actually returns how completely visible the area is to the other. Should fix it to be more clear [1/30/2009 tom]
+		visOtherToThis = job.area->ComputeVisibility( area, job.pvs, job.pvsSize, &bOutsidePVS ); // TODO: Hacky right now. Compute visibility for the "complete" case actually returns how completely visible the area is to the other. Should fix it to be more clear [1/30/2009 tom]
 
-		if ( !bOutsidePVS && ( visOtherToThis || ( g_pCurVisArea->GetCenter() - area->GetCenter() ).LengthSqr() < Sqr( nav_max_view_distance.GetFloat() ) ) )
+		if ( !bOutsidePVS && ( visOtherToThis || ( job.area->GetCenter() - area->GetCenter() ).LengthSqr() < Sqr( nav_max_view_distance.GetFloat() ) ) )
 		{
-			visThisToOther = area->ComputeVisibility( g_pCurVisArea, true, false );
+			visThisToOther = area->ComputeVisibility( job.area, NULL, 0 );
 		}
 
 		if ( !visOtherToThis && visThisToOther )
 		{
-			visOtherToThis = POTENTIALLY_VISIBLE;
+			visOtherToThis = CNavArea::POTENTIALLY_VISIBLE;
 		}
 
 		if ( !visThisToOther && visOtherToThis )
 		{
-			visThisToOther = POTENTIALLY_VISIBLE;
+			visThisToOther = CNavArea::POTENTIALLY_VISIBLE;
 		}
 	}
 
-	CNavArea::AreaBindInfo info;
-	if ( visThisToOther != NOT_VISIBLE )
-	{
-		info.area = area;
-		info.attributes = visThisToOther;
-		g_ComputedVis.PushItem( info );
-	}
-
-	if ( visOtherToThis != NOT_VISIBLE )
-	{
-		info.area = g_pCurVisArea;
-		info.attributes = visOtherToThis;
-		area->m_potentiallyVisibleAreas.AddToTail( info );
-	}
+	job.visThisToOther = visThisToOther;
+	job.visOtherToThis = visOtherToThis;
 }
 
 
@@ -5578,50 +5931,96 @@ void CNavArea::ComputeVisToArea( CNavArea *&pOtherArea )
  */
 void CNavArea::ComputeVisibilityToMesh( void )
 {
-	m_inheritVisibilityFrom.area = NULL;
-	m_isInheritedFrom = false;
+	CNavArea *area = this;
+	ComputeVisibilityToMesh( &area, 1 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Determine visibility from each of the given areas to all potentially/completely visible areas in the mesh.
+ * Each area pair is traced once, by the first area to reach it, exactly as if the areas were done one at
+ * a time. The PVS of every area in the batch is built up front, so the traces for the whole batch can run
+ * as one set of jobs, each writing only its own result. The results are added to the visibility lists
+ * once all the jobs are done.
+ */
+void CNavArea::ComputeVisibilityToMesh( CNavArea **areas, int count )
+{
+	if ( count <= 0 )
+		return;
 
-	// collect all possible nav areas that could be visible from this area
-	NavAreaCollector collector;
 	float radius = nav_max_view_distance.GetFloat();
 	if ( radius == 0.0f )
 	{
 		radius = DEF_NAV_VIEW_DISTANCE;
 	}
+
+	// only as much of the PVS as the map has clusters for
+	int pvsSize = MIN( PAD_NUMBER( engine->GetClusterCount(), 8 ) / 8, (int)sizeof( m_PVS ) );
+	pvsSize = MAX( pvsSize, 1 );
+
+	CUtlVector< byte > pvs;
+	pvs.SetCount( pvsSize * count );
+
+	CUtlVector< NavVisPairJob > jobs;
+	jobs.EnsureCapacity( 1000 * count );
+
+	NavAreaCollector collector;
 	collector.m_area.EnsureCapacity( 1000 );
-	TheNavMesh->ForAllAreasInRadius( collector, GetCenter(), radius );
 
 	NavVisPair_t visPair;
-	UtlHashHandle_t hHash;
 
-	// First eliminate the ones already calculated
-	for ( int i = collector.m_area.Count() - 1; i >= 0; --i )
+	for( int i=0; i<count; ++i )
 	{
-		visPair.SetPair( this, collector.m_area[i] );
+		CNavArea *area = areas[i];
+
+		area->m_inheritVisibilityFrom.area = NULL;
+		area->m_isInheritedFrom = false;
+
+		// collect all possible nav areas that could be visible from this area
+		collector.m_area.RemoveAll();
+		TheNavMesh->ForAllAreasInRadius( collector, area->GetCenter(), radius );
 
-		hHash = g_pNavVisPairHash->Find( visPair );
-		if ( hHash != g_pNavVisPairHash->InvalidHandle() )
+		byte *areaPVS = pvs.Base() + i * pvsSize;
+		area->SetupPVS( areaPVS, pvsSize );
+
+		FOR_EACH_VEC( collector.m_area, it )
 		{
-			collector.m_area.FastRemove( i );
+			// eliminate the pairs already calculated
+			visPair.SetPair( area, collector.m_area[it] );
+			if ( g_pNavVisPairHash->Find( visPair ) != g_pNavVisPairHash->InvalidHandle() )
+				continue;
+
+			g_pNavVisPairHash->Insert( visPair );
+
+			NavVisPairJob &job = jobs[ jobs.AddToTail() ];
+			job.area = area;
+			job.other = collector.m_area[it];
+			job.pvs = areaPVS;
+			job.pvsSize = pvsSize;
 		}
 	}
 
-	SetupPVS();
+	ParallelProcess( "CNavArea::ComputeVisibilityToMesh", jobs.Base(), jobs.Count(), &ComputeVisPair );
 
-	g_pCurVisArea = this;
-	ParallelProcess( "CNavArea::ComputeVisibilityToMesh", collector.m_area.Base(), collector.m_area.Count(), &ComputeVisToArea );
-
-	m_potentiallyVisibleAreas.EnsureCapacity( g_ComputedVis.Count() );
-	while ( g_ComputedVis.Count() )
+	AreaBindInfo info;
+	FOR_EACH_VEC( jobs, jit )
 	{
-		g_ComputedVis.PopItem( &m_potentiallyVisibleAreas[ m_potentiallyVisibleAreas.AddToTail() ] );
-	}
+		const NavVisPairJob &job = jobs[ jit ];
 
-	FOR_EACH_VEC( collector.m_area, it )
-	{
-		visPair.SetPair( this, (CNavArea *)collector.m_area[it] );
-		Assert( g_pNavVisPairHash->Find( visPair ) == g_pNavVisPairHash->InvalidHandle() );
-		g_pNavVisPairHash->Insert( visPair );
+		if ( job.visThisToOther != NOT_VISIBLE )
+		{
+			info.area = job.other;
+			info.attributes = job.visThisToOther;
+			job.area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		if ( job.visOtherToThis != NOT_VISIBLE )
+		{
+			info.area = job.area;
+			info.attributes = job.visOtherToThis;
+			job.other->m_potentiallyVisibleAreas.AddToTail( info );
+		}
 	}
 }
 
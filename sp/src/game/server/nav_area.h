@@ -496,7 +496,9 @@ public:
 	};
 
 	VisibilityType ComputeVisibility( const CNavArea *area, bool isPVSValid, bool bCheckPVS = true, bool *pOutsidePVS = NULL ) const;	// do actual line-of-sight traces to determine if any part of given area is visible from this area
+	VisibilityType ComputeVisibility( const CNavArea *area, const byte *pvs, int pvsSize, bool *pOutsidePVS = NULL ) const;			// as above, checking against the given PVS (none if NULL) - safe to call from job threads
 	void SetupPVS( void ) const;
+	void SetupPVS( byte *pvs, int pvsSize ) const;				// build the PVS as seen from anywhere within this area into the given buffer
 	bool IsInPVS( void ) const;					// return true if this area is within the current PVS
 
 	struct AreaBindInfo							// for pointer loading and binding
@@ -737,8 +739,9 @@ private:
 
 	//- visibility --------------------------------------------------------------------------------------
 	void ComputeVisibilityToMesh( void );						// compute visibility to surrounding mesh
+	static void ComputeVisibilityToMesh( CNavArea **areas, int count );	// compute visibility to surrounding mesh for a batch of areas, tracing all of their area pairs as parallel jobs
 	void ResetPotentiallyVisibleAreas();
-	static void ComputeVisToArea( CNavArea *&pOtherArea );
+	void SortPotentiallyVisibleAreas();							// sort the visibility list by area ID, as ComputeVisibilityDelta() requires
 
 #ifndef _X360
 	typedef CUtlVectorConservative<AreaBindInfo> CAreaBindInfoArray; // shaves 8 bytes off structure caused by need to support editing
@@ -750,7 +753,7 @@ private:
 	CAreaBindInfoArray m_potentiallyVisibleAreas;				// list of areas potentially visible from inside this area (after PostLoad(), use area portion of union)
 	bool m_isInheritedFrom;										// latch used during visibility inheritance computation
 
-	const CAreaBindInfoArray &ComputeVisibilityDelta( const CNavArea *other ) const;	// return a list of the delta between our visibility list and the given adjacent area
+	const CAreaBindInfoArray &ComputeVisibilityDelta( const CNavArea *other ) const;	// return a list of the delta between our visibility list and the given adjacent area (both lists must be sorted)
 
 	uint32 m_nVisTestCounter;
 	static uint32 s_nCurrVisTestCounter;
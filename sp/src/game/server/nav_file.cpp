@@ -19,6 +19,8 @@
 #endif
 
 #include "tier1/lzmaDecoder.h"
+#include "tier0/fasttimer.h"
+#include "utlhashtable.h"
 
 #ifdef CSTRIKE_DLL
 #include "cs_shareddefs.h"
@@ -176,11 +178,15 @@ PlaceDirectory placeDirectory;
 #if defined( _X360 )
 	#define FORMAT_BSPFILE "maps\\%s.360.bsp"
 	#define FORMAT_NAVFILE "maps\\%s.360.nav"
+	#define FORMAT_NAVBAKEDFILE "maps\\%s.360.navb"
 #else
 	#define FORMAT_BSPFILE "maps\\%s.bsp"
 	#define FORMAT_NAVFILE "maps\\%s.nav"
+	#define FORMAT_NAVBAKEDFILE "maps\\%s.navb"
 #endif
 
+ConVar nav_load_baked( "nav_load_baked", "1", FCVAR_GAMEDLL, "Load the baked copy of the navigation mesh (.navb) when it is up to date." );
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Replace extension with "bsp"
@@ -1397,6 +1403,12 @@ NavErrorType CNavMesh::Load( void )
 	char filename[256];
 	Q_snprintf( filename, sizeof( filename ), FORMAT_NAVFILE, STRING( gpGlobals->mapname ) );
 
+	// the baked copy skips the parsing and pointer binding below, if it is current
+	if ( nav_load_baked.GetBool() && GetSubVersionNumber() == 0 && LoadBaked( filename ) == NAV_OK )
+	{
+		return NAV_OK;
+	}
+
 	bool navIsInBsp = false;
 	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
 	if ( !filesystem->ReadFile( filename, "MOD", fileBuffer ) )	// this ignores .nav files embedded in the .bsp ...
@@ -1694,3 +1706,857 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 	
 	return NAV_OK;
 }
+
+
+//--------------------------------------------------------------------------------------------------------------
+//
+// The baked nav format stores a loaded mesh as contiguous arrays of fixed size records, with
+// every reference to an area, hiding spot or ladder stored as an array index. Loading it is a
+// single file read, then one pass that creates the objects and turns the indices into pointers.
+// There is no field by field parsing, no ID lookups, and none of the geometric work of PostLoad().
+//
+// The baked file is made from a mesh loaded from the .nav with "nav_bake", and is only used
+// while it matches the .nav and .bsp it was made from.
+//
+
+#define NAV_BAKED_MAGIC_NUMBER 0xFEEDBA4E		// to help identify baked nav files
+const unsigned int NavBakedVersion = 1;
+
+enum NavBakedLumpType
+{
+	NAV_BAKED_PLACES,						// the PlaceDirectory, as stored in the .nav (bytes)
+	NAV_BAKED_AREAS,						// NavBakedArea
+	NAV_BAKED_CONNECTIONS,					// NavBakedConnect, for adjacent and incoming connections
+	NAV_BAKED_HIDING_SPOTS,					// NavBakedHidingSpot, in TheHidingSpots order
+	NAV_BAKED_AREA_HIDING_SPOTS,			// hiding spot index, for each area's hiding spot list
+	NAV_BAKED_ENCOUNTERS,					// NavBakedEncounter
+	NAV_BAKED_ENCOUNTER_SPOTS,				// NavBakedSpotOrder
+	NAV_BAKED_LADDER_CONNECTIONS,			// ladder index
+	NAV_BAKED_VISIBLE_AREAS,				// NavBakedVisibleArea
+	NAV_BAKED_LADDERS,						// ladder count followed by CNavLadder::Save() records (bytes)
+
+	NUM_NAV_BAKED_LUMPS
+};
+
+struct NavBakedLump
+{
+	unsigned int offset;					// from the start of the file
+	unsigned int count;						// number of records, or bytes for the byte lumps
+};
+
+struct NavBakedRange
+{
+	unsigned int first;
+	unsigned int count;
+};
+
+struct NavBakedHeader
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int navVersion;				// NavCurrentVersion when baked
+	unsigned int bspSize;					// the .bsp and .nav the bake was made from, to detect a stale bake
+	unsigned int navSize;
+	unsigned int navTime;
+	unsigned int isAnalyzed;
+	NavBakedLump lump[ NUM_NAV_BAKED_LUMPS ];
+};
+
+struct NavBakedArea
+{
+	unsigned int id;
+	int attributeFlags;
+	Vector nwCorner;
+	Vector seCorner;
+	float neZ;
+	float swZ;
+	unsigned int placeEntry;				// index into the PlaceDirectory
+	unsigned int isUnderwater;
+	unsigned int inheritVisibilityFrom;		// area index + 1, or 0 if none
+	NavBakedRange connect[ NUM_DIRECTIONS ];
+	NavBakedRange incomingConnect[ NUM_DIRECTIONS ];
+	NavBakedRange ladder[ CNavLadder::NUM_LADDER_DIRECTIONS ];
+	NavBakedRange hidingSpots;
+	NavBakedRange encounters;
+	NavBakedRange visibleAreas;
+	float earliestOccupyTime[ MAX_NAV_TEAMS ];
+	float lightIntensity[ NUM_CORNERS ];
+};
+
+struct NavBakedConnect
+{
+	unsigned int area;						// area index
+	float length;
+};
+
+struct NavBakedHidingSpot
+{
+	unsigned int id;
+	Vector pos;
+	unsigned int flags;
+	unsigned int area;						// area index + 1, or 0 if off the mesh
+};
+
+struct NavBakedEncounter
+{
+	unsigned int from;						// area index + 1, or 0 if none
+	unsigned int fromDir;
+	unsigned int to;						// area index + 1, or 0 if none
+	unsigned int toDir;
+	Vector pathFrom;
+	Vector pathTo;
+	NavBakedRange spots;
+};
+
+struct NavBakedSpotOrder
+{
+	unsigned int spot;						// hiding spot index + 1, or 0 if none
+	float t;
+};
+
+struct NavBakedVisibleArea
+{
+	unsigned int area;						// area index
+	unsigned int attributes;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the size and modification time of the nav file the mesh is loaded from
+ */
+static void GetNavFileStamp( const char *navFilename, unsigned int *navSize, unsigned int *navTime )
+{
+	*navSize = filesystem->Size( navFilename, "MOD" );
+	*navTime = (unsigned int)filesystem->GetFileTime( navFilename, "MOD" );
+
+	if ( *navSize == 0 )
+	{
+		*navSize = filesystem->Size( navFilename, "BSP" );
+		*navTime = (unsigned int)filesystem->GetFileTime( navFilename, "BSP" );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Accumulates the arrays of a baked mesh while it is written
+ */
+class CNavBakedWriter
+{
+public:
+	CUtlVector< NavBakedArea > m_areas;
+	CUtlVector< NavBakedConnect > m_connections;
+	CUtlVector< NavBakedHidingSpot > m_hidingSpots;
+	CUtlVector< unsigned int > m_areaHidingSpots;
+	CUtlVector< NavBakedEncounter > m_encounters;
+	CUtlVector< NavBakedSpotOrder > m_encounterSpots;
+	CUtlVector< unsigned int > m_ladderConnections;
+	CUtlVector< NavBakedVisibleArea > m_visibleAreas;
+
+	CUtlHashtable< const CNavArea *, unsigned int > m_areaIndex;
+	CUtlHashtable< const HidingSpot *, unsigned int > m_spotIndex;
+
+	// return index + 1 of the given area, or 0 if NULL or not in the mesh
+	unsigned int AreaRef( const CNavArea *area ) const
+	{
+		UtlHashHandle_t h = area ? m_areaIndex.Find( area ) : m_areaIndex.InvalidHandle();
+		return ( h == m_areaIndex.InvalidHandle() ) ? 0 : m_areaIndex.Element( h ) + 1;
+	}
+
+	// return index + 1 of the given hiding spot, or 0 if NULL or unknown
+	unsigned int SpotRef( const HidingSpot *spot ) const
+	{
+		UtlHashHandle_t h = spot ? m_spotIndex.Find( spot ) : m_spotIndex.InvalidHandle();
+		return ( h == m_spotIndex.InvalidHandle() ) ? 0 : m_spotIndex.Element( h ) + 1;
+	}
+
+	NavBakedRange AddConnections( const NavConnectVector &connect )
+	{
+		NavBakedRange range;
+		range.first = m_connections.Count();
+		FOR_EACH_VEC( connect, it )
+		{
+			unsigned int ref = AreaRef( connect[ it ].area );
+			if ( ref )
+			{
+				NavBakedConnect &baked = m_connections[ m_connections.AddToTail() ];
+				baked.area = ref - 1;
+				baked.length = connect[ it ].length;
+			}
+		}
+		range.count = m_connections.Count() - range.first;
+		return range;
+	}
+
+	template < typename T >
+	static void PutLump( CUtlBuffer &fileBuffer, NavBakedLump *lump, const CUtlVector< T > &data )
+	{
+		lump->offset = fileBuffer.TellPut();
+		lump->count = data.Count();
+		fileBuffer.Put( data.Base(), data.Count() * sizeof( T ) );
+	}
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Write the current mesh in the baked format.
+ * The stamps identify the .bsp and .nav the mesh was loaded from, and are zero when only comparing meshes.
+ */
+void CNavMesh::WriteBakedMesh( CUtlBuffer &fileBuffer, unsigned int bspSize, unsigned int navSize, unsigned int navTime ) const
+{
+	CNavBakedWriter writer;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		writer.m_areaIndex.Insert( TheNavAreas[ it ], it );
+	}
+
+	FOR_EACH_VEC( TheHidingSpots, hit )
+	{
+		const HidingSpot *spot = TheHidingSpots[ hit ];
+		writer.m_spotIndex.Insert( spot, hit );
+
+		NavBakedHidingSpot &baked = writer.m_hidingSpots[ writer.m_hidingSpots.AddToTail() ];
+		baked.id = spot->GetID();
+		baked.pos = spot->GetPosition();
+		baked.flags = spot->GetFlags();
+		baked.area = writer.AreaRef( spot->GetArea() );
+	}
+
+	placeDirectory.Reset();
+	FOR_EACH_VEC( TheNavAreas, pit )
+	{
+		placeDirectory.AddPlace( TheNavAreas[ pit ]->GetPlace() );
+	}
+
+	FOR_EACH_VEC( TheNavAreas, ait )
+	{
+		const CNavArea *area = TheNavAreas[ ait ];
+		NavBakedArea &baked = writer.m_areas[ writer.m_areas.AddToTail() ];
+
+		baked.id = area->m_id;
+		baked.attributeFlags = area->m_attributeFlags;
+		baked.nwCorner = area->m_nwCorner;
+		baked.seCorner = area->m_seCorner;
+		baked.neZ = area->m_neZ;
+		baked.swZ = area->m_swZ;
+		baked.placeEntry = placeDirectory.GetIndex( area->GetPlace() );
+		baked.isUnderwater = area->m_isUnderwater;
+		baked.inheritVisibilityFrom = writer.AreaRef( area->m_inheritVisibilityFrom.area );
+
+		int d;
+		for ( d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			baked.connect[d] = writer.AddConnections( area->m_connect[d] );
+		}
+
+		for ( d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			baked.incomingConnect[d] = writer.AddConnections( area->m_incomingConnect[d] );
+		}
+
+		for ( d=0; d<CNavLadder::NUM_LADDER_DIRECTIONS; ++d )
+		{
+			baked.ladder[d].first = writer.m_ladderConnections.Count();
+			FOR_EACH_VEC( area->m_ladder[d], lit )
+			{
+				int ladderIndex = m_ladders.Find( area->m_ladder[d][ lit ].ladder );
+				if ( ladderIndex != m_ladders.InvalidIndex() )
+				{
+					writer.m_ladderConnections.AddToTail( ladderIndex );
+				}
+			}
+			baked.ladder[d].count = writer.m_ladderConnections.Count() - baked.ladder[d].first;
+		}
+
+		baked.hidingSpots.first = writer.m_areaHidingSpots.Count();
+		FOR_EACH_VEC( area->m_hidingSpots, hit )
+		{
+			unsigned int ref = writer.SpotRef( area->m_hidingSpots[ hit ] );
+			if ( ref )
+			{
+				writer.m_areaHidingSpots.AddToTail( ref - 1 );
+			}
+		}
+		baked.hidingSpots.count = writer.m_areaHidingSpots.Count() - baked.hidingSpots.first;
+
+		baked.encounters.first = writer.m_encounters.Count();
+		FOR_EACH_VEC( area->m_spotEncounters, eit )
+		{
+			const SpotEncounter *e = area->m_spotEncounters[ eit ];
+			NavBakedEncounter &encounter = writer.m_encounters[ writer.m_encounters.AddToTail() ];
+
+			encounter.from = writer.AreaRef( e->from.area );
+			encounter.fromDir = e->fromDir;
+			encounter.to = writer.AreaRef( e->to.area );
+			encounter.toDir = e->toDir;
+			encounter.pathFrom = e->path.from;
+			encounter.pathTo = e->path.to;
+
+			encounter.spots.first = writer.m_encounterSpots.Count();
+			FOR_EACH_VEC( e->spots, sit )
+			{
+				NavBakedSpotOrder &order = writer.m_encounterSpots[ writer.m_encounterSpots.AddToTail() ];
+				order.spot = writer.SpotRef( e->spots[ sit ].spot );
+				order.t = e->spots[ sit ].t;
+			}
+			encounter.spots.count = writer.m_encounterSpots.Count() - encounter.spots.first;
+		}
+		baked.encounters.count = writer.m_encounters.Count() - baked.encounters.first;
+
+		baked.visibleAreas.first = writer.m_visibleAreas.Count();
+		FOR_EACH_VEC( area->m_potentiallyVisibleAreas, vit )
+		{
+			unsigned int ref = writer.AreaRef( area->m_potentiallyVisibleAreas[ vit ].area );
+			if ( ref )
+			{
+				NavBakedVisibleArea &visible = writer.m_visibleAreas[ writer.m_visibleAreas.AddToTail() ];
+				visible.area = ref - 1;
+				visible.attributes = area->m_potentiallyVisibleAreas[ vit ].attributes;
+			}
+		}
+		baked.visibleAreas.count = writer.m_visibleAreas.Count() - baked.visibleAreas.first;
+
+		for ( int t=0; t<MAX_NAV_TEAMS; ++t )
+		{
+			baked.earliestOccupyTime[t] = area->m_earliestOccupyTime[t];
+		}
+
+		for ( int c=0; c<NUM_CORNERS; ++c )
+		{
+			baked.lightIntensity[c] = area->m_lightIntensity[c];
+		}
+	}
+
+	NavBakedHeader header;
+	V_memset( &header, 0, sizeof( header ) );
+	header.magic = NAV_BAKED_MAGIC_NUMBER;
+	header.version = NavBakedVersion;
+	header.navVersion = NavCurrentVersion;
+	header.bspSize = bspSize;
+	header.navSize = navSize;
+	header.navTime = navTime;
+	header.isAnalyzed = m_isAnalyzed;
+
+	// reserve the header, and fill it in once the lump offsets are known
+	fileBuffer.Put( &header, sizeof( header ) );
+
+	header.lump[ NAV_BAKED_PLACES ].offset = fileBuffer.TellPut();
+	placeDirectory.Save( fileBuffer );
+	header.lump[ NAV_BAKED_PLACES ].count = fileBuffer.TellPut() - header.lump[ NAV_BAKED_PLACES ].offset;
+
+	// keep the record lumps aligned
+	while ( fileBuffer.TellPut() % sizeof( unsigned int ) )
+	{
+		fileBuffer.PutUnsignedChar( 0 );
+	}
+
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_AREAS ], writer.m_areas );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_CONNECTIONS ], writer.m_connections );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_HIDING_SPOTS ], writer.m_hidingSpots );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_AREA_HIDING_SPOTS ], writer.m_areaHidingSpots );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_ENCOUNTERS ], writer.m_encounters );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_ENCOUNTER_SPOTS ], writer.m_encounterSpots );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_LADDER_CONNECTIONS ], writer.m_ladderConnections );
+	CNavBakedWriter::PutLump( fileBuffer, &header.lump[ NAV_BAKED_VISIBLE_AREAS ], writer.m_visibleAreas );
+
+	header.lump[ NAV_BAKED_LADDERS ].offset = fileBuffer.TellPut();
+	fileBuffer.PutUnsignedInt( m_ladders.Count() );
+	FOR_EACH_VEC( m_ladders, lit )
+	{
+		m_ladders[ lit ]->Save( fileBuffer, NavCurrentVersion );
+	}
+	header.lump[ NAV_BAKED_LADDERS ].count = fileBuffer.TellPut() - header.lump[ NAV_BAKED_LADDERS ].offset;
+
+	V_memcpy( fileBuffer.Base(), &header, sizeof( header ) );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store the loaded mesh in the baked format, next to the nav file it was loaded from
+ */
+bool CNavMesh::SaveBaked( void ) const
+{
+	if ( !IsLoaded() || m_isLoadedFromBakedFile )
+	{
+		Msg( "The navigation mesh must be loaded from its .nav file to bake it.\n" );
+		return false;
+	}
+
+	if ( GetSubVersionNumber() != 0 )
+	{
+		Msg( "This game stores custom navigation data, which the baked format doesn't support.\n" );
+		return false;
+	}
+
+	char navFilename[256];
+	Q_snprintf( navFilename, sizeof( navFilename ), FORMAT_NAVFILE, STRING( gpGlobals->mapname ) );
+
+	char bakedFilename[256];
+	Q_snprintf( bakedFilename, sizeof( bakedFilename ), FORMAT_NAVBAKEDFILE, STRING( gpGlobals->mapname ) );
+
+	char *bspFilename = GetBspFilename( navFilename );
+	if ( bspFilename == NULL )
+		return false;
+
+	unsigned int bspSize = filesystem->Size( bspFilename );
+	unsigned int navSize, navTime;
+	GetNavFileStamp( navFilename, &navSize, &navTime );
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024 );
+	WriteBakedMesh( fileBuffer, bspSize, navSize, navTime );
+
+	if ( !filesystem->WriteFile( bakedFilename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save %d bytes to %s\n", fileBuffer.TellPut(), bakedFilename );
+		return false;
+	}
+
+	Msg( "Baked navigation mesh saved to '%s' (%d bytes).\n", bakedFilename, fileBuffer.TellPut() );
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return a pointer to the records of the given lump, or NULL if the lump doesn't fit in the file
+ */
+template < typename T >
+static const T *GetBakedLump( const CUtlBuffer &fileBuffer, const NavBakedHeader &header, NavBakedLumpType type )
+{
+	const NavBakedLump &lump = header.lump[ type ];
+	if ( lump.offset % sizeof( unsigned int ) || lump.offset > (unsigned int)fileBuffer.TellPut() )
+		return NULL;
+
+	if ( lump.count > ( fileBuffer.TellPut() - lump.offset ) / sizeof( T ) )
+		return NULL;
+
+	return (const T *)( (const byte *)fileBuffer.Base() + lump.offset );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static bool IsBakedRangeValid( const NavBakedRange &range, unsigned int count )
+{
+	return range.first <= count && range.count <= count - range.first;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the baked copy of the nav file.
+ * Everything is checked before any object is created, so on failure the mesh is untouched and the
+ * caller can fall back to the .nav.
+ */
+NavErrorType CNavMesh::LoadBaked( const char *navFilename )
+{
+	char bakedFilename[256];
+	Q_snprintf( bakedFilename, sizeof( bakedFilename ), FORMAT_NAVBAKEDFILE, STRING( gpGlobals->mapname ) );
+
+	CUtlBuffer fileBuffer( 0, 0, CUtlBuffer::READ_ONLY );
+	if ( !filesystem->ReadFile( bakedFilename, "MOD", fileBuffer ) )
+		return NAV_CANT_ACCESS_FILE;
+
+	if ( fileBuffer.TellPut() < (int)sizeof( NavBakedHeader ) )
+		return NAV_INVALID_FILE;
+
+	const NavBakedHeader &header = *(const NavBakedHeader *)fileBuffer.Base();
+	if ( header.magic != NAV_BAKED_MAGIC_NUMBER )
+		return NAV_INVALID_FILE;
+
+	if ( header.version != NavBakedVersion || header.navVersion != NavCurrentVersion )
+	{
+		DevMsg( "Baked navigation file '%s' is from another version, loading the .nav\n", bakedFilename );
+		return NAV_BAD_FILE_VERSION;
+	}
+
+	// a bake is only good for the .nav and .bsp it was made from
+	char *bspFilename = GetBspFilename( navFilename );
+	if ( bspFilename == NULL )
+		return NAV_INVALID_FILE;
+
+	unsigned int navSize, navTime;
+	GetNavFileStamp( navFilename, &navSize, &navTime );
+	if ( header.bspSize != filesystem->Size( bspFilename ) || ( navSize && ( header.navSize != navSize || header.navTime != navTime ) ) )
+	{
+		DevMsg( "Baked navigation file '%s' is out of date, loading the .nav\n", bakedFilename );
+		return NAV_FILE_OUT_OF_DATE;
+	}
+
+	const NavBakedArea *bakedArea = GetBakedLump< NavBakedArea >( fileBuffer, header, NAV_BAKED_AREAS );
+	const NavBakedConnect *bakedConnect = GetBakedLump< NavBakedConnect >( fileBuffer, header, NAV_BAKED_CONNECTIONS );
+	const NavBakedHidingSpot *bakedSpot = GetBakedLump< NavBakedHidingSpot >( fileBuffer, header, NAV_BAKED_HIDING_SPOTS );
+	const unsigned int *bakedAreaSpot = GetBakedLump< unsigned int >( fileBuffer, header, NAV_BAKED_AREA_HIDING_SPOTS );
+	const NavBakedEncounter *bakedEncounter = GetBakedLump< NavBakedEncounter >( fileBuffer, header, NAV_BAKED_ENCOUNTERS );
+	const NavBakedSpotOrder *bakedOrder = GetBakedLump< NavBakedSpotOrder >( fileBuffer, header, NAV_BAKED_ENCOUNTER_SPOTS );
+	const unsigned int *bakedLadderConnect = GetBakedLump< unsigned int >( fileBuffer, header, NAV_BAKED_LADDER_CONNECTIONS );
+	const NavBakedVisibleArea *bakedVisible = GetBakedLump< NavBakedVisibleArea >( fileBuffer, header, NAV_BAKED_VISIBLE_AREAS );
+	const byte *bakedPlaces = GetBakedLump< byte >( fileBuffer, header, NAV_BAKED_PLACES );
+	const byte *bakedLadders = GetBakedLump< byte >( fileBuffer, header, NAV_BAKED_LADDERS );
+
+	if ( !bakedArea || !bakedConnect || !bakedSpot || !bakedAreaSpot || !bakedEncounter || !bakedOrder ||
+		 !bakedLadderConnect || !bakedVisible || !bakedPlaces || !bakedLadders )
+	{
+		Msg( "Invalid baked navigation file '%s'.\n", bakedFilename );
+		return NAV_INVALID_FILE;
+	}
+
+	unsigned int areaCount = header.lump[ NAV_BAKED_AREAS ].count;
+	unsigned int connectCount = header.lump[ NAV_BAKED_CONNECTIONS ].count;
+	unsigned int spotCount = header.lump[ NAV_BAKED_HIDING_SPOTS ].count;
+	unsigned int encounterCount = header.lump[ NAV_BAKED_ENCOUNTERS ].count;
+	unsigned int ladderConnectCount = header.lump[ NAV_BAKED_LADDER_CONNECTIONS ].count;
+
+	if ( areaCount == 0 )
+		return NAV_INVALID_FILE;
+
+	// the ladders are parsed from their own records, so read them before anything is created
+	CUtlBuffer ladderBuffer( bakedLadders, header.lump[ NAV_BAKED_LADDERS ].count, CUtlBuffer::READ_ONLY );
+	unsigned int ladderCount = ladderBuffer.GetUnsignedInt();
+	if ( !ladderBuffer.IsValid() )
+		return NAV_INVALID_FILE;
+
+	//
+	// Check every index, so the relocation pass below can't go out of bounds
+	//
+	bool isValid = true;
+	unsigned int i, j;
+	for ( i=0; i<areaCount && isValid; ++i )
+	{
+		const NavBakedArea &area = bakedArea[i];
+
+		for ( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			isValid &= IsBakedRangeValid( area.connect[d], connectCount );
+			isValid &= IsBakedRangeValid( area.incomingConnect[d], connectCount );
+		}
+
+		for ( int d=0; d<CNavLadder::NUM_LADDER_DIRECTIONS; ++d )
+		{
+			isValid &= IsBakedRangeValid( area.ladder[d], ladderConnectCount );
+		}
+
+		isValid &= IsBakedRangeValid( area.hidingSpots, header.lump[ NAV_BAKED_AREA_HIDING_SPOTS ].count );
+		isValid &= IsBakedRangeValid( area.encounters, encounterCount );
+		isValid &= IsBakedRangeValid( area.visibleAreas, header.lump[ NAV_BAKED_VISIBLE_AREAS ].count );
+		isValid &= area.inheritVisibilityFrom <= areaCount;
+	}
+
+	for ( i=0; i<connectCount && isValid; ++i )
+		isValid &= bakedConnect[i].area < areaCount;
+
+	for ( i=0; i<spotCount && isValid; ++i )
+		isValid &= bakedSpot[i].area <= areaCount;
+
+	for ( i=0; i<header.lump[ NAV_BAKED_AREA_HIDING_SPOTS ].count && isValid; ++i )
+		isValid &= bakedAreaSpot[i] < spotCount;
+
+	for ( i=0; i<encounterCount && isValid; ++i )
+	{
+		isValid &= bakedEncounter[i].from <= areaCount && bakedEncounter[i].to <= areaCount;
+		isValid &= IsBakedRangeValid( bakedEncounter[i].spots, header.lump[ NAV_BAKED_ENCOUNTER_SPOTS ].count );
+	}
+
+	for ( i=0; i<header.lump[ NAV_BAKED_ENCOUNTER_SPOTS ].count && isValid; ++i )
+		isValid &= bakedOrder[i].spot <= spotCount;
+
+	for ( i=0; i<ladderConnectCount && isValid; ++i )
+		isValid &= bakedLadderConnect[i] < ladderCount;
+
+	for ( i=0; i<header.lump[ NAV_BAKED_VISIBLE_AREAS ].count && isValid; ++i )
+		isValid &= bakedVisible[i].area < areaCount;
+
+	if ( !isValid )
+	{
+		Msg( "Corrupt baked navigation file '%s'.\n", bakedFilename );
+		return NAV_CORRUPT_DATA;
+	}
+
+	m_isAnalyzed = header.isAnalyzed != 0;
+
+	CUtlBuffer placeBuffer( bakedPlaces, header.lump[ NAV_BAKED_PLACES ].count, CUtlBuffer::READ_ONLY );
+	placeDirectory.Load( placeBuffer, NavCurrentVersion );
+
+	//
+	// Create the areas and hiding spots
+	//
+	Extent extent;
+	extent.lo.x = 9999999999.9f;
+	extent.lo.y = 9999999999.9f;
+	extent.hi.x = -9999999999.9f;
+	extent.hi.y = -9999999999.9f;
+
+	PreLoadAreas( areaCount );
+	TheNavAreas.EnsureCapacity( areaCount );
+	for ( i=0; i<areaCount; ++i )
+	{
+		const NavBakedArea &baked = bakedArea[i];
+		CNavArea *area = CreateArea();
+
+		area->m_id = baked.id;
+		if ( area->m_id >= CNavArea::m_nextID )
+			CNavArea::m_nextID = area->m_id+1;
+
+		area->m_attributeFlags = baked.attributeFlags;
+		area->m_nwCorner = baked.nwCorner;
+		area->m_seCorner = baked.seCorner;
+		area->m_neZ = baked.neZ;
+		area->m_swZ = baked.swZ;
+
+		area->m_center = ( area->m_nwCorner + area->m_seCorner ) / 2.0f;
+		if ( ( area->m_seCorner.x - area->m_nwCorner.x ) > 0.0f && ( area->m_seCorner.y - area->m_nwCorner.y ) > 0.0f )
+		{
+			area->m_invDxCorners = 1.0f / ( area->m_seCorner.x - area->m_nwCorner.x );
+			area->m_invDyCorners = 1.0f / ( area->m_seCorner.y - area->m_nwCorner.y );
+		}
+		else
+		{
+			area->m_invDxCorners = area->m_invDyCorners = 0;
+		}
+
+		area->m_isUnderwater = baked.isUnderwater != 0;
+		area->SetPlace( placeDirectory.IndexToPlace( baked.placeEntry ) );
+
+		for ( int t=0; t<MAX_NAV_TEAMS; ++t )
+		{
+			area->m_earliestOccupyTime[t] = baked.earliestOccupyTime[t];
+		}
+
+		for ( int c=0; c<NUM_CORNERS; ++c )
+		{
+			area->m_lightIntensity[c] = baked.lightIntensity[c];
+		}
+
+		TheNavAreas.AddToTail( area );
+
+		Extent areaExtent;
+		area->GetExtent( &areaExtent );
+		extent.lo.x = MIN( extent.lo.x, areaExtent.lo.x );
+		extent.lo.y = MIN( extent.lo.y, areaExtent.lo.y );
+		extent.hi.x = MAX( extent.hi.x, areaExtent.hi.x );
+		extent.hi.y = MAX( extent.hi.y, areaExtent.hi.y );
+	}
+
+	CUtlVector< HidingSpot * > spots;
+	spots.SetCount( spotCount );
+	for ( i=0; i<spotCount; ++i )
+	{
+		HidingSpot *spot = CreateHidingSpot();
+		spot->m_id = bakedSpot[i].id;
+		if ( spot->m_id >= HidingSpot::m_nextID )
+			HidingSpot::m_nextID = spot->m_id+1;
+
+		spot->m_pos = bakedSpot[i].pos;
+		spot->m_flags = bakedSpot[i].flags;
+		spot->m_area = bakedSpot[i].area ? TheNavAreas[ bakedSpot[i].area - 1 ] : NULL;
+		spots[i] = spot;
+	}
+
+	// add the areas to the grid
+	AllocateGrid( extent.lo.x, extent.hi.x, extent.lo.y, extent.hi.y );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		AddNavArea( TheNavAreas[ it ] );
+	}
+
+	// ladders refer to areas by ID, so they are loaded once the areas are in the mesh
+	m_ladders.EnsureCapacity( ladderCount );
+	for ( i=0; i<ladderCount; ++i )
+	{
+		CNavLadder *ladder = new CNavLadder;
+		ladder->Load( ladderBuffer, NavCurrentVersion );
+		m_ladders.AddToTail( ladder );
+	}
+
+	//
+	// Relocate: turn every stored index into a pointer
+	//
+	for ( i=0; i<areaCount; ++i )
+	{
+		const NavBakedArea &baked = bakedArea[i];
+		CNavArea *area = TheNavAreas[i];
+
+		for ( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			area->m_connect[d].EnsureCapacity( baked.connect[d].count );
+			for ( j=0; j<baked.connect[d].count; ++j )
+			{
+				const NavBakedConnect &bakedLink = bakedConnect[ baked.connect[d].first + j ];
+
+				NavConnect connect;
+				connect.area = TheNavAreas[ bakedLink.area ];
+				connect.length = bakedLink.length;
+				area->m_connect[d].AddToTail( connect );
+			}
+
+			area->m_incomingConnect[d].EnsureCapacity( baked.incomingConnect[d].count );
+			for ( j=0; j<baked.incomingConnect[d].count; ++j )
+			{
+				const NavBakedConnect &bakedLink = bakedConnect[ baked.incomingConnect[d].first + j ];
+
+				NavConnect connect;
+				connect.area = TheNavAreas[ bakedLink.area ];
+				connect.length = bakedLink.length;
+				area->m_incomingConnect[d].AddToTail( connect );
+			}
+		}
+
+		for ( int d=0; d<CNavLadder::NUM_LADDER_DIRECTIONS; ++d )
+		{
+			area->m_ladder[d].EnsureCapacity( baked.ladder[d].count );
+			for ( j=0; j<baked.ladder[d].count; ++j )
+			{
+				NavLadderConnect connect;
+				connect.ladder = m_ladders[ bakedLadderConnect[ baked.ladder[d].first + j ] ];
+				area->m_ladder[d].AddToTail( connect );
+			}
+		}
+
+		area->m_hidingSpots.EnsureCapacity( baked.hidingSpots.count );
+		for ( j=0; j<baked.hidingSpots.count; ++j )
+		{
+			area->m_hidingSpots.AddToTail( spots[ bakedAreaSpot[ baked.hidingSpots.first + j ] ] );
+		}
+
+		area->m_spotEncounters.EnsureCapacity( baked.encounters.count );
+		for ( j=0; j<baked.encounters.count; ++j )
+		{
+			const NavBakedEncounter &bakedE = bakedEncounter[ baked.encounters.first + j ];
+			SpotEncounter *e = new SpotEncounter;
+
+			e->from.area = bakedE.from ? TheNavAreas[ bakedE.from - 1 ] : NULL;
+			e->fromDir = (NavDirType)bakedE.fromDir;
+			e->to.area = bakedE.to ? TheNavAreas[ bakedE.to - 1 ] : NULL;
+			e->toDir = (NavDirType)bakedE.toDir;
+			e->path.from = bakedE.pathFrom;
+			e->path.to = bakedE.pathTo;
+
+			e->spots.SetCount( bakedE.spots.count );
+			for ( unsigned int s=0; s<bakedE.spots.count; ++s )
+			{
+				const NavBakedSpotOrder &order = bakedOrder[ bakedE.spots.first + s ];
+				e->spots[s].spot = order.spot ? spots[ order.spot - 1 ] : NULL;
+				e->spots[s].t = order.t;
+			}
+
+			area->m_spotEncounters.AddToTail( e );
+		}
+
+		area->m_potentiallyVisibleAreas.EnsureCapacity( baked.visibleAreas.count );
+		for ( j=0; j<baked.visibleAreas.count; ++j )
+		{
+			const NavBakedVisibleArea &visible = bakedVisible[ baked.visibleAreas.first + j ];
+
+			CNavArea::AreaBindInfo info;
+			info.area = TheNavAreas[ visible.area ];
+			info.attributes = visible.attributes;
+			area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		area->m_inheritVisibilityFrom.area = baked.inheritVisibilityFrom ? TheNavAreas[ baked.inheritVisibilityFrom - 1 ] : NULL;
+
+		// func avoid/prefer attributes are controlled by func_nav_cost entities
+		area->ClearAllNavCostEntities();
+	}
+
+	//
+	// The rest of PostLoad(). Connection lengths, encounter paths, hiding spot areas and
+	// incoming connections were all stored by the bake.
+	//
+	ComputeBattlefrontAreas();
+
+	for ( int i=0; i<m_avoidanceObstacles.Count(); ++i )
+	{
+		m_avoidanceObstacles[i]->OnNavMeshLoaded();
+	}
+
+	m_isLoaded = true;
+	m_isLoadedFromBakedFile = true;
+
+	WarnIfMeshNeedsAnalysis( NavCurrentVersion );
+
+	return NAV_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_bake, "Store the navigation mesh loaded from the .nav in the baked format, which loads faster.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavMesh->SaveBaked();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the mesh from the .nav and from the baked file, and compare the times and the resulting meshes
+ */
+CON_COMMAND_F( nav_bake_compare, "Load the navigation mesh from the .nav and from the baked file, reporting the load times and any difference between the two meshes.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	bool loadBaked = nav_load_baked.GetBool();
+
+	// the .nav
+	nav_load_baked.SetValue( 0 );
+
+	CFastTimer navTimer;
+	navTimer.Start();
+	NavErrorType navResult = TheNavMesh->Load();
+	navTimer.End();
+
+	CUtlBuffer navMesh;
+	if ( navResult == NAV_OK )
+	{
+		TheNavMesh->WriteBakedMesh( navMesh, 0, 0, 0 );
+	}
+
+	// the baked file
+	nav_load_baked.SetValue( 1 );
+
+	CFastTimer bakedTimer;
+	bakedTimer.Start();
+	NavErrorType bakedResult = TheNavMesh->Load();
+	bakedTimer.End();
+
+	bool isBaked = TheNavMesh->IsLoadedFromBakedFile();
+	CUtlBuffer bakedMesh;
+	if ( bakedResult == NAV_OK )
+	{
+		TheNavMesh->WriteBakedMesh( bakedMesh, 0, 0, 0 );
+	}
+
+	nav_load_baked.SetValue( loadBaked );
+
+	if ( navResult != NAV_OK )
+	{
+		Msg( "Unable to load the .nav file.\n" );
+		return;
+	}
+
+	if ( !isBaked )
+	{
+		Msg( "No current baked navigation file; use nav_bake to create one.\n" );
+		return;
+	}
+
+	Msg( ".nav load:   %.2f ms\n", navTimer.GetDuration().GetMillisecondsF() );
+	Msg( "baked load:  %.2f ms\n", bakedTimer.GetDuration().GetMillisecondsF() );
+
+	bool isSame = navMesh.TellPut() == bakedMesh.TellPut() && V_memcmp( navMesh.Base(), bakedMesh.Base(), navMesh.TellPut() ) == 0;
+	if ( isSame )
+	{
+		Msg( "The meshes are identical (%d areas).\n", TheNavAreas.Count() );
+	}
+	else
+	{
+		Warning( "The meshes differ! Re-bake with nav_load_baked 0; nav_load; nav_bake\n" );
+	}
+}
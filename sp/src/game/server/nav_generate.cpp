@@ -17,6 +17,10 @@
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "tier0/fasttimer.h"
+#include "tier1/generichash.h"
+#include "utlhashtable.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -51,6 +55,121 @@ bool FindGroundForNode( Vector *pos, Vector *normal );	// find a ground Z for po
 const float MaxTraversableHeight = StepHeight;		// max internal obstacle height that can occur between nav nodes and safely disregarded
 const float MinObstacleAreaWidth = 10.0f;			// min width of a nav area we will generate on top of an obstacle
 
+ConVar nav_generate_threaded( "nav_generate_threaded", "1", FCVAR_CHEAT, "Compute the traces for sampling and area building as parallel jobs. The mesh is identical to a serial generation." );
+ConVar nav_generate_region_size( "nav_generate_region_size", "16", FCVAR_CHEAT, "Width in nodes of the grid regions threaded generation hands to each job." );
+ConVar nav_visibility_batch_size( "nav_visibility_batch_size", "32", FCVAR_CHEAT, "Number of areas whose visibility traces are run together as parallel jobs during analysis." );
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The result of sampling one step from a node position in a direction
+ */
+struct NavSampleStep
+{
+	bool isValid;						// false if no node can be added in this direction
+	bool isOnDisplacement;
+	Vector to;
+	Vector toNormal;
+	float obstacleHeight;
+	float obstacleStartDist;
+	float obstacleEndDist;
+};
+
+static Vector GetSampleStepTarget( const Vector &from, NavDirType dir );
+static bool ComputeSampleStep( const Vector &from, const Vector &pos, bool testOverlap, NavSampleStep *step );
+bool TestForValidCrouchArea( CNavNode *node );
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Trace results for threaded generation.
+ * The traces made by SampleStep(), AddNode() and TestArea() depend only on the world, not on the nodes
+ * and areas built so far. A flood fill over the sampling grid computes them ahead of time as parallel
+ * jobs, one grid region per job, and merges each wave of results in a fixed order. The serial passes
+ * then run as before, taking these results instead of tracing, so the mesh is the same as a serial
+ * generation's. Anything the flood didn't reach is traced inline.
+ */
+class CNavGenerationCache
+{
+public:
+	CNavGenerationCache( void );
+
+	void AddSeed( const Vector &pos );
+	bool SampleWave( void );							// sample the next wave of the flood fill, return false once it is complete
+	bool IsFlooding( void ) const			{ return m_isFlooding; }
+	int GetWaveCount( void ) const			{ return m_waveCount; }
+	int GetSampledCount( void ) const		{ return m_sampledCount; }
+
+	const NavSampleStep *FindStep( const Vector &from, NavDirType dir );	// return the precomputed step, or NULL
+	const NavNodeCrouchInfo *FindCrouch( const Vector &pos );				// return the precomputed crouch tests, or NULL
+
+	void ComputeCrouchAreaTests( void );				// run TestForValidCrouchArea() on every crouch node
+	bool IsValidCrouchArea( CNavNode *node );
+
+	void ReportSampling( void ) const;
+
+private:
+	struct SamplePosition
+	{
+		Vector pos;
+		NavSampleStep steps[ NUM_DIRECTIONS ];
+		NavNodeCrouchInfo crouch;
+	};
+
+	struct SampleRegion
+	{
+		int first;										// range of m_waveOrder this job samples
+		int count;
+	};
+
+	struct WaveItem
+	{
+		int regionX;
+		int regionY;
+		int index;
+	};
+
+	static int __cdecl CompareWaveItems( const WaveItem *lhs, const WaveItem *rhs );
+
+	void SampleRegionJob( SampleRegion &region );
+	void CrouchAreaJob( CNavNode *&node );
+
+	bool IsQueued( const Vector &pos ) const;			// true if the flood already has a position CNavNode::GetNode() would match
+	void Enqueue( const Vector &pos );
+	int Find( const Vector &pos ) const;
+
+	struct PositionHashFunctor
+	{
+		unsigned int operator()( const Vector &pos ) const { return HashBlock( &pos, sizeof( pos ) ); }
+	};
+	struct PositionEqualFunctor
+	{
+		bool operator()( const Vector &lhs, const Vector &rhs ) const { return V_memcmp( &lhs, &rhs, sizeof( Vector ) ) == 0; }
+	};
+	struct CellHashFunctor
+	{
+		unsigned int operator()( const Vector2D &cell ) const { return HashBlock( &cell, sizeof( cell ) ); }
+	};
+	struct CellEqualFunctor
+	{
+		bool operator()( const Vector2D &lhs, const Vector2D &rhs ) const { return lhs == rhs; }
+	};
+
+	CUtlVector< SamplePosition > m_positions;			// every position the flood has reached, in the order it got there
+	CUtlHashtable< Vector, int, PositionHashFunctor, PositionEqualFunctor > m_positionIndex;
+	CUtlHashtable< Vector2D, int, CellHashFunctor, CellEqualFunctor > m_cellHead;	// first position at each grid XY
+	CUtlVector< int > m_nextAtXY;						// next position at the same grid XY, by position index
+
+	CUtlVector< int > m_waveOrder;						// position indices of the current wave, grouped by region
+	int m_sampledCount;									// positions below this index have been sampled
+	int m_waveCount;
+	bool m_isFlooding;
+
+	CUtlVector< signed char > m_validCrouchArea;		// TestForValidCrouchArea() results by node ID, -1 if not tested
+
+	int m_stepHits;
+	int m_stepMisses;
+	float m_floodTime;
+};
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Shortest path cost, paying attention to "blocked" areas
@@ -3100,9 +3219,13 @@ bool CNavMesh::TestArea( CNavNode *node, int width, int height )
 
 			// Now that we've done the quick checks, test for a valid crouch area.
 			// This finds pillars etc in the middle of 4 nodes, that weren't found initially.
-			if ( nodeCrouch && !TestForValidCrouchArea( horizNode ) )
+			if ( nodeCrouch )
 			{
-				return false;
+				bool isValidCrouch = m_generationCache ? m_generationCache->IsValidCrouchArea( horizNode ) : TestForValidCrouchArea( horizNode );
+				if ( !isValidCrouch )
+				{
+					return false;
+				}
 			}
 
 			horizNode = horizNode->GetConnectedNode( EAST );
@@ -3262,6 +3385,43 @@ int CNavMesh::BuildArea( CNavNode *node, int width, int height )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Reports how long each pass of the generation takes
+ */
+class CNavGenerationPhaseTimer
+{
+public:
+	CNavGenerationPhaseTimer( const char *name ) : m_name( name )
+	{
+		m_timer.Start();
+	}
+
+	~CNavGenerationPhaseTimer()
+	{
+		End();
+	}
+
+	// report the current pass and start timing the next one
+	void Next( const char *name )
+	{
+		End();
+		m_name = name;
+		m_timer.Start();
+	}
+
+private:
+	void End( void )
+	{
+		m_timer.End();
+		Msg( "  %s: %.2f seconds\n", m_name, m_timer.GetDuration().GetSeconds() );
+	}
+
+	const char *m_name;
+	CFastTimer m_timer;
+};
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * This function uses the CNavNodes that have been sampled from the map to
@@ -3274,6 +3434,8 @@ int CNavMesh::BuildArea( CNavNode *node, int width, int height )
  */
 void CNavMesh::CreateNavAreasFromNodes( void )
 {
+	CNavGenerationPhaseTimer timer( "Building areas from nodes" );
+
 	// haven't yet seen a map use larger than 30...
 	int tryWidth = nav_area_max_size.GetInt();
 	int tryHeight = tryWidth;
@@ -3346,17 +3508,27 @@ void CNavMesh::CreateNavAreasFromNodes( void )
 		AddNavArea( TheNavAreas[ git ] );
 	}
 
-	
+	timer.Next( "Connecting areas" );
 	ConnectGeneratedAreas();
+	timer.Next( "Marking player clip areas" );
 	MarkPlayerClipAreas();
+	timer.Next( "Marking jump areas" );
 	MarkJumpAreas();	// mark jump areas before we merge generated areas, so we don't merge jump and non-jump areas
+	timer.Next( "Merging areas" );
 	MergeGeneratedAreas();
+	timer.Next( "Splitting areas under overhangs" );
 	SplitAreasUnderOverhangs();
+	timer.Next( "Squaring up areas" );
 	SquareUpAreas();
+	timer.Next( "Marking stair areas" );
 	MarkStairAreas();
+	timer.Next( "Stitching jump areas" );
 	StichAndRemoveJumpAreas();
+	timer.Next( "Handling obstacle top areas" );
 	HandleObstacleTopAreas();
+	timer.Next( "Fixing up areas" );
 	FixUpGeneratedAreas();
+	timer.Next( "Connecting ladders" );
 
 	/// @TODO: incremental generation doesn't create ladders yet
 	if ( m_generationMode != GENERATE_INCREMENTAL )
@@ -3396,7 +3568,7 @@ void CNavMesh::AddWalkableSeeds( void )
 /**
  * Initiate the generation process
  */
-void CNavMesh::BeginGeneration( bool incremental )
+void CNavMesh::BeginGeneration( bool incremental, bool quitWhenFinished )
 {
 	IGameEvent *event = gameeventmanager->CreateEvent( "nav_generate" );
 	if ( event )
@@ -3426,10 +3598,14 @@ void CNavMesh::BeginGeneration( bool incremental )
 	}
 
 	m_generationState = SAMPLE_WALKABLE_SPACE;
+	m_generationPhase = NUM_GENERATION_STATES;
 	m_sampleTick = 0;
 	m_generationMode = (incremental) ? GENERATE_INCREMENTAL : GENERATE_FULL;
+	m_bQuitWhenFinished = quitWhenFinished;
 	lastMsgTime = 0.0f;
 
+	DestroyGenerationCache();
+
 	// clear any previous mesh
 	DestroyNavigationMesh( incremental );
 
@@ -3461,11 +3637,37 @@ void CNavMesh::BeginGeneration( bool incremental )
 	// initialize seed list index
 	m_seedIdx = 0;
 
-	Msg( "Generating Navigation Mesh...\n" );
+	// precompute the sampling traces on the job threads. Incremental generation tests against
+	// the existing areas, which the jobs can't see, so it always traces as it goes.
+	if ( !incremental && nav_generate_threaded.GetBool() && g_pThreadPool && g_pThreadPool->NumThreads() > 0 )
+	{
+		m_generationCache = new CNavGenerationCache;
+		FOR_EACH_VEC( m_walkableSeeds, it )
+		{
+			m_generationCache->AddSeed( m_walkableSeeds[it].pos );
+		}
+
+		Msg( "Generating Navigation Mesh (%d threads)...\n", g_pThreadPool->NumThreads() + 1 );
+	}
+	else
+	{
+		Msg( "Generating Navigation Mesh...\n" );
+	}
 	m_generationStartTime = Plat_FloatTime();
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Free the precomputed generation traces
+ */
+void CNavMesh::DestroyGenerationCache( void )
+{
+	delete m_generationCache;
+	m_generationCache = NULL;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
@@ -3525,6 +3727,7 @@ void CNavMesh::BeginAnalysis( bool quitWhenFinished )
 
 	DestroyHidingSpots();
 	m_generationState = FIND_HIDING_SPOTS;
+	m_generationPhase = NUM_GENERATION_STATES;
 	m_generationIndex = 0;
 	m_generationMode = GENERATE_ANALYSIS_ONLY;
 	m_bQuitWhenFinished = quitWhenFinished;
@@ -3623,6 +3826,13 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 	static ConVarRef host_thread_mode( "host_thread_mode" );
 
+	// note when each state begins, so we can report how long it took
+	if ( m_generationPhase != m_generationState )
+	{
+		m_generationPhase = m_generationState;
+		m_generationPhaseStartTime = startTime;
+	}
+
 	switch( m_generationState )
 	{
 		//---------------------------------------------------------------------------
@@ -3631,6 +3841,19 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 			AnalysisProgress( "Sampling walkable space...", 100, m_sampleTick / 10, false );
 			m_sampleTick = ( m_sampleTick + 1 ) % 1000;
 
+			// flood the sampling grid with jobs first, then walk it with the cached traces
+			if ( m_generationCache && m_generationCache->IsFlooding() )
+			{
+				while ( m_generationCache->SampleWave() )
+				{
+					if ( Plat_FloatTime() - startTime > maxTime )
+					{
+						return true;
+					}
+				}
+				return true;
+			}
+
 			while ( SampleStep() )
 			{
 				if ( Plat_FloatTime() - startTime > maxTime )
@@ -3639,6 +3862,12 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			if ( m_generationCache )
+			{
+				m_generationCache->ReportSampling();
+			}
+			Msg( "Sampling walkable space...DONE (%d nodes, %.2f seconds)\n", CNavNode::GetListLength(), Plat_FloatTime() - m_generationPhaseStartTime );
+
 			// sampling is complete, now build nav areas
 			m_generationState = CREATE_AREAS_FROM_SAMPLES;
 
@@ -3661,9 +3890,18 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			// test the crouch nodes on the job threads before TestArea() needs them
+			if ( m_generationCache )
+			{
+				CNavGenerationPhaseTimer timer( "Testing crouch areas" );
+				m_generationCache->ComputeCrouchAreaTests();
+			}
+
 			// Create new areas
 			CreateNavAreasFromNodes();
 
+			DestroyGenerationCache();
+
 			// And toggle the selection, so we end up with the new areas
 			if ( m_generationMode == GENERATE_INCREMENTAL )
 			{
@@ -3711,7 +3949,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding hiding spots...DONE\n" );
+			Msg( "Finding hiding spots...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = FIND_ENCOUNTER_SPOTS;
 			m_generationIndex = 0;
@@ -3736,7 +3974,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding encounter spots...DONE\n" );
+			Msg( "Finding encounter spots...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = FIND_SNIPER_SPOTS;
 			m_generationIndex = 0;
@@ -3761,7 +3999,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding sniper spots...DONE\n" );
+			Msg( "Finding sniper spots...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = COMPUTE_MESH_VISIBILITY;
 			m_generationIndex = 0;
@@ -3776,10 +4014,10 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		{
 			while( m_generationIndex < TheNavAreas.Count() )
 			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
+				int count = MIN( MAX( nav_visibility_batch_size.GetInt(), 1 ), TheNavAreas.Count() - m_generationIndex );
 
-				area->ComputeVisibilityToMesh();
+				CNavArea::ComputeVisibilityToMesh( TheNavAreas.Base() + m_generationIndex, count );
+				m_generationIndex += count;
 
 				// don't go over our time allotment
 				if ( Plat_FloatTime() - startTime > maxTime )
@@ -3793,7 +4031,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 			EndVisibilityComputations();
 
-			Msg( "Computing mesh visibility...DONE\n" );
+			Msg( "Computing mesh visibility...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = FIND_EARLIEST_OCCUPY_TIMES;
 			m_generationIndex = 0;
@@ -3818,7 +4056,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding earliest occupy times...DONE\n" );
+			Msg( "Finding earliest occupy times...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 #ifdef NAV_ANALYZE_LIGHT_INTENSITY
 			bool shouldSkipLightComputation = ( m_generationMode == GENERATE_INCREMENTAL || engine->IsDedicatedServer() );
@@ -3856,7 +4094,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 			if ( !s_unlitAreas.Count() || !host )
 			{
-				Msg( "Finding light intensity...DONE\n" );
+				Msg( "Finding light intensity...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 				m_generationState = CUSTOM;
 				m_generationIndex = 0;
@@ -3911,7 +4149,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 				else
 				{
-					Msg( "Finding light intensity...DONE (%d unlit areas)\n", s_unlitAreas.Count() );
+					Msg( "Finding light intensity...DONE (%d unlit areas, %.2f seconds)\n", s_unlitAreas.Count(), Plat_FloatTime() - m_generationPhaseStartTime );
 					if ( s_unlitAreas.Count() )
 					{
 						Warning( "To see unlit areas:\n" );
@@ -3927,7 +4165,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
-			Msg( "Finding light intensity...DONE\n" );
+			Msg( "Finding light intensity...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = CUSTOM;
 			m_generationIndex = 0;
@@ -3961,7 +4199,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 			PostCustomAnalysis();
 
 			EndCustomAnalysis();
-			Msg( "Custom game-specific analysis...DONE\n" );
+			Msg( "Custom game-specific analysis...DONE (%.2f seconds)\n", Plat_FloatTime() - m_generationPhaseStartTime );
 
 			m_generationState = SAVE_NAV_MESH;
 			m_generationIndex = 0;
@@ -4108,7 +4346,15 @@ CNavNode *CNavMesh::AddNode( const Vector &destPos, const Vector &normal, NavDir
 		m_currentNode = node;
 	}
 
-	node->CheckCrouch();
+	const NavNodeCrouchInfo *crouch = m_generationCache ? m_generationCache->FindCrouch( *node->GetPosition() ) : NULL;
+	if ( crouch )
+	{
+		node->ApplyCrouch( *crouch );
+	}
+	else
+	{
+		node->CheckCrouch();
+	}
 
 	// determine if there's a cliff nearby and set an attribute on this node
 	for ( int i = 0; i < NUM_DIRECTIONS; i++ )
@@ -4331,6 +4577,457 @@ static bool IsNodeOverlapped( const Vector& pos, const Vector& offset )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the grid position one step from 'from' in the given direction
+ */
+static Vector GetSampleStepTarget( const Vector &from, NavDirType dir )
+{
+	// start at current node position
+	Vector pos = from;
+
+	// snap to grid
+	int cx = TheNavMesh->SnapToGrid( pos.x );
+	int cy = TheNavMesh->SnapToGrid( pos.y );
+
+	switch( dir )
+	{
+		case NORTH:		cy -= GenerationStepSize; break;
+		case SOUTH:		cy += GenerationStepSize; break;
+		case EAST:		cx += GenerationStepSize; break;
+		case WEST:		cx -= GenerationStepSize; break;
+	}
+
+	pos.x = cx;
+	pos.y = cy;
+
+	return pos;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Trace one sampling step from a node at 'from' to the grid position 'pos'.
+ * Only the world is tested, so this is safe to run from a job thread while the mesh is empty.
+ * Returns false (and step->isValid false) if no node can be added there.
+ */
+static bool ComputeSampleStep( const Vector &from, const Vector &pos, bool testOverlap, NavSampleStep *step )
+{
+	step->isValid = false;
+	step->isOnDisplacement = false;
+
+	trace_t result;
+	CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
+	Vector to, toNormal;
+	float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
+	if ( TraceAdjacentNode( 0, from, pos, &result ) )
+	{
+		to = result.endpos;
+		toNormal = result.plane.normal;
+	}
+	else
+	{
+		// test going up ClimbUpHeight
+		bool success = false;
+		for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
+		{						
+			trace_t tr;
+			Vector start( from );
+			Vector end( pos );
+			start.z += height;
+			end.z += height;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+			if ( !tr.startsolid && tr.fraction == 1.0f )
+			{
+				if ( !StayOnFloor( &tr ) )
+				{
+					break;
+				}
+
+				to = tr.endpos;
+				toNormal = tr.plane.normal;
+
+				start = end = from;
+				end.z += height;
+				UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+				if ( tr.fraction < 1.0f )
+				{
+					break;
+				}
+
+				// keep track of far up we had to go to find a path to the next node
+				obstacleHeight = height;
+				success = true;
+				break;
+			}
+			else
+			{
+				// Could not trace from node to node at this height, something is in the way.
+				// Trace in the other direction to see if we hit something
+				Vector vecToObstacleStart = tr.endpos - start;
+				Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
+				if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
+				{
+					UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+					if ( !tr.startsolid && tr.fraction < 1.0 )
+					{
+						// We hit something going the other direction.  There is some obstacle between the two nodes.
+						Vector vecToObstacleEnd = tr.endpos - start;
+						Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
+						if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
+						{
+							// Remember the distances to start and end of the obstacle (with respect to the "from" node).
+							// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
+							// If we do eventually clear the obstacle, these values will be the start and end distance to the
+							// very tip of the obstacle.
+							obstacleStartDist = vecToObstacleStart.Length();
+							obstacleEndDist = vecToObstacleEnd.Length();
+							if ( obstacleEndDist == 0 )
+							{
+								obstacleEndDist = GenerationStepSize;
+							}
+						}								
+					}
+				}
+			}
+		}
+
+		if ( !success )
+		{
+			return false;
+		}
+	}
+
+	// Don't generate nodes if we spill off the end of the world onto skybox
+	if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+	{
+		return false;
+	}
+
+	// If we're incrementally generating, don't overlap existing nav areas.
+	if ( testOverlap )
+	{
+		Vector testPos( to );
+		bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
+		bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
+		bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
+		bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
+		if ( overlapSE && overlapSW && overlapNE && overlapNW )
+		{
+			return false;
+		}
+	}
+
+	bool isOnDisplacement = result.IsDispSurface();
+
+	if ( nav_displacement_test.GetInt() > 0 )
+	{
+		// Test for nodes under displacement surfaces.
+		// This happens during development, and is a pain because the space underneath a displacement
+		// is not 'solid'.
+		Vector start = to + Vector( 0, 0, 0 );
+		Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
+		UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &result );
+
+		if ( result.fraction > 0 )
+		{
+			end = start;
+			start = result.endpos;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &result );
+			if ( result.fraction < 1 )
+			{
+				// if we made it down to within StepHeight, maybe we're on a static prop
+				if ( result.endpos.z > to.z + StepHeight )
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	float deltaZ = to.z - from.z;
+	// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
+	// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
+	// and distances
+	if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
+	{
+		obstacleHeight = 0;
+		obstacleStartDist = 0;
+		obstacleEndDist = GenerationStepSize;
+	}
+
+	step->isValid = true;
+	step->isOnDisplacement = isOnDisplacement;
+	step->to = to;
+	step->toNormal = toNormal;
+	step->obstacleHeight = obstacleHeight;
+	step->obstacleStartDist = obstacleStartDist;
+	step->obstacleEndDist = obstacleEndDist;
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavGenerationCache::CNavGenerationCache( void )
+{
+	m_sampledCount = 0;
+	m_waveCount = 0;
+	m_isFlooding = true;
+	m_stepHits = 0;
+	m_stepMisses = 0;
+	m_floodTime = 0.0f;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavGenerationCache::AddSeed( const Vector &pos )
+{
+	if ( !IsQueued( pos ) )
+	{
+		Enqueue( pos );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if the flood has reached a position that CNavNode::GetNode() would consider the same node
+ */
+bool CNavGenerationCache::IsQueued( const Vector &pos ) const
+{
+	const float tolerance = 0.45f * GenerationStepSize;
+
+	UtlHashHandle_t h = m_cellHead.Find( pos.AsVector2D() );
+	if ( h == m_cellHead.InvalidHandle() )
+		return false;
+
+	for( int i = m_cellHead.Element( h ); i >= 0; i = m_nextAtXY[i] )
+	{
+		if ( fabs( m_positions[i].pos.z - pos.z ) < tolerance )
+			return true;
+	}
+
+	return false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavGenerationCache::Enqueue( const Vector &pos )
+{
+	int index = m_positions.AddToTail();
+	m_positions[ index ].pos = pos;
+	m_positionIndex.Insert( pos, index );
+
+	// link into the list of positions sharing this grid XY
+	int next = -1;
+	UtlHashHandle_t h = m_cellHead.Find( pos.AsVector2D() );
+	if ( h == m_cellHead.InvalidHandle() )
+	{
+		m_cellHead.Insert( pos.AsVector2D(), index );
+	}
+	else
+	{
+		next = m_cellHead.Element( h );
+		m_cellHead.Element( h ) = index;
+	}
+	m_nextAtXY.AddToTail( next );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavGenerationCache::Find( const Vector &pos ) const
+{
+	UtlHashHandle_t h = m_positionIndex.Find( pos );
+	if ( h == m_positionIndex.InvalidHandle() )
+		return -1;
+
+	return m_positionIndex.Element( h );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int __cdecl CNavGenerationCache::CompareWaveItems( const WaveItem *lhs, const WaveItem *rhs )
+{
+	if ( lhs->regionY != rhs->regionY )
+		return ( lhs->regionY < rhs->regionY ) ? -1 : 1;
+
+	if ( lhs->regionX != rhs->regionX )
+		return ( lhs->regionX < rhs->regionX ) ? -1 : 1;
+
+	return lhs->index - rhs->index;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Sample every position the flood reached last wave, one job per grid region, then queue
+ * the positions they step to. Returns false once there is nothing left to sample.
+ */
+bool CNavGenerationCache::SampleWave( void )
+{
+	int waveEnd = m_positions.Count();
+	if ( m_sampledCount >= waveEnd )
+	{
+		m_isFlooding = false;
+		return false;
+	}
+
+	CFastTimer timer;
+	timer.Start();
+
+	// group this wave by region, so each job's traces stay in one part of the map
+	const float regionWidth = GenerationStepSize * MAX( nav_generate_region_size.GetInt(), 1 );
+
+	CUtlVector< WaveItem > items;
+	items.SetCount( waveEnd - m_sampledCount );
+	for ( int i = m_sampledCount; i < waveEnd; ++i )
+	{
+		WaveItem &item = items[ i - m_sampledCount ];
+		item.regionX = (int)floor( m_positions[i].pos.x / regionWidth );
+		item.regionY = (int)floor( m_positions[i].pos.y / regionWidth );
+		item.index = i;
+	}
+	items.Sort( CompareWaveItems );
+
+	m_waveOrder.SetCount( items.Count() );
+	CUtlVector< SampleRegion > regions;
+	for ( int i = 0; i < items.Count(); ++i )
+	{
+		m_waveOrder[i] = items[i].index;
+
+		if ( i == 0 || items[i].regionX != items[i-1].regionX || items[i].regionY != items[i-1].regionY )
+		{
+			SampleRegion region;
+			region.first = i;
+			region.count = 0;
+			regions.AddToTail( region );
+		}
+		++regions.Tail().count;
+	}
+
+	ParallelProcess( "CNavGenerationCache::SampleRegion", regions.Base(), regions.Count(), this, &CNavGenerationCache::SampleRegionJob );
+
+	// queue the new positions in index order, so the flood is the same regardless of how the jobs ran
+	for ( int i = m_sampledCount; i < waveEnd; ++i )
+	{
+		for ( int dir = NORTH; dir < NUM_DIRECTIONS; ++dir )
+		{
+			const NavSampleStep &step = m_positions[i].steps[ dir ];
+			if ( step.isValid && !IsQueued( step.to ) )
+			{
+				Enqueue( step.to );
+			}
+		}
+	}
+
+	m_sampledCount = waveEnd;
+	++m_waveCount;
+
+	timer.End();
+	m_floodTime += timer.GetDuration().GetSeconds();
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavGenerationCache::SampleRegionJob( SampleRegion &region )
+{
+	for ( int i = region.first; i < region.first + region.count; ++i )
+	{
+		// each job writes only the positions in its region
+		SamplePosition &sample = m_positions[ m_waveOrder[i] ];
+
+		for ( int dir = NORTH; dir < NUM_DIRECTIONS; ++dir )
+		{
+			Vector pos = GetSampleStepTarget( sample.pos, (NavDirType)dir );
+			ComputeSampleStep( sample.pos, pos, true, &sample.steps[ dir ] );
+		}
+
+		CNavNode::ComputeCrouch( sample.pos, &sample.crouch );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const NavSampleStep *CNavGenerationCache::FindStep( const Vector &from, NavDirType dir )
+{
+	int index = Find( from );
+	if ( index < 0 || index >= m_sampledCount )
+	{
+		++m_stepMisses;
+		return NULL;
+	}
+
+	++m_stepHits;
+	return &m_positions[ index ].steps[ dir ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const NavNodeCrouchInfo *CNavGenerationCache::FindCrouch( const Vector &pos )
+{
+	int index = Find( pos );
+	if ( index < 0 || index >= m_sampledCount )
+		return NULL;
+
+	return &m_positions[ index ].crouch;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavGenerationCache::ReportSampling( void ) const
+{
+	int total = m_stepHits + m_stepMisses;
+	Msg( "  Sampled %d positions in %d waves on the job threads: %.2f seconds, %d%% of steps precomputed\n",
+		m_sampledCount, m_waveCount, m_floodTime, total ? 100 * m_stepHits / total : 0 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Run TestForValidCrouchArea() for every crouch node ahead of TestArea(), which is the only thing that asks
+ */
+void CNavGenerationCache::ComputeCrouchAreaTests( void )
+{
+	CUtlVector< CNavNode * > nodes;
+	unsigned int maxID = 0;
+	for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
+	{
+		maxID = MAX( maxID, node->GetID() );
+		if ( node->GetAttributes() & NAV_MESH_CROUCH )
+		{
+			nodes.AddToTail( node );
+		}
+	}
+
+	m_validCrouchArea.SetCount( maxID + 1 );
+	V_memset( m_validCrouchArea.Base(), -1, m_validCrouchArea.Count() );
+
+	ParallelProcess( "CNavGenerationCache::CrouchArea", nodes.Base(), nodes.Count(), this, &CNavGenerationCache::CrouchAreaJob );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavGenerationCache::CrouchAreaJob( CNavNode *&node )
+{
+	m_validCrouchArea[ node->GetID() ] = TestForValidCrouchArea( node ) ? 1 : 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavGenerationCache::IsValidCrouchArea( CNavNode *node )
+{
+	unsigned int id = node->GetID();
+	if ( id < (unsigned int)m_validCrouchArea.Count() && m_validCrouchArea[ id ] >= 0 )
+	{
+		return m_validCrouchArea[ id ] != 0;
+	}
+
+	return TestForValidCrouchArea( node );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Search the world and build a map of possible movements.
@@ -4389,24 +5086,8 @@ bool CNavMesh::SampleStep( void )
 			{
 				// have not searched in this direction yet
 
-				// start at current node position
-				Vector pos = *m_currentNode->GetPosition();
-
-				// snap to grid
-				int cx = SnapToGrid( pos.x );
-				int cy = SnapToGrid( pos.y );
-
 				// attempt to move to adjacent node
-				switch( dir )
-				{
-					case NORTH:		cy -= GenerationStepSize; break;
-					case SOUTH:		cy += GenerationStepSize; break;
-					case EAST:		cx += GenerationStepSize; break;
-					case WEST:		cx -= GenerationStepSize; break;
-				}
-
-				pos.x = cx;
-				pos.y = cy;
+				Vector pos = GetSampleStepTarget( *m_currentNode->GetPosition(), (NavDirType)dir );
 
 				m_generationDir = (NavDirType)dir;
 
@@ -4443,102 +5124,15 @@ bool CNavMesh::SampleStep( void )
 				}
 
 				// test if we can move to new position
-				trace_t result;
-				Vector from( *m_currentNode->GetPosition() );
-				CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
-				Vector to, toNormal;
-				float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
-				if ( TraceAdjacentNode( 0, from, pos, &result ) )
+				NavSampleStep computedStep;
+				const NavSampleStep *step = m_generationCache ? m_generationCache->FindStep( *m_currentNode->GetPosition(), m_generationDir ) : NULL;
+				if ( !step )
 				{
-					to = result.endpos;
-					toNormal = result.plane.normal;
+					ComputeSampleStep( *m_currentNode->GetPosition(), pos, m_generationMode != GENERATE_SIMPLIFY, &computedStep );
+					step = &computedStep;
 				}
-				else
-				{
-					// test going up ClimbUpHeight
-					bool success = false;
-					for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
-					{						
-						trace_t tr;
-						Vector start( from );
-						Vector end( pos );
-						start.z += height;
-						end.z += height;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-						if ( !tr.startsolid && tr.fraction == 1.0f )
-						{
-							if ( !StayOnFloor( &tr ) )
-							{
-								break;
-							}
-
-							to = tr.endpos;
-							toNormal = tr.plane.normal;
-
-							start = end = from;
-							end.z += height;
-							UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-							if ( tr.fraction < 1.0f )
-							{
-								break;
-							}
 
-							// keep track of far up we had to go to find a path to the next node
-							obstacleHeight = height;
-							success = true;
-							break;
-						}
-						else
-						{
-							// Could not trace from node to node at this height, something is in the way.
-							// Trace in the other direction to see if we hit something
-							Vector vecToObstacleStart = tr.endpos - start;
-							Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
-							if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
-							{
-								UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-								if ( !tr.startsolid && tr.fraction < 1.0 )
-								{
-									// We hit something going the other direction.  There is some obstacle between the two nodes.
-									Vector vecToObstacleEnd = tr.endpos - start;
-									Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
-									if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
-									{
-										// Remember the distances to start and end of the obstacle (with respect to the "from" node).
-										// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
-										// If we do eventually clear the obstacle, these values will be the start and end distance to the
-										// very tip of the obstacle.
-										obstacleStartDist = vecToObstacleStart.Length();
-										obstacleEndDist = vecToObstacleEnd.Length();
-										if ( obstacleEndDist == 0 )
-										{
-											obstacleEndDist = GenerationStepSize;
-										}
-									}								
-								}
-							}
-						}
-					}
-
-					if ( !success )
-					{
-						return true;
-					}
-				}
-
-				// Don't generate nodes if we spill off the end of the world onto skybox
-				if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
-				{
-					return true;
-				}
-
-				// If we're incrementally generating, don't overlap existing nav areas.
-				Vector testPos( to );
-				bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
-				bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
-				bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
-				bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
-				if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+				if ( !step->isValid )
 				{
 					return true;
 				}
@@ -4547,7 +5141,7 @@ bool CNavMesh::SampleStep( void )
 				if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
 				{
 					bool bValid = false;
-					int zPos = to.z;
+					int zPos = step->to.z;
 					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
 					{
 						const Vector &seedPos = m_walkableSeeds[i].pos;
@@ -4565,48 +5159,9 @@ bool CNavMesh::SampleStep( void )
 						return true;
 				}
 
-
-				bool isOnDisplacement = result.IsDispSurface();
-
-				if ( nav_displacement_test.GetInt() > 0 )
-				{
-					// Test for nodes under displacement surfaces.
-					// This happens during development, and is a pain because the space underneath a displacement
-					// is not 'solid'.
-					Vector start = to + Vector( 0, 0, 0 );
-					Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
-					UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-
-					if ( result.fraction > 0 )
-					{
-						end = start;
-						start = result.endpos;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-						if ( result.fraction < 1 )
-						{
-							// if we made it down to within StepHeight, maybe we're on a static prop
-							if ( result.endpos.z > to.z + StepHeight )
-							{
-								return true;
-							}
-						}
-					}
-				}
-
-				float deltaZ = to.z - m_currentNode->GetPosition()->z;
-				// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
-				// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
-				// and distances
-				if ( ( obstacleHeight < MaxTraversableHeight ) || ( deltaZ > ( obstacleHeight - 2.0f ) ) )
-				{
-					obstacleHeight = 0;
-					obstacleStartDist = 0;
-					obstacleEndDist = GenerationStepSize;
-				}
-
 				// we can move here
 				// create a new navigation node, and update current node pointer
-				AddNode( to, toNormal, m_generationDir, m_currentNode, isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
+				AddNode( step->to, step->toNormal, m_generationDir, m_currentNode, step->isOnDisplacement, step->obstacleHeight, step->obstacleStartDist, step->obstacleEndDist );
 
 				return true;
 			}
@@ -16,6 +16,10 @@
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/random.h"
+#include "nav_pathfind.h"
 #ifdef TERROR
 #include "func_simpleladder.h"
 #endif
@@ -63,6 +67,7 @@ CNavMesh::CNavMesh( void )
 	m_editMode = NORMAL;
 	m_bQuitWhenFinished = false;
 	m_hostThreadModeRestoreValue = 0;
+	m_generationCache = NULL;
 	m_placeCount = 0;
 	m_placeName = NULL;
 
@@ -83,6 +88,8 @@ CNavMesh::~CNavMesh()
 	if (m_spawnName)
 		delete [] m_spawnName;
 
+	DestroyGenerationCache();
+
  // !!!!bug!!! why does this crash in linux on server exit
 	for( unsigned int i=0; i<m_placeCount; ++i )
 	{
@@ -102,9 +109,11 @@ void CNavMesh::Reset( void )
 	m_generationMode = GENERATE_NONE;
 	m_currentNode = NULL;
 	ClearWalkableSeeds();
+	DestroyGenerationCache();
 
 	m_isAnalyzed = false;
 	m_isOutOfDate = false;
+	m_isLoadedFromBakedFile = false;
 	m_isEditing = false;
 	m_navPlace = UNDEFINED_PLACE;
 	m_markedArea = NULL;
@@ -252,7 +261,8 @@ void CNavMesh::Update( void )
 
 	if (IsGenerating())
 	{
-		UpdateGeneration( 0.03 );
+		// A scripted generation quits when it's done and nobody is watching, so it can take longer slices
+		UpdateGeneration( m_bQuitWhenFinished ? 1.0f : 0.03f );
 		return; // don't bother trying to draw stuff while we're generating
 	}
 
@@ -2594,6 +2604,17 @@ void CommandNavGenerate( void )
 static ConCommand nav_generate( "nav_generate", CommandNavGenerate, "Generate a Navigation Mesh for the current map and save it to disk.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
 
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavGenerateScripted( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	TheNavMesh->BeginGeneration( false, true );
+}
+static ConCommand nav_generate_scripted( "nav_generate_scripted", CommandNavGenerateScripted, "commandline hook to run a headless nav_generate and then quit.", FCVAR_GAMEDLL | FCVAR_CHEAT | FCVAR_HIDDEN );
+
+
 //--------------------------------------------------------------------------------------------------------------
 void CommandNavGenerateIncremental( void )
 {
@@ -2722,6 +2743,126 @@ void CommandNavCompressID( void )
 }
 static ConCommand nav_compress_id( "nav_compress_id", CommandNavCompressID, "Re-orders area and ladder ID's so they are continuous.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A run of nav_bench_paths searches done by one job, each job with its own search
+ */
+struct NavBenchPathBatch
+{
+	int first;
+	int count;
+};
+
+static CUtlVector< CNavArea * > s_benchPathEnds;			// start and goal area of each path
+static CUtlVector< float > s_benchPathCost;					// cost of each path found by the jobs, or -1
+
+static void BuildBenchPathBatch( NavBenchPathBatch &batch )
+{
+	CNavPathSearch search;
+	ShortestPathCost cost( &search );
+
+	for ( int i = batch.first; i < batch.first + batch.count; ++i )
+	{
+		CNavArea *startArea = s_benchPathEnds[ 2*i ];
+		CNavArea *goalArea = s_benchPathEnds[ 2*i+1 ];
+
+		s_benchPathCost[i] = NavAreaBuildPath( search, startArea, goalArea, NULL, cost ) ? search.GetCostSoFar( goalArea ) : -1.0f;
+	}
+}
+
+CON_COMMAND_F( nav_bench_paths, "Times paths between random pairs of areas, on the main thread and then as parallel jobs. Usage: nav_bench_paths [count] [seed]", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "Need a navigation mesh with at least two areas.\n" );
+		return;
+	}
+
+	int count = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 1000;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 0;
+
+	CUniformRandomStream random;
+	random.SetSeed( seed );
+
+	s_benchPathEnds.SetCount( 2*count );
+	s_benchPathCost.SetCount( count );
+	for ( int i = 0; i < count; ++i )
+	{
+		// NavAreaBuildPath returns before setting any costs when start is goal, which
+		// would leave the main thread reading a stale cost, so don't pick those pairs
+		CNavArea *startArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		CNavArea *goalArea;
+		do
+		{
+			goalArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		}
+		while ( goalArea == startArea );
+
+		s_benchPathEnds[ 2*i ] = startArea;
+		s_benchPathEnds[ 2*i+1 ] = goalArea;
+	}
+
+	// main thread, with the results left in the areas
+	CUtlVector< float > mainCost;
+	mainCost.SetCount( count );
+	ShortestPathCost cost;
+	int found = 0;
+
+	CFastTimer mainTimer;
+	mainTimer.Start();
+	for ( int i = 0; i < count; ++i )
+	{
+		CNavArea *goalArea = s_benchPathEnds[ 2*i+1 ];
+		mainCost[i] = NavAreaBuildPath( s_benchPathEnds[ 2*i ], goalArea, NULL, cost ) ? goalArea->GetCostSoFar() : -1.0f;
+		if ( mainCost[i] >= 0.0f )
+		{
+			++found;
+		}
+	}
+	mainTimer.End();
+
+	// a few batches per thread, so the jobs stay balanced
+	int numThreads = ( g_pThreadPool ? g_pThreadPool->NumThreads() : 0 ) + 1;
+	int numBatches = MIN( count, 4 * numThreads );
+	CUtlVector< NavBenchPathBatch > batches;
+	batches.SetCount( numBatches );
+	for ( int i = 0; i < numBatches; ++i )
+	{
+		batches[i].first = count * i / numBatches;
+		batches[i].count = count * ( i+1 ) / numBatches - batches[i].first;
+	}
+
+	CFastTimer jobTimer;
+	jobTimer.Start();
+	ParallelProcess( "nav_bench_paths", batches.Base(), batches.Count(), &BuildBenchPathBatch );
+	jobTimer.End();
+
+	int mismatches = 0;
+	for ( int i = 0; i < count; ++i )
+	{
+		if ( mainCost[i] != s_benchPathCost[i] )
+		{
+			++mismatches;
+		}
+	}
+
+	float mainMS = mainTimer.GetDuration().GetMillisecondsF();
+	float jobMS = jobTimer.GetDuration().GetMillisecondsF();
+	Msg( "nav_bench_paths: %d paths between %d areas, %d found\n", count, TheNavAreas.Count(), found );
+	Msg( "  main thread: %.2f ms (%.4f ms per path)\n", mainMS, mainMS / count );
+	Msg( "  %d threads: %.2f ms (%.4f ms per path, %.2fx)\n", numThreads, jobMS, jobMS / count, ( jobMS > 0.0f ) ? mainMS / jobMS : 0.0f );
+	if ( mismatches )
+	{
+		Warning( "  %d paths differ between the main thread and the jobs!\n", mismatches );
+	}
+
+	s_benchPathEnds.Purge();
+	s_benchPathCost.Purge();
+}
+
 
 //--------------------------------------------------------------------------------------------------------------
 #ifdef TERROR
@@ -3215,6 +3356,12 @@ void CNavMesh::EndVisibilityComputations( void )
 {
 	g_pNavVisPairHash->RemoveAll();
 
+	// the delta computation walks the visibility lists in area ID order
+	FOR_EACH_VEC( TheNavAreas, sit )
+	{
+		TheNavAreas[ sit ]->SortPotentiallyVisibleAreas();
+	}
+
 	int avgVisLength = 0;
 	int maxVisLength = 0;
 	int minVisLength = 999999999;
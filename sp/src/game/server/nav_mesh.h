@@ -31,6 +31,7 @@
 class CNavArea;
 class CBaseEntity; 
 class CBreakable;
+class CNavGenerationCache;
 
 extern ConVar nav_edit;
 extern ConVar nav_quicksave;
@@ -287,6 +288,10 @@ public:
 	virtual bool Save( void ) const;									// store Navigation Mesh to a file
 	bool IsOutOfDate( void ) const	{ return m_isOutOfDate; }			// return true if the Navigation Mesh is older than the current map version
 
+	bool SaveBaked( void ) const;										// store the loaded mesh in the baked format, for faster loading
+	void WriteBakedMesh( CUtlBuffer &fileBuffer, unsigned int bspSize, unsigned int navSize, unsigned int navTime ) const;
+	bool IsLoadedFromBakedFile( void ) const	{ return m_isLoadedFromBakedFile; }	// return true if the mesh came from the baked file instead of the .nav
+
 	virtual unsigned int GetSubVersionNumber( void ) const;										// returns sub-version number of data format used by derived classes
 	virtual void SaveCustomData( CUtlBuffer &fileBuffer ) const { }								// store custom mesh data for derived classes
 	virtual void LoadCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion ) { }			// load custom mesh data for derived classes
@@ -347,7 +352,7 @@ public:
 	// Auto-generation
 	//
 	#define INCREMENTAL_GENERATION true
-	void BeginGeneration( bool incremental = false );					// initiate the generation process
+	void BeginGeneration( bool incremental = false, bool quitWhenFinished = false );	// initiate the generation process
 	void BeginAnalysis( bool quitWhenFinished = false );						// re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
 
 	bool IsGenerating( void ) const		{ return m_generationMode != GENERATE_NONE; }	// return true while a Navigation Mesh is being generated
@@ -1074,6 +1079,8 @@ private:
 
 	bool m_isLoaded;											// true if a Navigation Mesh has been loaded
 	bool m_isOutOfDate;											// true if the Navigation Mesh is older than the actual BSP
+	bool m_isLoadedFromBakedFile;								// true if the mesh was loaded by LoadBaked()
+	NavErrorType LoadBaked( const char *navFilename );			// load the baked copy of the nav file, if it is current
 	bool m_isAnalyzed;											// true if the Navigation Mesh needs analysis
 
 	enum { HASH_TABLE_SIZE = 256 };
@@ -1158,6 +1165,9 @@ private:
 	NavDirType m_generationDir;
 	CNavNode *AddNode( const Vector &destPos, const Vector &destNormal, NavDirType dir, CNavNode *source, bool isOnDisplacement, float obstacleHeight, float flObstacleStartDist, float flObstacleEndDist );		// add a nav node and connect it, update current node
 
+	CNavGenerationCache *m_generationCache;						// trace results computed ahead of time by threaded generation, or NULL
+	void DestroyGenerationCache( void );
+
 	NavLadderVector m_ladders;									// list of ladder navigation representations
 	void BuildLadders( void );
 	void DestroyLadders( void );
@@ -1219,6 +1229,8 @@ private:
 	int m_sampleTick;											// counter for displaying pseudo-progress while sampling walkable space
 	bool m_bQuitWhenFinished;
 	float m_generationStartTime;
+	GenerationStateType m_generationPhase;						// the state m_generationPhaseStartTime was taken for
+	double m_generationPhaseStartTime;							// when the current generation state began, for the phase times report
 	Extent m_simplifyGenerationExtent;
 
 	char *m_spawnName;											// name of player spawn entity, used to initiate sampling
@@ -18,6 +18,18 @@
 // nav_show_node_id allows you to show the IDs of nodes that didn't get used to create areas.
 #define DEBUG_NAV_NODES 1
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Results of the crouch tests for a node position, see CNavNode::ComputeCrouch()
+ */
+struct NavNodeCrouchInfo
+{
+	bool isTested[ NUM_CORNERS ];
+	bool isBlocked[ NUM_CORNERS ];
+	bool crouch[ NUM_CORNERS ];
+	float groundHeightAboveNode[ NUM_CORNERS ];
+};
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Navigation Nodes.
@@ -65,11 +77,14 @@ public:
 
 	bool IsOnDisplacement( void ) const				{ return m_isOnDisplacement; }
 
+	static void ComputeCrouch( const Vector &pos, NavNodeCrouchInfo *info, unsigned int debugID = 0 );	///< run the crouch tests for a node at pos. Only traces, so safe on a worker thread if debugID is 0.
+	void ApplyCrouch( const NavNodeCrouchInfo &info );				///< set crouch attributes from ComputeCrouch() results
+
 private:
 	CNavNode() {}													// constructor used only for hash lookup
 	friend class CNavMesh;
 
-	bool TestForCrouchArea( NavCornerType cornerNum, const Vector& mins, const Vector& maxs, float *groundHeightAboveNode );
+	static bool TestForCrouchArea( const Vector &pos, unsigned int debugID, const Vector& mins, const Vector& maxs, float *groundHeightAboveNode, bool *isBlocked );
 	void CheckCrouch( void );
 
 	Vector m_pos;													///< position of this node in the world
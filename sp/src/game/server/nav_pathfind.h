@@ -32,6 +32,79 @@ enum RouteType
 };
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The open list, closed list and per-area costs of one NavAreaBuildPath() search.
+ * CNavArea keeps this state in its members and statics, which allows only one search at a time.
+ * A CNavPathSearch keeps its own copy, indexed by area ID, with the open list in a 4-ary heap,
+ * so searches using different CNavPathSearch objects can run on different threads at once
+ * as long as the mesh isn't being edited.
+ */
+class CNavPathSearch
+{
+public:
+	CNavPathSearch( bool writeToAreas = false );
+
+	void Reset( void );											// begin a new search
+
+	bool IsOpen( const CNavArea *area ) const;					// true if on the open list
+	bool IsClosed( const CNavArea *area ) const;				// true if on the closed list
+
+	void AddToOpenList( CNavArea *area );						// the area's total cost must already be set
+	void UpdateOnOpenList( CNavArea *area );					// a smaller total cost has been set, update the area's position
+	bool IsOpenListEmpty( void ) const		{ return m_heap.Count() == 0; }
+	CNavArea *PopOpenList( void );								// remove and return the open area with the smallest total cost
+
+	void AddToClosedList( CNavArea *area );
+	void RemoveFromClosedList( CNavArea *area );
+
+	void SetParent( CNavArea *area, CNavArea *parent, NavTraverseType how = NUM_TRAVERSE_TYPES );
+	CNavArea *GetParent( const CNavArea *area ) const;
+	NavTraverseType GetParentHow( const CNavArea *area ) const;
+
+	void SetTotalCost( CNavArea *area, float value );
+	float GetTotalCost( const CNavArea *area ) const;
+
+	void SetCostSoFar( CNavArea *area, float value );
+	float GetCostSoFar( const CNavArea *area ) const;
+
+	void SetPathLengthSoFar( CNavArea *area, float value );
+	float GetPathLengthSoFar( const CNavArea *area ) const;
+
+	static CNavPathSearch &GetAreaSearch( void );				// the main thread search that also stores its results in the areas
+
+private:
+	struct SearchArea
+	{
+		CNavArea *parent;
+		NavTraverseType parentHow;
+		float totalCost;
+		float costSoFar;
+		float pathLengthSoFar;
+		unsigned int order;										// breaks ties between equal costs in the order the areas were opened
+		int heapIndex;											// position in m_heap, or -1 if not open
+		unsigned int marker;									// the search this entry belongs to
+		bool isClosed;
+	};
+
+	enum { HEAP_ARITY = 4 };
+
+	SearchArea &Touch( const CNavArea *area );					// return the area's entry for this search, initializing it if needed
+	const SearchArea *Find( const CNavArea *area ) const;		// return the area's entry for this search, or NULL if this search hasn't seen it
+
+	bool IsBefore( int heapA, int heapB ) const;
+	void HeapSet( int heapIndex, CNavArea *area );
+	void SiftUp( int heapIndex );
+	void SiftDown( int heapIndex );
+
+	CUtlVector< SearchArea > m_area;							// indexed by area ID
+	CUtlVector< CNavArea * > m_heap;
+	unsigned int m_marker;
+	unsigned int m_order;
+	bool m_writeToAreas;										// also store the costs and parents in the areas, for the old single search interface
+};
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Functor used with NavAreaBuildPath()
@@ -39,6 +112,10 @@ enum RouteType
 class ShortestPathCost
 {
 public:
+	ShortestPathCost( const CNavPathSearch *search = NULL ) : m_search( search )
+	{
+	}
+
 	float operator() ( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length )
 	{
 		if ( fromArea == NULL )
@@ -64,7 +141,7 @@ public:
 				dist = ( area->GetCenter() - fromArea->GetCenter() ).Length();
 			}
 
-			float cost = dist + fromArea->GetCostSoFar();
+			float cost = dist + ( m_search ? m_search->GetCostSoFar( fromArea ) : fromArea->GetCostSoFar() );
 
 			// if this is a "crouch" area, add penalty
 			if ( area->GetAttributes() & NAV_MESH_CROUCH )
@@ -83,6 +160,9 @@ public:
 			return cost;
 		}
 	}
+
+private:
+	const CNavPathSearch *m_search;		// if non-NULL, costs come from this search instead of the areas
 };
 
 //--------------------------------------------------------------------------------------------------------------
@@ -96,10 +176,14 @@ public:
  * If 'goalPos' is NULL, will use the center of 'goalArea' as the goal position.
  * If 'maxPathLength' is nonzero, path building will stop when this length is reached.
  * Returns true if a path exists.
+ *
+ * The search state lives in 'search', so searches with different CNavPathSearch objects can run at
+ * the same time on different threads. The path is read back with search.GetParent(), and the cost
+ * functor must take the cost so far from search.GetCostSoFar().
  */
 #define IGNORE_NAV_BLOCKERS true
 template< typename CostFunctor >
-bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+bool NavAreaBuildPath( CNavPathSearch &search, CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
 {
 	VPROF_BUDGET( "NavAreaBuildPath", "NextBotSpiky" );
 
@@ -108,12 +192,14 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 		*closestArea = startArea;
 	}
 
-	bool isDebug = ( g_DebugPathfindCounter-- > 0 );
+	bool isDebug = ThreadInMainThread() && ( g_DebugPathfindCounter-- > 0 );
 
 	if (startArea == NULL)
 		return false;
 
-	startArea->SetParent( NULL );
+	// start search
+	search.Reset();
+	search.SetParent( startArea, NULL );
 
 	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
 		goalArea = NULL;
@@ -130,29 +216,26 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 	// determine actual goal position
 	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
 
-	// start search
-	CNavArea::ClearSearchLists();
-
 	// compute estimate of path length
 	/// @todo Cost might work as "manhattan distance"
-	startArea->SetTotalCost( (startArea->GetCenter() - actualGoalPos).Length() );
+	search.SetTotalCost( startArea, (startArea->GetCenter() - actualGoalPos).Length() );
 
 	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
 	if (initCost < 0.0f)
 		return false;
-	startArea->SetCostSoFar( initCost );
-	startArea->SetPathLengthSoFar( 0.0 );
+	search.SetCostSoFar( startArea, initCost );
+	search.SetPathLengthSoFar( startArea, 0.0 );
 
-	startArea->AddToOpenList();
+	search.AddToOpenList( startArea );
 
 	// keep track of the area we visit that is closest to the goal
-	float closestAreaDist = startArea->GetTotalCost();
+	float closestAreaDist = search.GetTotalCost( startArea );
 
 	// do A* search
-	while( !CNavArea::IsOpenListEmpty() )
+	while( !search.IsOpenListEmpty() )
 	{
 		// get next area to check
-		CNavArea *area = CNavArea::PopOpenList();
+		CNavArea *area = search.PopOpenList();
 
 		if ( isDebug )
 		{
@@ -329,7 +412,7 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 
 			// don't backtrack
 			Assert( newArea );
-			if ( newArea == area->GetParent() )
+			if ( newArea == search.GetParent( area ) )
 				continue;
 			if ( newArea == area ) // self neighbor?
 				continue;
@@ -346,13 +429,13 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 
 			// Safety check against a bogus functor.  The cost of the path
 			// A...B, C should always be at least as big as the path A...B.
-			Assert( newCostSoFar >= area->GetCostSoFar() );
+			Assert( newCostSoFar >= search.GetCostSoFar( area ) );
 
 			// And now that we've asserted, let's be a bit more defensive.
 			// Make sure that any jump to a new area incurs some pathfinsing
 			// cost, to avoid us spinning our wheels over insignificant cost
 			// benefit, floating point precision bug, or busted cost functor.
-			float minNewCostSoFar = area->GetCostSoFar() * 1.00001 + 0.00001;
+			float minNewCostSoFar = search.GetCostSoFar( area ) * 1.00001 + 0.00001;
 			newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
 				
 			// stop if path length limit reached
@@ -360,14 +443,14 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 			{
 				// keep track of path length so far
 				float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
-				float newLengthSoFar = area->GetPathLengthSoFar() + deltaLength;
+				float newLengthSoFar = search.GetPathLengthSoFar( area ) + deltaLength;
 				if ( newLengthSoFar > maxPathLength )
 					continue;
 				
-				newArea->SetPathLengthSoFar( newLengthSoFar );
+				search.SetPathLengthSoFar( newArea, newLengthSoFar );
 			}
 
-			if ( ( newArea->IsOpen() || newArea->IsClosed() ) && newArea->GetCostSoFar() <= newCostSoFar )
+			if ( ( search.IsOpen( newArea ) || search.IsClosed( newArea ) ) && search.GetCostSoFar( newArea ) <= newCostSoFar )
 			{
 				// this is a worse path - skip it
 				continue;
@@ -385,36 +468,50 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 					closestAreaDist = newCostRemaining;
 				}
 				
-				newArea->SetCostSoFar( newCostSoFar );
-				newArea->SetTotalCost( newCostSoFar + newCostRemaining );
+				search.SetCostSoFar( newArea, newCostSoFar );
+				search.SetTotalCost( newArea, newCostSoFar + newCostRemaining );
 
-				if ( newArea->IsClosed() )
+				if ( search.IsClosed( newArea ) )
 				{
-					newArea->RemoveFromClosedList();
+					search.RemoveFromClosedList( newArea );
 				}
 
-				if ( newArea->IsOpen() )
+				if ( search.IsOpen( newArea ) )
 				{
-					// area already on open list, update the list order to keep costs sorted
-					newArea->UpdateOnOpenList();
+					// area already on open list, update the heap to keep costs sorted
+					search.UpdateOnOpenList( newArea );
 				}
 				else
 				{
-					newArea->AddToOpenList();
+					search.AddToOpenList( newArea );
 				}
 
-				newArea->SetParent( area, how );
+				search.SetParent( newArea, area, how );
 			}
 		}
 
 		// we have searched this area
-		area->AddToClosedList();
+		search.AddToClosedList( area );
 	}
 
 	return false;
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find path from startArea to goalArea on the main thread, leaving the result in the areas themselves:
+ * the path is defined by following CNavArea::GetParent() back from goalArea to startArea, and the cost
+ * functor may use CNavArea::GetCostSoFar().
+ */
+template< typename CostFunctor >
+bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+{
+	Assert( ThreadInMainThread() );
+	return NavAreaBuildPath( CNavPathSearch::GetAreaSearch(), startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Compute distance between two areas. Return -1 if can't reach 'endArea' from 'startArea'.
@@ -929,6 +929,34 @@ bool CBasePlayer::WantsLagCompensationOnEntity( const CBasePlayer *pPlayer, cons
 	return true;
 }
 
+bool CBasePlayer::WantsLagCompensationOnNPC( const CAI_BaseNPC *pNPC, const CUserCmd *pCmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits ) const
+{
+	// If this entity hasn't been transmitted to us and acked, then don't bother lag compensating it.
+	if ( pEntityTransmitBits && !pEntityTransmitBits->Get( pNPC->entindex() ) )
+		return false;
+
+	const Vector &vMyOrigin = GetAbsOrigin();
+	const Vector &vHisOrigin = pNPC->GetAbsOrigin();
+
+	// Same dead zone rule as for players, using how fast the NPC wants to move
+	float maxDistance = 1.5 * pNPC->GetIdealSpeed() * sv_maxunlag.GetFloat();
+	if ( vHisOrigin.DistTo( vMyOrigin ) < maxDistance )
+		return true;
+
+	// If their origin is not within a 45 degree cone in front of us, no need to lag compensate.
+	Vector vForward;
+	AngleVectors( pCmd->viewangles, &vForward );
+	
+	Vector vDiff = vHisOrigin - vMyOrigin;
+	VectorNormalize( vDiff );
+
+	float flCosAngle = 0.707107f;	// 45 degree angle
+	if ( vForward.Dot( vDiff ) < flCosAngle )
+		return false;
+
+	return true;
+}
+
 void CBasePlayer::PauseBonusProgress( bool bPause )
 {
 	m_bPauseBonusProgress = bPause;
@@ -292,6 +292,8 @@ public:
 	// Saves a lot of overhead on the server if we can cull out entities that don't need to lag compensate
 	// (like team members, entities out of our PVS, etc).
 	virtual bool			WantsLagCompensationOnEntity( const CBasePlayer	*pPlayer, const CUserCmd *pCmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits ) const;
+	// Same as above, for NPCs that keep a lag compensation history (see CAI_BaseNPC::ShouldLagCompensate()).
+	virtual bool			WantsLagCompensationOnNPC( const CAI_BaseNPC *pNPC, const CUserCmd *pCmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits ) const;
 
 	virtual void			Spawn( void );
 	virtual void			Activate( void );
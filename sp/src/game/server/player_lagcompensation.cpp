@@ -10,8 +10,8 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
+#include "ai_basenpc.h"
 #include "tier0/vprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -25,6 +25,9 @@
 #define LC_SIZE_CHANGED		(1<<10)
 #define LC_ANIMATION_CHANGED (1<<11)
 
+// Everything the lag compensation manager spends time on, broken down by scope
+#define VPROF_BUDGETGROUP_LAGCOMPENSATION	"CLagCompensationManager"
+
 static ConVar sv_lagcompensation_teleport_dist( "sv_lagcompensation_teleport_dist", "64", FCVAR_DEVELOPMENTONLY | FCVAR_CHEAT, "How far a player got moved by game code before we can't lag compensate their position back" );
 #define LAG_COMPENSATION_EPS_SQR ( 0.1f * 0.1f )
 // Allow 4 units of error ( about 1 / 8 bbox width )
@@ -66,6 +69,7 @@ struct LayerRecord
 	}
 };
 
+
 struct LagRecord
 {
 public:
@@ -114,30 +118,239 @@ public:
 	float					m_masterCycle;
 };
 
+// Animation part of a history record
+struct LagAnimRecord
+{
+	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_masterSequence;
+	float					m_masterCycle;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Movement history of one player or NPC. A fixed size ring of records
+//			indexed by the tick of their simulation time, so a record lives in
+//			slot tick % LAG_TRACK_SIZE and each slot remembers which tick it
+//			holds. Simulation time only ever increases along the track, but an
+//			entity doesn't simulate every tick, so some ticks have no record.
+//			Each field lives in its own array so the look-ups by tick only have
+//			to touch the ticks.
+//-----------------------------------------------------------------------------
+#define LAG_TRACK_SIZE		256		// Power of two. Covers the trimmed history up to 128 tick.
+#define LAG_TRACK_MASK		( LAG_TRACK_SIZE - 1 )
+
+class CLagTrack
+{
+public:
+	CLagTrack( CBaseCombatCharacter *pEntity )
+	{
+		m_hEntity = pEntity;
+		m_iEntIndex = pEntity->entindex();
+		m_nLastUpdateTick = -1;
+		m_bRestore = false;
+		Clear();
+	}
+
+	void Clear()
+	{
+		m_nCount = 0;
+		m_nOldestTick = 0;
+		m_nNewestTick = -1;
+		m_nBreakTick = -1;
+		for ( int i = 0; i < LAG_TRACK_SIZE; i++ )
+		{
+			m_nTick[i] = -1;
+		}
+	}
+
+	int Count() const								{ return m_nCount; }
+	int Newest() const								{ return m_nNewestTick; }
+	int Oldest() const								{ return m_nOldestTick; }
+	static int Slot( int nTick )					{ return nTick & LAG_TRACK_MASK; }
+
+	// Is there a record for this tick?
+	bool HasRecord( int nTick ) const
+	{
+		return ( nTick >= m_nOldestTick && nTick <= m_nNewestTick && m_nTick[ Slot( nTick ) ] == nTick );
+	}
+
+	// Next newer record than nTick, -1 if there isn't one
+	int NextRecord( int nTick ) const;
+
+	// Can the entity be moved back to this record? Everything from here to
+	// the newest record has to be alive and free of teleports.
+	bool IsUsable( int nTick ) const				{ return nTick > m_nBreakTick; }
+
+	void RemoveOlderThan( float flDeadtime );
+	void AddRecord( CBaseCombatCharacter *pEntity, float flTeleportDistanceSqr );
+	int FindRecord( float flTargetTime ) const;
+
+	EHANDLE					m_hEntity;
+	int						m_iEntIndex;
+	int						m_nLastUpdateTick;
+	bool					m_bRestore;
+
+	int						m_nCount;
+	int						m_nOldestTick;
+	int						m_nNewestTick;
+	int						m_nBreakTick;		// newest record we can't backtrack through, -1 if none
+
+	int						m_nTick[LAG_TRACK_SIZE];	// tick of the record in each slot, -1 if none
+	float					m_flSimulationTime[LAG_TRACK_SIZE];
+	int						m_fFlags[LAG_TRACK_SIZE];
+	Vector					m_vecOrigin[LAG_TRACK_SIZE];
+	QAngle					m_vecAngles[LAG_TRACK_SIZE];
+	Vector					m_vecMinsPreScaled[LAG_TRACK_SIZE];
+	Vector					m_vecMaxsPreScaled[LAG_TRACK_SIZE];
+	LagAnimRecord			m_anim[LAG_TRACK_SIZE];
+
+	LagRecord				m_RestoreData;	// entity data before we moved it back
+	LagRecord				m_ChangeData;	// entity data where we moved it back
+};
+
+int CLagTrack::NextRecord( int nTick ) const
+{
+	for ( int i = nTick + 1; i <= m_nNewestTick; i++ )
+	{
+		if ( HasRecord( i ) )
+			return i;
+	}
+	return -1;
+}
+
+void CLagTrack::RemoveOlderThan( float flDeadtime )
+{
+	while ( m_nCount > 0 && m_flSimulationTime[ Slot( m_nOldestTick ) ] < flDeadtime )
+	{
+		m_nCount--;
+		m_nOldestTick = ( m_nCount > 0 ) ? NextRecord( m_nOldestTick ) : m_nNewestTick + 1;
+	}
+}
+
+void CLagTrack::AddRecord( CBaseCombatCharacter *pEntity, float flTeleportDistanceSqr )
+{
+	int nTick = TIME_TO_TICKS( pEntity->GetSimulationTime() );
+	Assert( nTick > m_nNewestTick );
+
+	// Drop the records whose slots are about to be shared with the new one
+	while ( m_nCount > 0 && m_nOldestTick <= nTick - LAG_TRACK_SIZE )
+	{
+		m_nCount--;
+		m_nOldestTick = ( m_nCount > 0 ) ? NextRecord( m_nOldestTick ) : m_nNewestTick + 1;
+	}
+
+	int nPrevTick = ( m_nCount > 0 ) ? m_nNewestTick : -1;
+	if ( m_nCount == 0 )
+	{
+		m_nOldestTick = nTick;
+	}
+	m_nNewestTick = nTick;
+	m_nCount++;
+
+	int i = Slot( nTick );
+	m_nTick[i] = nTick;
+
+	m_fFlags[i] = 0;
+	if ( pEntity->IsAlive() )
+	{
+		m_fFlags[i] |= LC_ALIVE;
+	}
+
+	m_flSimulationTime[i]	= pEntity->GetSimulationTime();
+	m_vecAngles[i]			= pEntity->GetLocalAngles();
+	m_vecOrigin[i]			= pEntity->GetLocalOrigin();
+	m_vecMinsPreScaled[i]	= pEntity->CollisionProp()->OBBMinsPreScaled();
+	m_vecMaxsPreScaled[i]	= pEntity->CollisionProp()->OBBMaxsPreScaled();
+
+	LagAnimRecord &anim = m_anim[i];
+	int layerCount = pEntity->GetNumAnimOverlays();
+	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+	{
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
+		if( currentLayer )
+		{
+			anim.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+			anim.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+			anim.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+			anim.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+		}
+	}
+	anim.m_masterSequence = pEntity->GetSequence();
+	anim.m_masterCycle = pEntity->GetCycle();
+
+	// Work out now whether the history stops here, so backtracking doesn't have to walk it
+	if ( !( m_fFlags[i] & LC_ALIVE ) )
+	{
+		// entity must be alive, lost track
+		m_nBreakTick = nTick;
+	}
+	else if ( nPrevTick != -1 )
+	{
+		Vector delta = m_vecOrigin[i] - m_vecOrigin[ Slot( nPrevTick ) ];
+		if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+		{
+			// lost track, too much difference
+			m_nBreakTick = nPrevTick;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the tick of the newest record at or before flTargetTime, or
+//			the oldest record if they are all newer. Starts at the target's own
+//			tick and steps back over the ticks the entity didn't simulate in.
+//-----------------------------------------------------------------------------
+int CLagTrack::FindRecord( float flTargetTime ) const
+{
+	Assert( m_nCount > 0 );
+
+	int nTick = MIN( TIME_TO_TICKS( flTargetTime ), m_nNewestTick );
+	for ( ; nTick > m_nOldestTick; nTick-- )
+	{
+		if ( HasRecord( nTick ) && m_flSimulationTime[ Slot( nTick ) ] <= flTargetTime )
+			return nTick;
+	}
+
+	return m_nOldestTick;
+}
+
+static const char *GetLagCompensationName( CBaseCombatCharacter *pEntity )
+{
+	return pEntity->IsPlayer() ? ToBasePlayer( pEntity )->GetPlayerName() : pEntity->GetDebugName();
+}
+
+static unsigned int GetLagCompensationMask( CBaseCombatCharacter *pEntity )
+{
+	return pEntity->IsPlayer() ? MASK_PLAYERSOLID : MASK_NPCSOLID;
+}
+
 
 //
-// Try to take the player from his current origin to vWantedPos.
-// If it can't get there, leave the player where he is.
+// Try to take the entity from its current origin to vWantedPos.
+// If it can't get there, leave the entity where it is.
 // 
 
 ConVar sv_unlag_debug( "sv_unlag_debug", "0", FCVAR_GAMEDLL | FCVAR_DEVELOPMENTONLY );
 
 float g_flFractionScale = 0.95;
-static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
+static void RestoreEntityTo( CBaseCombatCharacter *pEntity, const Vector &vWantedPos )
 {
 	// Try to move to the wanted position from our current position.
 	trace_t tr;
-	VPROF_BUDGET( "RestorePlayerTo", "CLagCompensationManager" );
-	UTIL_TraceEntity( pPlayer, vWantedPos, vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+	VPROF_BUDGET( "RestoreEntityTo", VPROF_BUDGETGROUP_LAGCOMPENSATION );
+
+	unsigned int mask = GetLagCompensationMask( pEntity );
+	int collisionGroup = pEntity->IsPlayer() ? COLLISION_GROUP_PLAYER_MOVEMENT : pEntity->GetCollisionGroup();
+
+	UTIL_TraceEntity( pEntity, vWantedPos, vWantedPos, mask, pEntity, collisionGroup, &tr );
 	if ( tr.startsolid || tr.allsolid )
 	{
 		if ( sv_unlag_debug.GetBool() )
 		{
-			DevMsg( "RestorePlayerTo() could not restore player position for client \"%s\" ( %.1f %.1f %.1f )\n",
-					pPlayer->GetPlayerName(), vWantedPos.x, vWantedPos.y, vWantedPos.z );
+			DevMsg( "RestoreEntityTo() could not restore position for \"%s\" ( %.1f %.1f %.1f )\n",
+					GetLagCompensationName( pEntity ), vWantedPos.x, vWantedPos.y, vWantedPos.z );
 		}
 
-		UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), vWantedPos, MASK_PLAYERSOLID, pPlayer, COLLISION_GROUP_PLAYER_MOVEMENT, &tr );
+		UTIL_TraceEntity( pEntity, pEntity->GetLocalOrigin(), vWantedPos, mask, pEntity, collisionGroup, &tr );
 		if ( tr.startsolid || tr.allsolid )
 		{
 			// In this case, the guy got stuck back wherever we lag compensated him to. Nasty.
@@ -149,8 +362,8 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 		{
 			// We can get to a valid place, but not all the way back to where we were.
 			Vector vPos;
-			VectorLerp( pPlayer->GetLocalOrigin(), vWantedPos, tr.fraction * g_flFractionScale, vPos );
-			UTIL_SetOrigin( pPlayer, vPos, true );
+			VectorLerp( pEntity->GetLocalOrigin(), vWantedPos, tr.fraction * g_flFractionScale, vPos );
+			UTIL_SetOrigin( pEntity, vPos, true );
 
 			if ( sv_unlag_debug.GetBool() )
 				DevMsg( " restore got most of the way\n" );
@@ -158,8 +371,8 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 	}
 	else
 	{
-		// Cool, the player can go back to whence he came.
-		UTIL_SetOrigin( pPlayer, tr.endpos, true );
+		// Cool, the entity can go back to whence it came.
+		UTIL_SetOrigin( pEntity, tr.endpos, true );
 	}
 }
 
@@ -172,6 +385,7 @@ class CLagCompensationManager : public CAutoGameSystemPerFrame, public ILagCompe
 public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
+		memset( m_pTracks, 0, sizeof( m_pTracks ) );
 	}
 
 	// IServerSystem stuff
@@ -195,23 +409,26 @@ public:
 	void			FinishLagCompensation( CBasePlayer *player );
 
 private:
-	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	void			BacktrackEntity( CBaseCombatCharacter *pEntity, CLagTrack *track, float flTargetTime );
+	void			RestoreEntity( CBaseCombatCharacter *pEntity, CLagTrack *track );
+
+	void			UpdateTrack( CBaseCombatCharacter *pEntity, float flDeadtime );
+	CLagTrack		*GetTrack( CBaseEntity *pEntity ) const;
 
 	void ClearHistory()
 	{
-		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+		m_RestoreTracks.RemoveAll();
+		m_Tracks.PurgeAndDeleteElements();
+		memset( m_pTracks, 0, sizeof( m_pTracks ) );
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history for each player and lag compensated NPC, by entity index
+	CLagTrack				*m_pTracks[ MAX_EDICTS ];
+	CUtlVector<CLagTrack *>	m_Tracks;
 
 	// Scratchpad for determining what needs to be restored
-	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
+	CUtlVector<CLagTrack *>	m_RestoreTracks;
 	bool					m_bNeedToRestore;
-	
-	LagRecord				m_RestoreData[ MAX_PLAYERS ];	// player data before we moved him back
-	LagRecord				m_ChangeData[ MAX_PLAYERS ];	// player data where we moved him back
 
 	CBasePlayer				*m_pCurrentPlayer;	// The player we are doing lag compensation for
 
@@ -222,6 +439,59 @@ static CLagCompensationManager g_LagCompensationManager( "CLagCompensationManage
 ILagCompensationManager *lagcompensation = &g_LagCompensationManager;
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns the history of an entity, NULL if it doesn't have one
+//-----------------------------------------------------------------------------
+CLagTrack *CLagCompensationManager::GetTrack( CBaseEntity *pEntity ) const
+{
+	int index = pEntity->entindex();
+	if ( index <= 0 || index >= MAX_EDICTS )
+		return NULL;
+
+	CLagTrack *track = m_pTracks[ index ];
+	if ( !track || track->m_hEntity.Get() != pEntity )
+		return NULL;
+
+	return track;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Trims an entity's history and adds its current state to it
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::UpdateTrack( CBaseCombatCharacter *pEntity, float flDeadtime )
+{
+	int index = pEntity->entindex();
+	CLagTrack *track = m_pTracks[ index ];
+	if ( !track )
+	{
+		track = new CLagTrack( pEntity );
+		m_pTracks[ index ] = track;
+		m_Tracks.AddToTail( track );
+	}
+	else if ( track->m_hEntity.Get() != pEntity )
+	{
+		// Someone else has this slot now
+		track->m_hEntity = pEntity;
+		track->Clear();
+	}
+
+	track->m_nLastUpdateTick = gpGlobals->tickcount;
+
+	// remove tail records that are too old
+	track->RemoveOlderThan( flDeadtime );
+
+	// check if head has same simulation time
+	if ( track->Count() > 0 )
+	{
+		// check if entity changed simulation time since last time updated
+		if ( TIME_TO_TICKS( pEntity->GetSimulationTime() ) <= track->Newest() )
+			return; // don't add new entry for same or older time
+	}
+
+	// add new record to the track
+	track->AddRecord( pEntity, m_flTeleportDistanceSqr );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Called once per frame after all entities have had a chance to think
 //-----------------------------------------------------------------------------
@@ -235,84 +505,42 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	
 	m_flTeleportDistanceSqr = sv_lagcompensation_teleport_dist.GetFloat() * sv_lagcompensation_teleport_dist.GetFloat();
 
-	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
+	VPROF_BUDGET( "FrameUpdatePostEntityThink", VPROF_BUDGETGROUP_LAGCOMPENSATION );
 
 	// remove all records before that time:
-	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
+	float flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
-
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
-
-		if ( !pPlayer )
-		{
-			if ( track->Count() > 0 )
-			{
-				track->RemoveAll();
-			}
-
-			continue;
-		}
-
-		Assert( track->Count() < 1000 ); // insanity check
-
-		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		if ( pPlayer )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			UpdateTrack( pPlayer, flDeadtime );
 		}
+	}
 
-		// check if head has same simulation time
-		if ( track->Count() > 0 )
-		{
-			LagRecord &head = track->Element( track->Head() );
-
-			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
-				continue; // don't add new entry for same or older time
-		}
-
-		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
-
-		record.m_fFlags = 0;
-		if ( pPlayer->IsAlive() )
+	// And the NPCs that asked for it
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pNPC = ppAIs[i];
+		if ( pNPC && pNPC->ShouldLagCompensate() && pNPC->edict() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			UpdateTrack( pNPC, flDeadtime );
 		}
+	}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+	// Drop the history of anything that's gone or opted out
+	for ( int i = m_Tracks.Count() - 1; i >= 0; i-- )
+	{
+		CLagTrack *track = m_Tracks[i];
+		if ( track->m_nLastUpdateTick == gpGlobals->tickcount )
+			continue;
 
-		int layerCount = pPlayer->GetNumAnimOverlays();
-		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
-		{
-			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-			if( currentLayer )
-			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
-			}
-		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+		m_pTracks[ track->m_iEntIndex ] = NULL;
+		m_Tracks.FastRemove( i );
+		delete track;
 	}
 
 	//Clear the current player.
@@ -331,8 +559,12 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		return;
 	}
 
-	// Assume no players need to be restored
-	m_RestorePlayer.ClearAll();
+	// Assume no entities need to be restored
+	for ( int i = 0; i < m_RestoreTracks.Count(); i++ )
+	{
+		m_RestoreTracks[i]->m_bRestore = false;
+	}
+	m_RestoreTracks.RemoveAll();
 	m_bNeedToRestore = false;
 
 	m_pCurrentPlayer = player;
@@ -346,9 +578,7 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		return;
 
 	// NOTE: Put this here so that it won't show up in single player mode.
-	VPROF_BUDGET( "StartLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING );
-	Q_memset( m_RestoreData, 0, sizeof( m_RestoreData ) );
-	Q_memset( m_ChangeData, 0, sizeof( m_ChangeData ) );
+	VPROF_BUDGET( "StartLagCompensation", VPROF_BUDGETGROUP_LAGCOMPENSATION );
 
 	// Get true latency
 
@@ -406,109 +636,103 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
+		CLagTrack *track = GetTrack( pPlayer );
+		if ( !track )
+			continue;
+
 		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		BacktrackEntity( pPlayer, track, TICKS_TO_TIME( targettick ) );
+	}
+
+	// Then the NPCs we keep a history for
+	for ( int i = 0; i < m_Tracks.Count(); i++ )
+	{
+		CLagTrack *track = m_Tracks[i];
+		CBaseEntity *pEntity = track->m_hEntity.Get();
+		CAI_BaseNPC *pNPC = pEntity ? pEntity->MyNPCPointer() : NULL;
+		if ( !pNPC )
+			continue;
+
+		if ( !player->WantsLagCompensationOnNPC( pNPC, cmd, pEntityTransmitBits ) )
+			continue;
+
+		BacktrackEntity( pNPC, track, TICKS_TO_TIME( targettick ) );
 	}
 }
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+void CLagCompensationManager::BacktrackEntity( CBaseCombatCharacter *pEntity, CLagTrack *track, float flTargetTime )
 {
 	Vector org;
 	Vector minsPreScaled;
 	Vector maxsPreScaled;
 	QAngle ang;
 
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
-
-	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	VPROF_BUDGET( pEntity->IsPlayer() ? "BacktrackPlayer" : "BacktrackNPC", VPROF_BUDGETGROUP_LAGCOMPENSATION );
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
 		return;
 
-	int curr = track->Head();
-
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
-
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	// The newest record has to be within reach of where the entity is now
+	int newest = track->Newest();
+	if ( !( track->m_fFlags[ CLagTrack::Slot( newest ) ] & LC_ALIVE ) )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// entity must be alive, lost track
+		return;
 	}
 
-	Assert( record );
-
-	if ( !record )
+	Vector delta = track->m_vecOrigin[ CLagTrack::Slot( newest ) ] - pEntity->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
 	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
+		// lost track, too much difference
+		return; 
+	}
 
-		return; // that should never happen
+	// find a context smaller than target time, the oldest one if there isn't any
+	int recordTick = track->FindRecord( flTargetTime );
+	if ( !track->IsUsable( recordTick ) )
+	{
+		// it died or teleported somewhere between then and now
+		return;
 	}
 
+	const int record = CLagTrack::Slot( recordTick );
+	const int prevRecordTick = track->NextRecord( recordTick );
+	const int prevRecord = ( prevRecordTick != -1 ) ? CLagTrack::Slot( prevRecordTick ) : -1;
+
+	const float recordTime = track->m_flSimulationTime[record];
+
 	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	if ( prevRecord != -1 && 
+		 (recordTime < flTargetTime) &&
+		 (recordTime < track->m_flSimulationTime[prevRecord]) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
+		const float prevRecordTime = track->m_flSimulationTime[prevRecord];
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( prevRecordTime > recordTime );
+		Assert( flTargetTime < prevRecordTime );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		frac = ( flTargetTime - recordTime ) / 
+			( prevRecordTime - recordTime );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+		ang				= Lerp( frac, track->m_vecAngles[record], track->m_vecAngles[prevRecord] );
+		org				= Lerp( frac, track->m_vecOrigin[record], track->m_vecOrigin[prevRecord] );
+		minsPreScaled	= Lerp( frac, track->m_vecMinsPreScaled[record], track->m_vecMinsPreScaled[prevRecord] );
+		maxsPreScaled	= Lerp( frac, track->m_vecMaxsPreScaled[record], track->m_vecMaxsPreScaled[prevRecord] );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		org				= track->m_vecOrigin[record];
+		ang				= track->m_vecAngles[record];
+		minsPreScaled	= track->m_vecMinsPreScaled[record];
+		maxsPreScaled	= track->m_vecMaxsPreScaled[record];
 	}
 
 	// See if this is still a valid position for us to teleport to
@@ -516,37 +740,36 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	{
 		// Try to move to the wanted position from our current position.
 		trace_t tr;
-		UTIL_TraceEntity( pPlayer, org, org, MASK_PLAYERSOLID, &tr );
+		UTIL_TraceEntity( pEntity, org, org, GetLagCompensationMask( pEntity ), &tr );
 		if ( tr.startsolid || tr.allsolid )
 		{
 			if ( sv_unlag_debug.GetBool() )
-				DevMsg( "WARNING: BackupPlayer trying to back player into a bad position - client %s\n", pPlayer->GetPlayerName() );
+				DevMsg( "WARNING: BackupPlayer trying to back player into a bad position - %s\n", GetLagCompensationName( pEntity ) );
 
-			CBasePlayer *pHitPlayer = dynamic_cast<CBasePlayer *>( tr.m_pEnt );
+			CBaseCombatCharacter *pHitEntity = tr.m_pEnt ? tr.m_pEnt->MyCombatCharacterPointer() : NULL;
+			CLagTrack *pHitTrack = pHitEntity ? GetTrack( pHitEntity ) : NULL;
 
 			// don't lag compensate the current player
-			if ( pHitPlayer && ( pHitPlayer != m_pCurrentPlayer ) )	
+			if ( pHitTrack && ( pHitEntity != m_pCurrentPlayer ) )	
 			{
-				// If we haven't backtracked this player, do it now
+				// If we haven't backtracked this entity, do it now
 				// this deliberately ignores WantsLagCompensationOnEntity.
-				if ( !m_RestorePlayer.Get( pHitPlayer->entindex() - 1 ) )
+				if ( !pHitTrack->m_bRestore )
 				{
-					// prevent recursion - save a copy of m_RestorePlayer,
-					// pretend that this player is off-limits
-					int pl_index = pPlayer->entindex() - 1;
+					// prevent recursion - pretend that this entity is off-limits
 
 					// Temp turn this flag on
-					m_RestorePlayer.Set( pl_index );
+					track->m_bRestore = true;
 
-					BacktrackPlayer( pHitPlayer, flTargetTime );
+					BacktrackEntity( pHitEntity, pHitTrack, flTargetTime );
 
 					// Remove the temp flag
-					m_RestorePlayer.Clear( pl_index );
+					track->m_bRestore = false;
 				}				
 			}
 
 			// now trace us back as far as we can go
-			UTIL_TraceEntity( pPlayer, pPlayer->GetLocalOrigin(), org, MASK_PLAYERSOLID, &tr );
+			UTIL_TraceEntity( pEntity, pEntity->GetLocalOrigin(), org, GetLagCompensationMask( pEntity ), &tr );
 
 			if ( tr.startsolid || tr.allsolid )
 			{
@@ -559,7 +782,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			{
 				// We can get to a valid place, but not all the way to the target
 				Vector vPos;
-				VectorLerp( pPlayer->GetLocalOrigin(), org, tr.fraction * g_flFractionScale, vPos );
+				VectorLerp( pEntity->GetLocalOrigin(), org, tr.fraction * g_flFractionScale, vPos );
 				
 				// This is as close as we're going to get
 				org = vPos;
@@ -570,34 +793,34 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		}
 	}
 	
-	// See if this represents a change for the player
+	// See if this represents a change for the entity
 	int flags = 0;
-	LagRecord *restore = &m_RestoreData[ pl_index ];
-	LagRecord *change  = &m_ChangeData[ pl_index ];
+	LagRecord *restore = &track->m_RestoreData;
+	LagRecord *change  = &track->m_ChangeData;
 
-	QAngle angdiff = pPlayer->GetLocalAngles() - ang;
-	Vector orgdiff = pPlayer->GetLocalOrigin() - org;
+	QAngle angdiff = pEntity->GetLocalAngles() - ang;
+	Vector orgdiff = pEntity->GetLocalOrigin() - org;
 
 	// Always remember the pristine simulation time in case we need to restore it.
-	restore->m_flSimulationTime = pPlayer->GetSimulationTime();
+	restore->m_flSimulationTime = pEntity->GetSimulationTime();
 
 	if ( angdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ANGLES_CHANGED;
-		restore->m_vecAngles = pPlayer->GetLocalAngles();
-		pPlayer->SetLocalAngles( ang );
+		restore->m_vecAngles = pEntity->GetLocalAngles();
+		pEntity->SetLocalAngles( ang );
 		change->m_vecAngles = ang;
 	}
 
 	// Use absolute equality here
-	if ( minsPreScaled != pPlayer->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pPlayer->CollisionProp()->OBBMaxsPreScaled() )
+	if ( minsPreScaled != pEntity->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pEntity->CollisionProp()->OBBMaxsPreScaled() )
 	{
 		flags |= LC_SIZE_CHANGED;
 
-		restore->m_vecMinsPreScaled = pPlayer->CollisionProp()->OBBMinsPreScaled();
-		restore->m_vecMaxsPreScaled = pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		restore->m_vecMinsPreScaled = pEntity->CollisionProp()->OBBMinsPreScaled();
+		restore->m_vecMaxsPreScaled = pEntity->CollisionProp()->OBBMaxsPreScaled();
 		
-		pPlayer->SetSize( minsPreScaled, maxsPreScaled );
+		pEntity->SetSize( minsPreScaled, maxsPreScaled );
 		
 		change->m_vecMinsPreScaled = minsPreScaled;
 		change->m_vecMaxsPreScaled = maxsPreScaled;
@@ -607,8 +830,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if ( orgdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ORIGIN_CHANGED;
-		restore->m_vecOrigin = pPlayer->GetLocalOrigin();
-		pPlayer->SetLocalOrigin( org );
+		restore->m_vecOrigin = pEntity->GetLocalOrigin();
+		pEntity->SetLocalOrigin( org );
 		change->m_vecOrigin = org;
 	}
 
@@ -616,11 +839,14 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	// standing still, but you breathe even on the server.
 	// This is quicker than actually comparing all bazillion floats.
 	flags |= LC_ANIMATION_CHANGED;
-	restore->m_masterSequence = pPlayer->GetSequence();
-	restore->m_masterCycle = pPlayer->GetCycle();
+	restore->m_masterSequence = pEntity->GetSequence();
+	restore->m_masterCycle = pEntity->GetCycle();
+
+	const LagAnimRecord &recordAnim = track->m_anim[record];
+	const LagAnimRecord *prevRecordAnim = ( prevRecord != -1 ) ? &track->m_anim[prevRecord] : NULL;
 
 	bool interpolationAllowed = false;
-	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
+	if( prevRecordAnim && (recordAnim.m_masterSequence == prevRecordAnim->m_masterSequence) )
 	{
 		// If the master state changes, all layers will be invalid too, so don't interp (ya know, interp barely ever happens anyway)
 		interpolationAllowed = true;
@@ -632,33 +858,33 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if( frac > 0.0f && interpolationAllowed )
 	{
 		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+		pEntity->SetSequence( Lerp( frac, recordAnim.m_masterSequence, prevRecordAnim->m_masterSequence ) );
+		pEntity->SetCycle( Lerp( frac, recordAnim.m_masterCycle, prevRecordAnim->m_masterCycle ) );
 
-		if( record->m_masterCycle > prevRecord->m_masterCycle )
+		if( recordAnim.m_masterCycle > prevRecordAnim->m_masterCycle )
 		{
 			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
 			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
-			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
-			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
+			float newCycle = Lerp( frac, recordAnim.m_masterCycle, prevRecordAnim->m_masterCycle + 1 );
+			pEntity->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
 		}
 		else
 		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+			pEntity->SetCycle( Lerp( frac, recordAnim.m_masterCycle, prevRecordAnim->m_masterCycle ) );
 		}
 	}
 	if( !interpolatedMasters )
 	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
+		pEntity->SetSequence(recordAnim.m_masterSequence);
+		pEntity->SetCycle(recordAnim.m_masterCycle);
 	}
 
 	////////////////////////
 	// Now do all the layers
-	int layerCount = pPlayer->GetNumAnimOverlays();
+	int layerCount = pEntity->GetNumAnimOverlays();
 	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 	{
-		CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
 		if( currentLayer )
 		{
 			restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
@@ -669,8 +895,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = recordAnim.m_layerRecords[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = prevRecordAnim->m_layerRecords[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -696,10 +922,10 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			if( !interpolated )
 			{
 				//Either no interp, or interp failed.  Just use record.
-				currentLayer->m_flCycle = record->m_layerRecords[layerIndex].m_cycle;
-				currentLayer->m_nOrder = record->m_layerRecords[layerIndex].m_order;
-				currentLayer->m_nSequence = record->m_layerRecords[layerIndex].m_sequence;
-				currentLayer->m_flWeight = record->m_layerRecords[layerIndex].m_weight;
+				currentLayer->m_flCycle = recordAnim.m_layerRecords[layerIndex].m_cycle;
+				currentLayer->m_nOrder = recordAnim.m_layerRecords[layerIndex].m_order;
+				currentLayer->m_nSequence = recordAnim.m_layerRecords[layerIndex].m_sequence;
+				currentLayer->m_flWeight = recordAnim.m_layerRecords[layerIndex].m_weight;
 			}
 		}
 	}
@@ -708,126 +934,138 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 		return; // we didn't change anything
 
 	if ( sv_lagflushbonecache.GetBool() )
-		pPlayer->InvalidateBoneCache();
+		pEntity->InvalidateBoneCache();
 
 	/*char text[256]; Q_snprintf( text, sizeof(text), "time %.2f", flTargetTime );
-	pPlayer->DrawServerHitboxes( 10 );
+	pEntity->DrawServerHitboxes( 10 );
 	NDebugOverlay::Text( org, text, false, 10 );
-	NDebugOverlay::EntityBounds( pPlayer, 255, 0, 0, 32, 10 ); */
+	NDebugOverlay::EntityBounds( pEntity, 255, 0, 0, 32, 10 ); */
 
-	m_RestorePlayer.Set( pl_index ); //remember that we changed this player
-	m_bNeedToRestore = true;  // we changed at least one player
+	//remember that we changed this entity
+	track->m_bRestore = true;
+	if ( !m_RestoreTracks.HasElement( track ) )
+	{
+		m_RestoreTracks.AddToTail( track );
+	}
+	m_bNeedToRestore = true;  // we changed at least one entity
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
 
 	if( sv_showlagcompensation.GetInt() == 1 )
 	{
-		pPlayer->DrawServerHitboxes(4, true);
+		pEntity->DrawServerHitboxes(4, true);
 	}
 }
 
 
 void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 {
-	VPROF_BUDGET_FLAGS( "FinishLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING, BUDGETFLAG_CLIENT|BUDGETFLAG_SERVER );
+	VPROF_BUDGET_FLAGS( "FinishLagCompensation", VPROF_BUDGETGROUP_LAGCOMPENSATION, BUDGETFLAG_CLIENT|BUDGETFLAG_SERVER );
 
 	m_pCurrentPlayer = NULL;
 
 	if ( !m_bNeedToRestore )
-		return; // no player was changed at all
+		return; // no entity was changed at all
 
-	// Iterate all active players
-	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	// Iterate all the entities we moved
+	for ( int i = 0; i < m_RestoreTracks.Count(); i++ )
 	{
-		int pl_index = i - 1;
-		
-		if ( !m_RestorePlayer.Get( pl_index ) )
+		CLagTrack *track = m_RestoreTracks[i];
+		if ( !track->m_bRestore )
 		{
-			// player wasn't changed by lag compensation
+			// entity wasn't changed by lag compensation
 			continue;
 		}
 
-		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
-		if ( !pPlayer )
+		track->m_bRestore = false;
+
+		CBaseEntity *pEntity = track->m_hEntity.Get();
+		CBaseCombatCharacter *pBCC = pEntity ? pEntity->MyCombatCharacterPointer() : NULL;
+		if ( !pBCC )
 		{
 			continue;
 		}
 
-		LagRecord *restore = &m_RestoreData[ pl_index ];
-		LagRecord *change  = &m_ChangeData[ pl_index ];
+		RestoreEntity( pBCC, track );
+	}
+
+	m_RestoreTracks.RemoveAll();
+}
+
+void CLagCompensationManager::RestoreEntity( CBaseCombatCharacter *pEntity, CLagTrack *track )
+{
+	LagRecord *restore = &track->m_RestoreData;
+	LagRecord *change  = &track->m_ChangeData;
 
-		bool restoreSimulationTime = false;
+	bool restoreSimulationTime = false;
 
-		if ( restore->m_fFlags & LC_SIZE_CHANGED )
+	if ( restore->m_fFlags & LC_SIZE_CHANGED )
+	{
+		restoreSimulationTime = true;
+
+		// see if simulation made any changes, if no, then do the restore, otherwise,
+		//  leave new values in
+		if ( pEntity->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
+			pEntity->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
 		{
-			restoreSimulationTime = true;
-	
-			// see if simulation made any changes, if no, then do the restore, otherwise,
-			//  leave new values in
-			if ( pPlayer->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
-				pPlayer->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
-			{
-				// Restore it
-				pPlayer->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
-			}
+			// Restore it
+			pEntity->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
+		}
 #ifdef STAGING_ONLY
-			else
-			{
-				Warning( "Should we really not restore the size?\n" );
-			}
-#endif
+		else
+		{
+			Warning( "Should we really not restore the size?\n" );
 		}
+#endif
+	}
 
-		if ( restore->m_fFlags & LC_ANGLES_CHANGED )
-		{		   
-			restoreSimulationTime = true;
+	if ( restore->m_fFlags & LC_ANGLES_CHANGED )
+	{		   
+		restoreSimulationTime = true;
 
-			if ( pPlayer->GetLocalAngles() == change->m_vecAngles )
-			{
-				pPlayer->SetLocalAngles( restore->m_vecAngles );
-			}
+		if ( pEntity->GetLocalAngles() == change->m_vecAngles )
+		{
+			pEntity->SetLocalAngles( restore->m_vecAngles );
 		}
+	}
 
-		if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
-		{
-			restoreSimulationTime = true;
+	if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			// Okay, let's see if we can do something reasonable with the change
-			Vector delta = pPlayer->GetLocalOrigin() - change->m_vecOrigin;
-			
-			// If it moved really far, just leave the player in the new spot!!!
-			if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
-			{
-				RestorePlayerTo( pPlayer, restore->m_vecOrigin + delta );
-			}
+		// Okay, let's see if we can do something reasonable with the change
+		Vector delta = pEntity->GetLocalOrigin() - change->m_vecOrigin;
+		
+		// If it moved really far, just leave the entity in the new spot!!!
+		if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
+		{
+			RestoreEntityTo( pEntity, restore->m_vecOrigin + delta );
 		}
+	}
 
-		if( restore->m_fFlags & LC_ANIMATION_CHANGED )
-		{
-			restoreSimulationTime = true;
+	if( restore->m_fFlags & LC_ANIMATION_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			pPlayer->SetSequence(restore->m_masterSequence);
-			pPlayer->SetCycle(restore->m_masterCycle);
+		pEntity->SetSequence(restore->m_masterSequence);
+		pEntity->SetCycle(restore->m_masterCycle);
 
-			int layerCount = pPlayer->GetNumAnimOverlays();
-			for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		int layerCount = pEntity->GetNumAnimOverlays();
+		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		{
+			CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
+			if( currentLayer )
 			{
-				CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-				if( currentLayer )
-				{
-					currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
-					currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
-					currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
-					currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
-				}
+				currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
+				currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
+				currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
+				currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
 			}
 		}
+	}
 
-		if ( restoreSimulationTime )
-		{
-			pPlayer->SetSimulationTime( restore->m_flSimulationTime );
-		}
+	if ( restoreSimulationTime )
+	{
+		pEntity->SetSimulationTime( restore->m_flSimulationTime );
 	}
 }
-
-
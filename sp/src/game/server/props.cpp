@@ -3139,6 +3139,7 @@ void CPhysicsProp::Spawn( )
 	{
 #ifdef MAPBASE
 		m_iClassname = gm_isz_class_PropPhysics;
+		gEntList.UpdateEntityIndex( this );
 #else
 		SetClassname( "prop_physics" );
 #endif
@@ -3154,6 +3155,7 @@ void CPhysicsProp::Spawn( )
 	if ( EntIsClass( this, gm_isz_class_PropPhysicsOverride ) )
 	{
 		m_iClassname = gm_isz_class_PropPhysics;
+		gEntList.UpdateEntityIndex( this );
 	}
 #else
 	if ( FClassnameIs( this, "prop_physics_override") )
@@ -21,6 +21,10 @@
 #define SOUNDLISTTYPE_FREE		1
 #define SOUNDLISTTYPE_ACTIVE	2
 
+// Size of the XY cells sounds are bucketed into. Hearing distance is the sound's
+// volume, so a typical gunshot covers a handful of cells.
+#define SOUND_INDEX_CELL_SIZE	512.0f
+
 
 
 LINK_ENTITY_TO_CLASS( soundent, CSoundEnt );
@@ -96,6 +100,19 @@ void CSound::Reset ( void )
 	m_iType			= 0;
 	m_iVolume		= 0;
 	m_iNext			= SOUNDLIST_EMPTY;
+
+	CSoundEnt::InvalidateSoundIndex();
+}
+
+//=========================================================
+// SetSoundOrigin - moves the sound. The sound index buckets
+// by position, so it has to be rebuilt.
+//=========================================================
+void CSound::SetSoundOrigin( const Vector &vecOrigin )
+{
+	m_vecOrigin = vecOrigin;
+
+	CSoundEnt::InvalidateSoundIndex();
 }
 
 //=========================================================
@@ -249,6 +266,7 @@ void CSoundEnt::ShutdownSoundEnt()
 //-----------------------------------------------------------------------------
 CSoundEnt::CSoundEnt()
 {
+	m_bSoundIndexDirty = true;
 }
 
 CSoundEnt::~CSoundEnt()
@@ -278,6 +296,7 @@ void CSoundEnt::OnRestore()
 		UTIL_Remove( g_pSoundEnt );
 	}
 	g_pSoundEnt = this;
+	m_bSoundIndexDirty = true;
 }
 
 
@@ -410,6 +429,8 @@ void CSoundEnt::FreeSound ( int iSound, int iPrevious )
 	// make iSound the head of the Free list.
 	g_pSoundEnt->m_SoundPool[ iSound ].m_iNext = g_pSoundEnt->m_iFreeSound;
 	g_pSoundEnt->m_iFreeSound = iSound;
+
+	g_pSoundEnt->m_bSoundIndexDirty = true;
 }
 
 //=========================================================
@@ -440,6 +461,8 @@ int CSoundEnt::IAllocSound( void )
 
 	m_iActiveSound = iNewSound;// now make the new sound the top of the active list. You're done.
 
+	m_bSoundIndexDirty = true;
+
 #ifdef DEBUG
 	m_SoundPool[ iNewSound ].m_iMyIndex = iNewSound;
 #endif // DEBUG
@@ -490,6 +513,9 @@ void CSoundEnt::InsertSound ( int iType, const Vector &vecOrigin, int iVolume, f
 	pSound->m_hTarget.Set( pSoundTarget );
 	pSound->m_ownerChannelIndex = soundChannelIndex;
 
+	// FindOrAllocateSound() may have reused a sound already in the index
+	g_pSoundEnt->m_bSoundIndexDirty = true;
+
 	// Keep track of whether this sound had an owner when it was made. If the sound has a long duration,
 	// the owner could disappear by the time someone hears this sound, so we have to look at this boolean
 	// and throw out sounds who have a NULL owner but this field set to true. (sjb) 12/2/2005
@@ -545,6 +571,7 @@ void CSoundEnt::Initialize ( void )
 	m_cLastActiveSounds;
 	m_iFreeSound = 0;
 	m_iActiveSound = SOUNDLIST_EMPTY;
+	m_bSoundIndexDirty = true;
 
 	// In SP, we should only use the first 64 slots so save/load works right.
 	// In MP, have one for each player and 32 extras.
@@ -693,6 +720,142 @@ int CSoundEnt::ClientSoundIndex ( edict_t *pClient )
 	return iReturn;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Sound index helpers
+//-----------------------------------------------------------------------------
+static inline int SoundIndexCell( float flCoord )
+{
+	return (int)floorf( flCoord * ( 1.0f / SOUND_INDEX_CELL_SIZE ) );
+}
+
+static inline int SoundIndexBucket( int x, int y, int nBuckets )
+{
+	return ( ( (unsigned)x * 73856093u ) ^ ( (unsigned)y * 19349663u ) ) & ( nBuckets - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuild the per-type and spatial sets from the active list.
+//			Each sound is ranked by its position in the active list, so walking
+//			a set in bit order visits sounds in the same order as the list.
+//-----------------------------------------------------------------------------
+void CSoundEnt::BuildSoundIndex( void )
+{
+	COMPILE_TIME_ASSERT( ( SOUND_INDEX_BUCKETS & ( SOUND_INDEX_BUCKETS - 1 ) ) == 0 );
+
+	for ( int i = 0; i < ARRAYSIZE( m_TypeBits ); i++ )
+	{
+		m_TypeBits[i].ClearAll();
+	}
+	for ( int i = 0; i < SOUND_INDEX_BUCKETS; i++ )
+	{
+		m_CellBits[i].ClearAll();
+	}
+	m_UnculledBits.ClearAll();
+	m_UnindexedBits.ClearAll();
+
+	int iRank = 0;
+	for ( int iSound = m_iActiveSound; iSound != SOUNDLIST_EMPTY && iRank < MAX_WORLD_SOUNDS_MP; iSound = m_SoundPool[iSound].m_iNext, iRank++ )
+	{
+		CSound *pSound = &m_SoundPool[iSound];
+		m_SoundForRank[iRank] = iSound;
+
+		if ( pSound->m_bNoExpirationTime )
+		{
+			m_UnindexedBits.Set( iRank );
+			continue;
+		}
+
+		unsigned int iType = (unsigned int)pSound->m_iType;
+		for ( int iBit = 0; iType != 0; iBit++, iType >>= 1 )
+		{
+			if ( iType & 1 )
+				m_TypeBits[iBit].Set( iRank );
+		}
+
+		const Vector &vecOrigin = pSound->GetSoundOrigin();
+		float flRadius = MAX( pSound->Volume(), 0 );
+		int x0 = SoundIndexCell( vecOrigin.x - flRadius ), x1 = SoundIndexCell( vecOrigin.x + flRadius );
+		int y0 = SoundIndexCell( vecOrigin.y - flRadius ), y1 = SoundIndexCell( vecOrigin.y + flRadius );
+
+		if ( (int64)( x1 - x0 + 1 ) * ( y1 - y0 + 1 ) > SOUND_INDEX_MAX_CELLS )
+		{
+			m_UnculledBits.Set( iRank );
+			continue;
+		}
+
+		for ( int x = x0; x <= x1; x++ )
+		{
+			for ( int y = y0; y <= y1; y++ )
+			{
+				m_CellBits[SoundIndexBucket( x, y, SOUND_INDEX_BUCKETS )].Set( iRank );
+			}
+		}
+	}
+
+	m_bSoundIndexDirty = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Find the active sounds that may be heard at vecEarPosition by a
+//			listener interested in iTypeMask. The result is a superset; the
+//			caller still makes the exact type and distance tests.
+//-----------------------------------------------------------------------------
+bool CSoundEnt::GetSoundCandidates( const Vector &vecEarPosition, float flHearingSensitivity, int iTypeMask, CSoundListBits *pResult )
+{
+	if ( !g_pSoundEnt )
+	{
+		return false;
+	}
+
+	if ( g_pSoundEnt->m_bSoundIndexDirty )
+	{
+		g_pSoundEnt->BuildSoundIndex();
+	}
+
+	pResult->ClearAll();
+
+	unsigned int iType = (unsigned int)iTypeMask;
+	for ( int iBit = 0; iType != 0; iBit++, iType >>= 1 )
+	{
+		if ( iType & 1 )
+			pResult->Or( g_pSoundEnt->m_TypeBits[iBit], pResult );
+	}
+
+	// Buckets are sized for hearing out to the sound's volume; more sensitive
+	// listeners just get the type filter
+	if ( flHearingSensitivity <= 1.0f )
+	{
+		int iBucket = SoundIndexBucket( SoundIndexCell( vecEarPosition.x ), SoundIndexCell( vecEarPosition.y ), SOUND_INDEX_BUCKETS );
+
+		CSoundListBits spatial;
+		g_pSoundEnt->m_CellBits[iBucket].Or( g_pSoundEnt->m_UnculledBits, &spatial );
+		pResult->And( spatial, pResult );
+	}
+
+	pResult->Or( g_pSoundEnt->m_UnindexedBits, pResult );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Map a bit from GetSoundCandidates() to an index in the sound pool
+//-----------------------------------------------------------------------------
+int CSoundEnt::SoundIndexForRank( int iRank )
+{
+	Assert( g_pSoundEnt && iRank >= 0 && iRank < MAX_WORLD_SOUNDS_MP );
+	return g_pSoundEnt->m_SoundForRank[iRank];
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called when a sound is changed outside of InsertSound()/FreeSound()
+//-----------------------------------------------------------------------------
+void CSoundEnt::InvalidateSoundIndex( void )
+{
+	if ( g_pSoundEnt )
+	{
+		g_pSoundEnt->m_bSoundIndexDirty = true;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Return the loudest sound of the specified type at "earposition"
 //-----------------------------------------------------------------------------
@@ -16,6 +16,8 @@
 #pragma once
 #endif
 
+#include "bitvec.h"
+
 enum
 {
 	MAX_WORLD_SOUNDS_SP	= 64,	// Maximum number of sounds handled by the world at one time in single player.
@@ -98,6 +100,9 @@ enum
 	SOUNDLIST_EMPTY = -1
 };
 
+// A set of active sounds, one bit per position in the active list
+typedef CBitVec<MAX_WORLD_SOUNDS_MP> CSoundListBits;
+
 #define SOUNDENT_VOLUME_MACHINEGUN	1500.0
 #define SOUNDENT_VOLUME_SHOTGUN		1500.0
 #define SOUNDENT_VOLUME_PISTOL		1500.0
@@ -123,7 +128,7 @@ class CSound
 public:
 	bool	DoesSoundExpire() const;
 	float	SoundExpirationTime() const;
-	void	SetSoundOrigin( const Vector &vecOrigin ) { m_vecOrigin = vecOrigin; }
+	void	SetSoundOrigin( const Vector &vecOrigin );
 	const	Vector& GetSoundOrigin( void ) { return m_vecOrigin; }
 	const	Vector& GetSoundReactOrigin( void );
 	bool	FIsSound( void );
@@ -258,16 +263,38 @@ public:
 	static CSound*	GetLoudestSoundOfType( int iType, const Vector &vecEarPosition );
 	static int		ClientSoundIndex ( edict_t *pClient );
 
+	// Sound index - narrows the active list down to the sounds that may reach a listener
+	static bool		GetSoundCandidates( const Vector &vecEarPosition, float flHearingSensitivity, int iTypeMask, CSoundListBits *pResult );
+	static int		SoundIndexForRank( int iRank );// map a bit from GetSoundCandidates() back to a sound index
+	static void		InvalidateSoundIndex( void );
+
 	bool	IsEmpty( void );
 	int		ISoundsInList ( int iListType );
 	int		IAllocSound ( void );
 	int		FindOrAllocateSound( CBaseEntity *pOwner, int soundChannelIndex );
 	
 private:
+	enum
+	{
+		SOUND_INDEX_BUCKETS = 256,		// spatial buckets, hashed from XY cells
+		SOUND_INDEX_MAX_CELLS = 64,		// sounds covering more cells than this are never culled
+	};
+
+	void	BuildSoundIndex( void );
+
 	int		m_iFreeSound;	// index of the first sound in the free sound list
 	int		m_iActiveSound; // indes of the first sound in the active sound list
 	int		m_cLastActiveSounds; // keeps track of the number of active sounds at the last update. (for diagnostic work)
 	CSound	m_SoundPool[ MAX_WORLD_SOUNDS_MP ];
+
+	// Sound index, not saved. Rebuilt from the active list the first time it's
+	// queried after the list changes. Bits are positions in the active list.
+	bool			m_bSoundIndexDirty;
+	short			m_SoundForRank[ MAX_WORLD_SOUNDS_MP ];
+	CSoundListBits	m_TypeBits[ 32 ];							// sounds with each type and context bit
+	CSoundListBits	m_CellBits[ SOUND_INDEX_BUCKETS ];			// sounds whose radius overlaps each bucket's cells
+	CSoundListBits	m_UnculledBits;								// sounds too loud to bucket
+	CSoundListBits	m_UnindexedBits;							// client sounds, which players update in place
 };
 
 
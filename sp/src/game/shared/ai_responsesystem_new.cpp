@@ -844,6 +844,70 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 	defaultresponsesytem.ReloadAllResponseSystems();
 }
 
+CON_COMMAND( rr_criteria_record, "Start recording the criteria sets passed to the response system. Use rr_criteria_record_stop to write them out." )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	defaultresponsesytem.StartCriteriaLog();
+	Msg( "Recording response system criteria sets\n" );
+}
+
+CON_COMMAND( rr_criteria_record_stop, "Stop recording criteria sets and write them to a file. Usage: rr_criteria_record_stop <file>" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: rr_criteria_record_stop <file>\n" );
+		return;
+	}
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !defaultresponsesytem.StopCriteriaLog( buf ) )
+	{
+		Msg( "Not recording criteria sets\n" );
+		return;
+	}
+
+	if ( !g_pFullFileSystem->WriteFile( args[1], "MOD", buf ) )
+	{
+		Warning( "Unable to write %s\n", args[1] );
+		return;
+	}
+
+	Msg( "Wrote %d bytes of criteria sets to %s\n", buf.TellPut(), args[1] );
+}
+
+CON_COMMAND( rr_criteria_bench, "Replay a recorded criteria log through the linear and indexed rule searches. Usage: rr_criteria_bench <file> [iterations]" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: rr_criteria_bench <file> [iterations]\n" );
+		return;
+	}
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !g_pFullFileSystem->ReadFile( args[1], "MOD", buf ) )
+	{
+		Warning( "Unable to read %s\n", args[1] );
+		return;
+	}
+
+	int nIterations = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 10;
+	defaultresponsesytem.BenchmarkCriteriaLog( buf, nIterations );
+}
+
 #if RR_DUMPHASHINFO_ENABLED
 static void CC_RR_DumpHashInfo( const CCommand &args )
 {
@@ -461,7 +461,14 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 	
 	if ( FStrEq( szKeyName, "targetname" ) )
 	{
-		m_iName = AllocPooledString( szValue );
+		SetName( AllocPooledString( szValue ) );
+		return true;
+	}
+
+	// Goes through SetClassname() so the entity list index sees it
+	if ( FStrEq( szKeyName, "classname" ) )
+	{
+		SetClassname( szValue );
 		return true;
 	}
 
@@ -17,6 +17,8 @@
 #include "saverestore_utlvector.h"
 #include "props_shared.h"
 #include "utlbuffer.h"
+#include "tier1/mempool.h"
+#include "coordsize.h"
 #include "usermessages.h"
 #ifdef CLIENT_DLL
 #include "hud_closecaption.h"
@@ -874,3 +876,450 @@ CON_COMMAND_SHARED( con_group_toggle, "Toggles a console group." )
 {
 	ToggleConsoleGroups( args.Arg( 1 ) );
 }
+
+//-----------------------------------------------------------------------------
+// Compares loading scripts into heap KeyValues against loading them into a CKeyValuesArena
+//-----------------------------------------------------------------------------
+static void KVBench_FindScripts( const char *pszDir, CUtlVector<CUtlBuffer*> &files, CUtlStringList &names )
+{
+	char szSearch[MAX_PATH];
+	Q_snprintf( szSearch, sizeof( szSearch ), "%s/*", pszDir );
+
+	FileFindHandle_t findHandle;
+	for ( const char *pszName = g_pFullFileSystem->FindFirstEx( szSearch, "GAME", &findHandle ); pszName; pszName = g_pFullFileSystem->FindNext( findHandle ) )
+	{
+		if ( pszName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		Q_snprintf( szPath, sizeof( szPath ), "%s/%s", pszDir, pszName );
+
+		if ( g_pFullFileSystem->FindIsDirectory( findHandle ) )
+		{
+			KVBench_FindScripts( szPath, files, names );
+		}
+		else if ( !Q_stricmp( Q_GetFileExtension( pszName ), "txt" ) )
+		{
+			CUtlBuffer *pBuf = new CUtlBuffer( 0, 0, CUtlBuffer::TEXT_BUFFER );
+			if ( g_pFullFileSystem->ReadFile( szPath, "GAME", *pBuf ) )
+			{
+				files.AddToTail( pBuf );
+				names.CopyAndAddToTail( szPath );
+			}
+			else
+			{
+				delete pBuf;
+			}
+		}
+	}
+	g_pFullFileSystem->FindClose( findHandle );
+}
+
+CON_COMMAND_F_SHARED( kv_bench_parse, "Times loading every script under scripts/ into heap KeyValues and into a KeyValues arena, and checks that both give the same trees. Format: kv_bench_parse [iterations]", FCVAR_CHEAT )
+{
+	int nIterations = args.ArgC() > 1 ? MAX( atoi( args.Arg( 1 ) ), 1 ) : 10;
+
+	CUtlVector<CUtlBuffer*> files;
+	CUtlStringList names;
+	KVBench_FindScripts( "scripts", files, names );
+
+	int nBytes = 0;
+	for ( int i = 0; i < files.Count(); i++ )
+	{
+		nBytes += files[i]->TellPut();
+	}
+
+	CFastTimer heapTimer, arenaTimer;
+	CCycleCount heapTime, arenaTime;
+	int nMismatches = 0;
+	CKeyValuesArena arena;
+
+	for ( int nIter = 0; nIter < nIterations; nIter++ )
+	{
+		heapTimer.Start();
+		for ( int i = 0; i < files.Count(); i++ )
+		{
+			files[i]->SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+			KeyValues *pKV = new KeyValues( names[i] );
+			pKV->LoadFromBuffer( names[i], *files[i], g_pFullFileSystem, "GAME" );
+			pKV->deleteThis();
+		}
+		heapTimer.End();
+		heapTime += heapTimer.GetDuration();
+
+		arenaTimer.Start();
+		for ( int i = 0; i < files.Count(); i++ )
+		{
+			files[i]->SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+			KeyValues *pKV = arena.CreateKeyValues( names[i] );
+			pKV->LoadFromBuffer( names[i], *files[i], g_pFullFileSystem, "GAME" );
+		}
+		arena.Clear();
+		arenaTimer.End();
+		arenaTime += arenaTimer.GetDuration();
+	}
+
+	// Both loads must give the same trees
+	for ( int i = 0; i < files.Count(); i++ )
+	{
+		files[i]->SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		KeyValues *pHeapKV = new KeyValues( names[i] );
+		pHeapKV->LoadFromBuffer( names[i], *files[i], g_pFullFileSystem, "GAME" );
+
+		files[i]->SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		KeyValues *pArenaKV = arena.CreateKeyValues( names[i] );
+		pArenaKV->LoadFromBuffer( names[i], *files[i], g_pFullFileSystem, "GAME" );
+
+		CUtlBuffer heapOut( 0, 0, CUtlBuffer::TEXT_BUFFER ), arenaOut( 0, 0, CUtlBuffer::TEXT_BUFFER );
+		for ( KeyValues *pKV = pHeapKV; pKV; pKV = pKV->GetNextKey() )
+			pKV->RecursiveSaveToFile( heapOut, 0 );
+		for ( KeyValues *pKV = pArenaKV; pKV; pKV = pKV->GetNextKey() )
+			pKV->RecursiveSaveToFile( arenaOut, 0 );
+
+		if ( heapOut.TellPut() != arenaOut.TellPut() || V_memcmp( heapOut.Base(), arenaOut.Base(), heapOut.TellPut() ) )
+		{
+			Warning( "kv_bench_parse: %s loads differently into the arena\n", names[i] );
+			nMismatches++;
+		}
+
+		pHeapKV->deleteThis();
+	}
+	int nArenaBytes = arena.GetBytesAllocated();
+	arena.Clear();
+
+	files.PurgeAndDeleteElements();
+
+	Msg( "kv_bench_parse: %d files, %d bytes, %d iterations\n", names.Count(), nBytes, nIterations );
+	Msg( "  heap:  %.2f ms per pass\n", heapTime.GetMillisecondsF() / nIterations );
+	Msg( "  arena: %.2f ms per pass (%.2fx), %d KB of blocks\n", arenaTime.GetMillisecondsF() / nIterations,
+		arenaTime.GetMillisecondsF() > 0.0 ? heapTime.GetMillisecondsF() / arenaTime.GetMillisecondsF() : 0.0, nArenaBytes / 1024 );
+	Msg( "  %d mismatches\n", nMismatches );
+}
+
+//-----------------------------------------------------------------------------
+// Has several threads hammer one CMemoryPoolMT, against the same pool behind a single lock
+//-----------------------------------------------------------------------------
+class CMemPoolBenchLocked : public CUtlMemoryPool
+{
+public:
+	CMemPoolBenchLocked( int blockSize, int numElements ) : CUtlMemoryPool( blockSize, numElements ) {}
+
+	void *Alloc() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
+	void Free( void *pMem ) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+
+private:
+	CThreadFastMutex m_mutex;
+};
+
+template <class POOL>
+struct MemPoolBenchThread_t
+{
+	POOL *m_pPool;
+	int m_nIterations;
+	CTSList<void *> *m_pHandOff;		// if set, every other block is freed by whichever thread picks it up
+
+	static unsigned Run( void *pParam )
+	{
+		MemPoolBenchThread_t *pThread = (MemPoolBenchThread_t *)pParam;
+		void *pBlocks[64];
+		for ( int nIter = 0; nIter < pThread->m_nIterations; nIter++ )
+		{
+			// vary the number held so magazines fill up and run dry
+			int nBlocks = 1 + ( nIter % ARRAYSIZE( pBlocks ) );
+			for ( int i = 0; i < nBlocks; i++ )
+			{
+				pBlocks[i] = pThread->m_pPool->Alloc();
+			}
+			for ( int i = 0; i < nBlocks; i++ )
+			{
+				if ( pThread->m_pHandOff && ( i & 1 ) )
+					pThread->m_pHandOff->PushItem( pBlocks[i] );
+				else
+					pThread->m_pPool->Free( pBlocks[i] );
+			}
+
+			void *pMem;
+			while ( pThread->m_pHandOff && pThread->m_pHandOff->PopItem( &pMem ) )
+			{
+				pThread->m_pPool->Free( pMem );
+			}
+		}
+		return 0;
+	}
+};
+
+template <class POOL>
+static double MemPoolBench( POOL &pool, int nThreads, int nIterations, bool bCrossThread )
+{
+	CUtlVector< MemPoolBenchThread_t<POOL> > threads;
+	CUtlVector< ThreadHandle_t > handles;
+	threads.SetCount( nThreads );
+
+	CTSList<void *> *pHandOff = bCrossThread ? new CTSList<void *> : NULL;
+
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads[i].m_pPool = &pool;
+		threads[i].m_nIterations = nIterations;
+		threads[i].m_pHandOff = pHandOff;
+		handles.AddToTail( CreateSimpleThread( &MemPoolBenchThread_t<POOL>::Run, &threads[i] ) );
+	}
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( handles[i] );
+		ReleaseThreadHandle( handles[i] );
+	}
+	timer.End();
+
+	if ( pHandOff )
+	{
+		// blocks handed off after the last thread looked
+		void *pMem;
+		while ( pHandOff->PopItem( &pMem ) )
+		{
+			pool.Free( pMem );
+		}
+		delete pHandOff;
+	}
+
+	return timer.GetDuration().GetMillisecondsF();
+}
+
+static void MemPoolBenchReport( const char *pszName, int nThreads, int nIterations, bool bCrossThread )
+{
+	const int nBlockSize = 64;
+
+	CMemPoolBenchLocked lockedPool( nBlockSize, 256 );
+	double flLockedMS = MemPoolBench( lockedPool, nThreads, nIterations, bCrossThread );
+
+	CMemoryPoolMT pool( nBlockSize, 256, UTLMEMORYPOOL_GROW_FAST, "mempool_bench_mt" );
+	double flCachedMS = MemPoolBench( pool, nThreads, nIterations, bCrossThread );
+
+	CMemoryPoolMT::Stats_t stats;
+	pool.GetStats( stats );
+
+	Msg( " %s:\n", pszName );
+	Msg( "  locked: %.2f ms, %d peak blocks\n", flLockedMS, lockedPool.PeakCount() );
+	Msg( "  cached: %.2f ms (%.2fx), %d peak blocks\n", flCachedMS, flCachedMS > 0.0 ? flLockedMS / flCachedMS : 0.0, stats.m_nPeakCount );
+	Msg( "  %d allocs, %d cache hits (%.1f%%), %d depot hits, %d pool refills, %d magazines, %d still in use\n",
+		stats.m_nAllocs, stats.m_nCacheHits, stats.m_nAllocs ? 100.0 * stats.m_nCacheHits / stats.m_nAllocs : 0.0,
+		stats.m_nDepotHits, stats.m_nPoolRefills, stats.m_nMagazines, stats.m_nInUse );
+}
+
+CON_COMMAND_F_SHARED( mempool_bench_mt, "Times several threads allocating from and freeing to one pool, with per-thread caches and with a single lock, first freeing their own blocks and then handing half of them to other threads to free. Format: mempool_bench_mt [threads] [iterations]", FCVAR_CHEAT )
+{
+	int nThreads = args.ArgC() > 1 ? clamp( atoi( args.Arg( 1 ) ), 1, 64 ) : 4;
+	int nIterations = args.ArgC() > 2 ? MAX( atoi( args.Arg( 2 ) ), 1 ) : 100000;
+
+	Msg( "mempool_bench_mt: %d threads, %d iterations each\n", nThreads, nIterations );
+	MemPoolBenchReport( "same thread frees", nThreads, nIterations, false );
+	MemPoolBenchReport( "cross thread frees", nThreads, nIterations, true );
+}
+
+//-----------------------------------------------------------------------------
+// Checks that the bf_write/bf_read accumulator paths are bit for bit the same as
+// writing each field on its own, then compares their speed
+//-----------------------------------------------------------------------------
+static void BitBufTest_WriteVec3CoordReference( bf_write &buf, const Vector &v )
+{
+	int flags[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		flags[i] = ( v[i] >= COORD_RESOLUTION ) || ( v[i] <= -COORD_RESOLUTION );
+		buf.WriteOneBit( flags[i] );
+	}
+	for ( int i = 0; i < 3; i++ )
+	{
+		if ( flags[i] )
+			buf.WriteBitCoord( v[i] );
+	}
+}
+
+static void BitBufTest_ReadVec3CoordReference( bf_read &buf, Vector &v )
+{
+	v.Init();
+	int flags[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		flags[i] = buf.ReadOneBit();
+	}
+	for ( int i = 0; i < 3; i++ )
+	{
+		if ( flags[i] )
+			v[i] = buf.ReadBitCoord();
+	}
+}
+
+static float BitBufTest_RandomCoord()
+{
+	switch ( RandomInt( 0, 3 ) )
+	{
+	case 0:		return 0.0f;
+	case 1:		return RandomInt( -64, 64 ) * COORD_RESOLUTION;
+	default:	return RandomFloat( -MAX_COORD_FLOAT, MAX_COORD_FLOAT );
+	}
+}
+
+CON_COMMAND_SHARED( bitbuf_test, "Checks the bitbuf accumulator paths against writing each field on its own, then times both. Format: bitbuf_test [iterations]" )
+{
+	int nIterations = args.ArgC() > 1 ? MAX( atoi( args.Arg( 1 ) ), 1 ) : 2000;
+
+	const int nBufferBytes = 4096;
+	const int nVectors = 64;
+	CUtlVector<uint32> refData, testData;
+	refData.SetCount( nBufferBytes / 4 );
+	testData.SetCount( nBufferBytes / 4 );
+
+	Vector vecs[nVectors], readVecs[nVectors];
+	QAngle angles[nVectors];
+	unsigned char bytes[nBufferBytes / 2], readBytes[nBufferBytes / 2 + 4];
+	int nFailures = 0;
+
+	for ( int nIter = 0; nIter < nIterations; nIter++ )
+	{
+		// garbage in the buffers, so bits we shouldn't touch are checked too
+		for ( int i = 0; i < refData.Count(); i++ )
+		{
+			refData[i] = testData[i] = (uint32)RandomInt( 0, INT_MAX ) * 3;
+		}
+		for ( int i = 0; i < nVectors; i++ )
+		{
+			vecs[i].Init( BitBufTest_RandomCoord(), BitBufTest_RandomCoord(), BitBufTest_RandomCoord() );
+			angles[i].Init( vecs[i].x, vecs[i].y, vecs[i].z );
+		}
+		for ( int i = 0; i < ARRAYSIZE( bytes ); i++ )
+		{
+			bytes[i] = RandomInt( 0, 255 );
+		}
+
+		// Near the end of a short buffer, so the one at a time fallback and overflow are covered
+		int nBytes = ( nIter & 3 ) ? nBufferBytes : 4 * RandomInt( 1, 80 );
+		int nStartBit = RandomInt( 0, 95 );
+		int nCount = RandomInt( 1, nVectors );
+		int nMode = nIter % 3;
+
+		bf_write refBuf( refData.Base(), nBytes ), testBuf( testData.Base(), nBytes );
+		refBuf.SetAssertOnOverflow( false );
+		testBuf.SetAssertOnOverflow( false );
+		refBuf.SeekToBit( nStartBit );
+		testBuf.SeekToBit( nStartBit );
+
+		for ( int i = 0; i < nCount; i++ )
+		{
+			BitBufTest_WriteVec3CoordReference( refBuf, vecs[i] );
+		}
+
+		if ( nMode == 0 )
+		{
+			for ( int i = 0; i < nCount; i++ )
+				testBuf.WriteBitVec3Coord( vecs[i] );
+		}
+		else if ( nMode == 1 )
+		{
+			testBuf.WriteBitVec3Coords( vecs, nCount );
+		}
+		else
+		{
+			testBuf.WriteBitAngles( angles, nCount );
+		}
+
+		// an unaligned run of bytes behind the vectors
+		int nByteOffset = RandomInt( 0, 3 );
+		int nBits = RandomInt( 0, ( ARRAYSIZE( bytes ) - 4 ) * 8 );
+		if ( refBuf.GetNumBitsLeft() < nBits )
+		{
+			// WriteBits() doesn't write anything if it would overflow
+			nBits = 0;
+		}
+		for ( int i = 0; i < nBits / 8; i++ )
+		{
+			refBuf.WriteUBitLong( bytes[nByteOffset + i], 8 );
+		}
+		if ( nBits & 7 )
+		{
+			refBuf.WriteUBitLong( bytes[nByteOffset + nBits / 8], nBits & 7 );
+		}
+		testBuf.WriteBits( bytes + nByteOffset, nBits );
+
+		if ( refBuf.GetNumBitsWritten() != testBuf.GetNumBitsWritten() || refBuf.IsOverflowed() != testBuf.IsOverflowed() ||
+			V_memcmp( refData.Base(), testData.Base(), nBufferBytes ) )
+		{
+			if ( nFailures++ < 10 )
+				Warning( "bitbuf_test: write mismatch (iteration %d, mode %d, start %d, %d vectors, %d bytes)\n", nIter, nMode, nStartBit, nCount, nBytes );
+			continue;
+		}
+
+		if ( refBuf.IsOverflowed() )
+			continue;
+
+		// Read it all back both ways
+		bf_read refRead( refData.Base(), nBytes ), testRead( testData.Base(), nBytes );
+		refRead.Seek( nStartBit );
+		testRead.Seek( nStartBit );
+
+		bool bMatch = true;
+		if ( nMode == 1 )
+		{
+			testRead.ReadBitVec3Coords( readVecs, nCount );
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			Vector ref;
+			BitBufTest_ReadVec3CoordReference( refRead, ref );
+
+			if ( nMode == 0 )
+			{
+				testRead.ReadBitVec3Coord( readVecs[i] );
+			}
+			else if ( nMode == 2 )
+			{
+				QAngle angle;
+				testRead.ReadBitAngles( angle );
+				readVecs[i].Init( angle.x, angle.y, angle.z );
+			}
+
+			bMatch = bMatch && V_memcmp( &ref, &readVecs[i], sizeof( Vector ) ) == 0;
+		}
+
+		int nReadOffset = RandomInt( 0, 3 );
+		testRead.ReadBits( readBytes + nReadOffset, nBits );
+		for ( int i = 0; i < nBits / 8; i++ )
+		{
+			bMatch = bMatch && readBytes[nReadOffset + i] == refRead.ReadUBitLong( 8 );
+		}
+
+		if ( !bMatch || refRead.GetNumBitsRead() + ( nBits & 7 ) != testRead.GetNumBitsRead() )
+		{
+			if ( nFailures++ < 10 )
+				Warning( "bitbuf_test: read mismatch (iteration %d, mode %d, start %d, %d vectors)\n", nIter, nMode, nStartBit, nCount );
+		}
+	}
+
+	Msg( "bitbuf_test: %d iterations, %d failures\n", nIterations, nFailures );
+
+	// Throughput, in a buffer that doesn't overflow
+	CFastTimer timer;
+	double flRefWrite, flWrite, flBatchWrite, flRefRead, flRead, flBatchRead;
+
+#define BITBUF_TIME( result, code ) \
+	timer.Start(); \
+	for ( int nIter = 0; nIter < nIterations; nIter++ ) { code; } \
+	timer.End(); \
+	result = timer.GetDuration().GetMillisecondsF();
+
+	BITBUF_TIME( flRefWrite, bf_write buf( testData.Base(), nBufferBytes ); buf.WriteOneBit( 1 ); for ( int i = 0; i < nVectors; i++ ) BitBufTest_WriteVec3CoordReference( buf, vecs[i] ) );
+	BITBUF_TIME( flWrite, bf_write buf( testData.Base(), nBufferBytes ); buf.WriteOneBit( 1 ); for ( int i = 0; i < nVectors; i++ ) buf.WriteBitVec3Coord( vecs[i] ) );
+	BITBUF_TIME( flBatchWrite, bf_write buf( testData.Base(), nBufferBytes ); buf.WriteOneBit( 1 ); buf.WriteBitVec3Coords( vecs, nVectors ) );
+	BITBUF_TIME( flRefRead, bf_read buf( testData.Base(), nBufferBytes ); buf.ReadOneBit(); for ( int i = 0; i < nVectors; i++ ) BitBufTest_ReadVec3CoordReference( buf, readVecs[i] ) );
+	BITBUF_TIME( flRead, bf_read buf( testData.Base(), nBufferBytes ); buf.ReadOneBit(); for ( int i = 0; i < nVectors; i++ ) buf.ReadBitVec3Coord( readVecs[i] ) );
+	BITBUF_TIME( flBatchRead, bf_read buf( testData.Base(), nBufferBytes ); buf.ReadOneBit(); buf.ReadBitVec3Coords( readVecs, nVectors ) );
+
+#undef BITBUF_TIME
+
+	Msg( "  %d x %d vectors: write %.2f ms one field at a time, %.2f ms (%.2fx) accumulated, %.2f ms (%.2fx) batched\n", nIterations, nVectors,
+		flRefWrite, flWrite, flWrite > 0.0 ? flRefWrite / flWrite : 0.0, flBatchWrite, flBatchWrite > 0.0 ? flRefWrite / flBatchWrite : 0.0 );
+	Msg( "  %d x %d vectors: read %.2f ms one field at a time, %.2f ms (%.2fx) accumulated, %.2f ms (%.2fx) batched\n", nIterations, nVectors,
+		flRefRead, flRead, flRead > 0.0 ? flRefRead / flRead : 0.0, flBatchRead, flBatchRead > 0.0 ? flRefRead / flBatchRead : 0.0 );
+}
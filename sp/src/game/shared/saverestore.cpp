@@ -24,6 +24,8 @@
 #include "vphysics/object_hash.h"
 #include "datacache/imdlcache.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "utlhashtable.h"
 
 #if !defined( CLIENT_DLL )
 
@@ -1333,11 +1335,17 @@ CRestore::CRestore( CSaveRestoreData *pdata )
  :	m_pData( pdata ),
 	m_pGameInfo( pdata ),
 	m_global( 0 ),
-	m_precache( true )
+	m_precache( true ),
+	m_pFieldCache( NULL )
 {
 	m_BlockEndStack.EnsureCapacity( 32 );
 }
 
+CRestore::~CRestore()
+{
+	delete m_pFieldCache;
+}
+
 //-------------------------------------
 
 int CRestore::GetReadPos() const
@@ -1522,6 +1530,131 @@ typedescription_t *CRestore::FindField( const char *pszFieldName, typedescriptio
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Caches the symbol -> field resolution done by CRestore::ReadFields().
+//			Symbols are only meaningful for the symbol table they came from, so
+//			each CRestore owns its cache and it goes away with the CRestore.
+//			Tables are kept per field array; names that occur more than once in
+//			an array are found from the search cookie, so they aren't cached.
+//-----------------------------------------------------------------------------
+class CRestoreFieldCache
+{
+public:
+	struct FieldTable_t
+	{
+		int										fieldCount;
+		CUtlVector<bool>						duplicate;	// per field, name is used by another field too
+		CUtlHashtable< int, typedescription_t * >	fields;		// symbol -> field, NULL if not in the array
+	};
+
+	~CRestoreFieldCache()
+	{
+		for ( UtlHashHandle_t h = m_Tables.FirstHandle(); h != m_Tables.InvalidHandle(); h = m_Tables.NextHandle( h ) )
+		{
+			delete m_Tables[h];
+		}
+	}
+
+	FieldTable_t *GetFieldTable( typedescription_t *pFields, int fieldCount )
+	{
+		UtlHashHandle_t h = m_Tables.Find( pFields );
+		if ( h == m_Tables.InvalidHandle() )
+		{
+			h = m_Tables.Insert( pFields, new FieldTable_t );
+			m_Tables[h]->fieldCount = -1;
+		}
+
+		FieldTable_t *pTable = m_Tables[h];
+		if ( pTable->fieldCount != fieldCount )
+		{
+			pTable->fieldCount = fieldCount;
+			pTable->fields.RemoveAll();
+			FindDuplicates( pFields, fieldCount, &pTable->duplicate );
+		}
+		return pTable;
+	}
+
+	static int s_nHits;
+	static int s_nMisses;
+
+private:
+	static int __cdecl CompareFieldNames( typedescription_t * const *ppLeft, typedescription_t * const *ppRight )
+	{
+		return stricmp( (*ppLeft)->fieldName, (*ppRight)->fieldName );
+	}
+
+	// Sorted by name, so duplicates end up next to each other
+	static void FindDuplicates( typedescription_t *pFields, int fieldCount, CUtlVector<bool> *pDuplicate )
+	{
+		CUtlVector<typedescription_t *> sorted;
+		sorted.SetCount( fieldCount );
+		pDuplicate->SetCount( fieldCount );
+		for ( int i = 0; i < fieldCount; i++ )
+		{
+			sorted[i] = &pFields[i];
+			(*pDuplicate)[i] = false;
+		}
+		sorted.Sort( CompareFieldNames );
+
+		for ( int i = 1; i < fieldCount; i++ )
+		{
+			if ( stricmp( sorted[i - 1]->fieldName, sorted[i]->fieldName ) == 0 )
+			{
+				(*pDuplicate)[sorted[i - 1] - pFields] = true;
+				(*pDuplicate)[sorted[i] - pFields] = true;
+			}
+		}
+	}
+
+	CUtlHashtable< typedescription_t *, FieldTable_t *, PointerHashFunctor, PointerEqualFunctor > m_Tables;
+};
+
+int CRestoreFieldCache::s_nHits;
+int CRestoreFieldCache::s_nMisses;
+
+//-------------------------------------
+// Same result and cookie as FindField(), which searches on from the field
+// after the last one found so that in order data is found straight away.
+//-------------------------------------
+
+typedescription_t *CRestore::FindFieldCached( int symbol, typedescription_t *pFields, int fieldCount, int *pCookie )
+{
+	if ( !m_pFieldCache )
+	{
+		m_pFieldCache = new CRestoreFieldCache;
+	}
+
+	CRestoreFieldCache::FieldTable_t *pTable = m_pFieldCache->GetFieldTable( pFields, fieldCount );
+
+	UtlHashHandle_t h = pTable->fields.Find( symbol );
+	if ( h != pTable->fields.InvalidHandle() )
+	{
+		CRestoreFieldCache::s_nHits++;
+
+		typedescription_t *pField = pTable->fields[h];
+		if ( pField )
+		{
+			int fieldNumber = ( pField - pFields ) + 1;
+			*pCookie = ( fieldNumber == fieldCount ) ? 0 : fieldNumber;
+		}
+		else
+		{
+			*pCookie = 0;
+		}
+		return pField;
+	}
+
+	CRestoreFieldCache::s_nMisses++;
+
+	// Misses (including fields that no longer exist) are remembered too
+	typedescription_t *pField = FindField( m_pData->StringFromSymbol( symbol ), pFields, fieldCount, pCookie );
+	if ( !pField || !pTable->duplicate[pField - pFields] )
+	{
+		pTable->fields.Insert( symbol, pField );
+	}
+	return pField;
+}
+
 //-------------------------------------
 
 bool CRestore::ShouldEmptyField( typedescription_t *pField )
@@ -1660,7 +1793,7 @@ int CRestore::ReadFields( const char *pname, void *pBaseData, datamap_t *pRootMa
 	{
 		ReadHeader( &header );
 
-		typedescription_t *pField = FindField( m_pData->StringFromSymbol( header.symbol ), pFields, fieldCount, &searchCookie);
+		typedescription_t *pField = FindFieldCached( header.symbol, pFields, fieldCount, &searchCookie );
 		if ( pField && ShouldReadField( pField ) )
 		{
 			ReadField( header, ((char *)pBaseData + pField->fieldOffset[ TD_OFFSET_NORMAL ]), pRootMap, pField );
@@ -2375,6 +2508,87 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Per-class timing of entity save/restore, see save_profile_entities
+//-----------------------------------------------------------------------------
+#if !defined( CLIENT_DLL )
+
+ConVar save_profile_entities( "save_profile_entities", "0", 0, "Report the time spent saving and restoring each entity class." );
+
+class CSaveRestoreClassProfile
+{
+public:
+	struct ClassTime_t
+	{
+		const char	*pszClassname;
+		int			nEntities;
+		CCycleCount	time;
+	};
+
+	void Reset()
+	{
+		m_Classes.RemoveAll();
+		m_Total.Init();
+	}
+
+	void AddEntity( string_t classname, const CCycleCount &time )
+	{
+		const char *pszClassname = STRING( classname ) ? STRING( classname ) : "<unknown>";
+
+		UtlHashHandle_t h = m_Classes.Find( pszClassname );
+		if ( h == m_Classes.InvalidHandle() )
+		{
+			ClassTime_t entry;
+			entry.pszClassname = pszClassname;
+			entry.nEntities = 0;
+			entry.time.Init();
+			h = m_Classes.Insert( pszClassname, entry );
+		}
+
+		ClassTime_t &entry = m_Classes.Element( h );
+		entry.nEntities++;
+		entry.time += time;
+		m_Total += time;
+	}
+
+	static int __cdecl SortByTime( const ClassTime_t *pLeft, const ClassTime_t *pRight )
+	{
+		if ( pLeft->time.GetLongCycles() == pRight->time.GetLongCycles() )
+			return 0;
+		return ( pLeft->time.GetLongCycles() > pRight->time.GetLongCycles() ) ? -1 : 1;
+	}
+
+	void Report( const char *pszAction )
+	{
+		CUtlVector< ClassTime_t > sorted;
+		sorted.EnsureCapacity( m_Classes.Count() );
+		int nEntities = 0;
+		for ( UtlHashHandle_t h = m_Classes.FirstHandle(); h != m_Classes.InvalidHandle(); h = m_Classes.NextHandle( h ) )
+		{
+			sorted.AddToTail( m_Classes.Element( h ) );
+			nEntities += m_Classes.Element( h ).nEntities;
+		}
+		sorted.Sort( SortByTime );
+
+		Msg( "%s: %d entities, %d classes, %.2f ms\n", pszAction, nEntities, sorted.Count(), m_Total.GetMillisecondsF() );
+		Msg( "  %-32s %6s %10s %10s\n", "class", "count", "total ms", "avg us" );
+		for ( int i = 0; i < sorted.Count(); i++ )
+		{
+			const ClassTime_t &entry = sorted[i];
+			Msg( "  %-32s %6d %10.3f %10.1f\n", entry.pszClassname, entry.nEntities, entry.time.GetMillisecondsF(), entry.time.GetMicrosecondsF() / entry.nEntities );
+		}
+	}
+
+private:
+	// Classnames are pooled strings, so the pointer identifies the class
+	CUtlHashtable< const char *, ClassTime_t, PointerHashFunctor, PointerEqualFunctor > m_Classes;
+	CCycleCount	m_Total;
+};
+
+static CSaveRestoreClassProfile g_SaveRestoreClassProfile;
+
+#endif
+
 //-----------------------------------------------------------------------------
 
 CEntitySaveRestoreBlockHandler g_EntitySaveRestoreBlockHandler;
@@ -2456,6 +2670,14 @@ void CEntitySaveRestoreBlockHandler::PreSave( CSaveRestoreData *pSaveData )
 void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 {
 	CGameSaveRestoreInfo *pSaveData = pSave->GetGameSaveRestoreInfo();
+
+#if !defined( CLIENT_DLL )
+	bool bProfile = save_profile_entities.GetBool();
+	if ( bProfile )
+	{
+		g_SaveRestoreClassProfile.Reset();
+	}
+#endif
 	
 	// write entity list that was previously built by SaveInitEntities()
 	for ( int i = 0; i < pSaveData->NumEntities(); i++ )
@@ -2476,7 +2698,21 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 #endif
 
 			pSaveData->SetCurrentEntityContext( pEnt );
+#if !defined( CLIENT_DLL )
+			CFastTimer timer;
+			if ( bProfile )
+			{
+				timer.Start();
+			}
+#endif
 			pEnt->Save( *pSave );
+#if !defined( CLIENT_DLL )
+			if ( bProfile )
+			{
+				timer.End();
+				g_SaveRestoreClassProfile.AddEntity( pEnt->m_iClassname, timer.GetDuration() );
+			}
+#endif
 			pSaveData->SetCurrentEntityContext( NULL );
 
 			pEntInfo->size = pSave->GetWritePos() - pEntInfo->location;	// Size of entity block is data size written to block
@@ -2495,6 +2731,13 @@ void CEntitySaveRestoreBlockHandler::Save( ISave *pSave )
 #endif
 		}
 	}
+
+#if !defined( CLIENT_DLL )
+	if ( bProfile )
+	{
+		g_SaveRestoreClassProfile.Report( "Entity save" );
+	}
+#endif
 }
 
 //---------------------------------
@@ -2521,6 +2764,11 @@ void CEntitySaveRestoreBlockHandler::PostSave()
 
 void CEntitySaveRestoreBlockHandler::PreRestore()
 {
+	CRestoreFieldCache::s_nHits = CRestoreFieldCache::s_nMisses = 0;
+
+#if !defined( CLIENT_DLL )
+	g_SaveRestoreClassProfile.Reset();
+#endif
 }
 
 //---------------------------------
@@ -2740,6 +2988,13 @@ void CEntitySaveRestoreBlockHandler::Restore( IRestore *pRestore, bool createPla
 
 void CEntitySaveRestoreBlockHandler::PostRestore()
 {
+#if !defined( CLIENT_DLL )
+	if ( save_profile_entities.GetBool() )
+	{
+		g_SaveRestoreClassProfile.Report( "Entity restore" );
+		Msg( "Restore field lookups: %d cached, %d resolved\n", CRestoreFieldCache::s_nHits, CRestoreFieldCache::s_nMisses );
+	}
+#endif
 }
 
 void SaveEntityOnTable( CBaseEntity *pEntity, CSaveRestoreData *pSaveData, int &iSlot )
@@ -2866,7 +3121,21 @@ bool CEntitySaveRestoreBlockHandler::DoRestoreEntity( CBaseEntity *pEntity, IRes
 	hEntity = pEntity;
 
 	pRestore->GetGameSaveRestoreInfo()->SetCurrentEntityContext( pEntity );
-	pEntity->Restore( *pRestore );
+#if !defined( CLIENT_DLL )
+	if ( save_profile_entities.GetBool() )
+	{
+		string_t iszClassname = pEntity->m_iClassname;
+		CFastTimer timer;
+		timer.Start();
+		pEntity->Restore( *pRestore );
+		timer.End();
+		g_SaveRestoreClassProfile.AddEntity( iszClassname, timer.GetDuration() );
+	}
+	else
+#endif
+	{
+		pEntity->Restore( *pRestore );
+	}
 	pRestore->GetGameSaveRestoreInfo()->SetCurrentEntityContext( NULL );
 
 #if !defined( CLIENT_DLL )
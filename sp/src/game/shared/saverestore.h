@@ -187,10 +187,13 @@ private:
 //
 //-----------------------------------------------------------------------------
 
+class CRestoreFieldCache;
+
 class CRestore : public IRestore
 {
 public:
 	CRestore( CSaveRestoreData *pdata );
+	~CRestore();
 	
 	int				GetReadPos() const;
 	void			SetReadPos( int pos );
@@ -276,6 +279,7 @@ private:
 	int				DoReadAll( void *pLeafObject, datamap_t *pLeafMap, datamap_t *pCurMap );
 	
 	typedescription_t *FindField( const char *pszFieldName, typedescription_t *pFields, int fieldCount, int *pIterator );
+	typedescription_t *FindFieldCached( int symbol, typedescription_t *pFields, int fieldCount, int *pIterator );
 	void			ReadField( const SaveRestoreRecordHeader_t &header, void *pDest, datamap_t *pRootMap, typedescription_t *pField );
 	
 	void 			ReadBasicField( const SaveRestoreRecordHeader_t &header, void *pDest, datamap_t *pRootMap, typedescription_t *pField );
@@ -324,6 +328,8 @@ private:
 	CGameSaveRestoreInfo *	m_pGameInfo;
 	int						m_global;		// Restoring a global entity?
 	bool					m_precache;
+
+	CRestoreFieldCache *	m_pFieldCache;	// symbol -> field lookups, for this symbol table only
 };
 
 
@@ -438,6 +438,46 @@ CON_COMMAND_F( script_dump_all, "Dump the state of the VM to the console", FCVAR
 	g_pScriptVM->DumpState();
 }
 
+#ifdef MAPBASE_VSCRIPT
+#ifdef CLIENT_DLL
+CON_COMMAND_F( script_profile_client, "Count calls and time spent in native functions and hooks (0/1)", FCVAR_CHEAT )
+#else
+CON_COMMAND_F( script_profile, "Count calls and time spent in native functions and hooks (0/1)", FCVAR_CHEAT )
+#endif
+{
+	if ( !IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !g_pScriptVM )
+	{
+		CGWarning( 0, CON_GROUP_VSCRIPT, "Scripting disabled or no server running\n" );
+		return;
+	}
+
+	bool bEnable = args.ArgC() < 2 || atoi( args[1] ) != 0;
+	g_pScriptVM->SetProfilingEnabled( bEnable );
+	CGMsg( 0, CON_GROUP_VSCRIPT, "Script profiling %s\n", bEnable ? "on" : "off" );
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND_F( script_profile_dump_client, "Dump native function and hook profiling counts, optionally resetting them (\"reset\")", FCVAR_CHEAT )
+#else
+CON_COMMAND_F( script_profile_dump, "Dump native function and hook profiling counts, optionally resetting them (\"reset\")", FCVAR_CHEAT )
+#endif
+{
+	if ( !IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !g_pScriptVM )
+	{
+		CGWarning( 0, CON_GROUP_VSCRIPT, "Scripting disabled or no server running\n" );
+		return;
+	}
+
+	g_pScriptVM->DumpProfile( !V_stricmp( args[1], "reset" ) );
+}
+#endif
+
 //-----------------------------------------------------------------------------
 
 #ifdef MAPBASE_VSCRIPT
@@ -169,7 +169,8 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 	if ( m_WeaponInfoDatabase.Count() )
 		return;
 
-	KeyValues *manifest = new KeyValues( "weaponscripts" );
+	CKeyValuesArena arena;
+	KeyValues *manifest = arena.CreateKeyValues( "weaponscripts" );
 	if ( manifest->LoadFromFile( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
 	{
 		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
@@ -194,7 +195,6 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 			}
 		}
 	}
-	manifest->deleteThis();
 }
 
 #ifdef STEAM_INPUT
@@ -204,7 +204,7 @@ CON_COMMAND( weapon_precache_weapon_info_database, "" )
 }
 #endif
 
-KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameWithoutExtension, const unsigned char *pICEKey, bool bForceReadEncryptedFile /*= false*/ )
+KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameWithoutExtension, const unsigned char *pICEKey, bool bForceReadEncryptedFile /*= false*/, CKeyValuesArena *pArena /*= NULL*/ )
 {
 	Assert( strchr( szFilenameWithoutExtension, '.' ) == NULL );
 	char szFullName[512];
@@ -217,7 +217,7 @@ KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameW
 	}
 
 	// Open the weapon data file, and abort if we can't
-	KeyValues *pKV = new KeyValues( "WeaponDatafile" );
+	KeyValues *pKV = pArena ? pArena->CreateKeyValues( "WeaponDatafile" ) : new KeyValues( "WeaponDatafile" );
 
 	Q_snprintf(szFullName,sizeof(szFullName), "%s.txt", szFilenameWithoutExtension);
 
@@ -300,13 +300,16 @@ bool ReadWeaponDataFromFileForSlot( IFileSystem* filesystem, const char *szWeapo
 	char sz[128];
 	Q_snprintf( sz, sizeof( sz ), "scripts/%s", szWeaponName );
 
+	// Parse() copies everything it needs out of the file, so the whole tree is
+	// allocated from an arena and freed in one go when we're done with it.
+	CKeyValuesArena arena;
 	KeyValues *pKV = ReadEncryptedKVFile( filesystem, sz, pICEKey,
 #if defined( DOD_DLL )
-		true			// Only read .ctx files!
+		true,			// Only read .ctx files!
 #else
-		false
+		false,
 #endif
-		);
+		&arena );
 
 	if ( !pKV )
 		return false;
@@ -316,8 +319,6 @@ bool ReadWeaponDataFromFileForSlot( IFileSystem* filesystem, const char *szWeapo
 #endif
 	pFileInfo->Parse( pKV, szWeaponName );
 
-	pKV->deleteThis();
-
 	return true;
 }
 
@@ -344,13 +345,14 @@ bool ReadCustomWeaponDataFromFileForSlot( IFileSystem* filesystem, const char *s
 	char sz[128];
 	Q_snprintf( sz, sizeof( sz ), "maps/%s_%s", g_MapName, szWeaponName );
 
+	CKeyValuesArena arena;
 	KeyValues *pKV = ReadEncryptedKVFile( filesystem, sz, pICEKey,
 #if defined( DOD_DLL )
-		true			// Only read .ctx files!
+		true,			// Only read .ctx files!
 #else
-		false
+		false,
 #endif
-		);
+		&arena );
 
 	if ( !pKV )
 		return false;
@@ -358,8 +360,6 @@ bool ReadCustomWeaponDataFromFileForSlot( IFileSystem* filesystem, const char *s
 	pFileInfo->bCustom = true;
 	pFileInfo->Parse( pKV, szWeaponName );
 
-	pKV->deleteThis();
-
 	return true;
 }
 #endif
@@ -57,6 +57,7 @@ int GetWeaponSoundFromString( const char *pszString );
 
 class CHudTexture;
 class KeyValues;
+class CKeyValuesArena;
 
 #ifdef MAPBASE
 enum WeaponUsageRestricions_e
@@ -194,9 +195,11 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 // If pICEKey is NULL, then it appends .txt to the filename and loads it as an unencrypted file.
 // If pICEKey is non-NULL, then it appends .ctx to the filename and loads it as an encrypted file.
 //
+// If pArena is non-NULL, the KeyValues are allocated from it instead of the heap.
+//
 // (This should be moved into a more appropriate place).
 //
-KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameWithoutExtension, const unsigned char *pICEKey, bool bForceReadEncryptedFile = false );
+KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameWithoutExtension, const unsigned char *pICEKey, bool bForceReadEncryptedFile = false, CKeyValuesArena *pArena = NULL );
 
 
 // Each game implements this. It can return a derived class and override Parse() if it wants.
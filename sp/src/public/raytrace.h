@@ -16,6 +16,11 @@
 // fast SSE-ONLY ray tracing module. Based upon various "real time ray tracing" research.
 //#define DEBUG_RAYTRACE 1
 
+// x86 builds can also trace with AVX, selected at runtime (see RayTrace_IsAVXEnabled)
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __i386__ ) || defined( __x86_64__ )
+#define RAYTRACE_AVX 1
+#endif
+
 class FourRays
 {
 public:
@@ -133,6 +138,10 @@ struct CacheOptimizedTriangle
 #define KDNODE_STATE_ZSPLIT 2								// this node is a zsplit
 #define KDNODE_STATE_LEAF 3									// this node is a leaf
 
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
 struct CacheOptimizedKDNode
 {
 	// this is the cache intensive data structure. "Tricks" are used to fit it into 8 bytes:
@@ -228,13 +237,34 @@ enum RayTraceLightingMode_t {
 };
 
 
+// Statistics from the last SetupAccelerationStructure
+struct RayTraceTreeStats_t
+{
+	float m_flBuildTime;									// seconds
+	int m_nSubtrees;										// subtrees built on worker threads
+	int m_nThreads;
+	int m_nNodes;
+	int m_nLeaves;
+	int m_nEmptyLeaves;
+	int m_nMaxLeafTriangles;
+	int m_nTriangleReferences;								// sum of triangles over all leaves
+	int m_nMaxDepth;
+	float m_flSAHCost;										// expected cost of tracing a ray
+};
+
+// 8-wide packet tracing is used on CPUs with AVX. It can be turned off, e.g. to compare
+// results against the 4-wide path; turning it on has no effect if the CPU lacks AVX.
+bool RayTrace_IsAVXEnabled( void );
+void RayTrace_SetAVXEnabled( bool bEnabled );
+
 class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
+	// rays are batched by direction octant, 8 at a time so they can go through Trace8Rays
+	RayTracingSingleResult *PendingStreamOutputs[8][8];
 	int n_in_stream[8];
-	FourRays PendingRays[8];
+	FourRays PendingRays[8][2];
 
 public:
 	RayStream(void)
@@ -267,12 +297,14 @@ public:
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	RayTraceTreeStats_t m_TreeStats;						//< from SetupAccelerationStructure
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		memset( &m_TreeStats, 0, sizeof( m_TreeStats ) );
 	}
 
 
@@ -297,6 +329,18 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// walk the kd-tree to fill in m_TreeStats, and print them
+	void CalculateTreeStats(void);
+	void PrintTreeStats(void) const;
+
+	// the set up tree and triangles can be saved, and loaded back in place of
+	// SetupAccelerationStructure when the same triangles have been added again.
+	// CalculateGeometryHash must be called before setup, while the triangles still
+	// hold their vertices. Load returns false if the file is missing or doesn't match.
+	uint32 CalculateGeometryHash(void) const;
+	bool SaveAccelerationStructure(const char *pFileName, uint32 nGeometryHash) const;
+	bool LoadAccelerationStructure(const char *pFileName, uint32 nGeometryHash);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +354,12 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// AVX version of Trace4Rays for 8 rays starting at t=0. all 8 rays must match
+	// DirectionSignMask. Only valid when RayTrace_IsAVXEnabled().
+	void Trace8Rays(const FourRays &rays0, const FourRays &rays1, fltx4 TMax0, fltx4 TMax1,
+					int DirectionSignMask, RayTracingResult *rslt_out0, RayTracingResult *rslt_out1,
+					int32 skip_id=-1);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -39,6 +39,8 @@ class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesArena;
+struct KeyValuesArenaNode_t;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -302,6 +304,16 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// Keys allocated from a CKeyValuesArena
+	friend class CKeyValuesArena;
+	KeyValuesArenaNode_t *GetArenaNode() const;
+	KeyValues *AllocKeyValues( const char *setName ) const;	// a new key, from our arena if we're in one
+	void ReleaseArenaKey();
+	void BuildChildIndex( int nMinChildren );
+	KeyValues *FindKeyInChildIndex( int keySymbol ) const;
+	void DropChildIndex();
+	void DropParentChildIndex();								// our name or our place among our peers changed
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -320,7 +332,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nArenaFlags; // non-zero if this key was allocated from a CKeyValuesArena
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -349,6 +361,57 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+//-----------------------------------------------------------------------------
+// Purpose: Allocates KeyValues trees that are loaded once and freed all at once,
+//			like scripts and manifests. Every key and value parsed into the arena
+//			is carved out of a few large blocks instead of being its own heap
+//			allocation, and Clear() frees all of them in one call. Keys with many
+//			children get a hash of them by name, so FindKey() doesn't walk the list.
+//
+//			Create the root with CreateKeyValues(), then load it as usual:
+//
+//				CKeyValuesArena arena;
+//				KeyValues *pKV = arena.CreateKeyValues( "WeaponData" );
+//				if ( pKV->LoadFromFile( filesystem, pszFile, "GAME" ) ) ...
+//
+//			Arena trees can be read and edited like any other. Keys added to them
+//			come from the arena too, and keys moved in from the heap are freed with
+//			the tree. deleteThis() works on arena keys: it frees whatever they hold
+//			on the heap right away, but their own memory only comes back with
+//			Clear() or the arena's destructor. Don't hand arena keys to another
+//			module, and MakeCopy() a tree that must outlive the arena.
+//-----------------------------------------------------------------------------
+class CKeyValuesArena
+{
+public:
+	// Keys with at least nIndexMinChildren children are hashed for FindKey() (0 = never)
+	CKeyValuesArena( int nIndexMinChildren = 32, int nBlockSize = 32 * 1024 );
+	~CKeyValuesArena();
+
+	// Create a root key in the arena
+	KeyValues *CreateKeyValues( const char *setName );
+
+	// Free every tree in the arena. Keys created by the arena can't be used afterwards.
+	void Clear();
+
+	int GetBytesAllocated() const { return m_nBytesAllocated; }
+
+private:
+	friend class KeyValues;
+
+	void *Alloc( int nSize );
+	KeyValues *NewKey( const char *setName );
+
+	CUtlVector< unsigned char * > m_Blocks;
+	unsigned char *m_pNextAlloc;
+	unsigned char *m_pAllocLimit;
+	int m_nBlockSize;
+	int m_nIndexMinChildren;
+	int m_nBytesAllocated;
+
+	CUtlVector< KeyValues * > m_Roots;
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
@@ -217,6 +217,11 @@ public:
 	void			WriteBitVec3Normal( const Vector& fa );
 	void			WriteBitAngles( const QAngle& fa );
 
+	// Same encoding as calling WriteBitVec3Coord/WriteBitAngles on each one, 
+	// but the buffer is checked once for all of them.
+	void			WriteBitVec3Coords( const Vector *pVectors, int nCount );
+	void			WriteBitAngles( const QAngle *pAngles, int nCount );
+
 
 // Byte functions.
 public:
@@ -591,6 +596,8 @@ public:
 	void			ReadBitVec3Coord( Vector& fa );
 	void			ReadBitVec3Normal( Vector& fa );
 	void			ReadBitAngles( QAngle& fa );
+	void			ReadBitVec3Coords( Vector *pVectors, int nCount );
+	void			ReadBitAngles( QAngle *pAngles, int nCount );
 
 	// Faster for comparisons but do not fully decode float values
 	unsigned int	ReadBitCoordBits();
@@ -803,6 +810,110 @@ BITBUF_INLINE int bf_read::CompareBits( bf_read * RESTRICT other, int numbits )
 }
 
 
+//-----------------------------------------------------------------------------
+// Writes a run of fields through a 64-bit accumulator. The constructor reserves
+// room for the most bits that will be written and checks the buffer once; the
+// writes themselves aren't checked, and whole dwords go to the buffer as they
+// fill up. Commit() (or the destructor) stores the last partial dword and
+// advances the bf_write. The output is bit for bit what bf_write would write.
+//
+// If the reservation doesn't fit, IsValid() is false, nothing may be written,
+// and the caller should use bf_write itself so it overflows as usual.
+//-----------------------------------------------------------------------------
+class bf_write_reserved
+{
+public:
+	bf_write_reserved( bf_write &buf, int nMaxBits );
+	~bf_write_reserved() { Commit(); }
+
+	bool			IsValid() const { return m_pOut != NULL; }
+	int				GetNumBitsWritten() const { return m_nBitsWritten; }
+
+	void			WriteOneBit( int nValue ) { WriteUBitLong( nValue ? 1 : 0, 1 ); }
+	void			WriteUBitLong( uint32 data, int numbits );
+	void			WriteBitCoord( float f );
+	void			WriteBitVec3Coord( const Vector &fa );
+
+	void			Commit();
+
+private:
+	bf_write		&m_Buf;
+	uint32			*m_pOut;			// the dword the accumulator starts at
+	uint64			m_nAccum;			// bits not yet stored, lowest first
+	int				m_nAccumBits;
+	int				m_nBitsWritten;
+	int				m_nMaxBits;
+};
+
+BITBUF_INLINE void bf_write_reserved::WriteUBitLong( uint32 data, int numbits )
+{
+	Assert( IsValid() && numbits >= 0 && numbits <= 32 );
+	Assert( m_nBitsWritten + numbits <= m_nMaxBits );
+
+	m_nAccum |= ( (uint64)data & ( ( (uint64)1 << numbits ) - 1 ) ) << m_nAccumBits;
+	m_nAccumBits += numbits;
+	m_nBitsWritten += numbits;
+
+	if ( m_nAccumBits >= 32 )
+	{
+		*m_pOut++ = LittleDWord( (uint32)m_nAccum );
+		m_nAccum >>= 32;
+		m_nAccumBits -= 32;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads a run of fields through a 64-bit accumulator, the other way around.
+// Only the dwords holding bits that are actually read are loaded. If fewer than
+// nMaxBits are left in the buffer, IsValid() is false and the caller should read
+// from bf_read itself.
+//-----------------------------------------------------------------------------
+class bf_read_reserved
+{
+public:
+	bf_read_reserved( bf_read &buf, int nMaxBits );
+	~bf_read_reserved() { Commit(); }
+
+	bool			IsValid() const { return m_pIn != NULL; }
+	int				GetNumBitsRead() const { return m_nBitsRead; }
+
+	int				ReadOneBit() { return ReadUBitLong( 1 ); }
+	uint32			ReadUBitLong( int numbits );
+	float			ReadBitCoord();
+	void			ReadBitVec3Coord( Vector &fa );
+
+	// Advances the bf_read past what was read
+	void			Commit();
+
+private:
+	bf_read			&m_Buf;
+	const uint32	*m_pIn;				// the next dword to load
+	uint64			m_nAccum;
+	int				m_nAccumBits;
+	int				m_nBitsRead;
+	int				m_nMaxBits;
+};
+
+BITBUF_INLINE uint32 bf_read_reserved::ReadUBitLong( int numbits )
+{
+	Assert( IsValid() && numbits > 0 && numbits <= 32 );
+	Assert( m_nBitsRead + numbits <= m_nMaxBits );
+
+	if ( m_nAccumBits < numbits )
+	{
+		m_nAccum |= (uint64)LittleDWord( *m_pIn++ ) << m_nAccumBits;
+		m_nAccumBits += 32;
+	}
+
+	uint32 data = (uint32)( m_nAccum & ( ( (uint64)1 << numbits ) - 1 ) );
+	m_nAccum >>= numbits;
+	m_nAccumBits -= numbits;
+	m_nBitsRead += numbits;
+	return data;
+}
+
+
 #endif
 
 
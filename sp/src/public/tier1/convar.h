@@ -679,6 +679,18 @@ private:
    static ConCommand name##_command( #name, name, description, flags ); \
    static void name( const CCommand &args )
 
+#ifdef CLIENT_DLL
+	#define CON_COMMAND_F_SHARED( name, description, flags ) \
+		static void name( const CCommand &args ); \
+		static ConCommand name##_command_client( #name "_client", name, description, flags ); \
+		static void name( const CCommand &args )
+#else
+	#define CON_COMMAND_F_SHARED( name, description, flags ) \
+		static void name( const CCommand &args ); \
+		static ConCommand name##_command( #name, name, description, flags ); \
+		static void name( const CCommand &args )
+#endif
+
 #define CON_COMMAND_F_COMPLETION( name, description, flags, completion ) \
 	static void name( const CCommand &args ); \
 	static ConCommand name##_command( #name, name, description, flags, completion ); \
@@ -106,24 +106,96 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// 
+// Purpose: Thread safe pool. Each thread keeps two magazines (small stacks of
+//			free blocks) and allocates from and frees to them without locking.
+//			Full magazines are traded through a lock-free depot; the lock is only
+//			taken when the depot runs dry and new blocks come out of the pool.
+//			Blocks freed by one thread can be allocated by any other. A thread's
+//			magazines go back to the pool when the thread exits.
 //-----------------------------------------------------------------------------
 class CMemoryPoolMT : public CUtlMemoryPool
 {
 public:
-	CMemoryPoolMT(int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner) {}
+	CMemoryPoolMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CMemoryPoolMT();
 
+	void*		Alloc();
+	void*		Alloc( size_t amount );
+	void*		AllocZero();
+	void*		AllocZero( size_t amount );
+	void		Free( void *pMem );
 
-	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
-	void*		Alloc( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc( amount ); }
-	void*		AllocZero()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero(); }	
-	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
-	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+	// Frees everything. No other thread may be using the pool.
+	void		Clear();
+
+	// returns number of blocks in use (blocks cached by threads don't count)
+	int			Count() const;
+	// returns the most blocks ever taken out of the pool, cached or in use
+	int			PeakCount() const { return m_PeakAlloc; }
+
+	struct Stats_t
+	{
+		int m_nAllocs;				// calls to Alloc()
+		int m_nCacheHits;			// allocations served by the thread's own magazines
+		int m_nDepotHits;			// allocations that took a full magazine from the depot
+		int m_nPoolRefills;			// times a magazine was refilled from the pool under the lock
+		int m_nInUse;				// same as Count()
+		int m_nPeakCount;			// same as PeakCount()
+		int m_nThreads;				// threads that have used the pool
+		int m_nMagazines;
+	};
+	void		GetStats( Stats_t &stats ) const;
 
-	// Frees everything
-	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
 private:
-	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
+	enum
+	{
+		MAGAZINE_SIZE = 32,
+	};
+
+	struct TSLIST_NODE_ALIGN Magazine_t : public TSLNodeBase_t
+	{
+		int m_nCount;
+		void *m_pBlocks[MAGAZINE_SIZE];
+	} TSLIST_NODE_ALIGN_POST;
+
+	// Only ever written by its own thread
+	struct ThreadCache_t
+	{
+		Magazine_t *m_pLoaded;
+		Magazine_t *m_pPrevious;
+		int m_nAllocs;
+		int m_nFrees;
+		int m_nCacheHits;
+		int m_nDepotHits;
+		int m_nPoolRefills;
+	};
+
+	// Every pool shares one thread local slot, holding this for each pool slot
+	struct ThreadCacheRef_t
+	{
+		int m_nPoolSerial;
+		ThreadCache_t *m_pCache;
+	};
+
+	ThreadCache_t	*GetThreadCache();
+	ThreadCache_t	*NewThreadCache();
+	void			ReleaseThreadCache( ThreadCache_t *pCache );
+	Magazine_t		*NewMagazine();
+	void			*AllocFromPool( ThreadCache_t *pCache );
+	void			FreeToDepot( ThreadCache_t *pCache );
+
+	static void STDCALL ReleaseThreadCaches( void *pThreadCaches );	// thread exit callback of the shared thread local slot
+
+	bool			m_bUseCaches;					// UTLMEMORYPOOL_GROW_NONE pools lock every call, so no block sits in a cache while another thread runs out
+	int				m_iCacheSlot;					// index into each thread's ThreadCacheRef_t list
+	int				m_nCacheSerial;					// tells this pool apart from earlier ones in the same slot
+	CTSListBase		m_FullMagazines;				// the depot
+	CTSListBase		m_EmptyMagazines;
+	CThreadFastMutex m_mutex;						// guards CUtlMemoryPool and the lists below
+	CUtlVector<ThreadCache_t *> m_ThreadCaches;
+	CUtlVector<Magazine_t *> m_Magazines;
+	ThreadCache_t	m_ExitedThreads;				// counters of the caches released by exited threads
+	int				m_nThreadsSeen;
 };
 
 
@@ -993,6 +993,12 @@ public:
 
 	virtual void DumpState() = 0;
 
+#ifdef MAPBASE_VSCRIPT
+	// Counts calls and time spent in each bound native function and hook
+	virtual void SetProfilingEnabled( bool bEnabled ) = 0;
+	virtual void DumpProfile( bool bReset ) = 0;
+#endif
+
 	virtual void SetOutputCallback( ScriptOutputFunc_t pFunc ) = 0;
 	virtual void SetErrorCallback( ScriptErrorFunc_t pFunc ) = 0;
 
@@ -5,6 +5,9 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include "tier0/threadtools.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlbuffer.h"
 
 static bool SameSign(float a, float b)
 {
@@ -257,10 +260,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit(int split_plane, float spli
 	return PLANECHECK_STRADDLING;
 }
 
-#define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
-#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
-
 struct NodeToVisit {
 	CacheOptimizedKDNode const *node;
 	fltx4 TMin;
@@ -272,6 +271,12 @@ static fltx4 FourEpsilons={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
 static fltx4 FourZeros={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
 static fltx4 FourNegativeEpsilons={-1.0e-10,-1.0e-10,-1.0e-10,-1.0e-10};
 
+#ifdef RAYTRACE_AVX
+// raytrace_avx.cpp
+void IntersectTrianglePair4RaysAVX( const FourRays &rays, TriIntersectData_t const *pTri0, int32 nTri0,
+									TriIntersectData_t const *pTri1, int32 nTri1, RayTracingResult *rslt_out );
+#endif
+
 static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 {
 	Vector boxdim=boxmax-boxmin;
@@ -346,6 +351,107 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+// intersect 4 rays with one triangle, updating any rays that hit it closer than their
+// current hit
+static FORCEINLINE void IntersectTriangle4Rays( const FourRays &rays, TriIntersectData_t const *tri, int32 tnum,
+										   ITransparentTriangleCallback *pCallback, RayTracingResult *rslt_out )
+{
+#ifndef MAPBASE
+	n_intersection_calculations++;
+#endif
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
@@ -377,6 +483,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
 	memset(mailboxids,0xff,sizeof(mailboxids));				// !!speed!! keep around?
 
+#ifdef RAYTRACE_AVX
+	bool bUseAVX = RayTrace_IsAVXEnabled();
+	TriIntersectData_t const *pPendingTri = NULL;			// opaque triangle waiting for a partner
+	int32 nPendingTri = 0;
+#endif
+
 	int front_idx[3],back_idx[3];							// based on ray direction, whether to
 															// visit left or right node first
 
@@ -478,106 +590,38 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
-#ifndef MAPBASE
-					n_intersection_calculations++;
-#endif
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+#ifdef RAYTRACE_AVX
+					if ( bUseAVX && !( tri->m_nFlags & FCACHETRI_TRANSPARENT ) )
 					{
-						if ( pCallback )
+						// opaque triangles are tested two at a time, 4 rays against each
+						if ( !pPendingTri )
 						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
+							pPendingTri = tri;
+							nPendingTri = tnum;
+							continue;
 						}
+						IntersectTrianglePair4RaysAVX( rays, pPendingTri, nPendingTri, tri, tnum, rslt_out );
+						pPendingTri = NULL;
+						continue;
 					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					if ( pPendingTri )
+					{
+						// keep triangle order for the transparency callback
+						IntersectTriangle4Rays( rays, pPendingTri, nPendingTri, pCallback, rslt_out );
+						pPendingTri = NULL;
+					}
+#endif
+					IntersectTriangle4Rays( rays, tri, tnum, pCallback, rslt_out );
 				}
 			} while (--ntris);
+#ifdef RAYTRACE_AVX
+			if ( pPendingTri )
+			{
+				IntersectTriangle4Rays( rays, pPendingTri, nPendingTri, pCallback, rslt_out );
+				pPendingTri = NULL;
+			}
+#endif
 			// now, check if all rays have terminated
 			fltx4 raydone=CmpLeSIMD(TMax,rslt_out->HitDistance);
 			if (! IsAnyNegative(raydone))
@@ -876,24 +920,576 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
+//-----------------------------------------------------------------------------
+// Binned SAH kd-tree builder
+//
+// RefineNode classifies every triangle against every candidate plane, which is
+// quadratic in the number of triangles in a node. Instead, this drops the extents
+// of each triangle into KDTREE_SAH_BINS bins per axis and evaluates the same cost
+// formula at the bin boundaries, plus the two planes that cut away empty space.
+// The chosen plane is then classified exactly, with the same rules as
+// ClassifyAgainstAxisSplit.
+//
+// Triangle bounds are precomputed and the triangles themselves are never written,
+// so subtrees at KDTREE_PARALLEL_DEPTH are built on worker threads into their own
+// node lists and spliced into OptimizedKDTree afterwards. The resulting tree does
+// not depend on the number of threads.
+//-----------------------------------------------------------------------------
+
+#define KDTREE_SAH_BINS 32
+#define KDTREE_PARALLEL_DEPTH 6								// depth at which subtrees go to threads
+#define KDTREE_PARALLEL_MIN_TRIS 256						// smaller subtrees are built in place
+#define KDTREE_PARALLEL_MIN_TOTAL_TRIS 8192					// don't start threads for small scenes
+#define KDTREE_MAX_BUILD_THREADS 64
+
+struct KDTreeSubtree_t
+{
+	int m_nNode;											// node in OptimizedKDTree this replaces
+	int m_nDepth;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	CUtlVector<int32> m_Triangles;
+
+	// output. m_Nodes[0] is the subtree root, children index into m_Nodes and leaves
+	// index into m_TriangleIndices
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndices;
+};
+
+static float SAHSplitCost( Vector const &MinBound, Vector const &MaxBound, float ISA,
+						   int split_plane, float split_value, int nleft, int nright, int nboth )
+{
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+	float SA_L=BoxSurfaceArea(MinBound,LeftMaxes);
+	float SA_R=BoxSurfaceArea(RightMins,MaxBound);
+	return COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+(SA_L*ISA*nleft)+(SA_R*ISA*nright));
+}
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( Vector const *pTriMins, Vector const *pTriMaxs,
+					CUtlVector<CacheOptimizedKDNode> &Nodes, CUtlVector<int32> &TriangleIndices,
+					CUtlVector<KDTreeSubtree_t *> *pSubtrees )
+		: m_pTriMins( pTriMins ), m_pTriMaxs( pTriMaxs ),
+		  m_Nodes( Nodes ), m_TriangleIndices( TriangleIndices ), m_pSubtrees( pSubtrees )
+	{
+	}
+
+	void BuildNode( int node_number, int32 const *tri_list, int ntris,
+					Vector MinBound, Vector MaxBound, int depth );
+
+private:
+	void MakeLeaf( int node_number, int32 const *tri_list, int ntris,
+				   Vector const &MinBound, Vector const &MaxBound );
+	float FindBestSplit( int32 const *tri_list, int ntris, Vector const &MinBound,
+						 Vector const &MaxBound, int &split_plane, float &split_value );
+
+	Vector const *m_pTriMins;
+	Vector const *m_pTriMaxs;
+	CUtlVector<CacheOptimizedKDNode> &m_Nodes;
+	CUtlVector<int32> &m_TriangleIndices;
+	CUtlVector<KDTreeSubtree_t *> *m_pSubtrees;				// if set, deep subtrees are deferred here
+};
+
+void CKDTreeBuilder::MakeLeaf( int node_number, int32 const *tri_list, int ntris,
+							   Vector const &MinBound, Vector const &MaxBound )
+{
+	m_Nodes[node_number].Children=KDNODE_STATE_LEAF+(m_TriangleIndices.Count()<<2);
+	m_Nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	m_Nodes[node_number].vecMins = MinBound;
+	m_Nodes[node_number].vecMaxs = MaxBound;
+#endif
+	m_TriangleIndices.AddMultipleToTail( ntris, tri_list );
+}
+
+float CKDTreeBuilder::FindBestSplit( int32 const *tri_list, int ntris, Vector const &MinBound,
+									 Vector const &MaxBound, int &split_plane, float &split_value )
+{
+	float best_cost=1.0e23;
+	split_plane=-1;
+	split_value=0;
+
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float flMin=MinBound[axis];
+		float flExtent=MaxBound[axis]-flMin;
+		if (flExtent<=0)
+			continue;
+
+		// count where each triangle starts and ends along this axis
+		int nStart[KDTREE_SAH_BINS];
+		int nEnd[KDTREE_SAH_BINS];
+		memset( nStart, 0, sizeof( nStart ) );
+		memset( nEnd, 0, sizeof( nEnd ) );
+		float tri_min=1.0e23,tri_max=-1.0e23;
+		float flScale=KDTREE_SAH_BINS/flExtent;
+		for(int t=0;t<ntris;t++)
+		{
+			float lo=m_pTriMins[tri_list[t]][axis];
+			float hi=m_pTriMaxs[tri_list[t]][axis];
+			tri_min=min(tri_min,lo);
+			tri_max=max(tri_max,hi);
+			nStart[clamp( (int) ((lo-flMin)*flScale), 0, KDTREE_SAH_BINS-1 )]++;
+			nEnd[clamp( (int) ((hi-flMin)*flScale), 0, KDTREE_SAH_BINS-1 )]++;
+		}
+
+		// sweep the bin boundaries. a triangle that has ended is on the left, one that
+		// hasn't started is on the right, and anything else straddles.
+		int nended=0,nstarted=0;
+		for(int b=1;b<KDTREE_SAH_BINS;b++)
+		{
+			nended+=nEnd[b-1];
+			nstarted+=nStart[b-1];
+			float trial_splitvalue=flMin+(flExtent*b)/KDTREE_SAH_BINS;
+			float trial_cost=SAHSplitCost(MinBound,MaxBound,ISA,axis,trial_splitvalue,
+										  nended,ntris-nstarted,nstarted-nended);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+
+		// cut off empty space, like the "growing" done by CalculateCostsOfSplit
+		if (tri_min>flMin)
+		{
+			float trial_cost=SAHSplitCost(MinBound,MaxBound,ISA,axis,tri_min,0,ntris,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=tri_min;
+			}
+		}
+		if (tri_max<MaxBound[axis])
+		{
+			float trial_cost=SAHSplitCost(MinBound,MaxBound,ISA,axis,tri_max,ntris,0,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=tri_max;
+			}
+		}
+	}
+	return best_cost;
+}
+
+void CKDTreeBuilder::BuildNode( int node_number, int32 const *tri_list, int ntris,
+								Vector MinBound, Vector MaxBound, int depth )
+{
+	if ( (ntris<3) || (depth>MAX_TREE_DEPTH) || (BoxSurfaceArea(MinBound,MaxBound)<=0) )
+	{
+		MakeLeaf(node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	if ( m_pSubtrees && (depth>=KDTREE_PARALLEL_DEPTH) && (ntris>=KDTREE_PARALLEL_MIN_TRIS) )
+	{
+		// leave this node for a worker thread
+		KDTreeSubtree_t *pSubtree=new KDTreeSubtree_t;
+		pSubtree->m_nNode=node_number;
+		pSubtree->m_nDepth=depth;
+		pSubtree->m_MinBound=MinBound;
+		pSubtree->m_MaxBound=MaxBound;
+		pSubtree->m_Triangles.CopyArray(tri_list,ntris);
+		m_pSubtrees->AddToTail(pSubtree);
+		return;
+	}
+
+	int split_plane;
+	float split_value;
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if ( FindBestSplit(tri_list,ntris,MinBound,MaxBound,split_plane,split_value)>=cost_of_no_split )
+	{
+		MakeLeaf(node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// classify against the chosen plane exactly. left and straddling triangles
+	// go at the front of the list, straddling and right ones at the back.
+	int32 *new_triangle_list=new int32[ntris];
+	int nleft=0,nright=0,nboth=0;
+	float tri_min=1.0e23,tri_max=-1.0e23;
+	for(int t=0;t<ntris;t++)
+	{
+		float minc=m_pTriMins[tri_list[t]][split_plane];
+		float maxc=m_pTriMaxs[tri_list[t]][split_plane];
+		tri_min=min(tri_min,minc);
+		tri_max=max(tri_max,maxc);
+		if ( (minc>=split_value) || ((maxc>split_value) && (minc==maxc)) )
+			new_triangle_list[ntris-(++nright)]=tri_list[t];
+		else if (maxc<=split_value)
+			new_triangle_list[nleft++]=tri_list[t];
+	}
+	for(int t=0;t<ntris;t++)
+	{
+		float minc=m_pTriMins[tri_list[t]][split_plane];
+		float maxc=m_pTriMaxs[tri_list[t]][split_plane];
+		if ( (minc<split_value) && (maxc>split_value) )
+			new_triangle_list[nleft+(nboth++)]=tri_list[t];
+	}
+	Assert( nleft+nright+nboth==ntris );
+
+	// the binned estimate can be off, so check the real cost before committing
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+	if ( (nboth==ntris) ||
+		 (SAHSplitCost(MinBound,MaxBound,ISA,split_plane,split_value,nleft,nright,nboth)>=cost_of_no_split) )
+	{
+		delete[] new_triangle_list;
+		MakeLeaf(node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// if the split resulted in one half being empty, "grow" the empty half
+	if (nleft && (nboth==0) && (nright==0))
+		split_value=tri_max;
+	if (nright && (nboth==0) && (nleft==0))
+		split_value=tri_min;
+
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+
+	int left_child=m_Nodes.Count();
+	int right_child=left_child+1;
+	m_Nodes[node_number].Children=split_plane+(left_child<<2);
+	m_Nodes[node_number].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+	m_Nodes[node_number].vecMins = MinBound;
+	m_Nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode;
+	m_Nodes.AddToTail(newnode);
+	m_Nodes.AddToTail(newnode);
+
+	if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+		depth+=100;
+	BuildNode(left_child,new_triangle_list,nleft+nboth,MinBound,LeftMaxes,depth+1);
+	BuildNode(right_child,new_triangle_list+nleft,nright+nboth,RightMins,MaxBound,depth+1);
+	delete[] new_triangle_list;
+}
+
+
+struct KDTreeBuildJobs_t
+{
+	Vector const *m_pTriMins;
+	Vector const *m_pTriMaxs;
+	KDTreeSubtree_t **m_ppSubtrees;							// biggest first
+	int m_nSubtrees;
+	long volatile m_nNextSubtree;
+};
+
+static unsigned KDTreeBuildThread( void *pParam )
+{
+	KDTreeBuildJobs_t *pJobs=(KDTreeBuildJobs_t *) pParam;
+	for(;;)
+	{
+		int i=ThreadInterlockedIncrement(&pJobs->m_nNextSubtree)-1;
+		if (i>=pJobs->m_nSubtrees)
+			break;
+
+		KDTreeSubtree_t *pSubtree=pJobs->m_ppSubtrees[i];
+		CKDTreeBuilder builder(pJobs->m_pTriMins,pJobs->m_pTriMaxs,
+							   pSubtree->m_Nodes,pSubtree->m_TriangleIndices,NULL);
+		CacheOptimizedKDNode root;
+		pSubtree->m_Nodes.AddToTail(root);
+		builder.BuildNode(0,pSubtree->m_Triangles.Base(),pSubtree->m_Triangles.Count(),
+						  pSubtree->m_MinBound,pSubtree->m_MaxBound,pSubtree->m_nDepth);
+		pSubtree->m_Triangles.Purge();
+	}
+	return 0;
+}
+
+static int __cdecl CompareSubtreeSizes( KDTreeSubtree_t * const *ppLeft, KDTreeSubtree_t * const *ppRight )
+{
+	return (*ppRight)->m_Triangles.Count()-(*ppLeft)->m_Triangles.Count();
+}
+
+
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
+	double flStartTime=Plat_FloatTime();
+
+	int ntris=OptimizedTriangleList.Count();
+	CUtlVector<Vector> TriMins;
+	CUtlVector<Vector> TriMaxs;
+	TriMins.SetCount(ntris);
+	TriMaxs.SetCount(ntris);
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
+	{
+		root_triangle_list[t]=t;
+		CalculateTriangleListBounds(root_triangle_list+t,1,TriMins[t],TriMaxs[t]);
+	}
+	CalculateTriangleListBounds(root_triangle_list,ntris,m_MinBound,m_MaxBound);
+
+	// build the top of the tree here, collecting the subtrees below it
+	CUtlVector<KDTreeSubtree_t *> Subtrees;
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
-	for(int t=0;t<OptimizedTriangleList.Count();t++)
-		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	CKDTreeBuilder builder(TriMins.Base(),TriMaxs.Base(),OptimizedKDTree,TriangleIndexList,
+						   (ntris>=KDTREE_PARALLEL_MIN_TOTAL_TRIS) ? &Subtrees : NULL);
+	builder.BuildNode(0,root_triangle_list,ntris,m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
 
+	m_TreeStats.m_nSubtrees=Subtrees.Count();
+	m_TreeStats.m_nThreads=1;
+	if (Subtrees.Count())
+	{
+		// the splice below goes in the original order, so the tree is the same however
+		// the work was spread
+		CUtlVector<KDTreeSubtree_t *> Jobs;
+		Jobs.CopyArray(Subtrees.Base(),Subtrees.Count());
+		Jobs.Sort(CompareSubtreeSizes);
+
+		KDTreeBuildJobs_t jobs;
+		jobs.m_pTriMins=TriMins.Base();
+		jobs.m_pTriMaxs=TriMaxs.Base();
+		jobs.m_ppSubtrees=Jobs.Base();
+		jobs.m_nSubtrees=Jobs.Count();
+		jobs.m_nNextSubtree=0;
+
+		int nThreads=GetCPUInformation()->m_nLogicalProcessors;
+		nThreads=clamp(nThreads,1,min(Jobs.Count(),KDTREE_MAX_BUILD_THREADS));
+		m_TreeStats.m_nThreads=nThreads;
+
+		ThreadHandle_t hThreads[KDTREE_MAX_BUILD_THREADS];
+		for(int i=1;i<nThreads;i++)
+			hThreads[i]=CreateSimpleThread(KDTreeBuildThread,&jobs);
+		KDTreeBuildThread(&jobs);
+		for(int i=1;i<nThreads;i++)
+		{
+			ThreadJoin(hThreads[i]);
+			ReleaseThreadHandle(hThreads[i]);
+		}
+
+		for(int s=0;s<Subtrees.Count();s++)
+		{
+			KDTreeSubtree_t *pSubtree=Subtrees[s];
+			// subtree node i>0 lands at node_base+i. node 0 replaces the placeholder.
+			int node_base=OptimizedKDTree.Count()-1;
+			int tri_base=TriangleIndexList.Count();
+			OptimizedKDTree.EnsureCapacity(node_base+pSubtree->m_Nodes.Count());
+			for(int i=0;i<pSubtree->m_Nodes.Count();i++)
+			{
+				CacheOptimizedKDNode node=pSubtree->m_Nodes[i];
+				if (node.NodeType()==KDNODE_STATE_LEAF)
+					node.Children+=tri_base<<2;
+				else
+					node.Children+=node_base<<2;
+				if (i==0)
+					OptimizedKDTree[pSubtree->m_nNode]=node;
+				else
+					OptimizedKDTree.AddToTail(node);
+			}
+			TriangleIndexList.AddMultipleToTail(pSubtree->m_TriangleIndices.Count(),
+												pSubtree->m_TriangleIndices.Base());
+			delete pSubtree;
+		}
+	}
+
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	m_TreeStats.m_flBuildTime=Plat_FloatTime()-flStartTime;
+	CalculateTreeStats();
 }
 
 
+void RayTracingEnvironment::CalculateTreeStats(void)
+{
+	struct StatsNode_t
+	{
+		int m_nNode;
+		int m_nDepth;
+		Vector m_MinBound;
+		Vector m_MaxBound;
+	};
+
+	m_TreeStats.m_nNodes=OptimizedKDTree.Count();
+	m_TreeStats.m_nLeaves=0;
+	m_TreeStats.m_nEmptyLeaves=0;
+	m_TreeStats.m_nMaxLeafTriangles=0;
+	m_TreeStats.m_nTriangleReferences=0;
+	m_TreeStats.m_nMaxDepth=0;
+	m_TreeStats.m_flSAHCost=0;
+	if (!OptimizedKDTree.Count())
+		return;
+
+	float flRootArea=BoxSurfaceArea(m_MinBound,m_MaxBound);
+	float ISA=(flRootArea>0)?1.0/flRootArea:0;
+
+	CUtlVector<StatsNode_t> Stack;
+	StatsNode_t root = { 0, 0, m_MinBound, m_MaxBound };
+	Stack.AddToTail(root);
+	while (Stack.Count())
+	{
+		StatsNode_t cur=Stack.Tail();
+		Stack.RemoveMultipleFromTail(1);
+		CacheOptimizedKDNode const &node=OptimizedKDTree[cur.m_nNode];
+		float flProbability=BoxSurfaceArea(cur.m_MinBound,cur.m_MaxBound)*ISA;
+		m_TreeStats.m_nMaxDepth=max(m_TreeStats.m_nMaxDepth,cur.m_nDepth);
+		if (node.NodeType()==KDNODE_STATE_LEAF)
+		{
+			int n=node.NumberOfTrianglesInLeaf();
+			m_TreeStats.m_nLeaves++;
+			if (!n)
+				m_TreeStats.m_nEmptyLeaves++;
+			m_TreeStats.m_nMaxLeafTriangles=max(m_TreeStats.m_nMaxLeafTriangles,n);
+			m_TreeStats.m_nTriangleReferences+=n;
+			m_TreeStats.m_flSAHCost+=COST_OF_INTERSECTION*n*flProbability;
+		}
+		else
+		{
+			m_TreeStats.m_flSAHCost+=COST_OF_TRAVERSAL*flProbability;
+			StatsNode_t left=cur, right=cur;
+			left.m_nNode=node.LeftChild();
+			right.m_nNode=node.RightChild();
+			left.m_nDepth=right.m_nDepth=cur.m_nDepth+1;
+			left.m_MaxBound[node.NodeType()]=node.SplittingPlaneValue;
+			right.m_MinBound[node.NodeType()]=node.SplittingPlaneValue;
+			Stack.AddToTail(left);
+			Stack.AddToTail(right);
+		}
+	}
+}
+
+
+void RayTracingEnvironment::PrintTreeStats(void) const
+{
+	Msg( "kd-tree: %.2f seconds, %d subtrees on %d threads\n",
+		 m_TreeStats.m_flBuildTime, m_TreeStats.m_nSubtrees, m_TreeStats.m_nThreads );
+	Msg( "kd-tree: %d nodes, %d leaves (%d empty), depth %d\n",
+		 m_TreeStats.m_nNodes, m_TreeStats.m_nLeaves, m_TreeStats.m_nEmptyLeaves, m_TreeStats.m_nMaxDepth );
+	Msg( "kd-tree: %.2f triangle refs per triangle, %.2f per leaf (max %d), SAH cost %.0f (%.0f unsplit)\n",
+		 OptimizedTriangleList.Count() ? (float) m_TreeStats.m_nTriangleReferences/OptimizedTriangleList.Count() : 0.0f,
+		 (m_TreeStats.m_nLeaves-m_TreeStats.m_nEmptyLeaves) ? (float) m_TreeStats.m_nTriangleReferences/(m_TreeStats.m_nLeaves-m_TreeStats.m_nEmptyLeaves) : 0.0f,
+		 m_TreeStats.m_nMaxLeafTriangles, m_TreeStats.m_flSAHCost,
+		 (float) COST_OF_INTERSECTION*OptimizedTriangleList.Count() );
+}
+
+
+
+// on-disk acceleration structure. bump the version whenever the tree builder or
+// the layout of the nodes or triangles changes.
+#define RAYTRACE_CACHE_MAGIC (('K'<<24)|('D'<<16)|('T'<<8)|'C')
+#define RAYTRACE_CACHE_VERSION 1
+
+struct RayTraceCacheHeader_t
+{
+	uint32 m_nMagic;
+	uint32 m_nVersion;
+	uint32 m_nGeometryHash;
+	int32 m_nNodeSize;										// sizeof(CacheOptimizedKDNode)
+	int32 m_nTriangleSize;									// sizeof(CacheOptimizedTriangle)
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	int32 m_nTriangles;
+	float m_MinBound[3];
+	float m_MaxBound[3];
+	RayTraceTreeStats_t m_TreeStats;
+	// followed by the nodes, the triangle indices and the triangles
+};
+
+uint32 RayTracingEnvironment::CalculateGeometryHash(void) const
+{
+	CRC32_t crc;
+	CRC32_Init(&crc);
+	int ntris=OptimizedTriangleList.Count();
+	CRC32_ProcessBuffer(&crc,&ntris,sizeof(ntris));
+	for(int i=0;i<ntris;i++)
+	{
+		TriGeometryData_t const &tri=OptimizedTriangleList[i].m_Data.m_GeometryData;
+		CRC32_ProcessBuffer(&crc,&tri.m_nTriangleID,sizeof(tri.m_nTriangleID));
+		CRC32_ProcessBuffer(&crc,tri.m_VertexCoordData,sizeof(tri.m_VertexCoordData));
+		CRC32_ProcessBuffer(&crc,&tri.m_nFlags,sizeof(tri.m_nFlags));
+	}
+	CRC32_Final(&crc);
+	return crc;
+}
+
+bool RayTracingEnvironment::SaveAccelerationStructure(const char *pFileName, uint32 nGeometryHash) const
+{
+	RayTraceCacheHeader_t header;
+	memset(&header,0,sizeof(header));
+	header.m_nMagic=RAYTRACE_CACHE_MAGIC;
+	header.m_nVersion=RAYTRACE_CACHE_VERSION;
+	header.m_nGeometryHash=nGeometryHash;
+	header.m_nNodeSize=sizeof(CacheOptimizedKDNode);
+	header.m_nTriangleSize=sizeof(CacheOptimizedTriangle);
+	header.m_nNodes=OptimizedKDTree.Count();
+	header.m_nTriangleIndices=TriangleIndexList.Count();
+	header.m_nTriangles=OptimizedTriangleList.Count();
+	for(int c=0;c<3;c++)
+	{
+		header.m_MinBound[c]=m_MinBound[c];
+		header.m_MaxBound[c]=m_MaxBound[c];
+	}
+	header.m_TreeStats=m_TreeStats;
+
+	CUtlBuffer buf;
+	buf.EnsureCapacity(sizeof(header)+header.m_nNodes*sizeof(CacheOptimizedKDNode)+
+					   header.m_nTriangleIndices*sizeof(int32)+
+					   header.m_nTriangles*sizeof(CacheOptimizedTriangle));
+	buf.Put(&header,sizeof(header));
+	buf.Put(OptimizedKDTree.Base(),header.m_nNodes*sizeof(CacheOptimizedKDNode));
+	buf.Put(TriangleIndexList.Base(),header.m_nTriangleIndices*sizeof(int32));
+	for(int i=0;i<header.m_nTriangles;i++)					// block vector isn't contiguous
+		buf.Put(&OptimizedTriangleList[i],sizeof(CacheOptimizedTriangle));
+	return g_pFileSystem->WriteFile(pFileName,NULL,buf);
+}
+
+bool RayTracingEnvironment::LoadAccelerationStructure(const char *pFileName, uint32 nGeometryHash)
+{
+	if (!g_pFileSystem->FileExists(pFileName))
+		return false;
+	CUtlBuffer buf;
+	if (!g_pFileSystem->ReadFile(pFileName,NULL,buf))
+		return false;
+
+	RayTraceCacheHeader_t header;
+	if (buf.TellMaxPut()<(int)sizeof(header))
+		return false;
+	buf.Get(&header,sizeof(header));
+	if ((header.m_nMagic!=RAYTRACE_CACHE_MAGIC) ||
+		(header.m_nVersion!=RAYTRACE_CACHE_VERSION) ||
+		(header.m_nGeometryHash!=nGeometryHash) ||
+		(header.m_nNodeSize!=sizeof(CacheOptimizedKDNode)) ||
+		(header.m_nTriangleSize!=sizeof(CacheOptimizedTriangle)) ||
+		(header.m_nTriangles!=OptimizedTriangleList.Count()) ||
+		(header.m_nNodes<=0) || (header.m_nTriangleIndices<0))
+		return false;
+	int nExpectedSize=sizeof(header)+header.m_nNodes*sizeof(CacheOptimizedKDNode)+
+		header.m_nTriangleIndices*sizeof(int32)+header.m_nTriangles*sizeof(CacheOptimizedTriangle);
+	if (buf.TellMaxPut()!=nExpectedSize)
+		return false;
+
+	OptimizedKDTree.SetCount(header.m_nNodes);
+	buf.Get(OptimizedKDTree.Base(),header.m_nNodes*sizeof(CacheOptimizedKDNode));
+	TriangleIndexList.SetCount(header.m_nTriangleIndices);
+	buf.Get(TriangleIndexList.Base(),header.m_nTriangleIndices*sizeof(int32));
+	for(int i=0;i<header.m_nTriangles;i++)
+		buf.Get(&OptimizedTriangleList[i],sizeof(CacheOptimizedTriangle));
+	for(int c=0;c<3;c++)
+	{
+		m_MinBound[c]=header.m_MinBound[c];
+		m_MaxBound[c]=header.m_MaxBound[c];
+	}
+	m_TreeStats=header.m_TreeStats;
+	return true;
+}
+
 
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
 {
@@ -0,0 +1,386 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// AVX paths for the ray tracer. This file is built without any special compiler
+// options; the functions that use AVX are only called once RayTrace_IsAVXEnabled()
+// has checked the CPU and OS support it.
+
+#include "raytrace.h"
+
+#ifdef RAYTRACE_AVX
+
+#include <immintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined( __GNUC__ )
+#define AVX_FUNC __attribute__((target("avx")))
+#else
+#define AVX_FUNC
+#endif
+
+static int s_nAVXState = -1;								// -1 = not checked yet
+
+static bool CPUSupportsAVX( void )
+{
+	// need the AVX instructions, and the OS has to save the ymm registers (OSXSAVE + XCR0 bits 1,2)
+#ifdef _WIN32
+	int info[4];
+	__cpuid( info, 1 );
+	if ( !( info[2] & ( 1 << 28 ) ) || !( info[2] & ( 1 << 27 ) ) )
+		return false;
+	return ( _xgetbv( 0 ) & 6 ) == 6;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if ( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+		return false;
+	if ( !( ecx & ( 1 << 28 ) ) || !( ecx & ( 1 << 27 ) ) )
+		return false;
+	unsigned int xcr0_lo, xcr0_hi;
+	__asm__ __volatile__ ( "xgetbv" : "=a" ( xcr0_lo ), "=d" ( xcr0_hi ) : "c" ( 0 ) );
+	return ( xcr0_lo & 6 ) == 6;
+#endif
+}
+
+bool RayTrace_IsAVXEnabled( void )
+{
+	if ( s_nAVXState == -1 )
+		s_nAVXState = CPUSupportsAVX() ? 1 : 0;
+	return ( s_nAVXState == 1 );
+}
+
+void RayTrace_SetAVXEnabled( bool bEnabled )
+{
+	s_nAVXState = ( bEnabled && CPUSupportsAVX() ) ? 1 : 0;
+}
+
+
+static const float AVX_EPSILON = 1.0e-10;
+
+// lanes 0..3 from a, 4..7 from b
+static FORCEINLINE AVX_FUNC __m256 Combine8( fltx4 a, fltx4 b )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( a ), b, 1 );
+}
+
+static FORCEINLINE AVX_FUNC __m256 Replicate8( float a, float b )
+{
+	return _mm256_setr_ps( a, a, a, a, b, b, b, b );
+}
+
+static FORCEINLINE AVX_FUNC fltx4 Low4( __m256 a )
+{
+	return _mm256_castps256_ps128( a );
+}
+
+static FORCEINLINE AVX_FUNC fltx4 High4( __m256 a )
+{
+	return _mm256_extractf128_ps( a, 1 );
+}
+
+static FORCEINLINE AVX_FUNC bool IsAnyNegative8( __m256 a )
+{
+	return ( _mm256_movemask_ps( a ) != 0 );
+}
+
+static FORCEINLINE AVX_FUNC __m256 Select8( __m256 mask, __m256 a, __m256 b )
+{
+	return _mm256_or_ps( _mm256_and_ps( mask, a ), _mm256_andnot_ps( mask, b ) );
+}
+
+// same masks as Trace4Rays: hit if not parallel, in front, closer than the current hit and
+// inside all three edges. B0/B1 are the barycentric edge values. Like the SSE code, "zero"
+// in the t and edge tests is AVX_EPSILON (raytrace.cpp's FourZeros), so both paths agree.
+static FORCEINLINE AVX_FUNC __m256 IntersectTriangle8( __m256 const *pOrigin, __m256 const *pDirection,
+													   __m256 Nx, __m256 Ny, __m256 Nz, __m256 D,
+													   __m256 Origin0, __m256 Direction0, __m256 Origin1, __m256 Direction1,
+													   float const *pEdge0, float const *pEdge1,
+													   __m256 HitDistance, __m256 &isect_t )
+{
+	__m256 epsilon = _mm256_set1_ps( AVX_EPSILON );
+
+	__m256 DDotN = _mm256_mul_ps( pDirection[0], Nx );
+	DDotN = _mm256_add_ps( _mm256_mul_ps( pDirection[1], Ny ), DDotN );
+	DDotN = _mm256_add_ps( _mm256_mul_ps( pDirection[2], Nz ), DDotN );
+	__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, epsilon, _CMP_GT_OQ ),
+								   _mm256_cmp_ps( DDotN, _mm256_set1_ps( -AVX_EPSILON ), _CMP_LT_OQ ) );
+
+	__m256 ODotN = _mm256_mul_ps( pOrigin[0], Nx );
+	ODotN = _mm256_add_ps( _mm256_mul_ps( pOrigin[1], Ny ), ODotN );
+	ODotN = _mm256_add_ps( _mm256_mul_ps( pOrigin[2], Nz ), ODotN );
+	isect_t = _mm256_div_ps( _mm256_sub_ps( D, ODotN ), DDotN );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, epsilon, _CMP_GT_OQ ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OQ ) );
+	if ( !IsAnyNegative8( did_hit ) )
+		return did_hit;
+
+	__m256 hitc1 = _mm256_add_ps( Origin0, _mm256_mul_ps( isect_t, Direction0 ) );
+	__m256 hitc2 = _mm256_add_ps( Origin1, _mm256_mul_ps( isect_t, Direction1 ) );
+
+	__m256 B0 = _mm256_mul_ps( Replicate8( pEdge0[0], pEdge1[0] ), hitc1 );
+	B0 = _mm256_add_ps( B0, _mm256_mul_ps( Replicate8( pEdge0[1], pEdge1[1] ), hitc2 ) );
+	B0 = _mm256_add_ps( B0, Replicate8( pEdge0[2], pEdge1[2] ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, epsilon, _CMP_GE_OQ ) );
+
+	__m256 B1 = _mm256_mul_ps( Replicate8( pEdge0[3], pEdge1[3] ), hitc1 );
+	B1 = _mm256_add_ps( B1, _mm256_mul_ps( Replicate8( pEdge0[4], pEdge1[4] ), hitc2 ) );
+	B1 = _mm256_add_ps( B1, Replicate8( pEdge0[5], pEdge1[5] ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, epsilon, _CMP_GE_OQ ) );
+
+	__m256 B2 = _mm256_add_ps( B1, B0 );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, _mm256_set1_ps( 1.0f ), _CMP_LE_OQ ) );
+	return did_hit;
+}
+
+static FORCEINLINE void StoreHit4( fltx4 did_hit, fltx4 isect_t, TriIntersectData_t const *tri, int32 tnum,
+								   RayTracingResult *rslt_out )
+{
+	fltx4 replicated_n = ReplicateIX4( tnum );
+	StoreAlignedSIMD( (float *) rslt_out->HitIds,
+					  OrSIMD( AndSIMD( replicated_n, did_hit ),
+							  AndNotSIMD( did_hit, LoadAlignedSIMD( (float *) rslt_out->HitIds ) ) ) );
+	rslt_out->HitDistance = OrSIMD( AndSIMD( isect_t, did_hit ),
+									AndNotSIMD( did_hit, rslt_out->HitDistance ) );
+	rslt_out->surface_normal.x = OrSIMD( AndSIMD( ReplicateX4( tri->m_flNx ), did_hit ),
+										 AndNotSIMD( did_hit, rslt_out->surface_normal.x ) );
+	rslt_out->surface_normal.y = OrSIMD( AndSIMD( ReplicateX4( tri->m_flNy ), did_hit ),
+										 AndNotSIMD( did_hit, rslt_out->surface_normal.y ) );
+	rslt_out->surface_normal.z = OrSIMD( AndSIMD( ReplicateX4( tri->m_flNz ), did_hit ),
+										 AndNotSIMD( did_hit, rslt_out->surface_normal.z ) );
+}
+
+//-----------------------------------------------------------------------------
+// Trace4Rays leaf test for two opaque triangles at once: lanes 0..3 are the 4 rays
+// against pTri0, lanes 4..7 the same rays against pTri1. The result is the same as
+// testing pTri0 and then pTri1.
+//-----------------------------------------------------------------------------
+AVX_FUNC void IntersectTrianglePair4RaysAVX( const FourRays &rays, TriIntersectData_t const *pTri0, int32 nTri0,
+											 TriIntersectData_t const *pTri1, int32 nTri1, RayTracingResult *rslt_out )
+{
+	__m256 Origin[3], Direction[3];
+	for ( int c = 0; c < 3; c++ )
+	{
+		Origin[c] = Combine8( rays.origin[c], rays.origin[c] );
+		Direction[c] = Combine8( rays.direction[c], rays.direction[c] );
+	}
+
+	__m256 isect_t;
+	__m256 did_hit = IntersectTriangle8( Origin, Direction,
+		Replicate8( pTri0->m_flNx, pTri1->m_flNx ), Replicate8( pTri0->m_flNy, pTri1->m_flNy ),
+		Replicate8( pTri0->m_flNz, pTri1->m_flNz ), Replicate8( pTri0->m_flD, pTri1->m_flD ),
+		Combine8( rays.origin[pTri0->m_nCoordSelect0], rays.origin[pTri1->m_nCoordSelect0] ),
+		Combine8( rays.direction[pTri0->m_nCoordSelect0], rays.direction[pTri1->m_nCoordSelect0] ),
+		Combine8( rays.origin[pTri0->m_nCoordSelect1], rays.origin[pTri1->m_nCoordSelect1] ),
+		Combine8( rays.direction[pTri0->m_nCoordSelect1], rays.direction[pTri1->m_nCoordSelect1] ),
+		pTri0->m_ProjectedEdgeEquations, pTri1->m_ProjectedEdgeEquations,
+		Combine8( rslt_out->HitDistance, rslt_out->HitDistance ), isect_t );
+
+	if ( IsAnyNegative8( did_hit ) )
+	{
+		fltx4 did_hit0 = Low4( did_hit );
+		fltx4 did_hit1 = High4( did_hit );
+		fltx4 isect_t0 = Low4( isect_t );
+		fltx4 isect_t1 = High4( isect_t );
+		if ( IsAnyNegative( did_hit0 ) )
+		{
+			StoreHit4( did_hit0, isect_t0, pTri0, nTri0, rslt_out );
+			// the second triangle has to beat the first one's hits as well
+			did_hit1 = AndSIMD( did_hit1, CmpLtSIMD( isect_t1, rslt_out->HitDistance ) );
+		}
+		if ( IsAnyNegative( did_hit1 ) )
+			StoreHit4( did_hit1, isect_t1, pTri1, nTri1, rslt_out );
+	}
+	_mm256_zeroupper();
+}
+
+
+struct NodeToVisit8
+{
+	CacheOptimizedKDNode const *node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+//-----------------------------------------------------------------------------
+// Trace4Rays for 8 rays: same traversal and intersection, with rays0 in lanes 0..3
+// and rays1 in lanes 4..7. No transparency callback, as with RayStream.
+//-----------------------------------------------------------------------------
+AVX_FUNC void RayTracingEnvironment::Trace8Rays( const FourRays &rays0, const FourRays &rays1, fltx4 TMax0, fltx4 TMax1,
+												 int DirectionSignMask, RayTracingResult *rslt_out0, RayTracingResult *rslt_out1,
+												 int32 skip_id )
+{
+	rays0.Check();
+	rays1.Check();
+
+	FourVectors OneOverRayDir0 = rays0.direction;
+	FourVectors OneOverRayDir1 = rays1.direction;
+	OneOverRayDir0.MakeReciprocalSaturate();
+	OneOverRayDir1.MakeReciprocalSaturate();
+
+	__m256 Origin[3], Direction[3], OneOverRayDir[3];
+	for ( int c = 0; c < 3; c++ )
+	{
+		Origin[c] = Combine8( rays0.origin[c], rays1.origin[c] );
+		Direction[c] = Combine8( rays0.direction[c], rays1.direction[c] );
+		OneOverRayDir[c] = Combine8( OneOverRayDir0[c], OneOverRayDir1[c] );
+	}
+
+	__m256 HitIds = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	__m256 HitDistance = _mm256_set1_ps( 1.0e23 );
+	__m256 Normal[3];
+	Normal[0] = Normal[1] = Normal[2] = _mm256_setzero_ps();
+
+	// now, clip rays against bounding box
+	__m256 TMin = _mm256_setzero_ps();
+	__m256 TMax = Combine8( TMax0, TMax1 );
+	for ( int c = 0; c < 3; c++ )
+	{
+		__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( m_MinBound[c] ), Origin[c] ), OneOverRayDir[c] );
+		__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( m_MaxBound[c] ), Origin[c] ), OneOverRayDir[c] );
+		TMin = _mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax = _mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+
+	if ( IsAnyNegative8( _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ ) ) )
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+		memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+		int front_idx[3], back_idx[3];
+		for ( int c = 0; c < 3; c++ )
+		{
+			back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+			front_idx[c] = 1 - back_idx[c];
+		}
+
+		NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode = &( OptimizedKDTree[0] );
+		NodeToVisit8 *stack_ptr = &NodeQueue[MAX_NODE_STACK_LEN];
+		while ( 1 )
+		{
+			while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+			{
+				int split_plane_number = CurNode->NodeType();
+				CacheOptimizedKDNode const *FrontChild = &( OptimizedKDTree[CurNode->LeftChild()] );
+
+				__m256 dist_to_sep_plane =				// dist=(split-org)/dir
+					_mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ), Origin[split_plane_number] ),
+								   OneOverRayDir[split_plane_number] );
+				__m256 activeLocl = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+
+				__m256 hits_front = _mm256_and_ps( activeLocl, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OQ ) );
+				if ( !IsAnyNegative8( hits_front ) )
+				{
+					// missed the front. only traverse back
+					CurNode = FrontChild + back_idx[split_plane_number];
+					TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+				}
+				else
+				{
+					__m256 hits_back = _mm256_and_ps( activeLocl, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OQ ) );
+					if ( !IsAnyNegative8( hits_back ) )
+					{
+						// missed the back - only need to traverse front node
+						CurNode = FrontChild + front_idx[split_plane_number];
+						TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+					else
+					{
+						// at least some rays hit both nodes. must push far, traverse near
+						Assert( stack_ptr > NodeQueue );
+						--stack_ptr;
+						stack_ptr->node = FrontChild + back_idx[split_plane_number];
+						stack_ptr->TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+						stack_ptr->TMax = TMax;
+						CurNode = FrontChild + front_idx[split_plane_number];
+						TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+				}
+			}
+
+			// hit a leaf! must do intersection check
+			int ntris = CurNode->NumberOfTrianglesInLeaf();
+			if ( ntris )
+			{
+				int32 const *tlist = &( TriangleIndexList[CurNode->TriangleIndexStart()] );
+				do
+				{
+					int tnum = *( tlist++ );
+					int mbox_slot = tnum & ( MAILBOX_HASH_SIZE - 1 );
+					TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+						continue;
+					mailboxids[mbox_slot] = tnum;
+
+					__m256 Nx = _mm256_set1_ps( tri->m_flNx );
+					__m256 Ny = _mm256_set1_ps( tri->m_flNy );
+					__m256 Nz = _mm256_set1_ps( tri->m_flNz );
+					__m256 isect_t;
+					__m256 did_hit = IntersectTriangle8( Origin, Direction, Nx, Ny, Nz, _mm256_set1_ps( tri->m_flD ),
+														 Origin[tri->m_nCoordSelect0], Direction[tri->m_nCoordSelect0],
+														 Origin[tri->m_nCoordSelect1], Direction[tri->m_nCoordSelect1],
+														 tri->m_ProjectedEdgeEquations, tri->m_ProjectedEdgeEquations,
+														 HitDistance, isect_t );
+					if ( !IsAnyNegative8( did_hit ) )
+						continue;
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					HitIds = Select8( did_hit, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), HitIds );
+					HitDistance = Select8( did_hit, isect_t, HitDistance );
+					Normal[0] = Select8( did_hit, Nx, Normal[0] );
+					Normal[1] = Select8( did_hit, Ny, Normal[1] );
+					Normal[2] = Select8( did_hit, Nz, Normal[2] );
+				} while ( --ntris );
+
+				// now, check if all rays have terminated
+				if ( !IsAnyNegative8( _mm256_cmp_ps( TMax, HitDistance, _CMP_LE_OQ ) ) )
+					break;
+			}
+
+			if ( stack_ptr == &NodeQueue[MAX_NODE_STACK_LEN] )
+				break;
+
+			// pop stack!
+			CurNode = stack_ptr->node;
+			TMin = stack_ptr->TMin;
+			TMax = stack_ptr->TMax;
+			stack_ptr++;
+		}
+	}
+
+	StoreAlignedSIMD( (float *) rslt_out0->HitIds, Low4( HitIds ) );
+	StoreAlignedSIMD( (float *) rslt_out1->HitIds, High4( HitIds ) );
+	rslt_out0->HitDistance = Low4( HitDistance );
+	rslt_out1->HitDistance = High4( HitDistance );
+	rslt_out0->surface_normal.x = Low4( Normal[0] );
+	rslt_out0->surface_normal.y = Low4( Normal[1] );
+	rslt_out0->surface_normal.z = Low4( Normal[2] );
+	rslt_out1->surface_normal.x = High4( Normal[0] );
+	rslt_out1->surface_normal.y = High4( Normal[1] );
+	rslt_out1->surface_normal.z = High4( Normal[2] );
+	_mm256_zeroupper();
+}
+
+#else // RAYTRACE_AVX
+
+bool RayTrace_IsAVXEnabled( void )
+{
+	return false;
+}
+
+void RayTrace_SetAVXEnabled( bool bEnabled )
+{
+}
+
+void RayTracingEnvironment::Trace8Rays( const FourRays &rays0, const FourRays &rays1, fltx4 TMax0, fltx4 TMax1,
+										int DirectionSignMask, RayTracingResult *rslt_out0, RayTracingResult *rslt_out1,
+										int32 skip_id )
+{
+	Trace4Rays( rays0, Four_Zeros, TMax0, DirectionSignMask, rslt_out0, skip_id );
+	Trace4Rays( rays1, Four_Zeros, TMax1, DirectionSignMask, rslt_out1, skip_id );
+}
+
+#endif // RAYTRACE_AVX
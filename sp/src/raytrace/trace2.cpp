@@ -307,21 +307,51 @@ inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
 {
 	assert(msk>=0);
 	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
-	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
-	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
+	int cnt=s.n_in_stream[msk];
+	assert(cnt>0);
+	int npackets=(cnt>4)?2:1;
+
+	// fill in unfilled entries with dups of first
+	for(int c=cnt;c<4*npackets;c++)
+	{
+		FourRays &dst=s.PendingRays[msk][c>>2];
+		dst.origin.X(c&3) = s.PendingRays[msk][0].origin.X(0);
+		dst.origin.Y(c&3) = s.PendingRays[msk][0].origin.Y(0);
+		dst.origin.Z(c&3) = s.PendingRays[msk][0].origin.Z(0);
+		dst.direction.X(c&3) = s.PendingRays[msk][0].direction.X(0);
+		dst.direction.Y(c&3) = s.PendingRays[msk][0].direction.Y(0);
+		dst.direction.Z(c&3) = s.PendingRays[msk][0].direction.Z(0);
+	}
+
+	fltx4 tmax[2];
+	RayTracingResult tmpresult[2];
+	for(int p=0;p<npackets;p++)
+	{
+		tmax[p]=s.PendingRays[msk][p].direction.length();
+		fltx4 scl=ReciprocalSaturateSIMD(tmax[p]);
+		s.PendingRays[msk][p].direction*=scl;			// normalize
+	}
+	if ((npackets==2) && RayTrace_IsAVXEnabled())
+		Trace8Rays(s.PendingRays[msk][0],s.PendingRays[msk][1],tmax[0],tmax[1],msk,
+				   &tmpresult[0],&tmpresult[1]);
+	else
+	{
+		for(int p=0;p<npackets;p++)
+			Trace4Rays(s.PendingRays[msk][p],Four_Zeros,tmax[p],msk,&tmpresult[p]);
+	}
+
 	// now, write out results
-	for(int r=0;r<4;r++)
+	for(int r=0;r<cnt;r++)
 	{
+		RayTracingResult const &rslt=tmpresult[r>>2];
+		int l=r&3;
 		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
-		out->ray_length=SubFloat( tmax, r );
-		out->surface_normal.x=tmpresult.surface_normal.X(r);
-		out->surface_normal.y=tmpresult.surface_normal.Y(r);
-		out->surface_normal.z=tmpresult.surface_normal.Z(r);
-		out->HitID=tmpresult.HitIds[r];
-		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
+		out->ray_length=SubFloat( tmax[r>>2], l );
+		out->surface_normal.x=rslt.surface_normal.X(l);
+		out->surface_normal.y=rslt.surface_normal.Y(l);
+		out->surface_normal.z=rslt.surface_normal.Z(l);
+		out->HitID=rslt.HitIds[l];
+		out->HitDistance=SubFloat( rslt.HitDistance, l );
 	}
 	s.n_in_stream[msk]=0;
 }
@@ -336,41 +366,27 @@ void RayTracingEnvironment::AddToRayStream(RayStream &s,
 	assert(msk>=0);
 	assert(msk<8);
 	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
+	assert(pos<8);
+	FourRays &dst=s.PendingRays[msk][pos>>2];
+	dst.origin.X(pos&3)=start.x;
+	dst.origin.Y(pos&3)=start.y;
+	dst.origin.Z(pos&3)=start.z;
+	dst.direction.X(pos&3)=delta.x;
+	dst.direction.Y(pos&3)=delta.y;
+	dst.direction.Z(pos&3)=delta.z;
 	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
+	s.n_in_stream[msk]++;
+	if (pos==7)
 	{
 		FlushStreamEntry(s,msk);
 	}
-	else
-		s.n_in_stream[msk]++;
 }
 
 void RayTracingEnvironment::FinishRayStream(RayStream &s)
 {
 	for(int msk=0;msk<8;msk++)
 	{
-		int cnt=s.n_in_stream[msk];
-		if (cnt)
-		{
-			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
-			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
-				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
-			}
+		if (s.n_in_stream[msk])
 			FlushStreamEntry(s,msk);
-		}
 	}
 }
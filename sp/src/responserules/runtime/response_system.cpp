@@ -12,6 +12,7 @@
 #include "convar.h"
 #include "fmtstr.h"
 #include "generichash.h"
+#include "tier0/fasttimer.h"
 #include "tier1/mapbase_con_groups.h"
 #ifdef MAPBASE
 #include "tier1/mapbase_matchers_base.h"
@@ -88,6 +89,8 @@ ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose ma
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
 ConVar rr_debugresponseconcept( "rr_debugresponseconcept", "", FCVAR_NONE, "If set, rr_debugresponses will print only responses testing for the specified concept" );
+ConVar rr_rulescache( "rr_rulescache", "1", FCVAR_NONE, "Load response rule sets from a binary cache when their scripts are unchanged, and write the cache after parsing them." );
+ConVar rr_indexed_matching( "rr_indexed_matching", "1", FCVAR_NONE, "Use the criterion index to prune rules before scoring them. Debug output always uses the linear search." );
 #define RR_DEBUGRESPONSES_SPECIALCASE 4
 
 #ifdef MAPBASE
@@ -178,6 +181,7 @@ static soundlevel_t TextToSoundLevel( const char *key )
 }
 
 CResponseSystem::ExcludeList_t CResponseSystem::m_DebugExcludeList( 4, 0 );
+int CResponseSystem::s_nInstancedCriteria = 0;
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -195,6 +199,10 @@ CResponseSystem::CResponseSystem() :
 #ifdef MAPBASE
 	m_bInProspective = false;
 #endif
+	m_nMatchQuery = 0;
+	SetDefLessFunc( m_RuleMatchIndex );
+	m_pCriteriaLog = NULL;
+	m_bRecordRuleSetSources = false;
 
 	BuildDispatchTables();
 }
@@ -204,6 +212,8 @@ CResponseSystem::CResponseSystem() :
 //-----------------------------------------------------------------------------
 CResponseSystem::~CResponseSystem()
 {
+	InvalidateRuleMatchIndex();
+	delete m_pCriteriaLog;
 }
 
 //-----------------------------------------------------------------------------
@@ -257,6 +267,9 @@ void CResponseSystem::Clear()
 	m_RulePartitions.RemoveAll();
 #endif
 	m_Enumerations.RemoveAll();
+
+	// Rule dict indices refer to rules and criteria that no longer exist
+	InvalidateRuleMatchIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -454,18 +467,37 @@ void CResponseSystem::ComputeMatcher( Criteria *c, Matcher& matcher )
 	matcher.valid = true;
 }
 
-bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, bool verbose /*=false*/ )
+//-----------------------------------------------------------------------------
+// Purpose: Numeric value of a criteria set value, as used by the matchers
+//-----------------------------------------------------------------------------
+float CResponseSystem::ParseCriterionValue( const char *setValue )
 {
-	if ( !m.valid )
-		return false;
-
-	float v = (float)atof( setValue );
 	if ( setValue[0] == '[' )
 	{
 		bool found = false;
-		v = LookupEnumeration( setValue, found );
+		return LookupEnumeration( setValue, found );
 	}
 
+	return (float)atof( setValue );
+}
+
+bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, bool verbose /*=false*/ )
+{
+	if ( !m.valid )
+		return false;
+
+	return CompareParsedUsingMatcher( setValue, ParseCriterionValue( setValue ), m );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as CompareUsingMatcher(), with the value already run through
+//			ParseCriterionValue()
+//-----------------------------------------------------------------------------
+bool CResponseSystem::CompareParsedUsingMatcher( const char *setValue, float v, Matcher& m )
+{
+	if ( !m.valid )
+		return false;
+
 #ifdef MAPBASE
 	// Bits are always a different story
 	if (m.isbit)
@@ -770,6 +802,209 @@ float CResponseSystem::ScoreCriteriaAgainstRule( const CriteriaSet& set, Respons
 }
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Memoized ScoreCriteriaAgainstRuleCriteria() for the indexed search.
+//			Gives the same score and exclusion, and does the work once per query.
+//-----------------------------------------------------------------------------
+float CResponseSystem::EvaluateIndexedCriterion( const CriteriaSet& set, int icriterion, bool& exclude )
+{
+	if ( m_CriterionEval[ icriterion ].nQuery == m_nMatchQuery )
+	{
+		exclude = m_CriterionEval[ icriterion ].bExclude;
+		return m_CriterionEval[ icriterion ].flScore;
+	}
+
+	Criteria *c = &m_Criteria[ icriterion ];
+
+	float score = 0.0f;
+	exclude = false;
+
+	if ( c->IsSubCriteriaType() )
+	{
+		int subcount = c->subcriteria.Count();
+		for ( int i = 0; i < subcount; i++ )
+		{
+			bool excludesubrule = false;
+			score += EvaluateIndexedCriterion( set, c->subcriteria[ i ], excludesubrule );
+		}
+
+		exclude = ( c->required && score == 0.0f ) ? true : false;
+		score = score * c->weight.GetFloat();
+	}
+	else
+	{
+		const char *actualValue = "";
+		float v = 0.0f;
+
+		int found = set.FindCriterionIndex( c->nameSym );
+		if ( found != -1 )
+		{
+			actualValue = set.GetValue( found );
+
+			ParsedSetValue_t &parsed = m_ParsedSetValues[ found ];
+			if ( parsed.nQuery != m_nMatchQuery )
+			{
+				parsed.nQuery = m_nMatchQuery;
+				parsed.flValue = ParseCriterionValue( actualValue );
+			}
+			v = parsed.flValue;
+		}
+
+		if ( CompareParsedUsingMatcher( actualValue, v, c->matcher ) )
+		{
+			score = set.GetWeight( found ) * c->weight.GetFloat();
+		}
+		else
+		{
+			exclude = c->required;
+		}
+	}
+
+	CriterionEval_t &eval = m_CriterionEval[ icriterion ];
+	eval.nQuery = m_nMatchQuery;
+	eval.flScore = score;
+	eval.bExclude = exclude;
+	return score;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: ScoreCriteriaAgainstRule() for the indexed search (never verbose)
+//-----------------------------------------------------------------------------
+float CResponseSystem::ScoreIndexedRule( const CriteriaSet& set, Rule *rule )
+{
+	if ( !rule->IsEnabled() )
+		return 0.0f;
+
+	float score = 0.0f;
+
+	int count = rule->m_Criteria.Count();
+	for ( int i = 0; i < count; i++ )
+	{
+		bool exclude = false;
+		score += EvaluateIndexedCriterion( set, rule->m_Criteria[ i ], exclude );
+
+		if ( exclude )
+		{
+			score = 0.0f;
+			break;
+		}
+	}
+
+	if ( rule->m_nForceWeight > 0 )
+	{
+		return fsel( score - FLT_MIN, rule->m_nForceWeight, 0 );
+	}
+
+	return score;
+}
+
+struct RuleKeyEntry_t
+{
+	unsigned short	key;
+	unsigned short	elem;
+};
+
+static int __cdecl RuleKeyEntryCompare( const RuleKeyEntry_t *pLeft, const RuleKeyEntry_t *pRight )
+{
+	if ( pLeft->key != pRight->key )
+		return ( pLeft->key < pRight->key ) ? -1 : 1;
+	return (int)pLeft->elem - (int)pRight->elem;
+}
+
+static int __cdecl RuleElemCompare( const unsigned short *pLeft, const unsigned short *pRight )
+{
+	return (int)*pLeft - (int)*pRight;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops every rule dict's criterion index. Anything that adds, replaces
+//			or removes a rule or criterion must call this.
+//-----------------------------------------------------------------------------
+void CResponseSystem::InvalidateRuleMatchIndex()
+{
+	FOR_EACH_MAP_FAST( m_RuleMatchIndex, i )
+	{
+		delete m_RuleMatchIndex[ i ];
+	}
+	m_RuleMatchIndex.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the criterion index for a rule dict, building it if there
+//			isn't one
+//-----------------------------------------------------------------------------
+CResponseSystem::RuleMatchIndex_t &CResponseSystem::GetRuleMatchIndex( ResponseRulePartition::tRuleDict *pDict )
+{
+	int nRules = pDict->Count();
+
+	unsigned short iMap = m_RuleMatchIndex.Find( pDict );
+	if ( iMap != m_RuleMatchIndex.InvalidIndex() )
+	{
+		AssertMsg( m_RuleMatchIndex[ iMap ]->m_nRules == nRules, "Response rules changed without InvalidateRuleMatchIndex()" );
+		return *m_RuleMatchIndex[ iMap ];
+	}
+
+	RuleMatchIndex_t &index = *m_RuleMatchIndex[ m_RuleMatchIndex.Insert( pDict, new RuleMatchIndex_t ) ];
+	index.m_nRules = nRules;
+
+	// Count how many rules in this dict require each criterion
+	CUtlVector< int > usage;
+	usage.SetCount( m_Criteria.MaxElement() );
+	for ( int i = 0; i < usage.Count(); i++ )
+	{
+		usage[ i ] = 0;
+	}
+
+	for ( int i = 0; i < nRules; i++ )
+	{
+		Rule *rule = (*pDict)[ i ];
+		for ( int j = 0; j < rule->m_Criteria.Count(); j++ )
+		{
+			int icriterion = rule->m_Criteria[ j ];
+			if ( m_Criteria[ icriterion ].required )
+			{
+				usage[ icriterion ]++;
+			}
+		}
+	}
+
+	// Key each rule on its most specific required criterion
+	CUtlVector< RuleKeyEntry_t > entries;
+	entries.SetCount( nRules );
+	for ( int i = 0; i < nRules; i++ )
+	{
+		Rule *rule = (*pDict)[ i ];
+
+		int key = NO_KEY_CRITERION;
+		for ( int j = 0; j < rule->m_Criteria.Count(); j++ )
+		{
+			int icriterion = rule->m_Criteria[ j ];
+			if ( m_Criteria[ icriterion ].required && ( key == NO_KEY_CRITERION || usage[ icriterion ] < usage[ key ] ) )
+			{
+				key = icriterion;
+			}
+		}
+
+		entries[ i ].key = key;
+		entries[ i ].elem = i;
+	}
+
+	entries.Sort( RuleKeyEntryCompare );
+
+	for ( int i = 0; i < entries.Count(); i++ )
+	{
+		if ( i == 0 || entries[ i ].key != entries[ i - 1 ].key )
+		{
+			index.m_Keys.AddToTail( entries[ i ].key );
+			index.m_KeyStart.AddToTail( i );
+		}
+		index.m_KeyedRules.AddToTail( entries[ i ].elem );
+	}
+	index.m_KeyStart.AddToTail( entries.Count() );
+
+	return index;
+}
+
 void CResponseSystem::DebugPrint( int depth, const char *fmt, ... )
 {
 	int indentchars = 3 * depth;
@@ -1254,9 +1489,49 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRule( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule )
 {
 	CUtlVector< ResponseRulePartition::tIndex >	bestrules(16,4);
-	float bestscore = 0.001f;
+	float bestscore;
 	scoreOfBestMatchingRule = 0;
 
+	const char *pszDebugRule = rr_debugrule.GetString();
+	if ( rr_indexed_matching.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] ) )
+	{
+		GatherBestMatchingRulesIndexed( set, bestrules, bestscore );
+	}
+	else
+	{
+		GatherBestMatchingRules( set, verbose, bestrules, bestscore );
+	}
+
+	int bestCount = bestrules.Count();
+	if ( bestCount <= 0 )
+		return m_RulePartitions.InvalidIdx();
+
+	scoreOfBestMatchingRule = bestscore ;
+	if ( bestCount == 1 )
+	{
+		return bestrules[ 0 ] ;
+	}
+	else
+	{
+		// Randomly pick one of the tied matching rules
+		int idx = IEngineEmulator::Get()->GetRandomStream()->RandomInt( 0, bestCount - 1 );
+		if ( verbose )
+		{
+			CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+		}
+		return bestrules[ idx ] ;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Scores every rule in the buckets for this set and collects the ones
+//			tied for the best score, in bucket order.
+//-----------------------------------------------------------------------------
+void CResponseSystem::GatherBestMatchingRules( const CriteriaSet& set, bool verbose, CUtlVector< ResponseRulePartition::tIndex > &bestrules, float &bestscore )
+{
+	bestrules.RemoveAll();
+	bestscore = 0.001f;
+
 	CUtlVectorFixed< ResponseRulePartition::tRuleDict *, 2 > buckets( 0, 2 );
 	m_RulePartitions.GetDictsForCriteria( &buckets, set );
 	for ( int b = 0 ; b < buckets.Count() ; ++b )
@@ -1283,25 +1558,227 @@ ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRule( const Crite
 		}
 	}
 
-	int bestCount = bestrules.Count();
-	if ( bestCount <= 0 )
-		return m_RulePartitions.InvalidIdx();
+}
 
-	scoreOfBestMatchingRule = bestscore ;
-	if ( bestCount == 1 )
+//-----------------------------------------------------------------------------
+// Purpose: GatherBestMatchingRules() using the per-dict criterion index. Rules
+//			whose key criterion excludes them are never scored; the rest are
+//			scored in dict order, so the result (and the order of ties) matches.
+//-----------------------------------------------------------------------------
+void CResponseSystem::GatherBestMatchingRulesIndexed( const CriteriaSet& set, CUtlVector< ResponseRulePartition::tIndex > &bestrules, float &bestscore )
+{
+	bestrules.RemoveAll();
+	bestscore = 0.001f;
+
+	// Start a new query; memoized criteria and set values from the last one are stale
+	++m_nMatchQuery;
+
+	int nOldCount = m_CriterionEval.Count();
+	if ( nOldCount < m_Criteria.MaxElement() )
 	{
-		return bestrules[ 0 ] ;
+		m_CriterionEval.SetCount( m_Criteria.MaxElement() );
+		for ( int i = nOldCount; i < m_CriterionEval.Count(); i++ )
+		{
+			m_CriterionEval[ i ].nQuery = 0;
+		}
 	}
-	else
+
+	nOldCount = m_ParsedSetValues.Count();
+	if ( nOldCount < set.GetCount() )
 	{
-		// Randomly pick one of the tied matching rules
-		int idx = IEngineEmulator::Get()->GetRandomStream()->RandomInt( 0, bestCount - 1 );
-		if ( verbose )
+		m_ParsedSetValues.SetCount( set.GetCount() );
+		for ( int i = nOldCount; i < m_ParsedSetValues.Count(); i++ )
 		{
-			CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+			m_ParsedSetValues[ i ].nQuery = 0;
 		}
-		return bestrules[ idx ] ;
 	}
+
+	CUtlVectorFixed< ResponseRulePartition::tRuleDict *, 2 > buckets( 0, 2 );
+	m_RulePartitions.GetDictsForCriteria( &buckets, set );
+	for ( int b = 0 ; b < buckets.Count() ; ++b )
+	{
+		ResponseRulePartition::tRuleDict *prules = buckets[b];
+		if ( prules->Count() <= 0 )
+			continue;
+
+		RuleMatchIndex_t &index = GetRuleMatchIndex( prules );
+
+		m_RuleCandidates.RemoveAll();
+		int nPassedKeys = 0;
+		for ( int k = 0; k < index.m_Keys.Count(); k++ )
+		{
+			if ( index.m_Keys[ k ] != NO_KEY_CRITERION )
+			{
+				bool exclude = false;
+				EvaluateIndexedCriterion( set, index.m_Keys[ k ], exclude );
+				if ( exclude )
+					continue;
+			}
+
+			m_RuleCandidates.AddMultipleToTail( index.m_KeyStart[ k + 1 ] - index.m_KeyStart[ k ], &index.m_KeyedRules[ index.m_KeyStart[ k ] ] );
+			nPassedKeys++;
+		}
+
+		// Keep dict order so ties come out in the same order as the linear search
+		if ( nPassedKeys > 1 )
+		{
+			m_RuleCandidates.Sort( RuleElemCompare );
+		}
+
+		for ( int i = 0; i < m_RuleCandidates.Count(); i++ )
+		{
+			int elem = m_RuleCandidates[ i ];
+			float score = ScoreIndexedRule( set, (*prules)[ elem ] );
+			if ( score >= bestscore )
+			{
+				if ( score != bestscore )
+				{
+					bestscore = score;
+					bestrules.RemoveAll();
+				}
+
+				bestrules.AddToTail( m_RulePartitions.IndexFromDictElem( prules, elem ) );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Criteria set log. Each set is written as "set <count>" followed by
+//			one "name<tab>value<tab>weight" line per criterion.
+//-----------------------------------------------------------------------------
+void CResponseSystem::StartCriteriaLog()
+{
+	if ( !m_pCriteriaLog )
+	{
+		m_pCriteriaLog = new CUtlBuffer( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	}
+}
+
+bool CResponseSystem::StopCriteriaLog( CUtlBuffer &buf )
+{
+	if ( !m_pCriteriaLog )
+		return false;
+
+	buf.Put( m_pCriteriaLog->Base(), m_pCriteriaLog->TellPut() );
+	delete m_pCriteriaLog;
+	m_pCriteriaLog = NULL;
+	return true;
+}
+
+static void WriteCriteriaSet( CUtlBuffer &buf, const CriteriaSet &set )
+{
+	buf.Printf( "set %d\n", set.GetCount() );
+	for ( int i = 0; i < set.GetCount(); i++ )
+	{
+		buf.Printf( "%s\t%s\t%.9g\n", set.GetName( i ), set.GetValue( i ), set.GetWeight( i ) );
+	}
+}
+
+static bool ReadCriteriaSets( CUtlBuffer &buf, CUtlVector< CriteriaSet > &sets )
+{
+	char line[ 1024 ];
+	while ( buf.IsValid() )
+	{
+		buf.GetLine( line, sizeof( line ) );
+		if ( !line[0] )
+			break;
+
+		int nCriteria = 0;
+		if ( sscanf( line, "set %d", &nCriteria ) != 1 )
+			return false;
+
+		CriteriaSet &set = sets[ sets.AddToTail() ];
+		for ( int i = 0; i < nCriteria; i++ )
+		{
+			buf.GetLine( line, sizeof( line ) );
+
+			char *pszValue = strchr( line, '\t' );
+			char *pszWeight = pszValue ? strchr( pszValue + 1, '\t' ) : NULL;
+			if ( !pszWeight )
+				return false;
+
+			*pszValue++ = 0;
+			*pszWeight++ = 0;
+			set.AppendCriteria( line, pszValue, (float)atof( pszWeight ) );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replays a criteria log through both searches, checks they pick the
+//			same rules, and times them
+//-----------------------------------------------------------------------------
+void CResponseSystem::BenchmarkCriteriaLog( CUtlBuffer &buf, int nIterations )
+{
+	CUtlVector< CriteriaSet > sets;
+	if ( !ReadCriteriaSets( buf, sets ) )
+	{
+		Warning( "Malformed criteria log after %d sets\n", sets.Count() );
+		return;
+	}
+
+	if ( !sets.Count() )
+	{
+		Msg( "Criteria log is empty\n" );
+		return;
+	}
+
+	CUtlVector< ResponseRulePartition::tIndex > linearRules;
+	CUtlVector< ResponseRulePartition::tIndex > indexedRules;
+	float linearScore, indexedScore;
+
+	int nMismatches = 0;
+	for ( int i = 0; i < sets.Count(); i++ )
+	{
+		GatherBestMatchingRules( sets[i], false, linearRules, linearScore );
+		GatherBestMatchingRulesIndexed( sets[i], indexedRules, indexedScore );
+
+		bool bMatch = ( linearRules.Count() == indexedRules.Count() ) && ( linearRules.Count() == 0 || linearScore == indexedScore );
+		for ( int j = 0; bMatch && j < linearRules.Count(); j++ )
+		{
+			bMatch = ( linearRules[j] == indexedRules[j] );
+		}
+
+		if ( !bMatch )
+		{
+			if ( nMismatches < 10 )
+			{
+				Warning( "Set %d: linear found %d rules (score %f), indexed found %d rules (score %f)\n",
+					i, linearRules.Count(), linearScore, indexedRules.Count(), indexedScore );
+			}
+			nMismatches++;
+		}
+	}
+
+	CFastTimer linearTimer;
+	linearTimer.Start();
+	for ( int n = 0; n < nIterations; n++ )
+	{
+		for ( int i = 0; i < sets.Count(); i++ )
+		{
+			GatherBestMatchingRules( sets[i], false, linearRules, linearScore );
+		}
+	}
+	linearTimer.End();
+
+	CFastTimer indexedTimer;
+	indexedTimer.Start();
+	for ( int n = 0; n < nIterations; n++ )
+	{
+		for ( int i = 0; i < sets.Count(); i++ )
+		{
+			GatherBestMatchingRulesIndexed( sets[i], indexedRules, indexedScore );
+		}
+	}
+	indexedTimer.End();
+
+	double flLinear = linearTimer.GetDuration().GetMillisecondsF();
+	double flIndexed = indexedTimer.GetDuration().GetMillisecondsF();
+	Msg( "%d criteria sets x %d iterations: linear %.2f ms, indexed %.2f ms (%.2fx), %d mismatches\n",
+		sets.Count(), nIterations, flLinear, flIndexed, flIndexed > 0.0 ? flLinear / flIndexed : 0.0, nMismatches );
 }
 
 //-----------------------------------------------------------------------------
@@ -1313,6 +1790,11 @@ bool CResponseSystem::FindBestResponse( const CriteriaSet& set, CRR_Response& re
 {
 	bool valid = false;
 
+	if ( m_pCriteriaLog )
+	{
+		WriteCriteriaSet( *m_pCriteriaLog, set );
+	}
+
 	int iDbgResponse = rr_debugresponses.GetInt();
 	bool showRules = ( iDbgResponse >= 2 && iDbgResponse < RR_DEBUGRESPONSES_SPECIALCASE );
 	bool showResult = ( iDbgResponse >= 1 && iDbgResponse < RR_DEBUGRESPONSES_SPECIALCASE );
@@ -1534,9 +2016,11 @@ void CResponseSystem::ParseInclude()
 	if ( !IEngineEmulator::Get()->GetFilesystem()->ReadFile( includefile, "GAME", buf ) )
 	{
 		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "Unable to load #included script %s\n", includefile );
+		RecordRuleSetSource( includefile, NULL );
 		return;
 	}
 
+	buf.PutChar( 0 );
 	LoadFromBuffer( includefile, (const char *)buf.PeekGet() );
 }
 
@@ -1544,6 +2028,7 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 {
 	COM_TimestampedLog( "CResponseSystem::LoadFromBuffer [%s] - Start", scriptfile );
 	m_IncludedFiles.Allocate( scriptfile );
+	RecordRuleSetSource( scriptfile, buffer );
 	PushScript( scriptfile, (unsigned char * )buffer );
 
 	if( rr_dumpresponses.GetBool() )
@@ -1594,6 +2079,11 @@ void CResponseSystem::LoadFromBuffer( const char *scriptfile, const char *buffer
 void CResponseSystem::LoadRuleSet( const char *basescript )
 {
 	float flStart = Plat_FloatTime();
+
+	bool bUseCache = rr_rulescache.GetBool() && IsRuleDatabaseEmpty();
+	if ( bUseCache && LoadRuleSetFromCache( basescript ) )
+		return;
+
 	int length = 0;
 	unsigned char *buffer = (unsigned char *)IEngineEmulator::Get()->LoadFileForMe( basescript, &length );
 	if ( length <= 0 || !buffer )
@@ -1603,13 +2093,25 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 	}
 
 	m_IncludedFiles.FreeAll();
+
+	int nInstancedCriteriaStart = s_nInstancedCriteria;
+	m_RuleSetSources.RemoveAll();
+	m_bRecordRuleSetSources = bUseCache;
+
 	LoadFromBuffer( basescript, (const char *)buffer );
 
+	m_bRecordRuleSetSources = false;
+
 	IEngineEmulator::Get()->FreeFile( buffer );
 
 	Assert( m_ScriptStack.Count() == 0 );
 	float flEnd = Plat_FloatTime();
 	COM_TimestampedLog( "CResponseSystem::LoadRuleSet took %f msec", 1000.0f * ( flEnd - flStart ) );
+
+	if ( bUseCache )
+	{
+		WriteRuleSetCache( basescript, 1000.0f * ( flEnd - flStart ), nInstancedCriteriaStart );
+	}
 }
 
 inline ResponseType_t ComputeResponseType( const char *s )
@@ -2025,6 +2527,9 @@ int CResponseSystem::ParseOneCriterion( const char *criterionName )
 
 	Criteria *pNewCriterion = NULL;
 
+	// Adding or redefining a criterion can change which one keys a rule
+	InvalidateRuleMatchIndex();
+
 	int idx;
 #ifdef MAPBASE
 	short existing = m_Criteria.Find( criterionName );
@@ -2307,8 +2812,6 @@ void CResponseSystem::ParseRule_Criteria( Rule &newRule )
 //-----------------------------------------------------------------------------
 void CResponseSystem::ParseRule( void )
 {
-	static int instancedCriteria = 0;
-
 	char ruleName[ 128 ];
 	ParseToken();
 	Q_strncpy( ruleName, token, sizeof( ruleName ) );
@@ -2346,7 +2849,7 @@ void CResponseSystem::ParseRule( void )
 			continue;
 
 		// It's an inline criteria, generate a name and parse it in
-		Q_snprintf( sz, sizeof( sz ), "[%s%03i]", ruleName, ++instancedCriteria );
+		Q_snprintf( sz, sizeof( sz ), "[%s%03i]", ruleName, ++s_nInstancedCriteria );
 		Unget();
 		int idx = ParseOneCriterion( sz );
 		if ( idx != m_Criteria.InvalidIndex() )
@@ -2358,6 +2861,7 @@ void CResponseSystem::ParseRule( void )
 	if ( m_bParseRuleValid )
 	{
 		m_RulePartitions.GetDictForRule( this, newRule ).Insert( ruleName, newRule );
+		InvalidateRuleMatchIndex();
 	}
 	else
 	{
@@ -2555,6 +3059,7 @@ void CResponseSystem::CopyRuleFrom( Rule *pSrcRule, ResponseRulePartition::tInde
 
 	// Add rule.
 	pCustomSystem->m_RulePartitions.GetDictForRule( this, dstRule ).Insert( m_RulePartitions.GetElementName( iRule ), dstRule );
+	pCustomSystem->InvalidateRuleMatchIndex();
 }
 
 
@@ -13,6 +13,9 @@
 #endif
 
 #include "utldict.h"
+#include "tier1/utlstring.h"
+
+class CUtlBuffer;
 
 namespace ResponseRules
 {
@@ -76,6 +79,12 @@ namespace ResponseRules
 		virtual const char *GetScriptFile( void ) = 0;
 		void		LoadRuleSet( const char *setname );
 
+		// Binary rule set cache, see rr_rulescache.cpp
+		bool		IsRuleDatabaseEmpty();
+		void		RecordRuleSetSource( const char *scriptfile, const char *buffer );
+		bool		LoadRuleSetFromCache( const char *basescript );
+		void		WriteRuleSetCache( const char *basescript, float flParseTime, int nInstancedCriteriaStart );
+
 		void		ResetResponseGroups();
 
 		float		LookForCriteria( const CriteriaSet &criteriaSet, int iCriteria );
@@ -239,11 +248,20 @@ public:
 
 		bool		Compare( const char *setValue, Criteria *c, bool verbose = false );
 		bool		CompareUsingMatcher( const char *setValue, Matcher& m, bool verbose = false );
+		bool		CompareParsedUsingMatcher( const char *setValue, float v, Matcher& m );
+		float		ParseCriterionValue( const char *setValue );
 		void		ComputeMatcher( Criteria *c, Matcher& matcher );
 		void		ResolveToken( Matcher& matcher, char *token, size_t bufsize, char const *rawtoken );
 		float		LookupEnumeration( const char *name, bool& found );
 
 		ResponseRulePartition::tIndex FindBestMatchingRule( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule );
+		void		GatherBestMatchingRules( const CriteriaSet& set, bool verbose, CUtlVector< ResponseRulePartition::tIndex > &bestrules, float &bestscore );
+		void		GatherBestMatchingRulesIndexed( const CriteriaSet& set, CUtlVector< ResponseRulePartition::tIndex > &bestrules, float &bestscore );
+
+		// Criteria set logging for rr_criteria_record / rr_criteria_bench
+		void		StartCriteriaLog();
+		bool		StopCriteriaLog( CUtlBuffer &buf );
+		void		BenchmarkCriteriaLog( CUtlBuffer &buf, int nIterations );
 
 #ifdef MAPBASE
 		void		DisableEmptyRules();
@@ -252,6 +270,8 @@ public:
 		float		ScoreCriteriaAgainstRule( const CriteriaSet& set, ResponseRulePartition::tRuleDict &dict, int irule, bool verbose = false );
 		float		RecursiveScoreSubcriteriaAgainstRule( const CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
 		float		ScoreCriteriaAgainstRuleCriteria( const CriteriaSet& set, int icriterion, bool& exclude, bool verbose = false );
+		float		ScoreIndexedRule( const CriteriaSet& set, Rule *rule );
+		float		EvaluateIndexedCriterion( const CriteriaSet& set, int icriterion, bool& exclude );
 		void		FakeDepletes( ResponseGroup *g, IResponseFilter *pFilter );
 		void		RevertFakedDepletes( ResponseGroup *g );
 		bool		GetBestResponse( ResponseSearchResult& result, Rule *rule, bool verbose = false, IResponseFilter *pFilter = NULL );
@@ -290,6 +310,63 @@ public:
 
 		CUtlVector<int> m_FakedDepletes;
 
+		//---------------------------------
+		// Indexed rule matching
+		//
+		// Each rule dict gets an index that groups its rules by one of their required
+		// criteria (the one shared by the fewest rules). A query evaluates each key
+		// criterion once and only scores rules whose key passed. Criterion results and
+		// parsed set values are memoized per query, tagged with m_nMatchQuery.
+		// Indices are built on demand and thrown away whenever a rule or criterion
+		// is added, replaced or removed.
+		struct RuleMatchIndex_t
+		{
+			int								m_nRules;		// dict count when built
+			CUtlVector< unsigned short >	m_Keys;			// key criterion, or NO_KEY_CRITERION
+			CUtlVector< int >				m_KeyStart;		// first entry in m_KeyedRules, m_Keys.Count() + 1 entries
+			CUtlVector< unsigned short >	m_KeyedRules;	// dict elements, ascending within a key
+		};
+
+		enum { NO_KEY_CRITERION = 0xFFFF };
+
+		struct CriterionEval_t
+		{
+			int		nQuery;
+			float	flScore;
+			bool	bExclude;
+		};
+
+		struct ParsedSetValue_t
+		{
+			int		nQuery;
+			float	flValue;
+		};
+
+		RuleMatchIndex_t &GetRuleMatchIndex( ResponseRulePartition::tRuleDict *pDict );
+		void		InvalidateRuleMatchIndex();
+
+		CUtlMap< const ResponseRulePartition::tRuleDict *, RuleMatchIndex_t * >	m_RuleMatchIndex;
+		CUtlVector< CriterionEval_t >	m_CriterionEval;
+		CUtlVector< ParsedSetValue_t >	m_ParsedSetValues;
+		CUtlVector< unsigned short >	m_RuleCandidates;
+		int								m_nMatchQuery;
+
+		CUtlBuffer						*m_pCriteriaLog;
+
+		// Script files read by the current LoadRuleSet(), recorded to key the rules cache
+		struct RuleSetSource_t
+		{
+			CUtlString		name;
+			unsigned int	crc;
+			bool			bExists;
+		};
+
+		CUtlVector< RuleSetSource_t >	m_RuleSetSources;
+		bool							m_bRecordRuleSetSources;
+
+		// Counter for the names of inline rule criteria, shared by all systems
+		static int						s_nInstancedCriteria;
+
 		char		token[ 1204 ];
 
 		bool		m_bUnget;
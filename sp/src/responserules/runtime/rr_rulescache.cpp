@@ -0,0 +1,580 @@
+//========= Copyright  1996-2010, Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Binary cache of a parsed response rule set.
+//
+// LoadRuleSet() writes everything it parsed (enumerations, criteria, response
+// groups and rules) to one file, together with the CRC of every script it read.
+// On the next load, if all of those scripts are unchanged, the whole database is
+// rebuilt from that file with a single read: strings come from a string table and
+// cross references are dictionary indices, so nothing needs to be tokenized.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "rrbase.h"
+#include "utlbuffer.h"
+#include "utlhashtable.h"
+#include "convar.h"
+#include "checksum_crc.h"
+#include "filesystem.h"
+#include "tier1/mapbase_con_groups.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+using namespace ResponseRules;
+
+extern ConVar rr_dumpresponses;
+
+#define RULESCACHE_ID			MAKEID( 'R', 'R', 'C', 'A' )
+#define RULESCACHE_VERSION		1
+#define RULESCACHE_PATH			"cache/responserules"
+#define RULESCACHE_PATHID		"MOD"
+
+namespace ResponseRules
+{
+	extern const char *ResponseCopyString( const char *in );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Cache file header
+//-----------------------------------------------------------------------------
+struct RulesCacheHeader_t
+{
+	int		id;
+	int		version;
+	int		nSizeofParams;		// sizeof( ResponseParams ), which is stored raw
+	float	flParseTime;		// msec it took to parse the scripts the cache was built from
+	int		nInstancedCriteriaStart;
+	int		nInstancedCriteriaEnd;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Maps each distinct string to its slot in the cache's string table
+//-----------------------------------------------------------------------------
+class CRulesCacheStringTable
+{
+public:
+	int AddString( const char *pszString )
+	{
+		if ( !pszString )
+			return -1;
+
+		UtlHashHandle_t h = m_Lookup.Find( pszString );
+		if ( h != m_Lookup.InvalidHandle() )
+			return m_Lookup[h];
+
+		int index = m_Strings.AddToTail( pszString );
+		m_Lookup.Insert( pszString, index );
+		return index;
+	}
+
+	void Write( CUtlBuffer &buf )
+	{
+		buf.PutInt( m_Strings.Count() );
+		for ( int i = 0; i < m_Strings.Count(); i++ )
+		{
+			int len = V_strlen( m_Strings[i] );
+			buf.PutInt( len );
+			buf.Put( m_Strings[i], len + 1 );
+		}
+	}
+
+private:
+	CUtlVector< const char * > m_Strings;
+	CUtlHashtable< const char *, int, StringHashFunctor, StringEqualFunctor > m_Lookup;
+};
+
+static void GetRulesCacheFileName( const char *basescript, char *pszOut, int nOutSize )
+{
+	char szName[ MAX_PATH ];
+	V_strncpy( szName, basescript, sizeof( szName ) );
+	for ( char *p = szName; *p; p++ )
+	{
+		if ( *p == '/' || *p == '\\' || *p == '.' || *p == ':' )
+		{
+			*p = '_';
+		}
+	}
+
+	V_snprintf( pszOut, nOutSize, "%s/%s.rrc", RULESCACHE_PATH, szName );
+}
+
+static unsigned int ComputeScriptCRC( const char *buffer )
+{
+	return CRC32_ProcessSingleBuffer( buffer, V_strlen( buffer ) );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The cache is only used when it would hold the whole database
+//-----------------------------------------------------------------------------
+bool CResponseSystem::IsRuleDatabaseEmpty()
+{
+	return m_Responses.Count() == 0 && m_Criteria.Count() == 0 && m_Enumerations.Count() == 0 && m_RulePartitions.Count() == 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called for each script LoadFromBuffer() reads, or NULL for a missing
+//			#include, while LoadRuleSet() is recording
+//-----------------------------------------------------------------------------
+void CResponseSystem::RecordRuleSetSource( const char *scriptfile, const char *buffer )
+{
+	if ( !m_bRecordRuleSetSources )
+		return;
+
+	RuleSetSource_t &source = m_RuleSetSources[ m_RuleSetSources.AddToTail() ];
+	source.name = scriptfile;
+	source.bExists = ( buffer != NULL );
+	source.crc = buffer ? ComputeScriptCRC( buffer ) : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the database LoadRuleSet() just parsed
+//-----------------------------------------------------------------------------
+void CResponseSystem::WriteRuleSetCache( const char *basescript, float flParseTime, int nInstancedCriteriaStart )
+{
+	CRulesCacheStringTable strings;
+	CUtlBuffer body;
+
+	// Enumerations
+	body.PutInt( m_Enumerations.Count() );
+	for ( int i = m_Enumerations.First(); i != m_Enumerations.InvalidIndex(); i = m_Enumerations.Next( i ) )
+	{
+		body.PutInt( strings.AddString( m_Enumerations.GetElementName( i ) ) );
+		body.PutFloat( m_Enumerations[i].value );
+	}
+
+	// Criteria, in index order so the indices come back the same
+	body.PutInt( m_Criteria.Count() );
+	for ( int i = 0; i < m_Criteria.MaxElement(); i++ )
+	{
+		if ( !m_Criteria.IsValidIndex( i ) )
+			continue;
+
+		Criteria &c = m_Criteria[i];
+		body.PutInt( i );
+		body.PutInt( strings.AddString( m_Criteria.GetElementName( i ) ) );
+		body.PutInt( c.nameSym.IsValid() ? strings.AddString( CriteriaSet::SymbolToStr( c.nameSym ) ) : -1 );
+		body.PutInt( strings.AddString( c.value ) );
+		body.PutFloat( c.weight.GetFloat() );
+		body.PutUnsignedChar( c.required );
+
+		Matcher &m = c.matcher;
+		body.PutUnsignedChar( m.valid );
+		if ( m.valid )
+		{
+			body.PutFloat( m.maxval );
+			body.PutFloat( m.minval );
+			body.PutUnsignedChar( m.isnumeric );
+			body.PutUnsignedChar( m.notequal );
+			body.PutUnsignedChar( m.usemin );
+			body.PutUnsignedChar( m.minequals );
+			body.PutUnsignedChar( m.usemax );
+			body.PutUnsignedChar( m.maxequals );
+#ifdef MAPBASE
+			body.PutUnsignedChar( m.isbit );
+#endif
+			body.PutInt( strings.AddString( m.GetToken() ) );
+			body.PutInt( strings.AddString( m.GetRaw() ) );
+		}
+
+		body.PutInt( c.subcriteria.Count() );
+		for ( int j = 0; j < c.subcriteria.Count(); j++ )
+		{
+			body.PutUnsignedShort( c.subcriteria[j] );
+		}
+	}
+
+	// Response groups, in index order
+	body.PutInt( m_Responses.Count() );
+	for ( int i = 0; i < m_Responses.MaxElement(); i++ )
+	{
+		if ( !m_Responses.IsValidIndex( i ) )
+			continue;
+
+		ResponseGroup &group = m_Responses[i];
+		body.PutInt( i );
+		body.PutInt( strings.AddString( m_Responses.GetElementName( i ) ) );
+		body.PutUnsignedChar( group.m_bEnabled );
+		body.PutUnsignedChar( group.m_nCurrentIndex );
+		body.PutUnsignedChar( group.m_nDepletionCount );
+		body.PutUnsignedChar( group.m_bDepleteBeforeRepeat );
+		body.PutUnsignedChar( group.m_bHasFirst );
+		body.PutUnsignedChar( group.m_bHasLast );
+		body.PutUnsignedChar( group.m_bSequential );
+		body.PutUnsignedChar( group.m_bNoRepeat );
+
+		body.PutInt( group.group.Count() );
+		for ( int j = 0; j < group.group.Count(); j++ )
+		{
+			ParserResponse &response = group.group[j];
+
+			// Params are plain data apart from the followup pointer, which is only set for queries
+			ResponseParams params = response.params;
+			params.m_pFollowup = NULL;
+			body.Put( &params, sizeof( params ) );
+
+			body.PutInt( strings.AddString( response.value ) );
+			body.PutFloat( response.weight.GetFloat() );
+			body.PutUnsignedChar( response.depletioncount );
+			body.PutUnsignedChar( response.type );
+			body.PutUnsignedChar( response.first );
+			body.PutUnsignedChar( response.last );
+
+			AI_ResponseFollowup &followup = response.m_followup;
+			body.PutInt( strings.AddString( followup.followup_concept ) );
+			body.PutInt( strings.AddString( followup.followup_contexts ) );
+			body.PutFloat( followup.followup_delay );
+			body.PutInt( strings.AddString( followup.followup_target ) );
+			body.PutInt( strings.AddString( followup.followup_entityiotarget ) );
+			body.PutInt( strings.AddString( followup.followup_entityioinput ) );
+			body.PutFloat( followup.followup_entityiodelay );
+			body.PutUnsignedChar( followup.bFired );
+		}
+	}
+
+	// Rules, in partition order
+	body.PutInt( m_RulePartitions.Count() );
+	for ( ResponseRulePartition::tIndex idx = m_RulePartitions.First(); m_RulePartitions.IsValid( idx ); idx = m_RulePartitions.Next( idx ) )
+	{
+		Rule &rule = m_RulePartitions[idx];
+		body.PutUnsignedInt( idx );
+		body.PutInt( strings.AddString( m_RulePartitions.GetElementName( idx ) ) );
+		body.PutInt( strings.AddString( rule.GetContext() ) );
+		body.PutUnsignedChar( rule.m_nForceWeight );
+#ifdef MAPBASE
+		body.PutUnsignedChar( rule.m_iContextFlags );
+#else
+		body.PutUnsignedChar( rule.m_bApplyContextToWorld );
+#endif
+		body.PutUnsignedChar( rule.m_bMatchOnce );
+		body.PutUnsignedChar( rule.m_bEnabled );
+
+		body.PutInt( rule.m_Criteria.Count() );
+		for ( int j = 0; j < rule.m_Criteria.Count(); j++ )
+		{
+			body.PutUnsignedShort( rule.m_Criteria[j] );
+		}
+
+		body.PutInt( rule.m_Responses.Count() );
+		for ( int j = 0; j < rule.m_Responses.Count(); j++ )
+		{
+			body.PutUnsignedShort( rule.m_Responses[j] );
+		}
+	}
+
+	// Header, sources and the string table go in front of the body
+	CUtlBuffer buf;
+
+	RulesCacheHeader_t header;
+	header.id = RULESCACHE_ID;
+	header.version = RULESCACHE_VERSION;
+	header.nSizeofParams = sizeof( ResponseParams );
+	header.flParseTime = flParseTime;
+	header.nInstancedCriteriaStart = nInstancedCriteriaStart;
+	header.nInstancedCriteriaEnd = s_nInstancedCriteria;
+	buf.Put( &header, sizeof( header ) );
+
+	buf.PutInt( m_RuleSetSources.Count() );
+	for ( int i = 0; i < m_RuleSetSources.Count(); i++ )
+	{
+		buf.PutString( m_RuleSetSources[i].name.Get() );
+		buf.PutUnsignedInt( m_RuleSetSources[i].crc );
+		buf.PutUnsignedChar( m_RuleSetSources[i].bExists );
+	}
+
+	strings.Write( buf );
+	buf.Put( body.Base(), body.TellPut() );
+
+	char szCacheFile[ MAX_PATH ];
+	GetRulesCacheFileName( basescript, szCacheFile, sizeof( szCacheFile ) );
+
+	IFileSystem *pFileSystem = IEngineEmulator::Get()->GetFilesystem();
+	pFileSystem->CreateDirHierarchy( RULESCACHE_PATH, RULESCACHE_PATHID );
+	if ( !pFileSystem->WriteFile( szCacheFile, RULESCACHE_PATHID, buf ) )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  unable to write rules cache %s\n", szCacheFile );
+		return;
+	}
+
+	CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  parsed %s in %.2f msec, wrote rules cache %s (%d bytes)\n",
+		basescript, flParseTime, szCacheFile, buf.TellPut() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Rebuilds the database from the rules cache if it is present and was
+//			built from the scripts as they are now. On failure the system is
+//			left empty so the caller can parse the scripts.
+//-----------------------------------------------------------------------------
+bool CResponseSystem::LoadRuleSetFromCache( const char *basescript )
+{
+	float flStart = Plat_FloatTime();
+
+	char szCacheFile[ MAX_PATH ];
+	GetRulesCacheFileName( basescript, szCacheFile, sizeof( szCacheFile ) );
+
+	IFileSystem *pFileSystem = IEngineEmulator::Get()->GetFilesystem();
+
+	CUtlBuffer buf;
+	if ( !pFileSystem->ReadFile( szCacheFile, RULESCACHE_PATHID, buf ) )
+		return false;
+
+	RulesCacheHeader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if ( !buf.IsValid() || header.id != RULESCACHE_ID || header.version != RULESCACHE_VERSION || header.nSizeofParams != sizeof( ResponseParams ) )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  rules cache %s is out of date\n", szCacheFile );
+		return false;
+	}
+
+	// Every script the cache was built from must be unchanged
+	CUtlVector< const char * > sources;
+	int nSources = buf.GetInt();
+	for ( int i = 0; i < nSources && buf.IsValid(); i++ )
+	{
+		const char *pszName = (const char *)buf.PeekGet();
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, V_strlen( pszName ) + 1 );
+		unsigned int crc = buf.GetUnsignedInt();
+		bool bExists = buf.GetUnsignedChar() != 0;
+
+		CUtlBuffer script;
+		bool bMatches;
+		if ( pFileSystem->ReadFile( pszName, "GAME", script ) )
+		{
+			script.PutChar( 0 );
+			bMatches = bExists && ComputeScriptCRC( (const char *)script.Base() ) == crc;
+		}
+		else
+		{
+			bMatches = !bExists;
+		}
+
+		if ( !bMatches )
+		{
+			CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  %s changed, rebuilding rules cache\n", pszName );
+			return false;
+		}
+
+		if ( bExists )
+		{
+			sources.AddToTail( pszName );
+		}
+	}
+
+	// String table; entries point into the file buffer until they're pooled
+	CUtlVector< const char * > strings;
+	int nStrings = buf.GetInt();
+	strings.EnsureCapacity( nStrings );
+	for ( int i = 0; i < nStrings && buf.IsValid(); i++ )
+	{
+		int len = buf.GetInt();
+		strings.AddToTail( (const char *)buf.PeekGet() );
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, len + 1 );
+	}
+
+	if ( !buf.IsValid() )
+		return false;
+
+	#define CACHE_STRING( index )	( ( (index) >= 0 && (index) < strings.Count() ) ? strings[ (index) ] : NULL )
+
+	InvalidateRuleMatchIndex();
+
+	bool bValid = true;
+
+	// Enumerations
+	int nEnumerations = buf.GetInt();
+	for ( int i = 0; i < nEnumerations && buf.IsValid(); i++ )
+	{
+		const char *pszName = CACHE_STRING( buf.GetInt() );
+		Enumeration newEnum;
+		newEnum.value = buf.GetFloat();
+		if ( pszName )
+		{
+			m_Enumerations.Insert( pszName, newEnum );
+		}
+	}
+
+	// Criteria
+	int nCriteria = buf.GetInt();
+	for ( int i = 0; i < nCriteria && bValid && buf.IsValid(); i++ )
+	{
+		int index = buf.GetInt();
+		const char *pszName = CACHE_STRING( buf.GetInt() );
+		if ( !pszName || m_Criteria.Insert( pszName ) != index )
+		{
+			bValid = false;
+			break;
+		}
+
+		Criteria &c = m_Criteria[ index ];
+		const char *pszSymbol = CACHE_STRING( buf.GetInt() );
+		if ( pszSymbol )
+		{
+			c.nameSym = CriteriaSet::ComputeCriteriaSymbol( pszSymbol );
+		}
+		c.value = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+		c.weight.SetFloat( buf.GetFloat() );
+		c.required = buf.GetUnsignedChar() != 0;
+
+		Matcher &m = c.matcher;
+		m.valid = buf.GetUnsignedChar() != 0;
+		if ( m.valid )
+		{
+			m.maxval = buf.GetFloat();
+			m.minval = buf.GetFloat();
+			m.isnumeric = buf.GetUnsignedChar() != 0;
+			m.notequal = buf.GetUnsignedChar() != 0;
+			m.usemin = buf.GetUnsignedChar() != 0;
+			m.minequals = buf.GetUnsignedChar() != 0;
+			m.usemax = buf.GetUnsignedChar() != 0;
+			m.maxequals = buf.GetUnsignedChar() != 0;
+#ifdef MAPBASE
+			m.isbit = buf.GetUnsignedChar() != 0;
+#endif
+			const char *pszToken = CACHE_STRING( buf.GetInt() );
+			const char *pszRaw = CACHE_STRING( buf.GetInt() );
+			m.SetToken( pszToken ? pszToken : "" );
+			m.SetRaw( pszRaw ? pszRaw : "" );
+		}
+
+		int nSubCriteria = buf.GetInt();
+		c.subcriteria.EnsureCapacity( nSubCriteria );
+		for ( int j = 0; j < nSubCriteria; j++ )
+		{
+			c.subcriteria.AddToTail( buf.GetUnsignedShort() );
+		}
+	}
+
+	// Response groups
+	int nGroups = bValid ? buf.GetInt() : 0;
+	for ( int i = 0; i < nGroups && bValid && buf.IsValid(); i++ )
+	{
+		int index = buf.GetInt();
+		const char *pszName = CACHE_STRING( buf.GetInt() );
+		if ( !pszName || m_Responses.Insert( pszName ) != index )
+		{
+			bValid = false;
+			break;
+		}
+
+		ResponseGroup &group = m_Responses[ index ];
+		group.m_bEnabled = buf.GetUnsignedChar() != 0;
+		group.m_nCurrentIndex = buf.GetUnsignedChar();
+		group.m_nDepletionCount = buf.GetUnsignedChar();
+		group.m_bDepleteBeforeRepeat = buf.GetUnsignedChar() != 0;
+		group.m_bHasFirst = buf.GetUnsignedChar() != 0;
+		group.m_bHasLast = buf.GetUnsignedChar() != 0;
+		group.m_bSequential = buf.GetUnsignedChar() != 0;
+		group.m_bNoRepeat = buf.GetUnsignedChar() != 0;
+
+		int nResponses = buf.GetInt();
+		group.group.EnsureCapacity( nResponses );
+		for ( int j = 0; j < nResponses && buf.IsValid(); j++ )
+		{
+			ParserResponse &response = group.group[ group.group.AddToTail() ];
+
+			buf.Get( &response.params, sizeof( response.params ) );
+			response.params.m_pFollowup = NULL;
+
+			response.value = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			response.weight.SetFloat( buf.GetFloat() );
+			response.depletioncount = buf.GetUnsignedChar();
+			response.type = buf.GetUnsignedChar();
+			response.first = buf.GetUnsignedChar() != 0;
+			response.last = buf.GetUnsignedChar() != 0;
+
+			AI_ResponseFollowup &followup = response.m_followup;
+			followup.followup_concept = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			followup.followup_contexts = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			followup.followup_delay = buf.GetFloat();
+			followup.followup_target = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			followup.followup_entityiotarget = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			followup.followup_entityioinput = ResponseCopyString( CACHE_STRING( buf.GetInt() ) );
+			followup.followup_entityiodelay = buf.GetFloat();
+			followup.bFired = buf.GetUnsignedChar() != 0;
+		}
+	}
+
+	// Rules
+	int nRules = bValid ? buf.GetInt() : 0;
+	for ( int i = 0; i < nRules && bValid && buf.IsValid(); i++ )
+	{
+		ResponseRulePartition::tIndex index = buf.GetUnsignedInt();
+		const char *pszName = CACHE_STRING( buf.GetInt() );
+
+		Rule *newRule = new Rule;
+		const char *pszContext = CACHE_STRING( buf.GetInt() );
+		if ( pszContext )
+		{
+			newRule->SetContext( pszContext );
+		}
+		newRule->m_nForceWeight = buf.GetUnsignedChar();
+#ifdef MAPBASE
+		newRule->m_iContextFlags = buf.GetUnsignedChar();
+#else
+		newRule->m_bApplyContextToWorld = buf.GetUnsignedChar() != 0;
+#endif
+		newRule->m_bMatchOnce = buf.GetUnsignedChar() != 0;
+		newRule->m_bEnabled = buf.GetUnsignedChar() != 0;
+
+		int nRuleCriteria = buf.GetInt();
+		newRule->m_Criteria.EnsureCapacity( nRuleCriteria );
+		for ( int j = 0; j < nRuleCriteria; j++ )
+		{
+			newRule->m_Criteria.AddToTail( buf.GetUnsignedShort() );
+		}
+
+		int nRuleResponses = buf.GetInt();
+		newRule->m_Responses.EnsureCapacity( nRuleResponses );
+		for ( int j = 0; j < nRuleResponses; j++ )
+		{
+			newRule->m_Responses.AddToTail( buf.GetUnsignedShort() );
+		}
+
+		if ( !pszName || !buf.IsValid() )
+		{
+			delete newRule;
+			bValid = false;
+			break;
+		}
+
+		// The rule must land in the same bucket and slot it was saved from
+		ResponseRulePartition::tRuleDict &dict = m_RulePartitions.GetDictForRule( this, newRule );
+		int elem = dict.Insert( pszName, newRule );
+		if ( m_RulePartitions.IndexFromDictElem( &dict, elem ) != index )
+		{
+			bValid = false;
+			break;
+		}
+	}
+
+	#undef CACHE_STRING
+
+	if ( !bValid || !buf.IsValid() )
+	{
+		CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  rules cache %s doesn't match, parsing %s\n", szCacheFile, basescript );
+		Clear();
+		return false;
+	}
+
+	m_IncludedFiles.FreeAll();
+	for ( int i = 0; i < sources.Count(); i++ )
+	{
+		m_IncludedFiles.Allocate( sources[i] );
+	}
+
+	// Later inline criteria must not reuse any of the cached names
+	s_nInstancedCriteria = MAX( s_nInstancedCriteria + header.nInstancedCriteriaEnd - header.nInstancedCriteriaStart, header.nInstancedCriteriaEnd );
+
+	float flLoadTime = 1000.0f * ( Plat_FloatTime() - flStart );
+	CGMsg( 1, CON_GROUP_RESPONSE_SYSTEM, "CResponseSystem:  %s (%i rules, %i criteria, and %i responses) from rules cache in %.2f msec, parsing took %.2f msec\n",
+		basescript, m_RulePartitions.Count(), m_Criteria.Count(), m_Responses.Count(), flLoadTime, header.flParseTime );
+	COM_TimestampedLog( "CResponseSystem::LoadRuleSet from cache took %f msec", flLoadTime );
+
+	if ( rr_dumpresponses.GetBool() )
+	{
+		DumpRules();
+	}
+
+	return true;
+}
@@ -26,6 +26,7 @@
 #include "utlvector.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "generichash.h"
 #include "UtlSortVector.h"
 #include "convar.h"
 #ifdef MAPBASE
@@ -45,6 +46,37 @@ CKeyValuesGrowableStringTable *KeyValues::s_pGrowableStringTable = NULL;
 #define KEYVALUES_TOKEN_SIZE	4096
 static char s_pTokenBuf[KEYVALUES_TOKEN_SIZE];
 
+// KeyValues::m_nArenaFlags
+enum
+{
+	KEYVALUES_ARENA_KEY		= 0x01,		// the key was allocated from a CKeyValuesArena
+	KEYVALUES_ARENA_STRING	= 0x02,		// m_sValue was allocated from the arena too
+	KEYVALUES_ARENA_INDEXED	= 0x04,		// the children of the key are hashed in its KeyValuesArenaNode_t
+	KEYVALUES_ARENA_FREED	= 0x08,		// deleteThis() has been called on the key
+};
+
+// Open addressed hash of the children of a key, by name
+struct KeyValuesChildIndex_t
+{
+	struct Entry_t
+	{
+		int m_iKeyName;
+		KeyValues *m_pKey;
+	};
+
+	unsigned int m_nMask;
+	Entry_t m_Entries[1];
+};
+
+// Lives right in front of every key allocated from a CKeyValuesArena
+struct KeyValuesArenaNode_t
+{
+	CKeyValuesArena *m_pArena;
+	KeyValues *m_pIndexedParent;			// the key whose index we're in, if any
+	KeyValuesChildIndex_t *m_pChildIndex;
+};
+COMPILE_TIME_ASSERT( sizeof(KeyValuesArenaNode_t) % sizeof(void *) == 0 );
+
 
 #define INTERNALWRITE( pData, len ) InternalWrite( filesystem, f, pBuf, pData, len )
 
@@ -452,8 +484,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nArenaFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -471,26 +502,25 @@ KeyValues::~KeyValues()
 //-----------------------------------------------------------------------------
 void KeyValues::RemoveEverything()
 {
+	DropChildIndex();
+
 	KeyValues *dat;
 	KeyValues *datNext = NULL;
 	for ( dat = m_pSub; dat != NULL; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
-	m_sValue = NULL;
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	FreeAllocatedValue();
 }
 
 //-----------------------------------------------------------------------------
@@ -521,6 +551,103 @@ const char *KeyValues::GetName( void ) const
 	return s_pfGetStringForSymbol( m_iKeyName );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Reads a token straight out of the memory of a text buffer. Returns
+//			the number of bytes the token used up, or -1 if the token runs into
+//			the end of the buffer, in which case the caller must take the slow
+//			path so that the buffer ends up in the same error state as before.
+//-----------------------------------------------------------------------------
+static int ReadTokenFromMemory( const char *pStart, const char *pEnd, CUtlCharConversion *pConv,
+	char *pToken, bool &wasQuoted, bool &wasConditional, bool &bOverflow )
+{
+	const char *p = pStart;
+
+	// eat white spaces and remarks
+	while ( true )
+	{
+		while ( p < pEnd && isspace( *(const unsigned char*)p ) )
+			++p;
+
+		if ( p >= pEnd )
+			return -1;
+
+		if ( p[0] != '/' || p + 1 >= pEnd || p[1] != '/' )
+			break;
+
+		p = (const char *)memchr( p + 2, '\n', pEnd - ( p + 2 ) );
+		if ( !p )
+			return -1;
+		++p;
+	}
+
+	int nCount = 0;
+	if ( *p == '\"' )
+	{
+		wasQuoted = true;
+
+		const char cEscape = pConv->GetEscapeChar();
+		const int nMaxConversionLength = pConv->MaxConversionLength();
+		for ( ++p; ; )
+		{
+			if ( p >= pEnd )
+				return -1;
+
+			char c = *p++;
+			if ( c == '\"' )
+				break;
+
+			if ( c == cEscape )
+			{
+				if ( p >= pEnd )
+					return -1;
+
+				int nLength = 0;
+				c = nMaxConversionLength ? pConv->FindConversion( p, &nLength ) : '\0';
+				p += nLength;
+			}
+
+			if ( nCount < KEYVALUES_TOKEN_SIZE - 1 )
+			{
+				pToken[nCount++] = c;
+			}
+		}
+	}
+	else if ( *p == '{' || *p == '}' )
+	{
+		// it's a control char, just add this one char and stop reading
+		pToken[nCount++] = *p++;
+	}
+	else
+	{
+		// read in the token until we hit a whitespace or a control character
+		bool bConditionalStart = false;
+		for ( ; p < pEnd; ++p )
+		{
+			const char c = *p;
+			if ( c == 0 || c == '"' || c == '{' || c == '}' || isspace( c ) )
+				break;
+
+			if ( c == '[' )
+				bConditionalStart = true;
+
+			if ( c == ']' && bConditionalStart )
+				wasConditional = true;
+
+			if ( nCount < KEYVALUES_TOKEN_SIZE - 1 )
+			{
+				pToken[nCount++] = c;
+			}
+			else
+			{
+				bOverflow = true;
+			}
+		}
+	}
+
+	pToken[nCount] = 0;
+	return p - pStart;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Read a single token from buffer (0 terminated)
 //-----------------------------------------------------------------------------
@@ -533,6 +660,28 @@ const char *KeyValues::ReadToken( CUtlBuffer &buf, bool &wasQuoted, bool &wasCon
 	if ( !buf.IsValid() )
 		return NULL; 
 
+	// text buffers in memory are scanned directly rather than a character at a time
+	int nRemaining = buf.GetBytesRemaining();
+	const char *pMemory = ( buf.IsText() && nRemaining > 0 ) ? (const char *)buf.PeekGet( nRemaining, 0 ) : NULL;
+	if ( pMemory )
+	{
+		bool bQuoted = false, bConditional = false, bOverflow = false;
+		CUtlCharConversion *pConv = m_bHasEscapeSequences ? GetCStringCharConversion() : GetNoEscCharConversion();
+		int nConsumed = ReadTokenFromMemory( pMemory, pMemory + nRemaining, pConv, s_pTokenBuf, bQuoted, bConditional, bOverflow );
+		if ( nConsumed >= 0 )
+		{
+			if ( bOverflow )
+			{
+				g_KeyValuesErrorStack.ReportError(" ReadToken overflow" );
+			}
+
+			wasQuoted = bQuoted;
+			wasConditional = bConditional;
+			buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nConsumed );
+			return s_pTokenBuf;
+		}
+	}
+
 	// eating white spaces and remarks loop
 	while ( true )
 	{
@@ -899,6 +1048,9 @@ void KeyValues::SaveKeyToFile( KeyValues *dat, IBaseFileSystem *filesystem, File
 //-----------------------------------------------------------------------------
 KeyValues *KeyValues::FindKey(int keySymbol) const
 {
+	if ( m_nArenaFlags & KEYVALUES_ARENA_INDEXED )
+		return FindKeyInChildIndex( keySymbol );
+
 	for (KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
 	{
 		if (dat->m_iKeyName == keySymbol)
@@ -944,15 +1096,27 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 
 	KeyValues *lastItem = NULL;
 	KeyValues *dat;
-	// find the searchStr in the current peer list
-	for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
+	if ( m_nArenaFlags & KEYVALUES_ARENA_INDEXED )
 	{
-		lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
-
-		// symbol compare
-		if (dat->m_iKeyName == iSearchStr)
+		// wide keys in an arena have their children hashed by name
+		dat = FindKeyInChildIndex( iSearchStr );
+		if ( !dat && bCreate )
 		{
-			break;
+			lastItem = FindLastSubKey();
+		}
+	}
+	else
+	{
+		// find the searchStr in the current peer list
+		for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
+		{
+			lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
+
+			// symbol compare
+			if (dat->m_iKeyName == iSearchStr)
+			{
+				break;
+			}
 		}
 	}
 
@@ -967,7 +1131,8 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 		if (bCreate)
 		{
 			// we need to create a new key
-			dat = new KeyValues( searchStr );
+			dat = AllocKeyValues( searchStr );
+			DropChildIndex();
 //			Assert(dat != NULL);
 
 			dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
@@ -1047,7 +1212,7 @@ KeyValues* KeyValues::CreateKey( const char *keyName )
 KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char *keyName, KeyValues *pLastChild )
 {
 	// Create a new key
-	KeyValues* dat = new KeyValues( keyName );
+	KeyValues* dat = AllocKeyValues( keyName );
 
 	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
 	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
@@ -1065,6 +1230,8 @@ void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues *pSubkey, KeyValues *pLa
 	Assert( pSubkey != NULL );
 	Assert( pSubkey->m_pPeer == NULL );
 
+	DropChildIndex();
+
 	// Empty child list?
 	if ( pLastChild == NULL )
 	{
@@ -1100,6 +1267,8 @@ void KeyValues::AddSubKey( KeyValues *pSubkey )
 	Assert( pSubkey != NULL );
 	Assert( pSubkey->m_pPeer == NULL );
 
+	DropChildIndex();
+
 	// add into subkey list
 	if ( m_pSub == NULL )
 	{
@@ -1127,6 +1296,8 @@ void KeyValues::RemoveSubKey(KeyValues *subKey)
 	if (!subKey)
 		return;
 
+	DropChildIndex();
+
 	// check the list pointer
 	if (m_pSub == subKey)
 	{
@@ -1175,6 +1346,7 @@ KeyValues *KeyValues::FindLastSubKey()
 //-----------------------------------------------------------------------------
 void KeyValues::SetNextKey( KeyValues *pDat )
 {
+	DropParentChildIndex();
 	m_pPeer = pDat;
 }
 
@@ -1509,11 +1681,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1543,11 +1712,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1572,11 +1738,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, and make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1616,11 +1779,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -1644,6 +1804,7 @@ void KeyValues::SetFloat( const char *keyName, float value )
 
 void KeyValues::SetName( const char * setName )
 {
+	DropParentChildIndex();
 	m_iKeyName = s_pfGetSymbolForString( setName, true );
 }
 
@@ -1767,8 +1928,12 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 
 KeyValues& KeyValues::operator=( KeyValues& src )
 {
+	DropParentChildIndex();
+
+	char nArenaFlags = m_nArenaFlags & KEYVALUES_ARENA_KEY;
 	RemoveEverything();
 	Init();	// reset all values
+	m_nArenaFlags = nArenaFlags;
 	RecursiveCopyKeyValues( src );
 	return *this;
 }
@@ -1779,6 +1944,8 @@ KeyValues& KeyValues::operator=( KeyValues& src )
 //-----------------------------------------------------------------------------
 void KeyValues::CopySubkeys( KeyValues *pParent ) const
 {
+	pParent->DropChildIndex();
+
 	// recursively copy subkeys
 	// Also maintain ordering....
 	KeyValues *pPrev = NULL;
@@ -1889,7 +2056,12 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	DropChildIndex();
+
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -1911,9 +2083,270 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	// the memory of a key in an arena is freed with the arena
+	if ( m_nArenaFlags & KEYVALUES_ARENA_KEY )
+	{
+		ReleaseArenaKey();
+		return;
+	}
+
 	delete this;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string values of the key
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( !( m_nArenaFlags & KEYVALUES_ARENA_STRING ) )
+	{
+		delete [] m_sValue;
+	}
+	m_sValue = NULL;
+	m_nArenaFlags &= ~KEYVALUES_ARENA_STRING;
+
+	delete [] m_wsValue;
+	m_wsValue = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocates size bytes for m_sValue, from our arena if we're in one
+//-----------------------------------------------------------------------------
+void KeyValues::AllocateValueBlock( int size )
+{
+	Assert( !m_sValue );
+
+	if ( m_nArenaFlags & KEYVALUES_ARENA_KEY )
+	{
+		m_sValue = (char *)GetArenaNode()->m_pArena->Alloc( size );
+		m_nArenaFlags |= KEYVALUES_ARENA_STRING;
+	}
+	else
+	{
+		m_sValue = new char[size];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Arena keys
+//-----------------------------------------------------------------------------
+KeyValuesArenaNode_t *KeyValues::GetArenaNode() const
+{
+	Assert( m_nArenaFlags & KEYVALUES_ARENA_KEY );
+	return (KeyValuesArenaNode_t *)this - 1;
+}
+
+KeyValues *KeyValues::AllocKeyValues( const char *setName ) const
+{
+	if ( m_nArenaFlags & KEYVALUES_ARENA_KEY )
+		return GetArenaNode()->m_pArena->NewKey( setName );
+
+	return new KeyValues( setName );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Does what the destructor does; the memory goes when the arena is cleared
+//-----------------------------------------------------------------------------
+void KeyValues::ReleaseArenaKey()
+{
+	TRACK_KV_REMOVE( this );
+
+	DropParentChildIndex();
+	RemoveEverything();
+	m_pSub = NULL;
+	m_pPeer = NULL;
+	m_nArenaFlags |= KEYVALUES_ARENA_FREED;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hashes the children of every key in the tree that has at least
+//			nMinChildren of them
+//-----------------------------------------------------------------------------
+void KeyValues::BuildChildIndex( int nMinChildren )
+{
+	int nChildren = 0;
+	bool bAllInArena = true;
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		dat->BuildChildIndex( nMinChildren );
+
+		++nChildren;
+		bAllInArena = bAllInArena && ( dat->m_nArenaFlags & KEYVALUES_ARENA_KEY );
+	}
+
+	if ( nChildren < nMinChildren || !bAllInArena || !( m_nArenaFlags & KEYVALUES_ARENA_KEY ) || ( m_nArenaFlags & KEYVALUES_ARENA_INDEXED ) )
+		return;
+
+	// at most half full
+	int nSize = 1;
+	while ( nSize < nChildren * 2 )
+	{
+		nSize <<= 1;
+	}
+
+	KeyValuesArenaNode_t *pNode = GetArenaNode();
+	KeyValuesChildIndex_t *pIndex = (KeyValuesChildIndex_t *)pNode->m_pArena->Alloc( sizeof(KeyValuesChildIndex_t) + ( nSize - 1 ) * sizeof(KeyValuesChildIndex_t::Entry_t) );
+	pIndex->m_nMask = nSize - 1;
+	for ( int i = 0; i < nSize; ++i )
+	{
+		pIndex->m_Entries[i].m_iKeyName = INVALID_KEY_SYMBOL;
+		pIndex->m_Entries[i].m_pKey = NULL;
+	}
+
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		unsigned int i = HashInt( dat->m_iKeyName ) & pIndex->m_nMask;
+		while ( pIndex->m_Entries[i].m_pKey && pIndex->m_Entries[i].m_iKeyName != dat->m_iKeyName )
+		{
+			i = ( i + 1 ) & pIndex->m_nMask;
+		}
+
+		// FindKey() returns the first of several keys with the same name
+		if ( !pIndex->m_Entries[i].m_pKey )
+		{
+			pIndex->m_Entries[i].m_iKeyName = dat->m_iKeyName;
+			pIndex->m_Entries[i].m_pKey = dat;
+		}
+
+		dat->GetArenaNode()->m_pIndexedParent = this;
+	}
+
+	pNode->m_pChildIndex = pIndex;
+	m_nArenaFlags |= KEYVALUES_ARENA_INDEXED;
+}
+
+KeyValues *KeyValues::FindKeyInChildIndex( int keySymbol ) const
+{
+	const KeyValuesChildIndex_t *pIndex = GetArenaNode()->m_pChildIndex;
+	for ( unsigned int i = HashInt( keySymbol ) & pIndex->m_nMask; pIndex->m_Entries[i].m_pKey; i = ( i + 1 ) & pIndex->m_nMask )
+	{
+		if ( pIndex->m_Entries[i].m_iKeyName == keySymbol )
+			return pIndex->m_Entries[i].m_pKey;
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Forgets the hash of our children once they change; FindKey() goes
+//			back to walking the list
+//-----------------------------------------------------------------------------
+void KeyValues::DropChildIndex()
+{
+	if ( !( m_nArenaFlags & KEYVALUES_ARENA_INDEXED ) )
+		return;
+
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		if ( dat->m_nArenaFlags & KEYVALUES_ARENA_KEY )
+		{
+			dat->GetArenaNode()->m_pIndexedParent = NULL;
+		}
+	}
+
+	GetArenaNode()->m_pChildIndex = NULL;
+	m_nArenaFlags &= ~KEYVALUES_ARENA_INDEXED;
+}
+
+void KeyValues::DropParentChildIndex()
+{
+	if ( !( m_nArenaFlags & KEYVALUES_ARENA_KEY ) )
+		return;
+
+	KeyValues *pParent = GetArenaNode()->m_pIndexedParent;
+	if ( pParent )
+	{
+		pParent->DropChildIndex();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: CKeyValuesArena
+//-----------------------------------------------------------------------------
+CKeyValuesArena::CKeyValuesArena( int nIndexMinChildren, int nBlockSize )
+{
+	m_pNextAlloc = NULL;
+	m_pAllocLimit = NULL;
+	m_nBlockSize = nBlockSize;
+	m_nIndexMinChildren = nIndexMinChildren;
+	m_nBytesAllocated = 0;
+}
+
+CKeyValuesArena::~CKeyValuesArena()
+{
+	Clear();
+}
+
+void *CKeyValuesArena::Alloc( int nSize )
+{
+	nSize = AlignValue( nSize, 8 );
+
+	if ( m_pNextAlloc + nSize > m_pAllocLimit )
+	{
+		// big allocations get a block of their own, and don't waste what's left of the current one
+		if ( nSize > m_nBlockSize / 4 )
+		{
+			unsigned char *pBlock = new unsigned char[nSize];
+			m_Blocks.AddToTail( pBlock );
+			m_nBytesAllocated += nSize;
+			return pBlock;
+		}
+
+		unsigned char *pBlock = new unsigned char[m_nBlockSize];
+		m_Blocks.AddToTail( pBlock );
+		m_nBytesAllocated += m_nBlockSize;
+		m_pNextAlloc = pBlock;
+		m_pAllocLimit = pBlock + m_nBlockSize;
+	}
+
+	void *pMem = m_pNextAlloc;
+	m_pNextAlloc += nSize;
+	return pMem;
+}
+
+KeyValues *CKeyValuesArena::NewKey( const char *setName )
+{
+	KeyValuesArenaNode_t *pNode = (KeyValuesArenaNode_t *)Alloc( sizeof(KeyValuesArenaNode_t) + sizeof(KeyValues) );
+	pNode->m_pArena = this;
+	pNode->m_pIndexedParent = NULL;
+	pNode->m_pChildIndex = NULL;
+
+	KeyValues *pKey = (KeyValues *)( pNode + 1 );
+	Construct( pKey, setName );
+	pKey->m_nArenaFlags = KEYVALUES_ARENA_KEY;
+	return pKey;
+}
+
+KeyValues *CKeyValuesArena::CreateKeyValues( const char *setName )
+{
+	KeyValues *pKey = NewKey( setName );
+	m_Roots.AddToTail( pKey );
+	return pKey;
+}
+
+void CKeyValuesArena::Clear()
+{
+	// free whatever the trees hold on the heap
+	for ( int i = 0; i < m_Roots.Count(); ++i )
+	{
+		if ( !( m_Roots[i]->m_nArenaFlags & KEYVALUES_ARENA_FREED ) )
+		{
+			m_Roots[i]->deleteThis();
+		}
+	}
+	m_Roots.Purge();
+
+	for ( int i = 0; i < m_Blocks.Count(); ++i )
+	{
+		delete [] m_Blocks[i];
+	}
+	m_Blocks.Purge();
+
+	m_pNextAlloc = NULL;
+	m_pAllocLimit = NULL;
+	m_nBytesAllocated = 0;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : includedKeys - 
@@ -1977,7 +2410,7 @@ void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoi
 	// Append included file
 	Q_strncat( fullpath, filetoinclude, sizeof( fullpath ), COPY_ALL_CHARACTERS );
 
-	KeyValues *newKV = new KeyValues( fullpath );
+	KeyValues *newKV = AllocKeyValues( fullpath );
 
 	// CUtlSymbol save = s_CurrentFileSymbol;	// did that had any use ???
 
@@ -2172,7 +2605,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 		if ( !pCurrentKey )
 		{
-			pCurrentKey = new KeyValues( s );
+			pCurrentKey = AllocKeyValues( s );
 			Assert( pCurrentKey );
 
 			pCurrentKey->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // same format has parent use
@@ -2248,6 +2681,16 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 	g_KeyValuesErrorStack.SetFilename( "" );	
 
+	// hash the children of wide keys, now that the tree is complete
+	if ( m_nArenaFlags & KEYVALUES_ARENA_KEY )
+	{
+		int nMinChildren = GetArenaNode()->m_pArena->m_nIndexMinChildren;
+		for ( KeyValues *dat = this; dat != NULL && nMinChildren > 0; dat = dat->m_pPeer )
+		{
+			dat->BuildChildIndex( nMinChildren );
+		}
+	}
+
 	return true;
 }
 
@@ -2358,11 +2801,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeAllocatedValue();
 
 			int len = Q_strlen( value );
 
@@ -2402,7 +2841,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 							digit -= 'A' - ( '9' + 1 );
 					retVal = ( retVal * 16 ) + ( digit - '0' );
 				}
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->AllocateValueBlock( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = retVal;
 				dat->m_iDataType = TYPE_UINT64;
 			}
@@ -2424,7 +2863,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
-				dat->m_sValue = new char[len+1];
+				dat->AllocateValueBlock( len+1 );
 				Q_memcpy( dat->m_sValue, value, len+1 );
 			}
 
@@ -2565,8 +3004,12 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 	if ( !buffer.IsValid() ) // must be valid, no overflows etc
 		return false;
 
+	DropParentChildIndex();
+
+	char nArenaFlags = m_nArenaFlags & KEYVALUES_ARENA_KEY;
 	RemoveEverything(); // remove current content
 	Init();	// reset
+	m_nArenaFlags = nArenaFlags;
 	
 	if ( nStackDepth > 100 )
 	{
@@ -118,6 +118,10 @@ public:
 };
 static CBitWriteMasksInit g_BitWriteMasksInit;
 
+// The most bits WriteBitCoord and WriteBitVec3Coord write
+#define BITCOORD_MAX_BITS		( 3 + COORD_INTEGER_BITS + COORD_FRACTIONAL_BITS )
+#define BITVEC3COORD_MAX_BITS	( 3 + 3 * BITCOORD_MAX_BITS )
+
 
 // ---------------------------------------------------------------------------------------- //
 // bf_write
@@ -482,36 +486,19 @@ bool bf_write::WriteBits(const void *pInData, int nBits)
 		m_iCurBit += numbits;
 	}
 
-	// X360TBD: Can't write dwords in WriteBits because they'll get swapped
-	if ( IsPC() && nBitsLeft >= 32 )
+	// Not byte aligned: shift the dwords in through an accumulator.
+	// The bounds were checked above.
+	if ( nBitsLeft >= 32 )
 	{
-		unsigned long iBitsRight = (m_iCurBit & 31);
-		unsigned long iBitsLeft = 32 - iBitsRight;
-		unsigned long bitMaskLeft = g_BitWriteMasks[iBitsRight][32];
-		unsigned long bitMaskRight = g_BitWriteMasks[0][iBitsRight];
-
-		unsigned long *pData = &m_pData[m_iCurBit>>5];
-
-		// Read dwords.
-		while(nBitsLeft >= 32)
+		bf_write_reserved out( *this, nBitsLeft & ~31 );
+		while ( nBitsLeft >= 32 )
 		{
-			unsigned long curData = *(unsigned long*)pOut;
-			pOut += sizeof(unsigned long);
-
-			*pData &= bitMaskLeft;
-			*pData |= curData << iBitsRight;
-
-			pData++; 
-
-			if ( iBitsLeft < 32 )
-			{
-				curData >>= iBitsLeft;
-				*pData &= bitMaskRight;
-				*pData |= curData;
-			}
+			uint32 curData;
+			Q_memcpy( &curData, pOut, sizeof( curData ) );
+			pOut += sizeof( curData );
 
+			out.WriteUBitLong( LittleDWord( curData ), 32 );
 			nBitsLeft -= 32;
-			m_iCurBit += 32;
 		}
 	}
 
@@ -653,6 +640,14 @@ void bf_write::WriteBitCoord (const float f)
 
 void bf_write::WriteBitVec3Coord( const Vector& fa )
 {
+	// Check the buffer once, unless this could be the write that overflows it
+	bf_write_reserved out( *this, BITVEC3COORD_MAX_BITS );
+	if ( out.IsValid() )
+	{
+		out.WriteBitVec3Coord( fa );
+		return;
+	}
+
 	int		xflag, yflag, zflag;
 
 	xflag = (fa[0] >= COORD_RESOLUTION) || (fa[0] <= -COORD_RESOLUTION);
@@ -716,6 +711,49 @@ void bf_write::WriteBitAngles( const QAngle& fa )
 	WriteBitVec3Coord( tmp );
 }
 
+void bf_write::WriteBitVec3Coords( const Vector *pVectors, int nCount )
+{
+	int i = 0;
+	if ( nCount > 0 && nCount <= INT_MAX / BITVEC3COORD_MAX_BITS )
+	{
+		bf_write_reserved out( *this, nCount * BITVEC3COORD_MAX_BITS );
+		if ( out.IsValid() )
+		{
+			for ( ; i < nCount; i++ )
+			{
+				out.WriteBitVec3Coord( pVectors[i] );
+			}
+		}
+	}
+
+	// Near the end of the buffer, one at a time
+	for ( ; i < nCount; i++ )
+	{
+		WriteBitVec3Coord( pVectors[i] );
+	}
+}
+
+void bf_write::WriteBitAngles( const QAngle *pAngles, int nCount )
+{
+	int i = 0;
+	if ( nCount > 0 && nCount <= INT_MAX / BITVEC3COORD_MAX_BITS )
+	{
+		bf_write_reserved out( *this, nCount * BITVEC3COORD_MAX_BITS );
+		if ( out.IsValid() )
+		{
+			for ( ; i < nCount; i++ )
+			{
+				out.WriteBitVec3Coord( Vector( pAngles[i].x, pAngles[i].y, pAngles[i].z ) );
+			}
+		}
+	}
+
+	for ( ; i < nCount; i++ )
+	{
+		WriteBitAngles( pAngles[i] );
+	}
+}
+
 void bf_write::WriteChar(int val)
 {
 	WriteSBitLong(val, sizeof(char) << 3);
@@ -892,6 +930,19 @@ void bf_read::ReadBits(void *pOutData, int nBits)
 		nBitsLeft -= 8;
 	}
 
+	// read dwords through an accumulator, unless the read runs off the end of the buffer
+	if ( nBitsLeft >= 32 && GetNumBitsLeft() >= ( nBitsLeft & ~31 ) )
+	{
+		bf_read_reserved in( *this, nBitsLeft & ~31 );
+		while ( nBitsLeft >= 32 )
+		{
+			uint32 curData = LittleDWord( in.ReadUBitLong( 32 ) );
+			Q_memcpy( pOut, &curData, sizeof( curData ) );
+			pOut += sizeof( curData );
+			nBitsLeft -= 32;
+		}
+	}
+
 	// X360TBD: Can't read dwords in ReadBits because they'll get swapped
 	if ( IsPC() )
 	{
@@ -1270,6 +1321,13 @@ unsigned int bf_read::ReadBitCoordMPBits( bool bIntegral, bool bLowPrecision )
 
 void bf_read::ReadBitVec3Coord( Vector& fa )
 {
+	bf_read_reserved in( *this, BITVEC3COORD_MAX_BITS );
+	if ( in.IsValid() )
+	{
+		in.ReadBitVec3Coord( fa );
+		return;
+	}
+
 	int		xflag, yflag, zflag;
 
 	// This vector must be initialized! Otherwise, If any of the flags aren't set, 
@@ -1341,6 +1399,54 @@ void bf_read::ReadBitAngles( QAngle& fa )
 	fa.Init( tmp.x, tmp.y, tmp.z );
 }
 
+void bf_read::ReadBitVec3Coords( Vector *pVectors, int nCount )
+{
+	// The encoding is variable length, so only read the vectors that are sure 
+	// to fit through the accumulator; the last few go one at a time
+	int i = 0;
+	while ( i < nCount )
+	{
+		int nBatch = MIN( nCount - i, GetNumBitsLeft() / BITVEC3COORD_MAX_BITS );
+		if ( nBatch <= 0 )
+			break;
+
+		bf_read_reserved in( *this, nBatch * BITVEC3COORD_MAX_BITS );
+		for ( int nEnd = i + nBatch; i < nEnd; i++ )
+		{
+			in.ReadBitVec3Coord( pVectors[i] );
+		}
+	}
+
+	for ( ; i < nCount; i++ )
+	{
+		ReadBitVec3Coord( pVectors[i] );
+	}
+}
+
+void bf_read::ReadBitAngles( QAngle *pAngles, int nCount )
+{
+	int i = 0;
+	while ( i < nCount )
+	{
+		int nBatch = MIN( nCount - i, GetNumBitsLeft() / BITVEC3COORD_MAX_BITS );
+		if ( nBatch <= 0 )
+			break;
+
+		bf_read_reserved in( *this, nBatch * BITVEC3COORD_MAX_BITS );
+		for ( int nEnd = i + nBatch; i < nEnd; i++ )
+		{
+			Vector tmp;
+			in.ReadBitVec3Coord( tmp );
+			pAngles[i].Init( tmp.x, tmp.y, tmp.z );
+		}
+	}
+
+	for ( ; i < nCount; i++ )
+	{
+		ReadBitAngles( pAngles[i] );
+	}
+}
+
 int64 bf_read::ReadLongLong()
 {
 	int64 retval;
@@ -1488,3 +1594,179 @@ int bf_read::CompareBitsAt( int offset, bf_read * RESTRICT other, int otherOffse
 	x ^= LoadLittleDWord( (unsigned long*)pData2End, 0 ) << (32 - iStartBit2);
 	return x & g_ExtraMasks[ numbits ];
 }
+
+
+// ---------------------------------------------------------------------------------------- //
+// bf_write_reserved
+// ---------------------------------------------------------------------------------------- //
+
+bf_write_reserved::bf_write_reserved( bf_write &buf, int nMaxBits ) : m_Buf( buf )
+{
+	m_pOut = NULL;
+	m_nAccum = 0;
+	m_nAccumBits = 0;
+	m_nBitsWritten = 0;
+	m_nMaxBits = nMaxBits;
+
+	if ( nMaxBits < 0 || buf.GetNumBitsLeft() < nMaxBits )
+		return;
+
+	// Keep the bits in front of us in the first dword
+	m_pOut = (uint32 *)buf.m_pData + ( buf.m_iCurBit >> 5 );
+	m_nAccumBits = buf.m_iCurBit & 31;
+	if ( m_nAccumBits )
+	{
+		m_nAccum = LittleDWord( *m_pOut ) & ( ( 1u << m_nAccumBits ) - 1 );
+	}
+}
+
+void bf_write_reserved::Commit()
+{
+	if ( !m_pOut )
+		return;
+
+	// Merge the last bits into their dword, keeping the ones after them
+	if ( m_nAccumBits )
+	{
+		uint32 mask = ( 1u << m_nAccumBits ) - 1;
+		*m_pOut = LittleDWord( ( LittleDWord( *m_pOut ) & ~mask ) | ( (uint32)m_nAccum & mask ) );
+	}
+
+	m_Buf.m_iCurBit += m_nBitsWritten;
+	m_pOut = NULL;
+}
+
+void bf_write_reserved::WriteBitCoord( float f )
+{
+	int		signbit = (f <= -COORD_RESOLUTION);
+	int		intval = (int)abs(f);
+	int		fractval = abs((int)(f*COORD_DENOMINATOR)) & (COORD_DENOMINATOR-1);
+
+	// Same fields as bf_write::WriteBitCoord, packed into as few writes as possible
+	uint32 flags = ( intval ? 1 : 0 ) | ( fractval ? 2 : 0 );
+	if ( !flags )
+	{
+		WriteUBitLong( 0, 2 );
+		return;
+	}
+
+	WriteUBitLong( flags | ( signbit << 2 ), 3 );
+
+	if ( intval )
+	{
+		// Adjust the integers from [1..MAX_COORD_VALUE] to [0..MAX_COORD_VALUE-1]
+		WriteUBitLong( (unsigned int)( intval - 1 ), COORD_INTEGER_BITS );
+	}
+
+	if ( fractval )
+	{
+		WriteUBitLong( (unsigned int)fractval, COORD_FRACTIONAL_BITS );
+	}
+}
+
+void bf_write_reserved::WriteBitVec3Coord( const Vector &fa )
+{
+	int		xflag, yflag, zflag;
+
+	xflag = (fa[0] >= COORD_RESOLUTION) || (fa[0] <= -COORD_RESOLUTION);
+	yflag = (fa[1] >= COORD_RESOLUTION) || (fa[1] <= -COORD_RESOLUTION);
+	zflag = (fa[2] >= COORD_RESOLUTION) || (fa[2] <= -COORD_RESOLUTION);
+
+	WriteUBitLong( xflag | ( yflag << 1 ) | ( zflag << 2 ), 3 );
+
+	if ( xflag )
+		WriteBitCoord( fa[0] );
+	if ( yflag )
+		WriteBitCoord( fa[1] );
+	if ( zflag )
+		WriteBitCoord( fa[2] );
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// bf_read_reserved
+// ---------------------------------------------------------------------------------------- //
+
+bf_read_reserved::bf_read_reserved( bf_read &buf, int nMaxBits ) : m_Buf( buf )
+{
+	m_pIn = NULL;
+	m_nAccum = 0;
+	m_nAccumBits = 0;
+	m_nBitsRead = 0;
+	m_nMaxBits = nMaxBits;
+
+	if ( nMaxBits <= 0 || buf.GetNumBitsLeft() < nMaxBits )
+		return;
+
+	m_pIn = (const uint32 *)buf.m_pData + ( buf.m_iCurBit >> 5 );
+
+	// Skip the bits in front of us in the first dword
+	int nSkip = buf.m_iCurBit & 31;
+	if ( nSkip )
+	{
+		m_nAccum = LittleDWord( *m_pIn++ ) >> nSkip;
+		m_nAccumBits = 32 - nSkip;
+	}
+}
+
+void bf_read_reserved::Commit()
+{
+	if ( !m_pIn )
+		return;
+
+	m_Buf.m_iCurBit += m_nBitsRead;
+	m_pIn = NULL;
+}
+
+float bf_read_reserved::ReadBitCoord()
+{
+	int		intval=0,fractval=0,signbit=0;
+	float	value = 0.0;
+
+	// Read the required integer and fraction flags
+	intval = ReadOneBit();
+	fractval = ReadOneBit();
+
+	// If we got either parse them, otherwise it's a zero.
+	if ( intval || fractval )
+	{
+		// Read the sign bit
+		signbit = ReadOneBit();
+
+		// If there's an integer, read it in
+		if ( intval )
+		{
+			// Adjust the integers from [0..MAX_COORD_VALUE-1] to [1..MAX_COORD_VALUE]
+			intval = ReadUBitLong( COORD_INTEGER_BITS ) + 1;
+		}
+
+		// If there's a fraction, read it in
+		if ( fractval )
+		{
+			fractval = ReadUBitLong( COORD_FRACTIONAL_BITS );
+		}
+
+		// Calculate the correct floating point value
+		value = intval + ((float)fractval * COORD_RESOLUTION);
+
+		// Fixup the sign if negative.
+		if ( signbit )
+			value = -value;
+	}
+
+	return value;
+}
+
+void bf_read_reserved::ReadBitVec3Coord( Vector &fa )
+{
+	fa.Init( 0, 0, 0 );
+
+	uint32 flags = ReadUBitLong( 3 );
+
+	if ( flags & 1 )
+		fa[0] = ReadBitCoord();
+	if ( flags & 2 )
+		fa[1] = ReadBitCoord();
+	if ( flags & 4 )
+		fa[2] = ReadBitCoord();
+}
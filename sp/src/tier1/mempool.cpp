@@ -4,6 +4,13 @@
 //
 //===========================================================================//
 
+#if defined( _WIN32 ) && !defined( _X360 )
+#define WIN_32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined( POSIX )
+#include <pthread.h>
+#endif
+
 #include "mempool.h"
 #include <stdio.h>
 #include <malloc.h>
@@ -310,3 +317,455 @@ void CUtlMemoryPool::Free( void *memBlock )
 }
 
 
+//-----------------------------------------------------------------------------
+// CMemoryPoolMT
+//-----------------------------------------------------------------------------
+
+// All the pools share one thread local slot, which holds a list of the thread's
+// caches indexed by pool slot. The slot's destructor hands the caches back when
+// the thread exits. The pool list is indexed by slot as well, and is created on
+// first use since pools can be constructed before this file's statics.
+static CThreadFastMutex s_ThreadCacheMutex;						// guards the three below
+static CUtlVector< CMemoryPoolMT * > *s_pCachingPools;			// NULL where a slot is free
+static int s_nNextCacheSerial;
+
+#if defined( _WIN32 ) && !defined( _X360 )
+static DWORD s_iThreadCacheSlot = FLS_OUT_OF_INDEXES;
+#elif defined( POSIX )
+static pthread_key_t s_iThreadCacheSlot;
+#endif
+
+static inline void *GetThreadCacheRefs()
+{
+#if defined( _WIN32 ) && !defined( _X360 )
+	return FlsGetValue( s_iThreadCacheSlot );
+#elif defined( POSIX )
+	return pthread_getspecific( s_iThreadCacheSlot );
+#endif
+}
+
+static inline void SetThreadCacheRefs( void *pRefs )
+{
+#if defined( _WIN32 ) && !defined( _X360 )
+	FlsSetValue( s_iThreadCacheSlot, pRefs );
+#elif defined( POSIX )
+	pthread_setspecific( s_iThreadCacheSlot, pRefs );
+#endif
+}
+
+CMemoryPoolMT::CMemoryPoolMT( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment ) :
+	CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner, nAlignment )
+{
+	m_bUseCaches = ( growMode != UTLMEMORYPOOL_GROW_NONE );
+	m_iCacheSlot = -1;
+	m_nCacheSerial = 0;
+	memset( &m_ExitedThreads, 0, sizeof( m_ExitedThreads ) );
+	m_nThreadsSeen = 0;
+
+	if ( !m_bUseCaches )
+		return;
+
+	AUTO_LOCK( s_ThreadCacheMutex );
+
+	if ( !s_pCachingPools )
+	{
+		s_pCachingPools = new CUtlVector< CMemoryPoolMT * >;
+#if defined( _WIN32 ) && !defined( _X360 )
+		s_iThreadCacheSlot = FlsAlloc( &ReleaseThreadCaches );
+#elif defined( POSIX )
+		pthread_key_create( &s_iThreadCacheSlot, &ReleaseThreadCaches );
+#endif
+	}
+
+	m_iCacheSlot = s_pCachingPools->Find( NULL );
+	if ( m_iCacheSlot == s_pCachingPools->InvalidIndex() )
+	{
+		m_iCacheSlot = s_pCachingPools->AddToTail();
+	}
+	(*s_pCachingPools)[m_iCacheSlot] = this;
+	m_nCacheSerial = ++s_nNextCacheSerial;
+}
+
+CMemoryPoolMT::~CMemoryPoolMT()
+{
+	// the base class reports whatever is still in use, not what the caches hold
+	int nInUse = Count();
+
+	if ( m_bUseCaches )
+	{
+		// threads exiting from now on leave our caches alone
+		AUTO_LOCK( s_ThreadCacheMutex );
+		(*s_pCachingPools)[m_iCacheSlot] = NULL;
+
+		bool bLastPool = true;
+		for ( int i = 0; i < s_pCachingPools->Count() && bLastPool; i++ )
+		{
+			bLastPool = ( s_pCachingPools->Element( i ) == NULL );
+		}
+
+		// That's how the module shuts down: drop the slot, so its exit
+		// callback can't be called once the module is unloaded
+		if ( bLastPool )
+		{
+#if defined( _WIN32 ) && !defined( _X360 )
+			FlsFree( s_iThreadCacheSlot );	// runs the callback for every thread, which only frees the lists now
+			s_iThreadCacheSlot = FLS_OUT_OF_INDEXES;
+#elif defined( POSIX )
+			// deleting a key doesn't call its destructor, so at least free our own list
+			delete (CUtlVector< ThreadCacheRef_t > *)GetThreadCacheRefs();
+			pthread_key_delete( s_iThreadCacheSlot );
+#endif
+			delete s_pCachingPools;
+			s_pCachingPools = NULL;
+		}
+	}
+
+	AUTO_LOCK( m_mutex );
+
+	for ( int i = 0; i < m_ThreadCaches.Count(); i++ )
+	{
+		delete m_ThreadCaches[i];
+	}
+	m_ThreadCaches.Purge();
+
+	for ( int i = 0; i < m_Magazines.Count(); i++ )
+	{
+		MemAlloc_FreeAligned( m_Magazines[i] );
+	}
+	m_Magazines.Purge();
+
+	m_BlocksAllocated = nInUse;
+}
+
+//-----------------------------------------------------------------------------
+// The calling thread's magazines, created on first use
+//-----------------------------------------------------------------------------
+CMemoryPoolMT::ThreadCache_t *CMemoryPoolMT::GetThreadCache()
+{
+	// a ref left behind by an earlier pool in our slot has another serial
+	CUtlVector< ThreadCacheRef_t > *pRefs = (CUtlVector< ThreadCacheRef_t > *)GetThreadCacheRefs();
+	if ( pRefs && m_iCacheSlot < pRefs->Count() && (*pRefs)[m_iCacheSlot].m_nPoolSerial == m_nCacheSerial )
+		return (*pRefs)[m_iCacheSlot].m_pCache;
+
+	return NewThreadCache();
+}
+
+CMemoryPoolMT::ThreadCache_t *CMemoryPoolMT::NewThreadCache()
+{
+	CUtlVector< ThreadCacheRef_t > *pRefs = (CUtlVector< ThreadCacheRef_t > *)GetThreadCacheRefs();
+	if ( !pRefs )
+	{
+		pRefs = new CUtlVector< ThreadCacheRef_t >;
+		SetThreadCacheRefs( pRefs );
+	}
+
+	while ( pRefs->Count() <= m_iCacheSlot )
+	{
+		ThreadCacheRef_t &ref = pRefs->Element( pRefs->AddToTail() );
+		ref.m_nPoolSerial = 0;
+		ref.m_pCache = NULL;
+	}
+
+	ThreadCache_t *pCache = new ThreadCache_t;
+	memset( pCache, 0, sizeof( ThreadCache_t ) );
+
+	AUTO_LOCK( m_mutex );
+	pCache->m_pLoaded = NewMagazine();
+	pCache->m_pPrevious = NewMagazine();
+	m_ThreadCaches.AddToTail( pCache );
+	m_nThreadsSeen++;
+
+	(*pRefs)[m_iCacheSlot].m_nPoolSerial = m_nCacheSerial;
+	(*pRefs)[m_iCacheSlot].m_pCache = pCache;
+	return pCache;
+}
+
+//-----------------------------------------------------------------------------
+// The thread that owns pCache is exiting: give its blocks back to the pool
+// and keep its counters
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::ReleaseThreadCache( ThreadCache_t *pCache )
+{
+	AUTO_LOCK( m_mutex );
+
+	Magazine_t *pMagazines[2] = { pCache->m_pLoaded, pCache->m_pPrevious };
+	for ( int i = 0; i < ARRAYSIZE( pMagazines ); i++ )
+	{
+		Magazine_t *pMagazine = pMagazines[i];
+		while ( pMagazine->m_nCount )
+		{
+			CUtlMemoryPool::Free( pMagazine->m_pBlocks[--pMagazine->m_nCount] );
+		}
+		m_EmptyMagazines.Push( pMagazine );
+	}
+
+	m_ExitedThreads.m_nAllocs += pCache->m_nAllocs;
+	m_ExitedThreads.m_nFrees += pCache->m_nFrees;
+	m_ExitedThreads.m_nCacheHits += pCache->m_nCacheHits;
+	m_ExitedThreads.m_nDepotHits += pCache->m_nDepotHits;
+	m_ExitedThreads.m_nPoolRefills += pCache->m_nPoolRefills;
+
+	m_ThreadCaches.FindAndFastRemove( pCache );
+	delete pCache;
+}
+
+//-----------------------------------------------------------------------------
+// Thread exit callback for the shared thread local slot
+//-----------------------------------------------------------------------------
+void STDCALL CMemoryPoolMT::ReleaseThreadCaches( void *pThreadCaches )
+{
+	// FLS callbacks also run for threads that never touched a pool
+	CUtlVector< ThreadCacheRef_t > *pRefs = (CUtlVector< ThreadCacheRef_t > *)pThreadCaches;
+	if ( !pRefs )
+		return;
+
+	{
+		// holding this keeps every pool we find alive until we're done with it
+		AUTO_LOCK( s_ThreadCacheMutex );
+
+		for ( int i = 0; i < pRefs->Count(); i++ )
+		{
+			const ThreadCacheRef_t &ref = pRefs->Element( i );
+			if ( !ref.m_pCache || i >= s_pCachingPools->Count() )
+				continue;
+
+			CMemoryPoolMT *pPool = s_pCachingPools->Element( i );
+			if ( pPool && pPool->m_nCacheSerial == ref.m_nPoolSerial )
+			{
+				pPool->ReleaseThreadCache( ref.m_pCache );
+			}
+		}
+	}
+
+	delete pRefs;
+}
+
+//-----------------------------------------------------------------------------
+// An empty magazine. Called with the lock held.
+//-----------------------------------------------------------------------------
+CMemoryPoolMT::Magazine_t *CMemoryPoolMT::NewMagazine()
+{
+	Magazine_t *pMagazine = (Magazine_t *)m_EmptyMagazines.Pop();
+	if ( !pMagazine )
+	{
+		MEM_ALLOC_CREDIT_( m_pszAllocOwner );
+		pMagazine = (Magazine_t *)MemAlloc_AllocAligned( sizeof( Magazine_t ), TSLIST_NODE_ALIGNMENT );
+		m_Magazines.AddToTail( pMagazine );
+	}
+	pMagazine->m_nCount = 0;
+	return pMagazine;
+}
+
+//-----------------------------------------------------------------------------
+// Both magazines are empty: trade the previous one for a full one from the
+// depot, or fill the loaded one from the pool.
+//-----------------------------------------------------------------------------
+void *CMemoryPoolMT::AllocFromPool( ThreadCache_t *pCache )
+{
+	Magazine_t *pFull = (Magazine_t *)m_FullMagazines.Pop();
+	if ( pFull )
+	{
+		m_EmptyMagazines.Push( pCache->m_pPrevious );
+		pCache->m_pPrevious = pCache->m_pLoaded;
+		pCache->m_pLoaded = pFull;
+		pCache->m_nDepotHits++;
+	}
+	else
+	{
+		AUTO_LOCK( m_mutex );
+
+		// take half a magazine, so the next few frees don't go straight to the depot
+		Magazine_t *pLoaded = pCache->m_pLoaded;
+		while ( pLoaded->m_nCount < MAGAZINE_SIZE / 2 )
+		{
+			void *pMem = CUtlMemoryPool::Alloc( m_BlockSize );
+			if ( !pMem )
+				break;
+			pLoaded->m_pBlocks[pLoaded->m_nCount++] = pMem;
+		}
+		pCache->m_nPoolRefills++;
+
+		if ( !pLoaded->m_nCount )
+			return NULL;
+	}
+
+	return pCache->m_pLoaded->m_pBlocks[--pCache->m_pLoaded->m_nCount];
+}
+
+//-----------------------------------------------------------------------------
+// Both magazines are full: move the previous one to the depot
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::FreeToDepot( ThreadCache_t *pCache )
+{
+	Magazine_t *pEmpty = (Magazine_t *)m_EmptyMagazines.Pop();
+	if ( pEmpty )
+	{
+		pEmpty->m_nCount = 0;
+	}
+	else
+	{
+		AUTO_LOCK( m_mutex );
+		pEmpty = NewMagazine();
+	}
+
+	m_FullMagazines.Push( pCache->m_pPrevious );
+	pCache->m_pPrevious = pCache->m_pLoaded;
+	pCache->m_pLoaded = pEmpty;
+}
+
+void *CMemoryPoolMT::Alloc()
+{
+	return Alloc( m_BlockSize );
+}
+
+void *CMemoryPoolMT::Alloc( size_t amount )
+{
+	if ( amount > (unsigned int)m_BlockSize )
+		return NULL;
+
+	if ( !m_bUseCaches )
+	{
+		AUTO_LOCK( m_mutex );
+		return CUtlMemoryPool::Alloc( amount );
+	}
+
+	ThreadCache_t *pCache = GetThreadCache();
+	void *pMem;
+	if ( pCache->m_pLoaded->m_nCount )
+	{
+		pMem = pCache->m_pLoaded->m_pBlocks[--pCache->m_pLoaded->m_nCount];
+		pCache->m_nCacheHits++;
+	}
+	else if ( pCache->m_pPrevious->m_nCount )
+	{
+		// the previous magazine is full, since we only swap when the loaded one fills up or runs out
+		Magazine_t *pFull = pCache->m_pPrevious;
+		pCache->m_pPrevious = pCache->m_pLoaded;
+		pCache->m_pLoaded = pFull;
+		pMem = pCache->m_pLoaded->m_pBlocks[--pCache->m_pLoaded->m_nCount];
+		pCache->m_nCacheHits++;
+	}
+	else
+	{
+		pMem = AllocFromPool( pCache );
+		if ( !pMem )
+			return NULL;
+	}
+
+	pCache->m_nAllocs++;
+	return pMem;
+}
+
+void *CMemoryPoolMT::AllocZero()
+{
+	return AllocZero( m_BlockSize );
+}
+
+void *CMemoryPoolMT::AllocZero( size_t amount )
+{
+	void *mem = Alloc( amount );
+	if ( mem )
+	{
+		V_memset( mem, 0x00, amount );
+	}
+	return mem;
+}
+
+void CMemoryPoolMT::Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+	if ( !m_bUseCaches )
+	{
+		AUTO_LOCK( m_mutex );
+		CUtlMemoryPool::Free( pMem );
+		return;
+	}
+
+#ifdef _DEBUG
+	// invalidate the memory
+	memset( pMem, 0xDD, m_BlockSize );
+#endif
+
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( pCache->m_pLoaded->m_nCount == MAGAZINE_SIZE )
+	{
+		if ( pCache->m_pPrevious->m_nCount == 0 )
+		{
+			Magazine_t *pEmpty = pCache->m_pPrevious;
+			pCache->m_pPrevious = pCache->m_pLoaded;
+			pCache->m_pLoaded = pEmpty;
+		}
+		else
+		{
+			FreeToDepot( pCache );
+		}
+	}
+
+	pCache->m_pLoaded->m_pBlocks[pCache->m_pLoaded->m_nCount++] = pMem;
+	pCache->m_nFrees++;
+}
+
+void CMemoryPoolMT::Clear()
+{
+	AUTO_LOCK( m_mutex );
+
+	// every magazine is in a thread cache, the depot or the empty list; make them all empty
+	for ( int i = 0; i < m_ThreadCaches.Count(); i++ )
+	{
+		ThreadCache_t *pCache = m_ThreadCaches[i];
+		pCache->m_pLoaded->m_nCount = 0;
+		pCache->m_pPrevious->m_nCount = 0;
+		pCache->m_nAllocs = pCache->m_nFrees = 0;
+	}
+	m_ExitedThreads.m_nAllocs = m_ExitedThreads.m_nFrees = 0;
+
+	while ( Magazine_t *pMagazine = (Magazine_t *)m_FullMagazines.Pop() )
+	{
+		pMagazine->m_nCount = 0;
+		m_EmptyMagazines.Push( pMagazine );
+	}
+
+	CUtlMemoryPool::Clear();
+}
+
+int CMemoryPoolMT::Count() const
+{
+	if ( !m_bUseCaches )
+		return m_BlocksAllocated;
+
+	// blocks can be freed by another thread than the one that allocated them, so only the sum means anything
+	AUTO_LOCK( m_mutex );
+
+	int nCount = m_ExitedThreads.m_nAllocs - m_ExitedThreads.m_nFrees;
+	for ( int i = 0; i < m_ThreadCaches.Count(); i++ )
+	{
+		nCount += m_ThreadCaches[i]->m_nAllocs - m_ThreadCaches[i]->m_nFrees;
+	}
+	return nCount;
+}
+
+void CMemoryPoolMT::GetStats( Stats_t &stats ) const
+{
+	memset( &stats, 0, sizeof( stats ) );
+	stats.m_nInUse = Count();
+
+	AUTO_LOCK( m_mutex );
+
+	stats.m_nAllocs = m_ExitedThreads.m_nAllocs;
+	stats.m_nCacheHits = m_ExitedThreads.m_nCacheHits;
+	stats.m_nDepotHits = m_ExitedThreads.m_nDepotHits;
+	stats.m_nPoolRefills = m_ExitedThreads.m_nPoolRefills;
+	for ( int i = 0; i < m_ThreadCaches.Count(); i++ )
+	{
+		const ThreadCache_t *pCache = m_ThreadCaches[i];
+		stats.m_nAllocs += pCache->m_nAllocs;
+		stats.m_nCacheHits += pCache->m_nCacheHits;
+		stats.m_nDepotHits += pCache->m_nDepotHits;
+		stats.m_nPoolRefills += pCache->m_nPoolRefills;
+	}
+	stats.m_nPeakCount = m_PeakAlloc;
+	stats.m_nThreads = m_nThreadsSeen;
+	stats.m_nMagazines = m_Magazines.Count();
+}
@@ -13,19 +13,19 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
 
-#ifdef MAPBASE
-// This was suggested in that Source 2013 pull request that fixed Vrad.
-// I trust their judgement on this.
-#define	MAX_THREADS	32
-#else
-#define	MAX_THREADS	16
-#endif
+
+#define	MAX_THREADS	MAX_TOOL_THREADS
 
 
 class CRunThreadsData
@@ -34,21 +34,69 @@ public:
 	int m_iThread;
 	void *m_pUserData;
 	RunThreadsFn m_Fn;
+	ERunThreadsPriority m_ePriority;
 };
 
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+ThreadHandle_t g_ThreadHandles[MAX_THREADS];
 
 
+/*
+===================================================================
+
+WORK DISTRIBUTION
+
+Work items go out from one shared cursor in small chunks, moved with a
+single interlocked add instead of the global lock. Items are still handed
+out from low to high: vvis sorts its portals so that the cheap ones at the
+front finish first and the later, expensive ones can reuse their results.
+
+===================================================================
+*/
+
+class CThreadWorkStats
+{
+public:
+	int				m_iNext;		// private chunk, only touched by the owning thread
+	int				m_iEnd;
+	int				m_nItems;
+	int				m_nChunks;
+	double			m_flIdleTime;	// when this thread first ran out of work
+	char			m_Pad[64 - 4 * sizeof(int) - sizeof(double)];	// keep each thread on its own cache line
+};
+
+static CThreadWorkStats	g_WorkStats[MAX_THREADS+1];
+static int				g_nWorkChunkSize = 1;
+static volatile long	g_nNextWorkItem;
+static CThreadFastMutex	g_PacifierMutex;
+
+// Index of the calling thread + 1, 0 when not on a worker thread.
+static CThreadLocalInt<> g_iCurWorkThread;
+
+static void ResetThreadWork( int workcnt )
+{
+	// Small chunks keep the order close to one item at a time and balance the end
+	// of a stage; bigger ones mean fewer interlocked adds on large stages.
+	g_nWorkChunkSize = clamp( workcnt / ( numthreads * 64 ), 1, 16 );
+	g_nNextWorkItem = 0;
+
+	for ( int i=0; i <= MAX_THREADS; i++ )
+	{
+		CThreadWorkStats &stats = g_WorkStats[i];
+		stats.m_iNext = stats.m_iEnd = 0;
+		stats.m_nItems = stats.m_nChunks = 0;
+		stats.m_flIdleTime = 0;
+	}
+}
+
 
 /*
 =============
@@ -58,23 +106,35 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	int iThread = g_iCurWorkThread - 1;
+	if ( iThread < 0 )
+		iThread = THREADINDEX_MAIN;
 
-	if (dispatch == workcount)
+	CThreadWorkStats &stats = g_WorkStats[iThread];
+	if ( stats.m_iNext >= stats.m_iEnd )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
+		// the cursor can run past workcount by a chunk per thread; nothing is handed out there
+		int iBegin = ThreadInterlockedExchangeAdd( &g_nNextWorkItem, g_nWorkChunkSize );
+		if ( iBegin >= workcount )
+		{
+			if ( stats.m_flIdleTime == 0 )
+				stats.m_flIdleTime = Plat_FloatTime();
+			return -1;
+		}
 
-	UpdatePacifier( (float)dispatch / workcount );
+		stats.m_iNext = iBegin;
+		stats.m_iEnd = min( iBegin + g_nWorkChunkSize, workcount );
+		stats.m_nChunks++;
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		if ( pacifier && g_PacifierMutex.TryLock() )
+		{
+			UpdatePacifier( (float)stats.m_iEnd / workcount );
+			g_PacifierMutex.Unlock();
+		}
+	}
 
-	return r;
+	stats.m_nItems++;
+	return stats.m_iNext++;
 }
 
 
@@ -107,43 +167,35 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+THREAD POOL
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex	crit;
 static int enter;
 
 
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
-
-
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	nice( 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = GetCPUInformation()->m_nLogicalProcessors;
+		if (numthreads < 1)
 			numthreads = 1;
+		if (numthreads > MAX_TOOL_THREADS)
+			numthreads = MAX_TOOL_THREADS;
 	}
 
 	Msg ("%i threads\n", numthreads);
@@ -154,7 +206,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -167,15 +219,31 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+
+#ifndef _WIN32
+	// pthreads has no per-thread priority for normal scheduling; niceness applies to the calling thread on Linux.
+	if ( pData->m_ePriority == k_eRunThreadsPriority_Idle )
+		nice( 19 );
+	else if ( pData->m_ePriority == k_eRunThreadsPriority_UseGlobalState && g_bLowPriorityThreads )
+		nice( 10 );
+#endif
+
+	g_iCurWorkThread = pData->m_iThread + 1;
+	g_WorkStats[pData->m_iThread].m_flIdleTime = 0;
+
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+
+	if ( g_WorkStats[pData->m_iThread].m_flIdleTime == 0 )
+		g_WorkStats[pData->m_iThread].m_flIdleTime = Plat_FloatTime();
+	g_iCurWorkThread = 0;
 	return 0;
 }
 
@@ -193,38 +261,75 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
+		g_RunThreadsData[i].m_ePriority = ePriority;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
+		if ( !g_ThreadHandles[i] )
+			Error( "RunThreads_Start: couldn't create thread %d\n", i );
 
+#ifdef _WIN32
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+			ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+#endif
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+		g_ThreadHandles[i] = NULL;
+	}
 
 	threaded = false;
 }
-	
+
+
+/*
+=============
+ReportThreadUtilization
+
+How much of the stage each thread spent with work in hand, as opposed to
+waiting for the slowest thread to finish.
+=============
+*/
+static void ReportThreadUtilization( double flStart, double flEnd )
+{
+	double flElapsed = flEnd - flStart;
+	if ( numthreads < 2 || flElapsed <= 0 )
+		return;
+
+	double flTotal = 0, flMin = 1;
+	int iMin = 0;
+	for ( int i=0; i < numthreads; i++ )
+	{
+		const CThreadWorkStats &stats = g_WorkStats[i];
+		double flBusy = ( stats.m_flIdleTime - flStart ) / flElapsed;
+		flBusy = clamp( flBusy, 0.0, 1.0 );
+
+		flTotal += flBusy;
+		if ( flBusy < flMin )
+		{
+			flMin = flBusy;
+			iMin = i;
+		}
+
+		qprintf( "    thread %2d: %5.1f%% busy, %d items in %d chunks\n", i, flBusy * 100.0, stats.m_nItems, stats.m_nChunks );
+	}
+
+	Msg( "    %d threads %.1f%% utilized (min %.1f%% on thread %d), chunks of %d\n", numthreads, flTotal * 100.0 / numthreads, flMin * 100.0, iMin, g_nWorkChunkSize );
+}
+
 
 /*
 =============
@@ -233,10 +338,9 @@ RunThreadsOn
 */
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
 {
-	int		start, end;
+	double	start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
 	pacifier = showpacifier;
@@ -247,6 +351,9 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
+	if ( numthreads > MAX_TOOL_THREADS )
+		numthreads = MAX_TOOL_THREADS;
+	ResetThreadWork( workcnt );
 	
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
@@ -256,7 +363,8 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	if (pacifier)
 	{
 		EndPacifier(false);
-		printf (" (%i)\n", end-start);
+		printf (" (%i)\n", (int)(end-start));
+		ReportThreadUtilization( start, end );
 	}
 }
 
@@ -17,9 +17,8 @@
 
 
 #ifdef MAPBASE
-// This was suggested in that Source 2013 pull request that fixed Vrad.
-// I trust their judgement on this.
-#define MAX_TOOL_THREADS	32
+// Work is distributed without the global lock now, so allow for large build machines.
+#define MAX_TOOL_THREADS	128
 #else
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
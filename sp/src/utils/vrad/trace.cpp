@@ -13,6 +13,7 @@
 #include "trace.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
+#include "mathlib/halton.h"
 
 
 //=============================================================================
@@ -651,3 +652,156 @@ void AddBrushesForRayTrace( void )
 		}
 	}
 }
+
+
+//-----------------------------------------------------------------------------
+// Ray tracer throughput benchmark (-rtbench). Rays start just above each face's
+// centroid and go out over the face's hemisphere, so the set is the same on every
+// run. The SSE and AVX paths are timed separately and their results compared.
+//-----------------------------------------------------------------------------
+#define RTBENCH_RAYS_PER_FACE	64
+#define RTBENCH_RAY_LENGTH		4096.0f
+
+// hits past the end of a ray depend on how rays were packed and are never used
+// (callers check HitDistance against the length, as TestLine does), so they count as misses
+struct RTBenchResults_t
+{
+	CUtlVector<int32> m_HitIds;
+	CUtlVector<float> m_HitDistances;
+};
+
+static void BuildBenchmarkRays( CUtlVector<Vector> &starts, CUtlVector<Vector> &ends )
+{
+	DirectionalSampler_t sampler;
+	Vector dirs[RTBENCH_RAYS_PER_FACE];
+	for ( int i = 0; i < RTBENCH_RAYS_PER_FACE; i++ )
+		dirs[i] = sampler.NextValue();
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *face = &g_pFaces[i];
+		if ( face->numedges < 3 )
+			continue;
+
+		Vector centroid( 0, 0, 0 );
+		for ( int j = 0; j < face->numedges; j++ )
+		{
+			int surfEdge = dsurfedges[face->firstedge + j];
+			unsigned short v = ( surfEdge < 0 ) ? dedges[-surfEdge].v[1] : dedges[surfEdge].v[0];
+			centroid += dvertexes[v].point;
+		}
+		centroid /= face->numedges;
+
+		Vector normal = dplanes[face->planenum].normal;
+		Vector start = centroid + normal;
+		for ( int j = 0; j < RTBENCH_RAYS_PER_FACE; j++ )
+		{
+			Vector dir = dirs[j];
+			if ( DotProduct( dir, normal ) < 0 )
+				dir = -dir;
+			starts.AddToTail( start );
+			ends.AddToTail( start + dir * RTBENCH_RAY_LENGTH );
+		}
+	}
+}
+
+static float TraceBenchmarkPackets( CUtlVector<Vector> const &starts, CUtlVector<Vector> const &ends, RTBenchResults_t &results )
+{
+	int nRays = starts.Count() & ~3;
+	results.m_HitIds.SetCount( nRays );
+	results.m_HitDistances.SetCount( nRays );
+
+	float start = Plat_FloatTime();
+	for ( int i = 0; i < nRays; i += 4 )
+	{
+		FourRays myrays;
+		myrays.origin.LoadAndSwizzle( starts[i], starts[i + 1], starts[i + 2], starts[i + 3] );
+		myrays.direction.LoadAndSwizzle( ends[i], ends[i + 1], ends[i + 2], ends[i + 3] );
+		myrays.direction -= myrays.origin;
+		fltx4 len = myrays.direction.length();
+		myrays.direction *= ReciprocalSIMD( len );
+
+		RayTracingResult rt_result;
+		g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result );
+		for ( int j = 0; j < 4; j++ )
+		{
+			bool bHit = ( rt_result.HitIds[j] != -1 ) && ( SubFloat( rt_result.HitDistance, j ) < SubFloat( len, j ) );
+			results.m_HitIds[i + j] = bHit ? rt_result.HitIds[j] : -1;
+			results.m_HitDistances[i + j] = SubFloat( rt_result.HitDistance, j );
+		}
+	}
+	return Plat_FloatTime() - start;
+}
+
+static float TraceBenchmarkStream( CUtlVector<Vector> const &starts, CUtlVector<Vector> const &ends, RTBenchResults_t &results )
+{
+	int nRays = starts.Count() & ~3;
+	CUtlVector<RayTracingSingleResult> rslts;
+	rslts.SetCount( nRays );
+
+	float start = Plat_FloatTime();
+	RayStream myStream;
+	for ( int i = 0; i < nRays; i++ )
+		g_RtEnv.AddToRayStream( myStream, starts[i], ends[i], &rslts[i] );
+	g_RtEnv.FinishRayStream( myStream );
+	float flElapsed = Plat_FloatTime() - start;
+
+	results.m_HitIds.SetCount( nRays );
+	results.m_HitDistances.SetCount( nRays );
+	for ( int i = 0; i < nRays; i++ )
+	{
+		bool bHit = ( rslts[i].HitID != -1 ) && ( rslts[i].HitDistance < rslts[i].ray_length );
+		results.m_HitIds[i] = bHit ? rslts[i].HitID : -1;
+		results.m_HitDistances[i] = rslts[i].HitDistance;
+	}
+	return flElapsed;
+}
+
+static int CountBenchmarkMismatches( RTBenchResults_t const &a, RTBenchResults_t const &b )
+{
+	int nMismatches = 0;
+	for ( int i = 0; i < a.m_HitIds.Count(); i++ )
+	{
+		if ( ( a.m_HitIds[i] != b.m_HitIds[i] ) ||
+			 ( ( a.m_HitIds[i] != -1 ) && ( a.m_HitDistances[i] != b.m_HitDistances[i] ) ) )
+			nMismatches++;
+	}
+	return nMismatches;
+}
+
+void RayTraceBenchmark( void )
+{
+	CUtlVector<Vector> starts, ends;
+	BuildBenchmarkRays( starts, ends );
+	int nRays = starts.Count() & ~3;
+	if ( !nRays )
+	{
+		Msg( "Ray trace benchmark: no faces to trace from.\n" );
+		return;
+	}
+
+	bool bAVX = RayTrace_IsAVXEnabled();
+	Msg( "Ray trace benchmark: %d rays from %d faces (AVX %s)\n", nRays, numfaces, bAVX ? "enabled" : "disabled" );
+
+	RTBenchResults_t packetSSE, packetAVX, streamSSE, streamAVX;
+	RayTrace_SetAVXEnabled( false );
+	float flPacketSSE = TraceBenchmarkPackets( starts, ends, packetSSE );
+	float flStreamSSE = TraceBenchmarkStream( starts, ends, streamSSE );
+	Msg( "  SSE  Trace4Rays: %7.3fs (%.2f Mrays/s)  RayStream: %7.3fs (%.2f Mrays/s)\n",
+		 flPacketSSE, nRays / ( 1.0e6 * MAX( flPacketSSE, 1.0e-6f ) ),
+		 flStreamSSE, nRays / ( 1.0e6 * MAX( flStreamSSE, 1.0e-6f ) ) );
+
+	if ( bAVX )
+	{
+		RayTrace_SetAVXEnabled( true );
+		float flPacketAVX = TraceBenchmarkPackets( starts, ends, packetAVX );
+		float flStreamAVX = TraceBenchmarkStream( starts, ends, streamAVX );
+		Msg( "  AVX  Trace4Rays: %7.3fs (%.2f Mrays/s)  RayStream: %7.3fs (%.2f Mrays/s)\n",
+			 flPacketAVX, nRays / ( 1.0e6 * MAX( flPacketAVX, 1.0e-6f ) ),
+			 flStreamAVX, nRays / ( 1.0e6 * MAX( flStreamAVX, 1.0e-6f ) ) );
+		Msg( "  SSE/AVX mismatches: Trace4Rays %d, RayStream %d\n",
+			 CountBenchmarkMismatches( packetSSE, packetAVX ), CountBenchmarkMismatches( streamSSE, streamAVX ) );
+	}
+
+	RayTrace_SetAVXEnabled( bAVX );
+}
@@ -0,0 +1,305 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: patch-to-patch transfers packed as a sparse matrix, so that each
+//			radiosity bounce is one streaming matrix-vector product.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+
+
+// bump rows keep one weight per lane of a fltx4
+COMPILE_TIME_ASSERT( NUM_BUMP_VECTS+1 == 4 );
+
+static CTransferMatrix *s_pTransferMatrix = NULL;		// for the thread callbacks
+
+
+CTransferMatrix::CTransferMatrix()
+{
+	m_bQuantized = false;
+	m_bFreeTransfers = false;
+	m_nEntries = 0;
+	m_pAddLight = NULL;
+}
+
+void CTransferMatrix::Purge()
+{
+	m_nEntries = 0;
+	m_Rows.Purge();
+	m_Columns.Purge();
+	m_Weights.Purge();
+	m_QuantizedWeights.Purge();
+	m_BumpColumns.Purge();
+	m_BumpWeights.Purge();
+	m_QuantizedBumpWeights.Purge();
+	m_Radiance.Purge();
+}
+
+size_t CTransferMatrix::GetMemoryUsage() const
+{
+	return m_Rows.Count() * sizeof( Row_t ) +
+		m_Columns.Count() * sizeof( int ) +
+		m_Weights.Count() * sizeof( float ) +
+		m_QuantizedWeights.Count() * sizeof( int16 ) +
+		m_BumpColumns.Count() * sizeof( int ) +
+		m_BumpWeights.Count() * sizeof( fltx4 ) +
+		m_QuantizedBumpWeights.Count() * sizeof( int16 ) +
+		m_Radiance.Count() * sizeof( fltx4 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Build
+//-----------------------------------------------------------------------------
+void CTransferMatrix::Build( bool bQuantize, bool bFreeTransfers )
+{
+	Purge();
+	m_bQuantized = bQuantize;
+	m_bFreeTransfers = bFreeTransfers;
+
+	// lay out the rows, flat and bump entries in separate arrays
+	int nPatches = g_Patches.Count();
+	int nFlat = 0, nBump = 0;
+	m_Rows.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		Row_t &row = m_Rows[i];
+		row.m_nCount = patch->numtransfers;
+		row.m_flScale = 1.0f;
+		if ( patch->needsBumpmap )
+		{
+			row.m_nFirst = nBump;
+			nBump += patch->numtransfers;
+		}
+		else
+		{
+			row.m_nFirst = nFlat;
+			nFlat += patch->numtransfers;
+		}
+	}
+	m_nEntries = nFlat + nBump;
+
+	m_Columns.SetCount( nFlat );
+	m_BumpColumns.SetCount( nBump );
+	if ( bQuantize )
+	{
+		m_QuantizedWeights.SetCount( nFlat );
+		m_QuantizedBumpWeights.SetCount( nBump * 4 );
+	}
+	else
+	{
+		m_Weights.SetCount( nFlat );
+		m_BumpWeights.SetCount( nBump );
+	}
+	m_Radiance.SetCount( nPatches );
+
+	s_pTransferMatrix = this;
+	RunThreadsOnIndividual( nPatches, false, BuildRowThread );
+	s_pTransferMatrix = NULL;
+}
+
+void CTransferMatrix::BuildRowThread( int iThread, int iPatch )
+{
+	s_pTransferMatrix->BuildRow( iPatch );
+}
+
+// weights can come out negative when a transfer is behind the patch's normal, so they're signed
+static inline int16 QuantizeWeight( float flWeight, float flInvScale )
+{
+	float flScaled = flWeight * flInvScale;
+	return (int16)( flScaled + ( ( flScaled >= 0 ) ? 0.5f : -0.5f ) );
+}
+
+void CTransferMatrix::BuildRow( int iPatch )
+{
+	CPatch *patch = &g_Patches[iPatch];
+	BuildRowWeights( iPatch );
+
+	if ( m_bFreeTransfers && patch->transfers )
+	{
+		free( patch->transfers );
+		patch->transfers = NULL;
+	}
+}
+
+void CTransferMatrix::BuildRowWeights( int iPatch )
+{
+	CPatch *patch = &g_Patches[iPatch];
+	Row_t &row = m_Rows[iPatch];
+	transfer_t *trans = patch->transfers;
+	if ( !row.m_nCount )
+		return;
+
+	if ( !patch->needsBumpmap )
+	{
+		float flMax = 0;
+		for ( int k = 0; k < row.m_nCount; k++ )
+		{
+			m_Columns[row.m_nFirst + k] = trans[k].patch;
+			if ( m_bQuantized )
+				flMax = max( flMax, fabs( trans[k].transfer ) );
+			else
+				m_Weights[row.m_nFirst + k] = trans[k].transfer;
+		}
+		if ( m_bQuantized )
+		{
+			row.m_flScale = flMax / 32767.0f;
+			float flInvScale = ( flMax > 0 ) ? 32767.0f / flMax : 0;
+			for ( int k = 0; k < row.m_nCount; k++ )
+				m_QuantizedWeights[row.m_nFirst + k] = QuantizeWeight( trans[k].transfer, flInvScale );
+		}
+		return;
+	}
+
+	// same weights as GatherLight: transfer, less the normal already factored into it,
+	// times the cosine to each bump basis vector
+	Vector normals[NUM_BUMP_VECTS+1];
+	GetPatchBumpNormals( patch, normals );
+
+	CUtlVector<float> weights;
+	weights.SetCount( row.m_nCount * 4 );
+	float flMax = 0;
+	for ( int k = 0; k < row.m_nCount; k++ )
+	{
+		CPatch *patch2 = &g_Patches[trans[k].patch];
+		Vector delta;
+		VectorSubtract( patch2->origin, patch->origin, delta );
+		VectorNormalize( delta );
+		float scale = trans[k].transfer * ( 1.0f / DotProduct( delta, patch->normal ) );
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			float dot = DotProduct( delta, normals[i] );
+			float w = ( dot <= 0 ) ? 0 : scale * dot;
+			weights[k * 4 + i] = w;
+			flMax = max( flMax, fabs( w ) );
+		}
+		m_BumpColumns[row.m_nFirst + k] = trans[k].patch;
+	}
+
+	if ( m_bQuantized )
+	{
+		row.m_flScale = flMax / 32767.0f;
+		float flInvScale = ( flMax > 0 ) ? 32767.0f / flMax : 0;
+		for ( int k = 0; k < row.m_nCount * 4; k++ )
+			m_QuantizedBumpWeights[row.m_nFirst * 4 + k] = QuantizeWeight( weights[k], flInvScale );
+	}
+	else
+	{
+		for ( int k = 0; k < row.m_nCount; k++ )
+			m_BumpWeights[row.m_nFirst + k] = LoadUnalignedSIMD( &weights[k * 4] );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Gather
+//-----------------------------------------------------------------------------
+void CTransferMatrix::Gather( Vector const *pEmitLight, bumplights_t *pAddLight )
+{
+	int nPatches = m_Rows.Count();
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		Vector const &refl = g_Patches[i].reflectivity;
+		float flRadiance[4] = { pEmitLight[i].x * refl.x, pEmitLight[i].y * refl.y, pEmitLight[i].z * refl.z, 0 };
+		m_Radiance[i] = LoadUnalignedSIMD( flRadiance );
+	}
+
+	m_pAddLight = pAddLight;
+	s_pTransferMatrix = this;
+	RunThreadsOnIndividual( nPatches, true, GatherRowThread );
+	s_pTransferMatrix = NULL;
+	m_pAddLight = NULL;
+}
+
+void CTransferMatrix::GatherRowThread( int iThread, int iPatch )
+{
+	s_pTransferMatrix->GatherRow( iPatch );
+}
+
+static FORCEINLINE void StoreLight( fltx4 sum, Vector &out )
+{
+	out.x = SubFloat( sum, 0 );
+	out.y = SubFloat( sum, 1 );
+	out.z = SubFloat( sum, 2 );
+}
+
+void CTransferMatrix::GatherRow( int iPatch )
+{
+	Row_t const &row = m_Rows[iPatch];
+	bumplights_t &out = m_pAddLight[iPatch];
+	fltx4 const *pRadiance = m_Radiance.Base();
+
+	if ( !g_Patches[iPatch].needsBumpmap )
+	{
+		int const *pColumns = m_Columns.Base() + row.m_nFirst;
+		int n = row.m_nCount;
+		int k = 0;
+
+		// two sums to keep the adds independent
+		fltx4 sum0 = Four_Zeros, sum1 = Four_Zeros;
+		if ( m_bQuantized )
+		{
+			int16 const *pWeights = m_QuantizedWeights.Base() + row.m_nFirst;
+			for ( ; k + 1 < n; k += 2 )
+			{
+				sum0 = MaddSIMD( ReplicateX4( (float)pWeights[k] ), pRadiance[pColumns[k]], sum0 );
+				sum1 = MaddSIMD( ReplicateX4( (float)pWeights[k + 1] ), pRadiance[pColumns[k + 1]], sum1 );
+			}
+			if ( k < n )
+				sum0 = MaddSIMD( ReplicateX4( (float)pWeights[k] ), pRadiance[pColumns[k]], sum0 );
+			sum0 = MulSIMD( AddSIMD( sum0, sum1 ), ReplicateX4( row.m_flScale ) );
+		}
+		else
+		{
+			float const *pWeights = m_Weights.Base() + row.m_nFirst;
+			for ( ; k + 1 < n; k += 2 )
+			{
+				sum0 = MaddSIMD( ReplicateX4( pWeights[k] ), pRadiance[pColumns[k]], sum0 );
+				sum1 = MaddSIMD( ReplicateX4( pWeights[k + 1] ), pRadiance[pColumns[k + 1]], sum1 );
+			}
+			if ( k < n )
+				sum0 = MaddSIMD( ReplicateX4( pWeights[k] ), pRadiance[pColumns[k]], sum0 );
+			sum0 = AddSIMD( sum0, sum1 );
+		}
+		StoreLight( sum0, out.light[0] );
+		return;
+	}
+
+	int const *pColumns = m_BumpColumns.Base() + row.m_nFirst;
+	fltx4 sum[NUM_BUMP_VECTS+1];
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		sum[i] = Four_Zeros;
+
+	if ( m_bQuantized )
+	{
+		int16 const *pWeights = m_QuantizedBumpWeights.Base() + row.m_nFirst * 4;
+		for ( int k = 0; k < row.m_nCount; k++, pWeights += 4 )
+		{
+			fltx4 radiance = pRadiance[pColumns[k]];
+			sum[0] = MaddSIMD( ReplicateX4( (float)pWeights[0] ), radiance, sum[0] );
+			sum[1] = MaddSIMD( ReplicateX4( (float)pWeights[1] ), radiance, sum[1] );
+			sum[2] = MaddSIMD( ReplicateX4( (float)pWeights[2] ), radiance, sum[2] );
+			sum[3] = MaddSIMD( ReplicateX4( (float)pWeights[3] ), radiance, sum[3] );
+		}
+		fltx4 scale = ReplicateX4( row.m_flScale );
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+			sum[i] = MulSIMD( sum[i], scale );
+	}
+	else
+	{
+		fltx4 const *pWeights = m_BumpWeights.Base() + row.m_nFirst;
+		for ( int k = 0; k < row.m_nCount; k++ )
+		{
+			fltx4 radiance = pRadiance[pColumns[k]];
+			fltx4 w = pWeights[k];
+			sum[0] = MaddSIMD( SplatXSIMD( w ), radiance, sum[0] );
+			sum[1] = MaddSIMD( SplatYSIMD( w ), radiance, sum[1] );
+			sum[2] = MaddSIMD( SplatZSIMD( w ), radiance, sum[2] );
+			sum[3] = MaddSIMD( SplatWSIMD( w ), radiance, sum[3] );
+		}
+	}
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		StoreLight( sum[i], out.light[i] );
+}
@@ -0,0 +1,77 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: patch-to-patch transfers packed as a sparse matrix, so that each
+//			radiosity bounce is one streaming matrix-vector product.
+//
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#include "mathlib/ssemath.h"
+#include "tier1/utlvector.h"
+
+struct bumplights_t;
+
+
+// One row per patch, built from the patch's transfer_t list. Rows of bumpmapped patches
+// have the per-basis dot products folded in, so every bounce is just weights times the
+// light each patch sends out.
+class CTransferMatrix
+{
+public:
+	CTransferMatrix();
+
+	// bQuantize stores signed 16 bit weights with a scale per row, at some loss of precision.
+	// bFreeTransfers releases each patch's transfer list once its row is built, so the lists
+	// and the matrix aren't both held; numtransfers is left as it was.
+	void Build( bool bQuantize, bool bFreeTransfers );
+	void Purge();
+
+	// addlight[j] = sum of transfers into patch j of emitlight * reflectivity
+	void Gather( Vector const *pEmitLight, bumplights_t *pAddLight );
+
+	int GetNumEntries() const { return m_nEntries; }
+	size_t GetMemoryUsage() const;
+
+private:
+	struct Row_t
+	{
+		int m_nFirst;										// into the flat or bump entries
+		int m_nCount;
+		float m_flScale;									// for quantized weights
+	};
+
+	static void BuildRowThread( int iThread, int iPatch );
+	static void GatherRowThread( int iThread, int iPatch );
+
+	void BuildRow( int iPatch );
+	void BuildRowWeights( int iPatch );
+	void GatherRow( int iPatch );
+
+	bool m_bQuantized;
+	bool m_bFreeTransfers;
+	int m_nEntries;
+	CUtlVector<Row_t> m_Rows;
+
+	// flat rows: one weight per transfer
+	CUtlVector<int> m_Columns;
+	CUtlVector<float> m_Weights;
+	CUtlVector<int16> m_QuantizedWeights;
+
+	// bump rows: a weight for the flat normal and each bump basis vector per transfer
+	CUtlVector<int> m_BumpColumns;
+	CUtlVector<fltx4, CUtlMemoryAligned<fltx4,16> > m_BumpWeights;
+	CUtlVector<int16> m_QuantizedBumpWeights;				// 4 per transfer
+
+	// emitlight * reflectivity for every patch, rgb in xyz, for the current gather
+	CUtlVector<fltx4, CUtlMemoryAligned<fltx4,16> > m_Radiance;
+	bumplights_t *m_pAddLight;
+};
+
+
+#endif // TRANSFERMATRIX_H
@@ -19,6 +19,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfermatrix.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +58,11 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRayTraceBenchmark = false;
+bool		g_bKDTreeCache = true;
+bool		g_bSIMDBounce = true;
+bool		g_bQuantizeBounce = false;
+bool		g_bVerifyBounce = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -1531,6 +1537,37 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+// normals[0] is the flat normal, 1..3 the bump basis around the smoothed normal
+void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
+{
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+	if ( bDisp )
+	{
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+	}
+	else
+	{
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+			normals[0], &normals[1] );
+	}
+
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
@@ -1554,33 +1591,7 @@ void GatherLight (int threadnum, void *pUserData)
 			Vector delta;
 			Vector bumpSum[NUM_BUMP_VECTS+1];
 			Vector normals[NUM_BUMP_VECTS+1];
-
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
-
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
-
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
-
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+			GetPatchBumpNormals( patch, normals );
 
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
@@ -1644,6 +1655,45 @@ void GatherLight (int threadnum, void *pUserData)
 #endif
 
 
+//-----------------------------------------------------------------------------
+// Runs GatherLight on the same emitlight and compares it against what the
+// transfer matrix put in addlight, which is left as it was.
+//-----------------------------------------------------------------------------
+static void VerifyTransferMatrixGather( void )
+{
+	unsigned int uiPatchCount = g_Patches.Size();
+	CUtlVector<bumplights_t> matrixLight;
+	matrixLight.CopyArray( addlight.Base(), uiPatchCount );
+
+	RunThreadsOn( uiPatchCount, false, GatherLight );
+
+	float flMaxError = 0;
+	int nMaxErrorPatch = -1;
+	for ( unsigned int i = 0; i < uiPatchCount; i++ )
+	{
+		int normalCount = g_Patches[i].needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+		for ( int j = 0; j < normalCount; j++ )
+		{
+			Vector const &ref = addlight[i].light[j];
+			Vector const &val = matrixLight[i].light[j];
+			float flScale = max( max( fabs( ref.x ), fabs( ref.y ) ), max( fabs( ref.z ), 1.0e-3f ) );
+			for ( int c = 0; c < 3; c++ )
+			{
+				float flError = fabs( val[c] - ref[c] ) / flScale;
+				if ( flError > flMaxError )
+				{
+					flMaxError = flError;
+					nMaxErrorPatch = i;
+				}
+			}
+		}
+	}
+	Msg( "Transfer matrix gather: max relative difference from GatherLight %g (patch %d)\n", flMaxError, nMaxErrorPatch );
+
+	memcpy( addlight.Base(), matrixLight.Base(), uiPatchCount * sizeof( bumplights_t ) );
+}
+
+
 /*
 =============
 BounceLight
@@ -1699,13 +1749,36 @@ void BounceLight (void)
 	}
 #endif
 
+	// pack the transfers into one sparse matrix so each bounce streams through it
+	CTransferMatrix transferMatrix;
+	if ( bouncing && g_bSIMDBounce )
+	{
+		float flStart = Plat_FloatTime();
+		// -verifybounce still needs the transfer lists for GatherLight
+		transferMatrix.Build( g_bQuantizeBounce, !g_bVerifyBounce );
+		size_t nTransferListBytes = (size_t)transferMatrix.GetNumEntries() * sizeof( transfer_t );
+		Msg( "Transfer matrix: %d transfers, %.1f MB%s, was %.1f MB as transfer lists (%.2f seconds)\n",
+			 transferMatrix.GetNumEntries(), transferMatrix.GetMemoryUsage() / ( 1024.0 * 1024.0 ),
+			 g_bQuantizeBounce ? " quantized" : "", nTransferListBytes / ( 1024.0 * 1024.0 ),
+			 Plat_FloatTime() - flStart );
+	}
+
 	i = 0;
 	while ( bouncing )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		if ( g_bSIMDBounce )
+		{
+			transferMatrix.Gather( emitlight.Base(), addlight.Base() );
+			if ( g_bVerifyBounce && i == 0 )
+				VerifyTransferMatrixGather();
+		}
+		else
+		{
+			RunThreadsOn (uiPatchCount, true, GatherLight);
+		}
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
@@ -2254,12 +2327,40 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
-	// Build acceleration structure
-	printf ( "Setting up ray-trace acceleration structure... ");
+	// Build acceleration structure, or load it from the last run if the geometry hasn't changed.
+	// VMPI workers always build their own.
+	bool bUseKDTreeCache = g_bKDTreeCache && ( !g_bUseMPI || g_bMPIMaster );
+	char szKDTreeCache[MAX_PATH];
+	Q_StripExtension( source, szKDTreeCache, sizeof( szKDTreeCache ) );
+	Q_strncat( szKDTreeCache, ".kdcache", sizeof( szKDTreeCache ), COPY_ALL_CHARACTERS );
+	uint32 nGeometryHash = bUseKDTreeCache ? g_RtEnv.CalculateGeometryHash() : 0;
+
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	if ( bUseKDTreeCache && g_RtEnv.LoadAccelerationStructure( szKDTreeCache, nGeometryHash ) )
+	{
+		float end = Plat_FloatTime();
+		Msg( "Loaded ray-trace acceleration structure from %s (%.2f seconds, saved %.2f seconds)\n",
+			 szKDTreeCache, end-start, max( g_RtEnv.m_TreeStats.m_flBuildTime - ( end-start ), 0.0f ) );
+	}
+	else
+	{
+		if ( bUseKDTreeCache )
+			Msg( "No usable ray-trace cache in %s, geometry changed or first run\n", szKDTreeCache );
+		printf ( "Setting up ray-trace acceleration structure... ");
+		g_RtEnv.SetupAccelerationStructure();
+		float end = Plat_FloatTime();
+		printf ( "Done (%.2f seconds)\n", end-start );
+		g_RtEnv.PrintTreeStats();
+
+		if ( bUseKDTreeCache && !g_RtEnv.SaveAccelerationStructure( szKDTreeCache, nGeometryHash ) )
+			Warning( "Couldn't write ray-trace cache %s\n", szKDTreeCache );
+	}
+
+	if ( g_bRayTraceBenchmark )
+	{
+		RayTraceBenchmark();
+		exit( 0 );
+	}
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2384,6 +2485,30 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpPatches = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_bRayTraceBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-noavx" ) )
+		{
+			RayTrace_SetAVXEnabled( false );
+		}
+		else if ( !Q_stricmp( argv[i], "-nokdcache" ) )
+		{
+			g_bKDTreeCache = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-scalarbounce" ) )
+		{
+			g_bSIMDBounce = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-quantizebounce" ) )
+		{
+			g_bQuantizeBounce = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-verifybounce" ) )
+		{
+			g_bVerifyBounce = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-nodetaillight" ) )
 		{
 			g_bNoDetailLighting = true;
@@ -2792,6 +2917,14 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -rtbench        : Time the ray tracer on rays cast from every face, then exit.\n"
+		"  -noavx          : Don't use the AVX ray tracing paths.\n"
+		"  -nokdcache      : Always rebuild the ray-trace acceleration structure instead of\n"
+		"                    reusing <mapname>.kdcache when the geometry is unchanged.\n"
+		"  -scalarbounce   : Gather bounced light patch by patch instead of through the\n"
+		"                    packed transfer matrix.\n"
+		"  -quantizebounce : Store transfer matrix weights in 16 bits to save memory.\n"
+		"  -verifybounce   : Compare the first transfer matrix bounce against -scalarbounce.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
@@ -390,9 +390,13 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
 
+// times the SSE and AVX ray tracing paths over rays cast from every face
+void RayTraceBenchmark( void );
+
 void BaseLightForFace( dface_t *f, Vector& light, float *parea, Vector& reflectivity );
 void CreateDirectLights (void);
 void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
+void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
@@ -12,6 +12,8 @@
 #include "tier1/utlbuffer.h"
 #include "tier1/utlmap.h"
 #include "tier1/utlstring.h"
+#include "tier1/utldict.h"
+#include "tier0/fasttimer.h"
 
 #include "squirrel.h"
 #include "sqstdaux.h"
@@ -133,6 +135,17 @@ struct ReadStateMap
 	}
 };
 
+struct FunctionStubPlan;
+
+// Accumulated while SquirrelVM::profiling_ is set
+struct ScriptProfileCounter
+{
+	ScriptProfileCounter() : nCalls(0) {}
+
+	int nCalls;
+	CCycleCount time;
+};
+
 class SquirrelVM : public IScriptVM
 {
 public:
@@ -190,6 +203,7 @@ public:
 	//--------------------------------------------------------
 	virtual HScriptRaw HScriptToRaw( HSCRIPT val ) override;
 	virtual ScriptStatus_t ExecuteHookFunction( const char *pszEventName, ScriptVariant_t *pArgs, int nArgs, ScriptVariant_t *pReturn, HSCRIPT hScope, bool bWait ) override;
+	ScriptStatus_t CallHookFunction( const char *pszEventName, ScriptVariant_t *pArgs, int nArgs, ScriptVariant_t *pReturn, HSCRIPT hScope );
 
 	//--------------------------------------------------------
 	// External functions
@@ -260,6 +274,9 @@ public:
 
 	virtual void DumpState() override;
 
+	virtual void SetProfilingEnabled(bool bEnabled) override;
+	virtual void DumpProfile(bool bReset) override;
+
 	virtual void SetOutputCallback(ScriptOutputFunc_t pFunc) override;
 	virtual void SetErrorCallback(ScriptErrorFunc_t pFunc) override;
 
@@ -274,6 +291,10 @@ public:
 	HSQOBJECT lastError_;
 	HSQOBJECT vectorClass_;
 	HSQOBJECT regexpClass_;
+
+	CUtlVector<FunctionStubPlan*> stubPlans_;
+	CUtlDict<ScriptProfileCounter, int> hookProfile_;
+	bool profiling_ = false;
 };
 
 static char TYPETAG_VECTOR[] = "VectorTypeTag";
@@ -1282,6 +1303,135 @@ bool getVariant(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& variant)
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Argument marshalling for native calls. Every binding resolves its parameter
+// types to a list of these once when it's registered, so function_stub reads
+// arguments straight into a stack buffer without switching on each type.
+//-----------------------------------------------------------------------------
+typedef SQInteger (*ScriptArgMarshalFn_t)(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out);
+
+static SQInteger MarshalFloatArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	float val = 0.0;
+	if (SQ_FAILED(sq_getfloat(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected float");
+	out = val;
+	return SQ_OK;
+}
+
+static SQInteger MarshalStringArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	const char* val;
+	if (SQ_FAILED(sq_getstring(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected string");
+	out = val;
+	return SQ_OK;
+}
+
+static SQInteger MarshalVectorArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	Vector* val;
+	if (SQ_FAILED(sq_getinstanceup(vm, idx, (SQUserPointer*)&val, TYPETAG_VECTOR)))
+		return sq_throwerror(vm, "Expected Vector");
+	out = *val;
+	return SQ_OK;
+}
+
+static SQInteger MarshalIntegerArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	SQInteger val = 0;
+	if (SQ_FAILED(sq_getinteger(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected integer");
+	out = (int)val;
+	return SQ_OK;
+}
+
+static SQInteger MarshalBoolArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	SQBool val = 0;
+	if (SQ_FAILED(sq_getbool(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected bool");
+	out = val ? true : false;
+	return SQ_OK;
+}
+
+static SQInteger MarshalCharArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	const char* val;
+	if (SQ_FAILED(sq_getstring(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected string");
+	out = val[0];
+	return SQ_OK;
+}
+
+static SQInteger MarshalHScriptArg(HSQUIRRELVM vm, SQInteger idx, ScriptVariant_t& out)
+{
+	HSQOBJECT val;
+	if (SQ_FAILED(sq_getstackobj(vm, idx, &val)))
+		return sq_throwerror(vm, "Expected handle");
+
+	if (sq_isnull(val))
+	{
+		out = (HSCRIPT)nullptr;
+	}
+	else
+	{
+		HSQOBJECT* pObject = new HSQOBJECT;
+		*pObject = val;
+		sq_addref(vm, pObject);
+		out = (HSCRIPT)pObject;
+	}
+	return SQ_OK;
+}
+
+// The binding templates go up to 14 parameters
+#define MAX_STUB_ARGS 14
+
+struct FunctionStubPlan
+{
+	ScriptFunctionBinding_t* pFunc;
+	const char* pszClassname;
+	int nArgs;
+	ScriptArgMarshalFn_t pfnMarshal[MAX_STUB_ARGS];
+
+	ScriptProfileCounter profile;
+};
+
+static FunctionStubPlan* CreateFunctionStubPlan(ScriptFunctionBinding_t& scriptFunction, ScriptClassDesc_t* pClassDesc)
+{
+	int nArgs = scriptFunction.m_desc.m_Parameters.Count();
+	if (nArgs > MAX_STUB_ARGS)
+	{
+		Assert(!"Too many parameters");
+		return nullptr;
+	}
+
+	FunctionStubPlan* pPlan = new FunctionStubPlan;
+	pPlan->pFunc = &scriptFunction;
+	pPlan->pszClassname = pClassDesc ? pClassDesc->m_pszScriptName : nullptr;
+	pPlan->nArgs = nArgs;
+
+	for (int i = 0; i < nArgs; ++i)
+	{
+		switch (scriptFunction.m_desc.m_Parameters[i])
+		{
+		case FIELD_FLOAT:		pPlan->pfnMarshal[i] = MarshalFloatArg; break;
+		case FIELD_CSTRING:		pPlan->pfnMarshal[i] = MarshalStringArg; break;
+		case FIELD_VECTOR:		pPlan->pfnMarshal[i] = MarshalVectorArg; break;
+		case FIELD_INTEGER:		pPlan->pfnMarshal[i] = MarshalIntegerArg; break;
+		case FIELD_BOOLEAN:		pPlan->pfnMarshal[i] = MarshalBoolArg; break;
+		case FIELD_CHARACTER:	pPlan->pfnMarshal[i] = MarshalCharArg; break;
+		case FIELD_HSCRIPT:		pPlan->pfnMarshal[i] = MarshalHScriptArg; break;
+		default:
+			Assert(!"Unsupported type");
+			delete pPlan;
+			return nullptr;
+		}
+	}
+
+	return pPlan;
+}
+
 SQInteger function_stub(HSQUIRRELVM vm)
 {
 	SQInteger top = sq_gettop(vm);
@@ -1291,9 +1441,10 @@ SQInteger function_stub(HSQUIRRELVM vm)
 
 	Assert(userptr);
 
-	ScriptFunctionBinding_t* pFunc = (ScriptFunctionBinding_t*)userptr;
+	FunctionStubPlan* pPlan = (FunctionStubPlan*)userptr;
+	ScriptFunctionBinding_t* pFunc = pPlan->pFunc;
 
-	auto nargs = pFunc->m_desc.m_Parameters.Count();
+	int nargs = pPlan->nArgs;
 
 	if (nargs > top)
 	{
@@ -1301,84 +1452,13 @@ SQInteger function_stub(HSQUIRRELVM vm)
 		return sq_throwerror(vm, "Invalid number of parameters");
 	}
 
-	CUtlVector<ScriptVariant_t> params;
-	params.SetCount(nargs);
+	ScriptVariant_t params[MAX_STUB_ARGS];
 
 	for (int i = 0; i < nargs; ++i)
 	{
-		switch (pFunc->m_desc.m_Parameters[i])
-		{
-		case FIELD_FLOAT:
-		{
-			float val = 0.0;
-			if (SQ_FAILED(sq_getfloat(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected float");
-			params[i] = val;
-			break;
-		}
-		case FIELD_CSTRING:
-		{
-			const char* val;
-			if (SQ_FAILED(sq_getstring(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected string");
-			params[i] = val;
-			break;
-		}
-		case FIELD_VECTOR:
-		{
-			Vector* val;
-			if (SQ_FAILED(sq_getinstanceup(vm, i + 2, (SQUserPointer*)&val, TYPETAG_VECTOR)))
-				return sq_throwerror(vm, "Expected Vector");
-			params[i] = *val;
-			break;
-		}
-		case FIELD_INTEGER:
-		{
-			SQInteger val = 0;
-			if (SQ_FAILED(sq_getinteger(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected integer");
-			params[i] = (int)val;
-			break;
-		}
-		case FIELD_BOOLEAN:
-		{
-			SQBool val = 0;
-			if (SQ_FAILED(sq_getbool(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected bool");
-			params[i] = val ? true : false;
-			break;
-		}
-		case FIELD_CHARACTER:
-		{
-			const char* val;
-			if (SQ_FAILED(sq_getstring(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected string");
-			params[i] = val[i];
-			break;
-		}
-		case FIELD_HSCRIPT:
-		{
-			HSQOBJECT val;
-			if (SQ_FAILED(sq_getstackobj(vm, i + 2, &val)))
-				return sq_throwerror(vm, "Expected handle");
-
-			if (sq_isnull(val))
-			{
-				params[i] = (HSCRIPT)nullptr;
-			}
-			else
-			{
-				HSQOBJECT* pObject = new HSQOBJECT;
-				*pObject = val;
-				sq_addref(vm, pObject);
-				params[i] = (HSCRIPT)pObject;
-			}
-			break;
-		}
-		default:
-			Assert(!"Unsupported type");
-			return false;
-		}
+		SQInteger result = pPlan->pfnMarshal[i](vm, i + 2, params[i]);
+		if (SQ_FAILED(result))
+			return result;
 	}
 
 	void* instance = nullptr;
@@ -1403,8 +1483,23 @@ SQInteger function_stub(HSQUIRRELVM vm)
 
 	sq_resetobject(&pSquirrelVM->lastError_);
 
-	(*pFunc->m_pfnBinding)(pFunc->m_pFunction, instance, params.Base(), nargs,
-		pFunc->m_desc.m_ReturnType == FIELD_VOID ? nullptr : &retval);
+	if (pSquirrelVM->profiling_)
+	{
+		CFastTimer timer;
+		timer.Start();
+
+		(*pFunc->m_pfnBinding)(pFunc->m_pFunction, instance, params, nargs,
+			pFunc->m_desc.m_ReturnType == FIELD_VOID ? nullptr : &retval);
+
+		timer.End();
+		pPlan->profile.nCalls++;
+		pPlan->profile.time += timer.GetDuration();
+	}
+	else
+	{
+		(*pFunc->m_pfnBinding)(pFunc->m_pFunction, instance, params, nargs,
+			pFunc->m_desc.m_ReturnType == FIELD_VOID ? nullptr : &retval);
+	}
 
 	if (!sq_isnull(pSquirrelVM->lastError_))
 	{
@@ -2070,6 +2165,9 @@ void SquirrelVM::Shutdown()
 		sq_close(vm_);
 		vm_ = nullptr;
 	}
+
+	stubPlans_.PurgeAndDeleteElements();
+	hookProfile_.Purge();
 }
 
 bool SquirrelVM::ConnectDebugger()
@@ -2361,9 +2459,36 @@ HScriptRaw SquirrelVM::HScriptToRaw( HSCRIPT val )
 }
 
 ScriptStatus_t SquirrelVM::ExecuteHookFunction(const char *pszEventName, ScriptVariant_t* pArgs, int nArgs, ScriptVariant_t* pReturn, HSCRIPT hScope, bool bWait)
+{
+	if (!profiling_)
+		return CallHookFunction(pszEventName, pArgs, nArgs, pReturn, hScope);
+
+	CFastTimer timer;
+	timer.Start();
+
+	ScriptStatus_t result = CallHookFunction(pszEventName, pArgs, nArgs, pReturn, hScope);
+
+	timer.End();
+
+	int i = hookProfile_.Find(pszEventName);
+	if (i == hookProfile_.InvalidIndex())
+	{
+		i = hookProfile_.Insert(pszEventName);
+	}
+
+	hookProfile_[i].nCalls++;
+	hookProfile_[i].time += timer.GetDuration();
+
+	return result;
+}
+
+ScriptStatus_t SquirrelVM::CallHookFunction(const char *pszEventName, ScriptVariant_t* pArgs, int nArgs, ScriptVariant_t* pReturn, HSCRIPT hScope)
 {
 	SquirrelSafeCheck safeCheck(vm_);
 
+	// Hooks::Call, its environment, the event name and scope, then the arguments
+	sq_reservestack(vm_, nArgs + 4);
+
 	HSQOBJECT* pFunc = (HSQOBJECT*)GetScriptHookManager().GetHookFunction();
 	sq_pushobject(vm_, *pFunc);
 
@@ -2420,11 +2545,18 @@ void SquirrelVM::RegisterFunction(ScriptFunctionBinding_t* pScriptFunction)
 		return;
 	}
 
+	FunctionStubPlan* pPlan = CreateFunctionStubPlan(*pScriptFunction, nullptr);
+	if (!pPlan)
+	{
+		return;
+	}
+	stubPlans_.AddToTail(pPlan);
+
 	sq_pushroottable(vm_);
 
 	sq_pushstring(vm_, pScriptFunction->m_desc.m_pszScriptName, -1);
 
-	sq_pushuserpointer(vm_, pScriptFunction);
+	sq_pushuserpointer(vm_, pPlan);
 	sq_newclosure(vm_, function_stub, 1);
 
 	sq_setnativeclosurename(vm_, -1, pScriptFunction->m_desc.m_pszScriptName);
@@ -2541,9 +2673,18 @@ bool SquirrelVM::RegisterClass(ScriptClassDesc_t* pClassDesc)
 			break;
 		}
 
+		FunctionStubPlan* pPlan = CreateFunctionStubPlan(scriptFunction, pClassDesc);
+		if (!pPlan)
+		{
+			Warning("Unable to create argument plan for %s.%s\n",
+				pClassDesc->m_pszClassname, scriptFunction.m_desc.m_pszFunction);
+			break;
+		}
+		stubPlans_.AddToTail(pPlan);
+
 		sq_pushstring(vm_, scriptFunction.m_desc.m_pszScriptName, -1);
 
-		sq_pushuserpointer(vm_, &scriptFunction);
+		sq_pushuserpointer(vm_, pPlan);
 		sq_newclosure(vm_, function_stub, 1);
 
 		sq_setnativeclosurename(vm_, -1, scriptFunction.m_desc.m_pszScriptName);
@@ -4050,6 +4191,94 @@ void SquirrelVM::DumpState()
 	// TODO: Dump state
 }
 
+void SquirrelVM::SetProfilingEnabled(bool bEnabled)
+{
+	profiling_ = bEnabled;
+}
+
+struct ScriptProfileEntry
+{
+	const char* pszClassname;
+	const char* pszName;
+	const ScriptProfileCounter* pCounter;
+};
+
+static int __cdecl ScriptProfileEntrySort(const ScriptProfileEntry* a, const ScriptProfileEntry* b)
+{
+	if (a->pCounter->time.m_Int64 == b->pCounter->time.m_Int64)
+		return 0;
+	return a->pCounter->time.m_Int64 > b->pCounter->time.m_Int64 ? -1 : 1;
+}
+
+static void DumpProfileEntries(const char* pszTitle, CUtlVector<ScriptProfileEntry>& entries)
+{
+	entries.Sort(ScriptProfileEntrySort);
+
+	CGMsg(0, CON_GROUP_VSCRIPT, "%s\n", pszTitle);
+	CGMsg(0, CON_GROUP_VSCRIPT, "%10s %12s %10s  %s\n", "calls", "total ms", "avg us", "name");
+
+	for (int i = 0; i < entries.Count(); ++i)
+	{
+		const ScriptProfileEntry& entry = entries[i];
+		double flTotal = entry.pCounter->time.GetMillisecondsF();
+
+		if (entry.pszClassname)
+		{
+			CGMsg(0, CON_GROUP_VSCRIPT, "%10d %12.3f %10.3f  %s::%s\n", entry.pCounter->nCalls, flTotal,
+				1000.0 * flTotal / entry.pCounter->nCalls, entry.pszClassname, entry.pszName);
+		}
+		else
+		{
+			CGMsg(0, CON_GROUP_VSCRIPT, "%10d %12.3f %10.3f  %s\n", entry.pCounter->nCalls, flTotal,
+				1000.0 * flTotal / entry.pCounter->nCalls, entry.pszName);
+		}
+	}
+}
+
+void SquirrelVM::DumpProfile(bool bReset)
+{
+	if (!profiling_)
+	{
+		CGMsg(0, CON_GROUP_VSCRIPT, "Script profiling is off\n");
+	}
+
+	CUtlVector<ScriptProfileEntry> entries;
+	for (int i = 0; i < stubPlans_.Count(); ++i)
+	{
+		FunctionStubPlan* pPlan = stubPlans_[i];
+		if (!pPlan->profile.nCalls)
+			continue;
+
+		ScriptProfileEntry& entry = entries[entries.AddToTail()];
+		entry.pszClassname = pPlan->pszClassname;
+		entry.pszName = pPlan->pFunc->m_desc.m_pszScriptName;
+		entry.pCounter = &pPlan->profile;
+	}
+
+	DumpProfileEntries("Native functions:", entries);
+
+	entries.RemoveAll();
+	for (int i = hookProfile_.First(); i != hookProfile_.InvalidIndex(); i = hookProfile_.Next(i))
+	{
+		ScriptProfileEntry& entry = entries[entries.AddToTail()];
+		entry.pszClassname = nullptr;
+		entry.pszName = hookProfile_.GetElementName(i);
+		entry.pCounter = &hookProfile_[i];
+	}
+
+	DumpProfileEntries("Hooks:", entries);
+
+	if (bReset)
+	{
+		for (int i = 0; i < stubPlans_.Count(); ++i)
+		{
+			stubPlans_[i]->profile = ScriptProfileCounter();
+		}
+
+		hookProfile_.Purge();
+	}
+}
+
 void SquirrelVM::SetOutputCallback(ScriptOutputFunc_t pFunc)
 {
 	SquirrelSafeCheck safeCheck(vm_);